@@ -11,5 +11,5 @@ include_directories(${LLVM_INCLUDE_DIRS})
 #add_definitions(${LLVM_DEFINITIONS})
 message(STATUS "LLVM_INCLUDE_DIRS: ${LLVM_INCLUDE_DIRS}")
 message(STATUS "LLVM_DEFINITIONS: ${LLVM_DEFINITIONS}")
-llvm_map_components_to_libnames(llvm_libs core executionengine interpreter native mcjit)
+llvm_map_components_to_libnames(llvm_libs core executionengine interpreter native mcjit ipo)
 message(STATUS "LLVM_LIBS: ${llvm_libs}")
@@ -13,16 +13,109 @@
 extern "C" {
 #endif
 
+/* cached attribute of a load site */
+typedef struct _AttrSite {
+    const char *name;
+    /* receiver type */
+    TypeObject *type;
+    /* field or method */
+    Object *attr;
+    /* offset of the field in receiver, -1: not a plain load */
+    int offset;
+    /* MBR_T_XXX of the field */
+    int mtype;
+} AttrSite;
+
+/* backward jump of a loop, allocated once, native code refers to it */
+typedef struct _LoopSite {
+    /* taken times, the loop is optimized at opt_threshold */
+    uint32_t count;
+    /* optimized loop entered at the jump target, NULL: not compiled */
+    struct _OptOsr *osr;
+} LoopSite;
+
+/* inline cache of one quickened instruction */
+typedef struct _InlineCache {
+    /* generic opcode, restored if the guard fails */
+    int opcode;
+    union {
+        /* cached methods of a call site */
+        MethodSite ms;
+        /* cached field of an attribute load site */
+        AttrSite as;
+        /* counter of a backward jump */
+        LoopSite *ls;
+    };
+} InlineCache;
+
+/*
+ * Live registers of the safepoints, by a backward liveness analysis of the
+ * bytecode. A frame stopped in an insn is at the offset after it, its live
+ * registers are the ones read by the insn or later, the entry is at 0.
+ */
+typedef struct _StackMap {
+    /* words of a register set */
+    int words;
+    /* number of safepoints, 0: not analyzable */
+    int num;
+    /* ascending offsets of the safepoints */
+    int *offsets;
+    /* register sets of the safepoints */
+    uint64_t bits[0];
+} StackMap;
+
 typedef struct _CodeObject {
     FUNCTION_HEAD
     /* code spec from klc */
     CodeSpec cs;
+    /* instruction offset -> index of caches(0: no cache), lazily created */
+    uint16_t *cache_index;
+    /* inline caches */
+    Vector caches;
+    /* calls and backward jumps, compiled by jit at the threshold */
+    uint32_t hotness;
+    /* native code, NULL: not compiled */
+    struct _JitCode *jit;
+    /* optimized by llvm, NULL: not a numeric kernel or not hot enough */
+    struct _OptCode *opt;
+    /* created by the first gc which scans a frame of the code */
+    StackMap *stack_map;
+    /* the superinstructions are fused, see code_fuse_insns */
+    int fused;
 } CodeObject;
 
 extern TypeObject code_type;
 #define IS_CODE(ob) IS_TYPE((ob), &code_type)
 
 Object *kl_new_code(char *name, Object *m, TypeObject *cls);
+InlineCache *code_inline_cache(CodeObject *code, int offset);
+/* the loop site of the backward jump at `offset`, create it if not exist */
+LoopSite *code_loop_site(CodeObject *code, int offset);
+/* the name of a cache site, copied, the constant str may be moved by the gc */
+const char *code_site_name(Value *name);
+/* counters of a method call site */
+typedef struct _MethodSiteStats {
+    int offset;
+    const char *name;
+    /* "monomorphic", "polymorphic" or "megamorphic" */
+    const char *state;
+    uint32_t hits;
+    uint32_t misses;
+} MethodSiteStats;
+
+/* the method call site after `offset`, -1 for the first, return its offset, -1: none */
+int code_next_method_site(CodeObject *code, int offset, MethodSiteStats *stats);
+/* print the method call sites: offset, name, state, hits and misses */
+void code_show_method_sites(CodeObject *code);
+
+/* the live registers of a frame stopped at `offset`, NULL: all registers */
+uint64_t *code_live_regs(CodeObject *code, int offset);
+
+/* decoding of the bytecode, shared by the jit tiers */
+int code_unfuse_opcode(int op);
+int code_insn_length(int op);
+/* fuse the superinstructions before the code is first run, return the number */
+int code_fuse_insns(CodeObject *code);
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,8 @@
 #ifndef _KOALA_OPCODE_H_
 #define _KOALA_OPCODE_H_
 
+#include "super_insns.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -129,7 +131,7 @@ typedef enum _OpCode {
 
     /* call */
     OP_CALL,            /* A B C  A = mod index, B = obj index, C = nargs */
-    OP_CALL_METHOD,
+    OP_CALL_METHOD,     /* K16 B C  method = CONST(K16), B = nargs(self included), R(C) = result */
     OP_CALL_DYNAMIC,
 
     /* call with keywords */
@@ -146,7 +148,7 @@ typedef enum _OpCode {
     OP_GLOBAL_STORE,
 
     /* fields */
-    OP_FIELD_LOAD,
+    OP_FIELD_LOAD,          /* A, B, K16    R(A) = R(B).CONST(K16), field only   */
     OP_FIELD_STORE,
 
     /* generic arithmetic operators */
@@ -178,7 +180,7 @@ typedef enum _OpCode {
     OP_SUBSCR_STORE,
 
     /* generic attribute operations */
-    OP_ATTR_LOAD,           /* A, B, K16    R(A) = Get(R(B), Field(REL(K16)))    */
+    OP_ATTR_LOAD,           /* A, B, K16    R(A) = R(B).CONST(K16)               */
     OP_ATTR_STORE,
 
     OP_REL_LOAD,            /* A, K16,      R(A) = REL(K16)                      */
@@ -190,12 +192,18 @@ typedef enum _OpCode {
     /* raise an error */
     OP_RAISE,
 
+    /* The below insns are only quickened at runtime */
+    OP_BINARY_METHOD,       /* A B C        R(A) = IC.method(R(B), R(C))         */
+
     /* The below insns are only in IR */
     OP_IR_LOAD,
     OP_IR_STORE,
     OP_IR_PHI,
     OP_IR_JMP_COND,
 
+    /* superinstructions, generated by tools/gen_superinsns.py */
+    SUPER_OPCODES
+
 } OpCode;
 
 /* clang-format on */
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+/* Generated by tools/gen_superinsns.py, DO NOT EDIT! */
+
+#ifndef _KOALA_SUPER_INSNS_H_
+#define _KOALA_SUPER_INSNS_H_
+
+/* clang-format off */
+
+#define NUM_SUPER_INSNS 2
+
+/* max number of insns in a superinstruction */
+#define MAX_SUPER_INSN_LEN 3
+
+/* opcodes, appended to OpCode */
+#define SUPER_OPCODES \
+    OP_SUPER_INT_SUB_IMM8_PUSH_CALL, \
+    OP_SUPER_INT_ADD_RETURN, \
+
+
+/* threaded dispatch targets, appended to opcode_targets */
+#define SUPER_TARGETS \
+    &&TARGET_OP_SUPER_INT_SUB_IMM8_PUSH_CALL, \
+    &&TARGET_OP_SUPER_INT_ADD_RETURN, \
+
+
+/* { super opcode, number of insns, { opcodes } }, longest first */
+#define SUPER_INSN_PATTERNS \
+    { OP_SUPER_INT_SUB_IMM8_PUSH_CALL, 3, { OP_INT_SUB_IMM8, OP_PUSH, OP_CALL } }, \
+    { OP_SUPER_INT_ADD_RETURN, 2, { OP_INT_ADD, OP_RETURN } }, \
+
+
+/* clang-format on */
+
+#endif /* _KOALA_SUPER_INSNS_H_ */
@@ -12,17 +12,56 @@
 extern "C" {
 #endif
 
+/*
+ * Open addressing, the table is key and value pairs, a none key is an empty
+ * slot. The keys are hashed by their contents, the objects may be moved.
+ */
 typedef struct _DictObject {
     OBJECT_HEAD
-    HashMapEntry entry;
-    const char *key;
-    Value value;
+    int len;
+    GcArrayObject *table;
 } DictObject;
 
 extern TypeObject dict_type;
 #define IS_DICT(ob) IS_TYPE((ob), &dict_type)
 
+#define DICT_LEN(x) (((DictObject *)(x))->len)
+
 Object *kl_new_dict(void);
+/* the key is an int or a str */
+void kl_dict_set(Object *self, Value *key, Value *val);
+/* error_value: not found */
+Value kl_dict_get(Object *self, Value *key);
+/* set a value of a str key */
+void kl_dict_set_str(Object *self, const char *key, Value *val);
+Value kl_dict_get_str(Object *self, const char *key);
+
+/*
+ * Ephemeron table, an entry is kept while its key is reachable without it, its
+ * value is not kept by the key only. The entries of the dead keys are cleared
+ * by the gc to error keys, they are reused by the insertions.
+ * The keys are objects compared by identity and hashed by their addresses, the
+ * table is rehashed in place when it is used after the gc moved objects.
+ */
+typedef struct _WeakDictObject {
+    OBJECT_HEAD
+    /* the live and the cleared entries */
+    int used;
+    /* gc_moves when the keys were hashed */
+    size_t moves;
+    GcArrayObject *table;
+} WeakDictObject;
+
+extern TypeObject weakdict_type;
+#define IS_WEAKDICT(ob) IS_TYPE((ob), &weakdict_type)
+
+Object *kl_new_weakdict(void);
+/* the key is an object, not an int or a float */
+void kl_weakdict_set(Object *self, Value *key, Value *val);
+/* error_value: not found, or its key is collected */
+Value kl_weakdict_get(Object *self, Value *key);
+/* the live entries, counted */
+int kl_weakdict_len(Object *self);
 
 #ifdef __cplusplus
 }
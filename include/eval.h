@@ -40,6 +40,13 @@ typedef struct _CallFrame {
     /* value stack base pointer */
     Value *stack_base;
 
+    /* saved insn pointer, while calling another code in the same loop */
+    uint8_t *next_inst;
+    /* saved value stack top, while calling another code in the same loop */
+    Value *top;
+    /* caller's register for return value, NULL if called from C */
+    Value *ret;
+
     /* locals and value stack */
     Value local_stack[0];
 } CallFrame;
@@ -69,11 +76,13 @@ typedef struct _KoalaState {
     char *stack_top_ptr;
     /* depth of call frames */
     int depth;
+    /* nested kl_eval_code, on the c stack */
+    int native_depth;
 
     /* stack size */
     int stack_size;
-    /* base stack pointer */
-    char base_stack_ptr[0];
+    /* base stack pointer, the frames are aligned */
+    _Alignas(8) char base_stack_ptr[0];
 } KoalaState;
 
 Value kl_eval_code(Value *self, Value *args, int nargs, Object *names);
@@ -81,6 +90,13 @@ Value kl_eval_code(Value *self, Value *args, int nargs, Object *names);
 KoalaState *ks_new(void);
 void ks_free(KoalaState *ks);
 
+#ifdef OPCODE_PROFILE
+/* record an opcode and its two predecessors(-1 if none) */
+void opcode_profile_record(int prev2, int prev1, int opcode);
+/* dump to $KOALA_OPCODE_PROFILE or ./opcode_profile.txt */
+void opcode_profile_dump(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,15 +42,53 @@ typedef struct _FieldObject {
 #define FIELD_KIND_MEMBER 2
 #define FIELD_KIND_VAR    3
 #define FIELD_KIND_VALUE  4
-    /* below real data */
-    char data[0];
+    /* below real data, pointer aligned after the one word header */
+    _Alignas(void *) char data[0];
 } FieldObject;
 
+extern TypeObject field_type;
+#define IS_FIELD(ob) IS_TYPE((ob), &field_type)
+
 Object *kl_field_from_member(MemberDef *member);
 Object *kl_field_from_getset(GetSetDef *getset);
 Object *kl_field_from_var(VarInfo *var);
 Object *kl_field_from_value(ValueInfo *val);
 
+/* vars of koala object are saved in Value slots after object header */
+#define VAR_OFFSET(index) ((int)(sizeof(Object) + sizeof(Value) * (index)))
+
+/* offset and MBR_T_XXX of the field in its object, -1 if not stored in object */
+int kl_field_offset(Object *field, int *type);
+Value kl_field_get(Object *field, Object *obj);
+
+/* load a member at `ptr` by its type */
+static inline Value kl_member_load(char *ptr, int type)
+{
+    switch (type) {
+        case MBR_T_VALUE:
+            return *(Value *)ptr;
+        case MBR_T_OBJECT: {
+            Object *obj = *(Object **)ptr;
+            return obj ? obj_value(obj) : none_value;
+        }
+        case MBR_T_BYTE:
+            return int_value(*(int8_t *)ptr);
+        case MBR_T_SHORT:
+            return int_value(*(int16_t *)ptr);
+        case MBR_T_INT:
+            return int_value(*(int32_t *)ptr);
+        case MER_T_LONG:
+            return int_value(*(int64_t *)ptr);
+        case MER_T_FLOAT:
+            return float_value(*(float *)ptr);
+        case MER_T_DOUBLE:
+            return float_value(*(double *)ptr);
+        default:
+            UNREACHABLE();
+            return none_value;
+    }
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,52 +7,67 @@
 #define _KOALA_GC_H_
 
 #include "lldq.h"
-#include "queue.h"
+#include "mm.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define GC_COLOR_WHITE 1
-#define GC_COLOR_GRAY  2
-#define GC_COLOR_BLACK 3
-
 #define GC_KIND_ARRAY_INT8   1
 #define GC_KIND_ARRAY_INT64  2
 #define GC_KIND_ARRAY_FLT64  3
 #define GC_KIND_ARRAY_OBJECT 4
 #define GC_KIND_ARRAY_VALUE  5
 #define GC_KIND_OBJECT       6
+/* moved by a minor gc or a compaction, see GcForward */
+#define GC_KIND_FORWARD      7
 
+/*
+ * One word: the kind, the age, the index of the type in the type table and
+ * the size. The marks are side bitmaps of the pages and the big objects.
+ */
 /* clang-format off */
-#define GC_OBJECT_HEAD LLDqNode gc_link; int gc_size; short gc_age; char gc_color; char gc_kind;
+#define GC_OBJECT_HEAD \
+    unsigned int gc_kind : 3; signed int gc_age : 5; unsigned int gc_type : 24; \
+    int gc_size;
 /* clang-format on */
 
 typedef struct _GcObject {
     GC_OBJECT_HEAD
 } GcObject;
 
+/* the elements follow it, aligned for the int64, double and Value ones */
 typedef struct _GcArrayObject {
     GC_OBJECT_HEAD
     int gc_num_objs;
+    _Alignas(8) char gc_items[0];
 } GcArrayObject;
 
 /* clang-format off */
-#define GC_OBJECT_INIT(_size, _age, _color) \
-    .gc_link = { NULL }, .gc_size = (_size), .gc_age = (_age), .gc_color = (_color)
+#define GC_OBJECT_INIT(_size, _age) .gc_size = (_size), .gc_age = (_age)
 
-#define INIT_GC_OBJECT(_obj, _size, _age, _color) \
-    lldq_node_init(&(_obj)->gc_link); (_obj)->gc_size = (_size); \
-    (_obj)->gc_age = (_age); (_obj)->gc_color = (_color)
+#define INIT_GC_OBJECT(_obj, _size, _age) \
+    (_obj)->gc_size = (_size); (_obj)->gc_age = (_age)
 /* clang-format on */
 
-extern volatile char *_gc_check_ptr;
+/* gc_age: -1 permanent, 0 old, > 0 young, the minor gcs survived plus one */
+#define gc_is_young(obj) (((GcObject *)(obj))->gc_age > 0)
+
+/* the young object is copied to `to`, the smallest object is one of it */
+typedef struct _GcForward {
+    GC_OBJECT_HEAD
+    GcObject *to;
+} GcForward;
+
+/* the collector is stopping the world, polled by the mutators at safepoints */
+extern volatile int gc_safepoint_requested;
 
-/* This will trigger segment fault, if gc has no memory. */
-static inline void gc_check_stw(void)
+void _gc_safepoint(void);
+
+/* suspend the thread here if the world is stopping, until it is resumed */
+static inline void gc_safepoint(void)
 {
-    char v = *_gc_check_ptr;
-    UNUSED(v);
+    if (gc_safepoint_requested) _gc_safepoint();
 }
 
 typedef enum _GcState {
@@ -62,29 +77,336 @@ typedef enum _GcState {
     GC_REMARK,
     GC_CO_SWEEP,
     GC_FULL,
+    GC_YOUNG,
 } GcState;
 
-void init_gc_system(size_t max_mem_size, double factor);
+/*
+ * Small objects are cells of size class pages, bigger ones are allocated alone.
+ * A page is aligned to its size, its mark bits are a side bitmap.
+ */
+#define GC_PAGE_SIZE      (64 * 1024)
+#define GC_MAX_SMALL_SIZE 2048
+#define GC_NR_CLASSES     24
+
+/*
+ * Thread local allocation buffer, used by its thread without locks, and by
+ * the collector only when the world is stopped. A thread owns a page of every
+ * size class, the free cells of a bitmap word are taken at a time, and a page
+ * of the nursery, the young objects are bumped in it.
+ */
+/* objects recorded by the write barrier of a thread */
+#define GC_SATB_SIZE 256
+
+typedef struct _GcSatbBuf {
+    struct _GcSatbBuf *next;
+    int count;
+    GcObject *objs[GC_SATB_SIZE];
+} GcSatbBuf;
+
+typedef struct _GcTlab {
+    struct _GcTlab *next;
+    /* snapshot of the concurrent marking, NULL: nothing recorded */
+    GcSatbBuf *satb;
+    struct _GcPage *pages[GC_NR_CLASSES];
+    /* bitmap word taken of the page */
+    int words[GC_NR_CLASSES];
+    /* free cells of the word */
+    uint64_t bits[GC_NR_CLASSES];
+    /* bump region of the nursery page of the thread */
+    char *young_top;
+    char *young_end;
+} GcTlab;
+
+void gc_init_tlab(GcTlab *tlab);
+void gc_fini_tlab(GcTlab *tlab);
+
+/* heap options, from the environment and the command line */
+typedef struct _GcOptions {
+    /* the heap is never shrunk below it */
+    size_t init_size;
+    /* the heap is never grown above it */
+    size_t max_size;
+    /* target pause of a minor gc, in milliseconds */
+    int pause_ms;
+    /* the statistics are appended to it, NULL: not dumped */
+    const char *stats_file;
+    /* at most once in it, in milliseconds */
+    int stats_ms;
+    /* the read-only arena is protected by gc_seal_perm() */
+    int protect_perm;
+    /* the fragmented old pages are compacted by a full gc */
+    int compact;
+} GcOptions;
+
+/*
+ * The defaults, KOALA_GC_INIT_HEAP, KOALA_GC_MAX_HEAP, KOALA_GC_PAUSE,
+ * KOALA_GC_STATS, KOALA_GC_STATS_INTERVAL, KOALA_GC_PROTECT_PERM and
+ * KOALA_GC_COMPACT.
+ */
+void gc_init_options(GcOptions *opts, size_t max_size);
+/*
+ * --gc-init-heap=SIZE, --gc-max-heap=SIZE, --gc-pause=MS, --gc-stats=FILE,
+ * --gc-stats-interval=MS, --gc-protect-perm=0|1 or --gc-compact=0|1, -1: not
+ * one of them
+ */
+int gc_parse_option(GcOptions *opts, const char *arg);
+
+void init_gc_system(GcOptions *opts);
 void fini_gc_system(void);
 
-void *_gc_alloc(int size, int perm);
+/*
+ * The runtime is initialized, the pages of the read-only arena are made
+ * read-only if protect_perm is set. A later permanent object is in a new
+ * page, protected by the next call. The young objects the pages refer to are
+ * promoted first, a page still referring to a pinned one is not protected.
+ */
+void gc_seal_perm(void);
+
+/* the heap size a full gc is run at, resized after every cycle */
+size_t gc_heap_size(void);
+
+/* bucket i: [2^(i-1), 2^i) microseconds, the last one is longer too */
+#define GC_HIST_BUCKETS 24
+
+/* the times of a phase, mark roots, remark, full and young stop the world */
+typedef struct _GcPhaseStats {
+    size_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    size_t hist[GC_HIST_BUCKETS];
+} GcPhaseStats;
+
+/* the objects of a type marked by a major cycle */
+typedef struct _GcTypeStats {
+    /* a TypeObject, or the kind of an array, NULL: empty */
+    void *type;
+    size_t objs;
+    size_t bytes;
+} GcTypeStats;
+
+#define GC_MAX_TYPE_STATS 256
+
+typedef struct _GcStats {
+    /* all bytes so far */
+    size_t young_allocated;
+    size_t old_allocated;
+    size_t young_freed;
+    size_t old_freed;
+    size_t promoted;
+    /* promoted bytes of the young ones collected by the last minor gc */
+    double promotion_rate;
+    /* old bytes per millisecond during the concurrent cycles */
+    double alloc_rate;
+    size_t heap_size;
+    size_t used_size;
+    /* bytes mapped by the live large objects */
+    size_t large_size;
+    /* after the last major cycle */
+    size_t live_size;
+    /* the free bytes of the old pages after the last sweep, of all their bytes */
+    double fragmentation;
+    /* old bytes moved by the compactions */
+    size_t compacted;
+    /* indexed by GcState, GC_DONE is not used */
+    GcPhaseStats phases[GC_YOUNG + 1];
+    /* survivors of the last major cycle, the most bytes first */
+    int ntypes;
+    GcTypeStats types[GC_MAX_TYPE_STATS];
+} GcStats;
+
+void gc_get_stats(GcStats *stats);
+/* "young", "full" and so on */
+const char *gc_phase_name(int phase);
+const char *gc_type_name(GcTypeStats *ts);
+/* one line of json */
+void gc_dump_stats(GcStats *stats, FILE *fp);
+
+void *_gc_alloc(int size, int perm, char kind);
+
+/* permanent, in the read-only arena, or in the writable one */
+#define GC_PERM_RO 1
+#define GC_PERM_RW 2
+/* old, its fini is run by the finalizer thread after it is dead */
+#define GC_FINI 3
+
+#define gc_alloc(size)    _gc_alloc(size, 0, GC_KIND_OBJECT)
+#define gc_alloc_p(size)  _gc_alloc(size, GC_PERM_RO, GC_KIND_OBJECT)
+#define gc_alloc_pw(size) _gc_alloc(size, GC_PERM_RW, GC_KIND_OBJECT)
+#define gc_alloc_f(size)  _gc_alloc(size, GC_FINI, GC_KIND_OBJECT)
+
+#define gc_alloc_obj(ptr)    gc_alloc(OBJ_SIZE(ptr))
+#define gc_alloc_obj_p(ptr)  gc_alloc_p(OBJ_SIZE(ptr))
+#define gc_alloc_obj_pw(ptr) gc_alloc_pw(OBJ_SIZE(ptr))
+#define gc_alloc_obj_f(ptr)  gc_alloc_f(OBJ_SIZE(ptr))
+
+/*
+ * Run the queued finis in the caller, and wait for the ones being run by the
+ * finalizer thread, for the tests and the shutdown. The number run by it.
+ */
+int gc_run_finalizers(void);
+
+/*
+ * The address of the object is kept by the C code, it is neither moved nor
+ * collected until it is unpinned as many times as it is pinned.
+ */
+void gc_pin(void *obj);
+void gc_unpin(void *obj);
+
+/* objects in a mark stack segment */
+#define GC_MARK_SEG_SLOTS 1022
+
+typedef struct _GcMarkSeg {
+    struct _GcMarkSeg *prev;
+    int top;
+    GcObject *objs[GC_MARK_SEG_SLOTS];
+} GcMarkSeg;
 
-#define gc_alloc(size)   _gc_alloc(size, 0)
-#define gc_alloc_p(size) _gc_alloc(size, 1)
+/*
+ * Gray objects to scan, LIFO. The segments are reused, no memory is allocated
+ * by a push unless the stack is deeper than ever.
+ */
+typedef struct _GcMarkStack {
+    GcMarkSeg *seg;
+    /* emptied segments */
+    GcMarkSeg *spare;
+    /* a minor gc, the young objects are copied instead of marked */
+    int minor;
+    /* the object scanned by a minor gc, its slots are remembered */
+    GcObject *owner;
+} GcMarkStack;
 
-#define gc_alloc_obj(ptr)   gc_alloc(OBJ_SIZE(ptr))
-#define gc_alloc_obj_p(ptr) gc_alloc_p(OBJ_SIZE(ptr))
+void gc_mark_stack_init(GcMarkStack *stk);
+void gc_mark_stack_fini(GcMarkStack *stk);
+void _gc_mark_stack_push_seg(GcMarkStack *stk);
+int _gc_mark_stack_pop_seg(GcMarkStack *stk);
 
-#define _gc_mark(obj, _color) ((GcObject *)(obj))->gc_color = (_color)
+static inline void gc_mark_stack_push(GcMarkStack *stk, GcObject *obj)
+{
+    if (stk->seg->top == GC_MARK_SEG_SLOTS) _gc_mark_stack_push_seg(stk);
+    GcMarkSeg *seg = stk->seg;
+    seg->objs[seg->top++] = obj;
+}
 
-static inline void gc_mark_obj(GcObject *obj, Queue *que)
+/* NULL: empty, the next object to scan is prefetched */
+static inline GcObject *gc_mark_stack_pop(GcMarkStack *stk)
+{
+    if (!stk->seg->top && !_gc_mark_stack_pop_seg(stk)) return NULL;
+    GcMarkSeg *seg = stk->seg;
+    GcObject *obj = seg->objs[--seg->top];
+    if (seg->top) __builtin_prefetch(seg->objs[seg->top - 1]);
+    return obj;
+}
+
+/* set the mark bit, 0: already marked */
+int gc_set_mark(GcObject *obj);
+
+/* a minor gc, copy the young object, return its new address */
+GcObject *_gc_forward(GcObject *obj, void *slot, GcMarkStack *stk);
+/* a minor gc, the young object is kept in place */
+void _gc_pin(GcObject *obj, GcMarkStack *stk);
+
+/*
+ * A reference not in a heap slot, like in a shadow stack, cannot be updated,
+ * so a minor gc pins its object instead of moving it.
+ */
+static inline void gc_mark_obj(GcObject *obj, GcMarkStack *stk)
 {
     ASSERT(obj);
 
-    if (obj->gc_age != -1) {
-        _gc_mark(obj, GC_COLOR_GRAY);
-        queue_push(que, obj);
+    if (stk->minor) {
+        if (gc_is_young(obj)) _gc_pin(obj, stk);
+        return;
     }
+
+    /* permanent, or not in the heap */
+    if (obj->gc_age == -1 || !obj->gc_size) return;
+    if (gc_set_mark(obj)) gc_mark_stack_push(stk, obj);
+}
+
+/* a reference slot of a heap object or a root, updated if its object is moved */
+static inline void gc_mark_field(void *slot, GcMarkStack *stk)
+{
+    GcObject **ptr = slot;
+    GcObject *obj = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    if (!obj) return;
+
+    if (stk->minor) {
+        if (gc_is_young(obj)) *ptr = _gc_forward(obj, ptr, stk);
+        return;
+    }
+    gc_mark_obj(obj, stk);
+}
+
+void _gc_weak_slot(void *slot);
+void _gc_ephemeron_slot(void *slot);
+
+/*
+ * A weak reference slot of a heap object. A major gc does not mark through it,
+ * and clears it after the marking if its object is dead. A minor gc keeps its
+ * object, the young object is cleared by the next major gc.
+ */
+static inline void gc_mark_weak(void *slot, GcMarkStack *stk)
+{
+    if (stk->minor) {
+        gc_mark_field(slot, stk);
+    } else if (__atomic_load_n((GcObject **)slot, __ATOMIC_ACQUIRE)) {
+        _gc_weak_slot(slot);
+    }
+}
+
+/*
+ * The slot of an ephemeron table, an array of value pairs, a none key is empty.
+ * A value is marked by a major gc only if its key is marked by the others. The
+ * entries of the dead keys are cleared to an error key and a none value.
+ */
+static inline void gc_mark_ephemerons(void *slot, GcMarkStack *stk)
+{
+    if (stk->minor) {
+        gc_mark_field(slot, stk);
+    } else if (__atomic_load_n((GcObject **)slot, __ATOMIC_ACQUIRE)) {
+        _gc_ephemeron_slot(slot);
+    }
+}
+
+/* run a full gc and wait for it */
+void gc_collect(void);
+/* bumped by the gcs moving objects, the addresses hashed before it are stale */
+size_t gc_moves(void);
+/* start a concurrent cycle, return its number after its roots are marked */
+size_t gc_start_marking(void);
+/* wait for the cycle to finish */
+void gc_wait_cycle(size_t cycle);
+/* wait for the running cycle, if any, before exit */
+void gc_wait_done(void);
+
+/* concurrent marking is running, the write barrier records the old objects */
+extern volatile int gc_marking;
+
+void _gc_satb_push(GcObject *obj);
+
+/*
+ * Read barrier of a weak reference, or an ephemeron value. The object may be
+ * not marked by the running cycle, it is recorded before it is stored.
+ */
+static inline void gc_keep_alive(void *obj)
+{
+    if (gc_marking && obj) _gc_satb_push(obj);
+}
+/* the slot of the old object refers to a young one */
+void _gc_card_mark(void *owner, void *slot);
+
+/*
+ * Write barrier, every reference store into a heap object is done by it.
+ * Snapshot-at-the-beginning: the overwritten object is recorded, so all objects
+ * reachable when the marking started are marked. Card marking: the card of an
+ * old to young reference is dirty, it is scanned by the next minor gc.
+ */
+static inline void gc_store_obj(void *owner, void *slot, void *obj)
+{
+    GcObject **ptr = slot;
+    if (gc_marking && *ptr) _gc_satb_push(*ptr);
+    __atomic_store_n(ptr, (GcObject *)obj, __ATOMIC_RELEASE);
+    if (obj && gc_is_young(obj) && !gc_is_young(owner)) _gc_card_mark(owner, slot);
 }
 
 void *gc_alloc_array(char kind, size_t len);
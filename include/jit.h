@@ -0,0 +1,197 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#ifndef _KOALA_JIT_H_
+#define _KOALA_JIT_H_
+
+#include "eval.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* baseline jit, only x86-64 is supported */
+#ifndef USE_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define USE_JIT 1
+#else
+#define USE_JIT 0
+#endif
+#endif
+
+/* calls + backward jumps before a code is compiled */
+#define JIT_THRESHOLD 1000
+
+/*
+ * Native code of a CodeObject, stitched from per-opcode templates. It runs
+ * on the locals of the CallFrame and returns the offset of the first insn
+ * it does not handle, which is run by the interpreter.
+ */
+typedef struct _JitCode {
+    /* executable memory, starts with the entry stub */
+    uint8_t *mem;
+    int size;
+    /* number of insns compiled to native code */
+    int nr_native;
+    /* insn offset -> native code, NULL: interpreted */
+    uint8_t **entries;
+} JitCode;
+
+/* the exception is raised */
+#define JIT_ERROR  -1
+/* resume the top frame at its next_inst */
+#define JIT_RESUME -2
+
+/*
+ * Jump to `target` on the locals of `cf`, returns the offset of the insn to
+ * be run by the interpreter or JIT_XXX. The native code calls and returns in
+ * the same loop, the frame to resume is always the top one.
+ */
+typedef int (*JitFunc)(CallFrame *cf, uint8_t *target);
+
+/* the frame switched to by a call or return helper */
+typedef struct _JitFrame {
+    /* NULL: not switched, the insn is left to the interpreter */
+    CallFrame *cf;
+    /* NULL: the frame is resumed by the interpreter */
+    uint8_t *target;
+} JitFrame;
+
+#if USE_JIT
+
+/* 0 disables the jit, set by $KOALA_JIT_THRESHOLD */
+extern uint32_t jit_threshold;
+
+void jit_init(void);
+/* compile the code to native code, failed if no insn can be compiled */
+int jit_compile(CodeObject *code);
+
+static inline int jit_run(JitCode *jc, CallFrame *cf, int offset)
+{
+    return ((JitFunc)jc->mem)(cf, jc->entries[offset]);
+}
+
+/* called by native code, same as the insns in interpreter */
+int jit_binary_generic(CallFrame *cf, int offset, int op);
+JitFrame jit_call(CallFrame *cf, int offset);
+JitFrame jit_return(CallFrame *cf, int offset);
+
+#else
+
+#define jit_threshold 0
+static inline void jit_init(void) {}
+static inline int jit_compile(CodeObject *code) { return -1; }
+
+#endif /* USE_JIT */
+
+/* optimizing tier by llvm, enabled by cmake -DLLVM_JIT=ON */
+#ifndef USE_LLVM_JIT
+#define USE_LLVM_JIT 0
+#endif
+
+/* calls + backward jumps before a code is optimized, hottest only */
+#define OPT_THRESHOLD 10000
+
+/* max arguments of an optimized code */
+#define OPT_MAX_ARGS 8
+
+/* the optimized code bails out, it is run again by the interpreter */
+#define OPT_BAIL 1
+
+/*
+ * Entry of an optimized code, on the unboxed int arguments. `budget` is the
+ * call depth left, the code bails out if it is exhausted.
+ */
+typedef int (*OptFunc)(int64_t *args, int64_t *ret, int budget);
+
+/*
+ * A numeric kernel optimized by llvm: all its locals are ints and it has no
+ * side effect, so a bail out just runs the call again in the interpreter.
+ */
+typedef struct _OptCode {
+    /* llvm execution engine, owns the machine code */
+    void *engine;
+    OptFunc entry;
+    int nargs;
+} OptCode;
+
+/* max locals of an optimized loop */
+#define OPT_MAX_LOCALS 256
+
+/*
+ * Entry of an optimized loop, on the unboxed int locals of the frame. It
+ * returns the offset where the interpreter resumes, the locals in `mask` are
+ * written back to `locals` by it.
+ */
+typedef int (*OsrFunc)(int64_t *locals, uint64_t *mask, int budget);
+
+/*
+ * A loop entered by on-stack replacement. The insns reachable from the loop
+ * head are optimized, the others are exits, where the optimized code deopts
+ * to the interpreter.
+ */
+typedef struct _OptOsr {
+    void *engine;
+    OsrFunc entry;
+    /* the locals must be ints at entry */
+    uint64_t mask[OPT_MAX_LOCALS / 64];
+} OptOsr;
+
+#if USE_LLVM_JIT
+
+/* 0 disables the tier, set by $KOALA_OPT_THRESHOLD */
+extern uint32_t opt_threshold;
+
+void opt_init(void);
+/* lower the typed bytecode to llvm ir and run O2, failed if not a kernel */
+int opt_compile(CodeObject *code);
+
+/* call the optimized code, failed if the arguments are not ints or it bails */
+static inline int opt_run(OptCode *oc, Value *args, int nargs, int budget, Value *ret)
+{
+    if (nargs != oc->nargs) return -1;
+    int64_t iargs[OPT_MAX_ARGS];
+    for (int i = 0; i < nargs; i++) {
+        if (!IS_INT(args + i)) return -1;
+        iargs[i] = to_int(args + i);
+    }
+    int64_t r;
+    if (oc->entry(iargs, &r, budget)) return -1;
+    *ret = int_value(r);
+    return 0;
+}
+
+/* optimize the loop of the backward jump at `offset`, for the locals of `cf` */
+int opt_compile_osr(CallFrame *cf, int offset);
+/* move the locals into the optimized loop, returns the offset to resume at */
+int opt_osr_run(OptOsr *osr, CallFrame *cf, int budget);
+
+#else
+
+#define opt_threshold 0
+static inline void opt_init(void) {}
+static inline int opt_compile(CodeObject *code) { return -1; }
+static inline int opt_run(OptCode *oc, Value *args, int nargs, int budget, Value *ret)
+{
+    return -1;
+}
+static inline int opt_compile_osr(CallFrame *cf, int offset) { return -1; }
+static inline int opt_osr_run(OptOsr *osr, CallFrame *cf, int budget) { return -1; }
+
+#endif /* USE_LLVM_JIT */
+
+/* count a call or backward jump, tier up the code at the thresholds */
+static inline void jit_count(CodeObject *code)
+{
+    uint32_t n = ++code->hotness;
+    if (n == jit_threshold) jit_compile(code);
+    if (n == opt_threshold) opt_compile(code);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_JIT_H_ */
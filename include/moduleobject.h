@@ -65,6 +65,9 @@ int module_add_member(Object *_m, MemberDef *member);
 int module_add_getset(Object *_m, GetSetDef *getset);
 int module_add_cfunc(Object *m, MethodDef *def);
 int module_add_object(Object *_m, const char *name, Object *obj);
+Object *module_lookup_object(Object *_m, const char *name, int len);
+int kl_add_module(const char *name, Object *m);
+Object *kl_lookup_module(const char *path, int len);
 
 static inline RelocInfo *module_get_rel(Object *_m, int index)
 {
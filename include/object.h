@@ -16,21 +16,48 @@ extern "C" {
 #endif
 
 /* clang-format off */
-#define OBJECT_HEAD GcObject ob_gc_obj; struct _TypeObject *ob_type;
+#define OBJECT_HEAD GcObject ob_gc_obj;
 /* clang-format on */
 
 typedef struct _Object {
     OBJECT_HEAD
 } Object;
 
+/*
+ * The type of an object is its index in kl_type_table, in the gc header.
+ * A type gets its index by its first object. The static objects are types,
+ * their type is type_type, the first one. The table spans the 24-bit index
+ * space, its zero pages are committed when the types are registered.
+ */
+#define TYPE_TABLE_SIZE (1 << 24)
+#define TYPE_INDEX_TYPE 1
+
+extern struct _TypeObject *kl_type_table[];
+
+/* clang-format off */
 #define OBJECT_HEAD_INIT(_type) \
-    .ob_gc_obj = { GC_OBJECT_INIT(0, -1, GC_COLOR_BLACK) }, .ob_type = (_type)
+    .ob_gc_obj = { GC_OBJECT_INIT(0, -1), .gc_type = TYPE_INDEX_TYPE }
+/* clang-format on */
+
+#define INIT_OBJECT_HEAD(_ob, _type) OB_TYPE_INDEX(_ob) = kl_type_index(_type)
+
+#define OB_TYPE_INDEX(_ob) (((GcObject *)(_ob))->gc_type)
+#define OB_TYPE(_ob)       (kl_type_table[OB_TYPE_INDEX(_ob)])
+
+#define IS_TYPE(ob, type) (OB_TYPE_INDEX(ob) == (type)->index)
 
-#define INIT_OBJECT_HEAD(_ob, _type) (_ob)->ob_type = (_type)
+/* 8-byte NaN-boxed Value, default is 16-byte tagged Value */
+#ifndef USE_NAN_BOXING
+#define USE_NAN_BOXING 0
+#endif
 
-#define OB_TYPE(_ob) (((Object *)(_ob))->ob_type)
+#define VAL_TAG_NONE   0 // none(null/nil) value
+#define VAL_TAG_INT    1
+#define VAL_TAG_FLOAT  2
+#define VAL_TAG_OBJECT 3
+#define VAL_TAG_ERROR  4 // nothing type
 
-#define IS_TYPE(ob, type) (OB_TYPE(ob) == type)
+#if !USE_NAN_BOXING
 
 typedef struct _Value {
     union {
@@ -41,11 +68,7 @@ typedef struct _Value {
     int tag;
 } Value;
 
-#define VAL_TAG_NONE   0 // none(null/nil) value
-#define VAL_TAG_INT    1
-#define VAL_TAG_FLOAT  2
-#define VAL_TAG_OBJECT 3
-#define VAL_TAG_ERROR  4 // nothing type
+#define VAL_TAG(x)  ((x)->tag)
 
 #define IS_OBJ(x)   ((x)->tag == VAL_TAG_OBJECT)
 #define IS_INT(x)   ((x)->tag == VAL_TAG_INT)
@@ -60,25 +83,150 @@ typedef struct _Value {
 #define none_value     (Value){ .tag = VAL_TAG_NONE,   .ival = 0   }
 #define error_value    (Value){ .tag = VAL_TAG_ERROR,  .ival = -1  }
 
-// will throw exception, if type check failed.
-#define as_obj(v)   ({ ASSERT(IS_OBJ(v)); (v)->obj; })
-#define as_int(v)   ({ ASSERT(IS_INT(v)); (v)->ival; })
-#define as_float(v) ({ ASSERT(IS_INT(v)); (v)->fval; })
-
 #define to_obj(v)   ((v)->obj)
 #define to_int(v)   ((v)->ival)
 #define to_float(v) ((v)->fval)
+/* clang-format on */
+
+#else /* USE_NAN_BOXING */
+
+/*
+ * The high 16 bits tell the kind, as JavaScriptCore does:
+ *   0x0000 | 48-bit pointer    object, bits 0-7 are none and error
+ *   0x0001 ... 0xFFFE          float, double bits plus 2^48
+ *   0xFFFF | 48-bit int        int, out of range ones are boxed as object
+ * All zeros is none, so zeroed memory is none in both representations.
+ */
+typedef struct _Value {
+    uint64_t bits;
+} Value;
+
+#define NAN_BOX_NONE          ((uint64_t)0)
+#define NAN_BOX_ERROR         ((uint64_t)2)
+#define NAN_BOX_DOUBLE_OFFSET ((uint64_t)1 << 48)
+#define NAN_BOX_INT_TAG       ((uint64_t)0xFFFF << 48)
+#define NAN_BOX_INT_MASK      (NAN_BOX_DOUBLE_OFFSET - 1)
+#define NAN_BOX_INT_MIN       (-((int64_t)1 << 47))
+#define NAN_BOX_INT_MAX       (((int64_t)1 << 47) - 1)
+
+/* int out of 48 bits */
+typedef struct _BoxedInt {
+    OBJECT_HEAD
+    int64_t ival;
+} BoxedInt;
 
+extern struct _TypeObject int_type;
+Value kl_new_boxed_int(int64_t v);
+
+#define IS_SMALL_INT(x) ((x)->bits >= NAN_BOX_INT_TAG)
+#define IS_OBJ(x)   ((x)->bits - 8 < NAN_BOX_DOUBLE_OFFSET - 8)
+#define IS_INT(x)   (IS_SMALL_INT(x) || (IS_OBJ(x) && OB_TYPE(to_obj(x)) == &int_type))
+#define IS_FLOAT(x) ((x)->bits - NAN_BOX_DOUBLE_OFFSET < NAN_BOX_INT_TAG - NAN_BOX_DOUBLE_OFFSET)
+#define IS_NONE(x)  ((x)->bits == NAN_BOX_NONE)
+#define IS_ERROR(x) ((x)->bits == NAN_BOX_ERROR)
+
+static inline int _nan_box_tag(Value *v)
+{
+    if (IS_SMALL_INT(v)) return VAL_TAG_INT;
+    if (IS_FLOAT(v)) return VAL_TAG_FLOAT;
+    if (IS_NONE(v)) return VAL_TAG_NONE;
+    if (IS_ERROR(v)) return VAL_TAG_ERROR;
+    return VAL_TAG_OBJECT;
+}
+
+static inline Value _nan_box_int(int64_t v)
+{
+    if (v < NAN_BOX_INT_MIN || v > NAN_BOX_INT_MAX) return kl_new_boxed_int(v);
+    return (Value){ .bits = NAN_BOX_INT_TAG | ((uint64_t)v & NAN_BOX_INT_MASK) };
+}
+
+static inline Value _nan_box_float(double d)
+{
+    union { double d; uint64_t u; } x = { .d = d };
+    /* canonicalize NaN, negative NaNs overlap with int */
+    if (d != d) x.u = 0x7FF8000000000000ULL;
+    return (Value){ .bits = x.u + NAN_BOX_DOUBLE_OFFSET };
+}
+
+static inline int64_t _nan_unbox_int(Value *v)
+{
+    if (IS_SMALL_INT(v)) return (int64_t)(v->bits << 16) >> 16;
+    return ((BoxedInt *)(uintptr_t)v->bits)->ival;
+}
+
+static inline double _nan_unbox_float(Value *v)
+{
+    union { uint64_t u; double d; } x = { .u = v->bits - NAN_BOX_DOUBLE_OFFSET };
+    return x.d;
+}
+
+#define VAL_TAG(x)  _nan_box_tag(x)
+
+/* clang-format off */
+#define obj_value(x)   (Value){ .bits = (uint64_t)(uintptr_t)(x) }
+#define int_value(x)   _nan_box_int((int64_t)(x))
+#define float_value(x) _nan_box_float((double)(x))
+#define none_value     (Value){ .bits = NAN_BOX_NONE  }
+#define error_value    (Value){ .bits = NAN_BOX_ERROR }
+
+#define to_obj(v)   ((void *)(uintptr_t)(v)->bits)
+#define to_int(v)   _nan_unbox_int(v)
+#define to_float(v) _nan_unbox_float(v)
 /* clang-format on */
 
-static inline void gc_mark_value(Value *val, Queue *que)
+#endif /* USE_NAN_BOXING */
+
+/* clang-format off */
+// will throw exception, if type check failed.
+#define as_obj(v)   ({ ASSERT(IS_OBJ(v)); to_obj(v); })
+#define as_int(v)   ({ ASSERT(IS_INT(v)); to_int(v); })
+#define as_float(v) ({ ASSERT(IS_FLOAT(v)); to_float(v); })
+/* clang-format on */
+
+/* the slot may be stored by a mutator, if marked concurrently */
+static inline void gc_mark_value(Value *val, GcMarkStack *stk)
 {
-    if (IS_OBJ(val)) {
-        gc_mark_obj(to_obj(val), que);
+#if !USE_NAN_BOXING
+    if (__atomic_load_n(&val->tag, __ATOMIC_ACQUIRE) != VAL_TAG_OBJECT) return;
+    void *obj = __atomic_load_n(&val->obj, __ATOMIC_ACQUIRE);
+    /* the payload is being changed, the old object is in the snapshot */
+    if (__atomic_load_n(&val->tag, __ATOMIC_RELAXED) != VAL_TAG_OBJECT) return;
+#else
+    Value v = { __atomic_load_n(&val->bits, __ATOMIC_RELAXED) };
+    if (!IS_OBJ(&v)) return;
+    void *obj = to_obj(&v);
+#endif
+    /* the world is stopped, the slot is updated if the object is moved */
+    if (stk->minor) {
+        if (gc_is_young(obj)) *val = obj_value((Object *)_gc_forward(obj, val, stk));
+        return;
     }
+    gc_mark_obj(obj, stk);
 }
 
-typedef void (*GcMarkFunc)(Object *, Queue *);
+/* write barrier of a value slot in a heap object, see gc_store_obj */
+static inline void gc_store_value(void *owner, Value *slot, Value val)
+{
+    if (!gc_marking) {
+        *slot = val;
+    } else {
+        if (IS_OBJ(slot)) _gc_satb_push(to_obj(slot));
+#if !USE_NAN_BOXING
+        /* the marker sees none while the payload is changed */
+        __atomic_store_n(&slot->tag, VAL_TAG_NONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->ival, val.ival, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->tag, val.tag, __ATOMIC_RELEASE);
+#else
+        __atomic_store_n(&slot->bits, val.bits, __ATOMIC_RELEASE);
+#endif
+    }
+
+    if (IS_OBJ(&val) && gc_is_young(to_obj(&val)) && !gc_is_young(owner)) {
+        _gc_card_mark(owner, slot);
+    }
+}
+
+typedef void (*GcMarkFunc)(Object *, GcMarkStack *);
 typedef Value (*HashFunc)(Value *self);
 typedef Value (*CmpFunc)(Value *lhs, Value *rhs);
 typedef Value (*GetIterFunc)(Object *self);
@@ -86,6 +234,11 @@ typedef Value (*IterNextFunc)(Object *self);
 typedef Value (*StrFunc)(Value *self);
 typedef Object *(*AllocFunc)(struct _TypeObject *tp);
 typedef int (*InitFunc)(Value *self, Value *args, int nargs, Object *names);
+/*
+ * Of an object allocated by gc_alloc_f, run by the finalizer thread after
+ * it is dead. It releases the native resources of its object, it must not
+ * allocate nor follow the references to other heap objects.
+ */
 typedef void (*FiniFunc)(Object *self);
 typedef Value (*CallFunc)(Value *self, Value *args, int nargs, Object *names);
 
@@ -217,6 +370,8 @@ typedef struct _TraitObject {
 
 typedef struct _TypeObject {
     OBJECT_HEAD
+    /* in kl_type_table, 0: no object yet */
+    int index;
     /* type name */
     char *name;
     /* one of TP_FLAGS_XXX */
@@ -281,6 +436,14 @@ extern TypeObject none_type;
 extern TypeObject int_type;
 extern TypeObject float_type;
 
+int kl_register_type(TypeObject *tp);
+
+static inline int kl_type_index(TypeObject *tp)
+{
+    int index = __atomic_load_n(&tp->index, __ATOMIC_ACQUIRE);
+    return index ? index : kl_register_type(tp);
+}
+
 /* common header of CFuncObject & CodeObject */
 #define FUNCTION_HEAD \
     OBJECT_HEAD \
@@ -294,10 +457,20 @@ typedef struct _FuncObject {
 /* call site cache */
 // https://en.wikipedia.org/wiki/Inline_caching
 // https://bernsteinbear.com/blog/inline-caching/
+/* max cached types of a call site, it is megamorphic if more */
+#define METHOD_SITE_SIZE 4
+
 typedef struct _MethodSite {
-    TypeObject *type;
     const char *fname;
-    Object *method;
+    /* number of cached types, -1: megamorphic */
+    int num;
+    struct {
+        TypeObject *type;
+        Object *method;
+    } entries[METHOD_SITE_SIZE];
+    /* statistics */
+    uint32_t hits;
+    uint32_t misses;
 } MethodSite;
 
 int type_ready(TypeObject *tp, Object *module);
@@ -322,7 +495,9 @@ static inline CallFunc object_callable(Value *val)
 /* clang-format on */
 
 Value object_call(Value *self, Value *args, int nargs, Object *names);
+Object *methodsite_lookup(MethodSite *ms, Value *obj);
 Value methodsite_call(MethodSite *ms, Value *args, int nargs, Object *names);
+Object *kl_lookup_attr(Value *obj, const char *name);
 Object *kl_lookup_method(Value *obj, const char *fname);
 int kl_parse_kwargs(Value *args, int nargs, Object *names, int npos, const char **kws,
                     ...);
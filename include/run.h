@@ -26,6 +26,8 @@ typedef struct _ThreadState {
     size_t steal_count;
     /* pthread id */
     pthread_t pid;
+    /* allocation buffers of gc */
+    GcTlab tlab;
     /* state flag */
     int state;
 #define TS_RUNNING 0
@@ -48,7 +50,9 @@ extern HashMap _gs_modules;
 static inline KoalaState *__ks(void) { return __ts->current; }
 
 int check_all_threads_stw(void);
-int enum_all_roots(Queue *que);
+int enum_all_roots(GcMarkStack *stk);
+/* the objects of the shadow stacks are pushed, they are not moved */
+void enum_pinned_roots(GcMarkStack *stk);
 
 #ifdef __cplusplus
 }
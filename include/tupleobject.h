@@ -22,9 +22,17 @@ typedef struct _TupleObject {
 extern TypeObject tuple_type;
 #define IS_TUPLE(ob) IS_TYPE((ob), &tuple_type)
 
-#define TUPLE_ITEMS(x) (Value *)((((TupleObject *)(x))->array) + 1)
+#define TUPLE_ITEMS(x) ((Value *)((((TupleObject *)(x))->array) + 1))
 #define TUPLE_LEN(x)   (((TupleObject *)(x))->stop - ((TupleObject *)(x))->start)
 
+/* clang-format off */
+/* store an item with the write barrier, `v` first, it may move the array */
+#define TUPLE_SET_ITEM(x, i, v) do { \
+    Value _v = (v); \
+    gc_store_value(((TupleObject *)(x))->array, TUPLE_ITEMS(x) + (i), _v); \
+} while (0)
+/* clang-format on */
+
 Object *kl_new_tuple(int size);
 
 #ifdef __cplusplus
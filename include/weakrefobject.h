@@ -0,0 +1,32 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#ifndef _KOALA_WEAKREF_OBJECT_H_
+#define _KOALA_WEAKREF_OBJECT_H_
+
+#include "object.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Its object is not kept by it, it is cleared after the object is dead. */
+typedef struct _WeakRefObject {
+    OBJECT_HEAD
+    Object *obj;
+} WeakRefObject;
+
+extern TypeObject weakref_type;
+#define IS_WEAKREF(ob) IS_TYPE((ob), &weakref_type)
+
+Object *kl_new_weakref(Object *obj);
+/* NULL: the object is collected */
+Object *kl_weakref_get(Object *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_WEAKREF_OBJECT_H_ */
@@ -10,9 +10,9 @@
 extern "C" {
 #endif
 
-static void str_gc_mark(StrObject *obj, Queue *que)
+static void str_gc_mark(StrObject *obj, GcMarkStack *stk)
 {
-    if (obj->array) gc_mark_obj((GcObject *)obj->array, que);
+    gc_mark_field(&obj->array, stk);
 }
 
 TypeObject byte_type = {
@@ -38,7 +38,7 @@ Object *kl_new_bytearray(const char *buf, int len)
     char *data = (char *)(arr + 1);
     memcpy(data, s, len);
     data[len] = '\0';
-    sobj->array = arr;
+    gc_store_obj(sobj, &sobj->array, arr);
 
     FINI_TRACE_STACK();
 
@@ -4,7 +4,9 @@
  */
 
 #include "codeobject.h"
+#include "opcode.h"
 #include "run.h"
+#include "stringobject.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,9 +25,359 @@ Object *kl_new_code(char *name, Object *m, TypeObject *cls)
     code->cs.name = name;
     code->module = m;
     code->cls = cls;
+    vector_init(&code->caches, sizeof(InlineCache));
     return (Object *)code;
 }
 
+/* Get the inline cache of the instruction at `offset`, create it if not exist. */
+InlineCache *code_inline_cache(CodeObject *code, int offset)
+{
+    ASSERT(offset >= 0 && offset < code->cs.insns_size);
+
+    if (!code->cache_index) {
+        code->cache_index = mm_alloc(sizeof(uint16_t) * code->cs.insns_size);
+    }
+
+    int index = code->cache_index[offset];
+    if (!index) {
+        InlineCache cache = { 0 };
+        vector_push_back(&code->caches, &cache);
+        index = vector_size(&code->caches);
+        ASSERT(index <= UINT16_MAX);
+        code->cache_index[offset] = index;
+    }
+
+    return vector_get(&code->caches, index - 1);
+}
+
+LoopSite *code_loop_site(CodeObject *code, int offset)
+{
+    InlineCache *ic = code_inline_cache(code, offset);
+    if (!ic->ls) {
+        ic->opcode = code_unfuse_opcode((uint8_t)code->cs.insns[offset]);
+        ic->ls = mm_alloc_obj(ic->ls);
+    }
+    return ic->ls;
+}
+
+const char *code_site_name(Value *name)
+{
+    Object *s = as_obj(name);
+    ASSERT(IS_STR(s));
+    int len = STR_LEN(s);
+    char *buf = mm_alloc(len + 1);
+    memcpy(buf, STR_BUF(s), len);
+    return buf;
+}
+
+int code_next_method_site(CodeObject *code, int offset, MethodSiteStats *stats)
+{
+    if (!code->cache_index) return -1;
+
+    while (++offset < code->cs.insns_size) {
+        int index = code->cache_index[offset];
+        if (!index) continue;
+        InlineCache *ic = vector_get(&code->caches, index - 1);
+        if (ic->opcode == OP_ATTR_LOAD || ic->opcode == OP_FIELD_LOAD) continue;
+        if (ic->opcode == OP_JMP_INT_CMP_LT_IMM8 || ic->opcode == OP_JMP_INT_CMP_GE_IMM8)
+            continue;
+        MethodSite *ms = &ic->ms;
+        if (!ms->fname) continue;
+        stats->offset = offset;
+        stats->name = ms->fname;
+        if (ms->num < 0) {
+            stats->state = "megamorphic";
+        } else if (ms->num > 1) {
+            stats->state = "polymorphic";
+        } else {
+            stats->state = "monomorphic";
+        }
+        stats->hits = ms->hits;
+        stats->misses = ms->misses;
+        return offset;
+    }
+    return -1;
+}
+
+void code_show_method_sites(CodeObject *code)
+{
+    MethodSiteStats st;
+    int offset = -1;
+    while ((offset = code_next_method_site(code, offset, &st)) >= 0) {
+        printf("%s:%d %s %s hits:%u misses:%u\n", code->cs.name, st.offset, st.name,
+               st.state, st.hits, st.misses);
+    }
+}
+
+typedef struct _SuperInsnPattern {
+    int code;
+    int num;
+    int codes[MAX_SUPER_INSN_LEN];
+} SuperInsnPattern;
+
+static SuperInsnPattern super_insn_patterns[] = {
+    SUPER_INSN_PATTERNS
+};
+
+/* the first insn of a superinstruction, the kept opcodes follow it */
+int code_unfuse_opcode(int op)
+{
+    for (int i = 0; i < COUNT_OF(super_insn_patterns); i++) {
+        if (super_insn_patterns[i].code == op) return super_insn_patterns[i].codes[0];
+    }
+    return op;
+}
+
+/* length of the insns run by the interpreter, -1: unknown */
+int code_insn_length(int op)
+{
+    switch (op) {
+        case OP_CONST_INT_0:
+        case OP_RETURN_NONE:
+            return 1;
+        case OP_PUSH:
+        case OP_PUSH_IMM8:
+        case OP_RETURN:
+            return 2;
+        case OP_CONST_INT_IMM8:
+            return 3;
+        case OP_INT_ADD ... OP_INT_MOD:
+        case OP_INT_AND ... OP_INT_XOR:
+        case OP_INT_SHL ... OP_INT_CMP_GE:
+        case OP_INT_SUB_IMM8:
+        case OP_FLOAT_ADD ... OP_FLOAT_MOD:
+        case OP_BINARY_ADD ... OP_BINARY_MOD:
+        case OP_BINARY_AND ... OP_BINARY_XOR:
+        case OP_BINARY_SHL ... OP_BINARY_CMP_GE:
+        case OP_BINARY_METHOD:
+        case OP_CONST_LOAD:
+        case OP_REL_LOAD:
+            return 4;
+        case OP_JMP_INT_CMP_LT_IMM8:
+        case OP_JMP_INT_CMP_GE_IMM8:
+        case OP_CALL:
+        case OP_CALL_METHOD:
+        case OP_CALL_KW:
+        case OP_ATTR_LOAD:
+        case OP_FIELD_LOAD:
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+static int match_super_insn(SuperInsnPattern *pat, uint8_t *inst, uint8_t *end)
+{
+    for (int i = 0; i < pat->num; i++) {
+        if (inst >= end || code_unfuse_opcode(*inst) != pat->codes[i]) return 0;
+        inst += code_insn_length(pat->codes[i]);
+    }
+    return 1;
+}
+
+/*
+ * Only the head opcode is replaced, the others are kept in the bytecode, so a
+ * jump into the sequence still runs them one by one. An unknown insn stops it.
+ */
+int code_fuse_insns(CodeObject *code)
+{
+    int count = 0;
+    uint8_t *inst = (uint8_t *)code->cs.insns;
+    uint8_t *end = inst + code->cs.insns_size;
+    code->fused = 1;
+    while (inst < end) {
+        int n = 1;
+        /* longest first */
+        for (int i = 0; i < COUNT_OF(super_insn_patterns); i++) {
+            SuperInsnPattern *pat = &super_insn_patterns[i];
+            if (match_super_insn(pat, inst, end)) {
+                *inst = pat->code;
+                n = pat->num;
+                count++;
+                break;
+            }
+        }
+        while (n-- > 0) {
+            int len = code_insn_length(code_unfuse_opcode(*inst));
+            if (len < 0) return count;
+            inst += len;
+        }
+    }
+    return count;
+}
+
+/* the register written by the insn at `inst` and the ones read, -1: none */
+static void insn_regs(int op, uint8_t *inst, int *def, int uses[2])
+{
+    *def = uses[0] = uses[1] = -1;
+    switch (op) {
+        case OP_CONST_INT_IMM8:
+        case OP_CONST_LOAD:
+        case OP_REL_LOAD:
+            *def = inst[1];
+            break;
+        case OP_INT_ADD ... OP_INT_MOD:
+        case OP_INT_AND ... OP_INT_XOR:
+        case OP_INT_SHL ... OP_INT_CMP_GE:
+        case OP_FLOAT_ADD ... OP_FLOAT_MOD:
+        case OP_BINARY_ADD ... OP_BINARY_MOD:
+        case OP_BINARY_AND ... OP_BINARY_XOR:
+        case OP_BINARY_SHL ... OP_BINARY_CMP_GE:
+        case OP_BINARY_METHOD:
+            *def = inst[1];
+            uses[0] = inst[2];
+            uses[1] = inst[3];
+            break;
+        case OP_INT_SUB_IMM8:
+        case OP_ATTR_LOAD:
+        case OP_FIELD_LOAD:
+            *def = inst[1];
+            uses[0] = inst[2];
+            break;
+        case OP_PUSH:
+        case OP_RETURN:
+        case OP_JMP_INT_CMP_LT_IMM8:
+        case OP_JMP_INT_CMP_GE_IMM8:
+            uses[0] = inst[1];
+            break;
+        /* the arguments are in the value stack */
+        case OP_CALL:
+        case OP_CALL_METHOD:
+        case OP_CALL_KW:
+            *def = inst[4];
+            break;
+        default:
+            break;
+    }
+}
+
+#define REG_SET(s, i) ((s)[(i) >> 6] |= (uint64_t)1 << ((i)&63))
+#define REG_CLR(s, i) ((s)[(i) >> 6] &= ~((uint64_t)1 << ((i)&63)))
+
+/* the index of the insn at `offset`, -1: not an insn */
+static int insn_index(int *offsets, int num, int offset)
+{
+    int lo = 0, hi = num - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (offsets[mid] == offset) return mid;
+        if (offsets[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The registers live in an insn are the ones it reads, and the ones live after
+ * it but not written by it. It is iterated backward until no set is changed.
+ * The written register of a call is not live in it, the result is stored after
+ * the callee returns. Returns 0 if an insn is not known.
+ */
+static int analyze_liveness(CodeObject *code, int num, int *offsets, uint64_t *live)
+{
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    int words = (code->cs.nlocals + 63) / 64;
+    uint64_t *out = mm_alloc(sizeof(uint64_t) * (words ? words : 1));
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (int i = num - 1; i >= 0; i--) {
+            uint8_t *inst = insns + offsets[i];
+            int op = code_unfuse_opcode(*inst);
+            memset(out, 0, sizeof(uint64_t) * words);
+
+            /* successors, the fall-through one and the jump target */
+            if (op != OP_RETURN && op != OP_RETURN_NONE && i + 1 < num) {
+                for (int w = 0; w < words; w++) out[w] |= live[(i + 1) * words + w];
+            }
+            if (op == OP_JMP_INT_CMP_LT_IMM8 || op == OP_JMP_INT_CMP_GE_IMM8) {
+                int target = insn_index(offsets, num, inst[3] | (inst[4] << 8));
+                if (target < 0) {
+                    mm_free(out);
+                    return 0;
+                }
+                for (int w = 0; w < words; w++) out[w] |= live[target * words + w];
+            }
+
+            int def, uses[2];
+            insn_regs(op, inst, &def, uses);
+            if (def >= 0) REG_CLR(out, def);
+            for (int k = 0; k < 2; k++) {
+                if (uses[k] >= 0) REG_SET(out, uses[k]);
+            }
+
+            uint64_t *in = live + i * words;
+            if (memcmp(in, out, sizeof(uint64_t) * words)) {
+                memcpy(in, out, sizeof(uint64_t) * words);
+                changed = 1;
+            }
+        }
+    }
+
+    mm_free(out);
+    return 1;
+}
+
+/*
+ * The safepoints are the entry and the ends of all insns, a frame is stopped
+ * at the end of a call, a backward jump, or an insn calling C functions.
+ */
+static StackMap *new_stack_map(CodeObject *code)
+{
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    int size = code->cs.insns_size;
+    int words = (code->cs.nlocals + 63) / 64;
+
+    int num = 0;
+    int *offsets = mm_alloc(sizeof(int) * (size + 1));
+    int offset = 0;
+    while (offset < size) {
+        int len = code_insn_length(code_unfuse_opcode(insns[offset]));
+        if (len < 0 || offset + len > size) {
+            mm_free(offsets);
+            return mm_alloc(sizeof(StackMap));
+        }
+        offsets[num++] = offset;
+        offset += len;
+    }
+
+    /* live in of the insns, the ones at the entry are the first */
+    StackMap *map = mm_alloc(sizeof(StackMap) + sizeof(uint64_t) * words * (num + 1));
+    if (!analyze_liveness(code, num, offsets, map->bits)) {
+        mm_free(offsets);
+        return map;
+    }
+
+    /* the insn ending at a safepoint, the entry is at 0 */
+    memmove(map->bits + words, map->bits, sizeof(uint64_t) * words * num);
+    for (int i = num; i > 0; i--) {
+        int op = code_unfuse_opcode(insns[offsets[i - 1]]);
+        offsets[i] = offsets[i - 1] + code_insn_length(op);
+    }
+    offsets[0] = 0;
+
+    map->words = words;
+    map->num = num + 1;
+    map->offsets = offsets;
+    return map;
+}
+
+uint64_t *code_live_regs(CodeObject *code, int offset)
+{
+    if (!code->stack_map) code->stack_map = new_stack_map(code);
+
+    StackMap *map = code->stack_map;
+    if (!map->num) return NULL;
+
+    int index = insn_index(map->offsets, map->num, offset);
+    ASSERT(index >= 0);
+    return index >= 0 ? map->bits + index * map->words : NULL;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,24 +4,318 @@
  */
 
 #include "dictobject.h"
+#include "shadowstack.h"
+#include "stringobject.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* dict(iterable Iterable = None) */
-static Value _dict_call(Object *self, Value *args, int nargs, Object *kwds)
+#define DICT_INIT_SIZE 8
+
+#define TABLE_SIZE(t)     ((t)->gc_num_objs / 2)
+#define TABLE_KEY(t, i)   ((Value *)((t) + 1) + (i) * 2)
+#define TABLE_VALUE(t, i) (TABLE_KEY(t, i) + 1)
+
+static void dict_gc_mark(DictObject *obj, GcMarkStack *stk)
 {
-    return none_value;
+    gc_mark_field(&obj->table, stk);
 }
 
 TypeObject dict_type = {
     OBJECT_HEAD_INIT(&type_type),
     .name = "dict",
-    .call = NULL,
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC | TP_FLAGS_FINAL,
+    .mark = (GcMarkFunc)dict_gc_mark,
+};
+
+static unsigned int key_hash(Value *key)
+{
+    if (IS_INT(key)) {
+        uint64_t x = (uint64_t)to_int(key) * 0x9E3779B97F4A7C15ULL;
+        return (unsigned int)(x >> 32);
+    }
+    Object *obj = as_obj(key);
+    ASSERT(IS_STR(obj));
+    return mem_hash(STR_BUF(obj), STR_LEN(obj));
+}
+
+static int key_equal(Value *a, Value *b)
+{
+    if (IS_INT(a)) return IS_INT(b) && to_int(a) == to_int(b);
+    if (!IS_OBJ(b) || !IS_STR(to_obj(b))) return 0;
+    Object *x = to_obj(a);
+    Object *y = to_obj(b);
+    return STR_LEN(x) == STR_LEN(y) && !memcmp(STR_BUF(x), STR_BUF(y), STR_LEN(x));
+}
+
+/* the slot of the key, or the empty one it would be put in */
+static int find_slot(GcArrayObject *table, Value *key, unsigned int hash)
+{
+    int mask = TABLE_SIZE(table) - 1;
+    int i = hash & mask;
+    while (1) {
+        Value *k = TABLE_KEY(table, i);
+        if (IS_NONE(k) || key_equal(k, key)) return i;
+        i = (i + 1) & mask;
+    }
+}
+
+static GcArrayObject *new_table(int size)
+{
+    GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_VALUE, size * 2);
+    Value *values = (Value *)(arr + 1);
+    for (int i = 0; i < size * 2; i++) values[i] = none_value;
+    return arr;
+}
+
+/* the dict is pinned by the caller */
+static void grow_table(DictObject *d)
+{
+    GcArrayObject *arr = new_table(TABLE_SIZE(d->table) * 2);
+    GcArrayObject *old = d->table;
+    for (int i = 0; i < TABLE_SIZE(old); i++) {
+        Value *k = TABLE_KEY(old, i);
+        if (IS_NONE(k)) continue;
+        int j = find_slot(arr, k, key_hash(k));
+        /* a big table is old */
+        gc_store_value(arr, TABLE_KEY(arr, j), *k);
+        gc_store_value(arr, TABLE_VALUE(arr, j), k[1]);
+    }
+    gc_store_obj(d, &d->table, arr);
+}
+
+Object *kl_new_dict(void)
+{
+    DictObject *d = gc_alloc_obj(d);
+    INIT_OBJECT_HEAD(d, &dict_type);
+    d->len = 0;
+
+    init_gc_stack_push(1, d);
+    GcArrayObject *arr = new_table(DICT_INIT_SIZE);
+    fini_gc_stack();
+    gc_store_obj(d, &d->table, arr);
+
+    return (Object *)d;
+}
+
+void kl_dict_set(Object *self, Value *key, Value *val)
+{
+    ASSERT(IS_DICT(self));
+    DictObject *d = (DictObject *)self;
+    unsigned int hash = key_hash(key);
+
+    int i = find_slot(d->table, key, hash);
+    if (IS_NONE(TABLE_KEY(d->table, i))) {
+        if ((d->len + 1) * 4 > TABLE_SIZE(d->table) * 3) {
+            init_gc_stack(3);
+            gc_stack_push(d);
+            if (IS_OBJ(key)) gc_stack_push(to_obj(key));
+            if (IS_OBJ(val)) gc_stack_push(to_obj(val));
+            grow_table(d);
+            fini_gc_stack();
+            i = find_slot(d->table, key, hash);
+        }
+        gc_store_value(d->table, TABLE_KEY(d->table, i), *key);
+        ++d->len;
+    }
+    gc_store_value(d->table, TABLE_VALUE(d->table, i), *val);
+}
+
+Value kl_dict_get(Object *self, Value *key)
+{
+    ASSERT(IS_DICT(self));
+    GcArrayObject *table = ((DictObject *)self)->table;
+    int i = find_slot(table, key, key_hash(key));
+    if (IS_NONE(TABLE_KEY(table, i))) return error_value;
+    return *TABLE_VALUE(table, i);
+}
+
+void kl_dict_set_str(Object *self, const char *key, Value *val)
+{
+    init_gc_stack(2);
+    gc_stack_push(self);
+    if (IS_OBJ(val)) gc_stack_push(to_obj(val));
+    Value k = obj_value(kl_new_str(key));
+    kl_dict_set(self, &k, val);
+    fini_gc_stack();
+}
+
+Value kl_dict_get_str(Object *self, const char *key)
+{
+    ASSERT(IS_DICT(self));
+    GcArrayObject *table = ((DictObject *)self)->table;
+    int len = strlen(key);
+    int mask = TABLE_SIZE(table) - 1;
+    int i = mem_hash(key, len) & mask;
+    while (1) {
+        Value *k = TABLE_KEY(table, i);
+        if (IS_NONE(k)) return error_value;
+        if (IS_OBJ(k)) {
+            Object *s = to_obj(k);
+            if (STR_LEN(s) == len && !memcmp(STR_BUF(s), key, len)) {
+                return *TABLE_VALUE(table, i);
+            }
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void weakdict_gc_mark(WeakDictObject *obj, GcMarkStack *stk)
+{
+    gc_mark_ephemerons(&obj->table, stk);
+}
+
+TypeObject weakdict_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "weakdict",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC | TP_FLAGS_FINAL,
+    .mark = (GcMarkFunc)weakdict_gc_mark,
 };
 
-Object *kl_new_dict(void) { return NULL; }
+static unsigned int addr_hash(Value *key)
+{
+    uint64_t x = (uintptr_t)to_obj(key) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(x >> 32);
+}
+
+/* the slot of the key, or the first cleared or empty one it would be put in */
+static int find_weak_slot(GcArrayObject *table, Value *key)
+{
+    int mask = TABLE_SIZE(table) - 1;
+    int i = addr_hash(key) & mask;
+    int free = -1;
+    while (1) {
+        Value *k = TABLE_KEY(table, i);
+        if (IS_NONE(k)) return free >= 0 ? free : i;
+        if (IS_ERROR(k)) {
+            if (free < 0) free = i;
+        } else if (to_obj(k) == to_obj(key)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+int kl_weakdict_len(Object *self)
+{
+    ASSERT(IS_WEAKDICT(self));
+    GcArrayObject *table = ((WeakDictObject *)self)->table;
+    int len = 0;
+    for (int i = 0; i < TABLE_SIZE(table); i++) {
+        Value *k = TABLE_KEY(table, i);
+        if (!IS_NONE(k) && !IS_ERROR(k)) ++len;
+    }
+    return len;
+}
+
+/* the keys moved by the gc are hashed again, no allocation by the gc */
+static void rehash_moved(WeakDictObject *d)
+{
+    size_t moves = gc_moves();
+    if (d->moves == moves) return;
+
+    GcArrayObject *table = d->table;
+    int size = TABLE_SIZE(table);
+    Value *entries = mm_alloc(sizeof(Value) * 2 * size);
+    int n = 0;
+    for (int i = 0; i < size; i++) {
+        Value *k = TABLE_KEY(table, i);
+        if (!IS_NONE(k) && !IS_ERROR(k)) {
+            entries[n++] = k[0];
+            entries[n++] = k[1];
+        }
+        /* recorded by the marking, the entries are kept in this cycle */
+        gc_store_value(table, k, none_value);
+        gc_store_value(table, k + 1, none_value);
+    }
+    for (int i = 0; i < n; i += 2) {
+        int j = find_weak_slot(table, entries + i);
+        gc_store_value(table, TABLE_KEY(table, j), entries[i]);
+        gc_store_value(table, TABLE_VALUE(table, j), entries[i + 1]);
+    }
+    mm_free(entries);
+    d->used = n / 2;
+    d->moves = moves;
+}
+
+/* the dict is pinned by the caller, the cleared entries are dropped */
+static void rehash_weak(WeakDictObject *d)
+{
+    int len = kl_weakdict_len((Object *)d);
+    int size = TABLE_SIZE(d->table);
+    if ((len + 1) * 2 > size) size *= 2;
+
+    GcArrayObject *arr = new_table(size);
+    GcArrayObject *old = d->table;
+    for (int i = 0; i < TABLE_SIZE(old); i++) {
+        Value *k = TABLE_KEY(old, i);
+        if (IS_NONE(k) || IS_ERROR(k)) continue;
+        int j = find_weak_slot(arr, k);
+        gc_store_value(arr, TABLE_KEY(arr, j), *k);
+        gc_store_value(arr, TABLE_VALUE(arr, j), k[1]);
+    }
+    gc_store_obj(d, &d->table, arr);
+    d->used = len;
+    /* the keys may be moved by the allocation of the table */
+    d->moves = gc_moves();
+}
+
+Object *kl_new_weakdict(void)
+{
+    WeakDictObject *d = gc_alloc_obj(d);
+    INIT_OBJECT_HEAD(d, &weakdict_type);
+    d->used = 0;
+
+    init_gc_stack_push(1, d);
+    GcArrayObject *arr = new_table(DICT_INIT_SIZE);
+    fini_gc_stack();
+    gc_store_obj(d, &d->table, arr);
+    d->moves = gc_moves();
+
+    return (Object *)d;
+}
+
+void kl_weakdict_set(Object *self, Value *key, Value *val)
+{
+    ASSERT(IS_WEAKDICT(self));
+    ASSERT(IS_OBJ(key));
+    WeakDictObject *d = (WeakDictObject *)self;
+    rehash_moved(d);
+
+    int i = find_weak_slot(d->table, key);
+    Value *k = TABLE_KEY(d->table, i);
+    if (IS_NONE(k) && (d->used + 1) * 4 > TABLE_SIZE(d->table) * 3) {
+        init_gc_stack(3);
+        gc_stack_push(d);
+        gc_stack_push(to_obj(key));
+        if (IS_OBJ(val)) gc_stack_push(to_obj(val));
+        rehash_weak(d);
+        fini_gc_stack();
+        i = find_weak_slot(d->table, key);
+        k = TABLE_KEY(d->table, i);
+    }
+    if (IS_NONE(k)) ++d->used;
+    if (IS_NONE(k) || IS_ERROR(k)) gc_store_value(d->table, k, *key);
+    gc_store_value(d->table, TABLE_VALUE(d->table, i), *val);
+}
+
+Value kl_weakdict_get(Object *self, Value *key)
+{
+    ASSERT(IS_WEAKDICT(self));
+    if (!IS_OBJ(key)) return error_value;
+    WeakDictObject *d = (WeakDictObject *)self;
+    rehash_moved(d);
+
+    GcArrayObject *table = d->table;
+    int i = find_weak_slot(table, key);
+    Value *k = TABLE_KEY(table, i);
+    if (IS_NONE(k) || IS_ERROR(k)) return error_value;
+    Value val = *TABLE_VALUE(table, i);
+    /* its key may be not marked */
+    if (IS_OBJ(&val)) gc_keep_alive(to_obj(&val));
+    return val;
+}
 
 #ifdef __cplusplus
 }
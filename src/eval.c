@@ -4,14 +4,20 @@
  */
 
 #include "eval.h"
+#include <math.h>
+#include <sys/mman.h>
 #include "cfuncobject.h"
 #include "codeobject.h"
 #include "dictobject.h"
 #include "exception.h"
+#include "fieldobject.h"
+#include "jit.h"
+#include "log.h"
 #include "mm.h"
 #include "moduleobject.h"
 #include "opcode.h"
 #include "shadowstack.h"
+#include "stringobject.h"
 #include "tupleobject.h"
 
 #ifdef __cplusplus
@@ -20,11 +26,26 @@ extern "C" {
 
 /*------------------------------------DATA-----------------------------------*/
 
-/* max stack size */
-#define MAX_STACK_SIZE (16 * 64 * 1024)
+/* max megabytes of a value stack, KOALA_STACK_SIZE overrides it */
+#define STACK_SIZE_MB 64
 
-/* max call depth, stop for this limit */
-#define MAX_CALL_DEPTH 10000
+/* max nested calls on the c stack, by kl_eval_code or the optimized code */
+#define MAX_NATIVE_DEPTH 10000
+
+/*
+ * Native calls left to the optimized code. The interpreted frames are counted,
+ * or a deep recursion bails out and is retried natively at every level.
+ */
+#define OPT_BUDGET(ks) (MAX_NATIVE_DEPTH - (ks)->native_depth - (ks)->depth)
+
+/* threaded dispatch needs gcc/clang labels-as-values extension */
+#ifndef USE_COMPUTED_GOTOS
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_COMPUTED_GOTOS 1
+#else
+#define USE_COMPUTED_GOTOS 0
+#endif
+#endif
 
 /*-------------------------------------API-----------------------------------*/
 
@@ -40,12 +61,14 @@ static void _copy_arguments(CallFrame *cf, Value *args, int nargs)
     }
 
     for (int i = nargs; i < total; i++) {
-        (p + i)->tag = 0;
+        *(p + i) = none_value;
     }
 }
 
 static CallFrame *_new_frame(KoalaState *ks, CodeObject *code)
 {
+    if (!code->fused) code_fuse_insns(code);
+
     CallFrame *cf = (CallFrame *)ks->stack_top_ptr;
     ks->stack_top_ptr = ks->stack_top_ptr + sizeof(*cf);
 
@@ -56,12 +79,37 @@ static CallFrame *_new_frame(KoalaState *ks, CodeObject *code)
     cf->local_size = nlocals;
     cf->stack_size = stack_size;
     cf->stack = cf->local_stack + nlocals;
+    /* at the entry safepoint */
+    cf->next_inst = (uint8_t *)code->cs.insns;
+    cf->top = cf->stack;
+    cf->ret = NULL;
     ks->stack_top_ptr += sizeof(Value) * (nlocals + stack_size);
     ASSERT(ks->stack_top_ptr <= ks->base_stack_ptr + ks->stack_size);
 
     return cf;
 }
 
+/* check the stack is enough for a new frame of the code, the depth is not limited */
+static int _frame_overflow(KoalaState *ks, CodeObject *code)
+{
+    int size = sizeof(CallFrame) + sizeof(Value) * (code->cs.nlocals + code->cs.stack_size);
+    return ks->stack_top_ptr + size > ks->base_stack_ptr + ks->stack_size;
+}
+
+static void _enter_frame(KoalaState *ks, CallFrame *cf)
+{
+    cf->back = ks->cf;
+    cf->ks = ks;
+    ks->cf = cf;
+    ++ks->depth;
+}
+
+static void _leave_frame(KoalaState *ks, CallFrame *cf)
+{
+    ks->cf = cf->back;
+    --ks->depth;
+}
+
 static void _pop_frame(KoalaState *ks, CallFrame *cf)
 {
     /* shrink stack */
@@ -69,15 +117,37 @@ static void _pop_frame(KoalaState *ks, CallFrame *cf)
     ASSERT(ks->stack_top_ptr >= ks->base_stack_ptr);
 }
 
+static int _stack_size;
+
+static int stack_size(void)
+{
+    if (_stack_size) return _stack_size;
+    int mb = STACK_SIZE_MB;
+    char *s = getenv("KOALA_STACK_SIZE");
+    if (s) {
+        int n = atoi(s);
+        if (n > 0 && n <= 1024) {
+            mb = n;
+        } else {
+            log_warn("invalid KOALA_STACK_SIZE: '%s'", s);
+        }
+    }
+    _stack_size = mb << 20;
+    return _stack_size;
+}
+
 KoalaState *ks_new(void)
 {
-    int msize = sizeof(KoalaState) + MAX_STACK_SIZE;
-    KoalaState *ks = mm_alloc(msize);
+    /* reserved, the pages are committed when the stack grows into them */
+    size_t msize = sizeof(KoalaState) + stack_size();
+    KoalaState *ks = mmap(NULL, msize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ks == MAP_FAILED) panic("mmap value stack failed");
     lldq_node_init(&ks->link);
     ks->ts = __ts;
     ks->shadow_stacks = NULL;
     ks->stack_top_ptr = ks->base_stack_ptr;
-    ks->stack_size = MAX_STACK_SIZE;
+    ks->stack_size = _stack_size;
     return ks;
 }
 
@@ -86,7 +156,7 @@ void ks_free(KoalaState *ks)
     if (!ks) return;
     ASSERT(!ks->cf);
     ASSERT(ks->shadow_stacks == NULL);
-    mm_free(ks);
+    munmap(ks, sizeof(KoalaState) + ks->stack_size);
 }
 
 /* clang-format off */
@@ -114,27 +184,261 @@ void ks_free(KoalaState *ks)
 #define NEXT_OP() do {   \
     opcode = *next_inst; \
     next_inst++;         \
+    PROFILE_OPCODE();    \
+} while (0)
+
+#ifdef OPCODE_PROFILE
+#define PROFILE_OPCODE() do {                       \
+    opcode_profile_record(prev2, prev1, opcode);    \
+    prev2 = prev1;                                  \
+    prev1 = opcode;                                 \
+} while (0)
+/* sequences across frames are not adjacent in bytecode */
+#define PROFILE_RESET() (prev2 = prev1 = -1)
+#else
+#define PROFILE_OPCODE() ((void)0)
+#define PROFILE_RESET()  ((void)0)
+#endif
+
+/* reload the cached states of the current frame */
+#define LOAD_FRAME() do {                               \
+    code = cf->code;                                    \
+    module = (ModuleObject *)cf->module;                \
+    consts = &module->consts;                           \
+    first_inst = (uint8_t *)code->cs.insns;             \
+    locals = cf->local_stack;                           \
+    nlocals = cf->local_size;                           \
+    PROFILE_RESET();                                    \
+} while (0)
+
+/* the frame seen by gc, saved before an insn may call C functions */
+#define SAVE_FRAME() do {      \
+    cf->next_inst = next_inst; \
+    cf->top = top;             \
+} while (0)
+
+/* suspend here if the world is stopping, the frame is at the end of an insn */
+#define SAFEPOINT() do {              \
+    if (gc_safepoint_requested) {     \
+        SAVE_FRAME();                 \
+        _gc_safepoint();              \
+    }                                 \
+} while (0)
+
+/* count calls and backward jumps, compile the code at the thresholds */
+#define JIT_COUNT() jit_count(code)
+
+#if USE_JIT
+
+/* run the native code from next_inst, until an insn left to us */
+#define JIT_ENTER() do {                                                \
+    JitCode *_jc = code->jit;                                           \
+    if (_jc && _jc->entries[next_inst - first_inst]) {                  \
+        cf->top = top;                                                  \
+        int _off = jit_run(_jc, cf, next_inst - first_inst);            \
+        /* the native code may call or return to another frame */       \
+        cf = ks->cf;                                                    \
+        LOAD_FRAME();                                                   \
+        if (_off == JIT_ERROR) {                                        \
+            ASSERT(_exc_occurred(ks));                                  \
+            *result = error_value;                                      \
+            goto error;                                                 \
+        }                                                               \
+        next_inst = _off == JIT_RESUME ? cf->next_inst : first_inst + _off; \
+        top = cf->top;                                                  \
+    }                                                                   \
+} while (0)
+#else
+#define JIT_ENTER() ((void)0)
+#endif
+
+/* a call of an optimized code with int arguments, all in native code */
+#define OPT_CALL(callee, nargs, ra)                                     \
+    ((callee)->opt &&                                                   \
+     !opt_run((callee)->opt, cf->stack, nargs, OPT_BUDGET(ks), ra))
+
+#if USE_LLVM_JIT
+
+/* count the loop at `site`, run its optimized version from the loop head */
+#define OSR_ENTER(site) do {                                            \
+    LoopSite *_ls = code_loop_site(code, site);                         \
+    if (++_ls->count == opt_threshold) opt_compile_osr(cf, site);       \
+    if (_ls->osr) {                                                     \
+        SAVE_FRAME();                                                   \
+        int _off = opt_osr_run(_ls->osr, cf, OPT_BUDGET(ks));          \
+        /* exited or deopt, locals written back */                      \
+        if (_off >= 0) next_inst = first_inst + _off;                   \
+    }                                                                   \
+} while (0)
+#else
+#define OSR_ENTER(site) ((void)(site))
+#endif
+
+/* absolute offset of a `len` bytes jump, a backward jump is a loop */
+#define JUMP_TO(off, len) do {                                          \
+    uint8_t *_target = first_inst + (off);                              \
+    if (_target < next_inst) {                                          \
+        int _site = next_inst - (len) - first_inst;                     \
+        SAFEPOINT();                                                    \
+        next_inst = _target;                                            \
+        JIT_COUNT();                                                    \
+        OSR_ENTER(_site);                                               \
+        JIT_ENTER();                                                    \
+    } else {                                                            \
+        next_inst = _target;                                            \
+    }                                                                   \
 } while (0)
 
+/* pop the frame called by OP_CALL and resume its caller */
+#define RETURN_TO_CALLER() do {                         \
+    CallFrame *back = cf->back;                         \
+    _leave_frame(ks, cf);                               \
+    _pop_frame(ks, cf);                                 \
+    cf = back;                                          \
+    LOAD_FRAME();                                       \
+    next_inst = cf->next_inst;                          \
+    top = cf->top;                                      \
+    JIT_ENTER();                                        \
+} while (0)
+
+/* stackless, run the callee in this loop, arguments are at the stack base */
+#define CALL_CODE(callee, nargs, ra) do {                               \
+    if (OPT_CALL(callee, nargs, ra)) {                                  \
+        SHRINK(nargs);                                                  \
+        break;                                                          \
+    }                                                                   \
+    if (_frame_overflow(ks, callee)) {                                  \
+        _raise_exc_str(ks, "maximum call depth exceeded");              \
+        *result = error_value;                                          \
+        goto error;                                                     \
+    }                                                                   \
+    SHRINK(nargs);                                                      \
+    cf->next_inst = next_inst;                                          \
+    cf->top = top;                                                      \
+    CallFrame *new_cf = _new_frame(ks, callee);                         \
+    _copy_arguments(new_cf, cf->stack, nargs);                          \
+    new_cf->ret = (ra);                                                 \
+    _enter_frame(ks, new_cf);                                           \
+    cf = new_cf;                                                        \
+    LOAD_FRAME();                                                       \
+    next_inst = first_inst;                                             \
+    top = cf->stack;                                                    \
+    SAFEPOINT();                                                        \
+    JIT_COUNT();                                                        \
+    JIT_ENTER();                                                        \
+} while (0)
+
+/* field by field, no 16-byte load of a half written tagged Value */
+#if !USE_NAN_BOXING
 #define SET(x, y)   ((x)->tag = (y)->tag, (x)->obj = (y)->obj)
+#define SET_INT(x, v) ((x)->tag = VAL_TAG_INT, (x)->ival = (v))
+#else
+#define SET(x, y)   (*(x) = *(y))
+/* a big one is boxed, the allocation may wait for a gc which scans the frame */
+#define SET_INT(x, v) ({                                        \
+    int64_t _iv = (v);                                          \
+    if (_iv < NAN_BOX_INT_MIN || _iv > NAN_BOX_INT_MAX) {       \
+        SAVE_FRAME();                                           \
+    }                                                           \
+    *(x) = int_value(_iv);                                      \
+})
+#endif
+
 #define PUSH(x)     (SET(top, x), top++)
 #define POP()       (--top)
 #define SHRINK(n)   (top -= (n))
 
-#define PUSH_INT(v) ((top->tag = VAL_TAG_INT, top->ival = (v)), top++)
+#define PUSH_INT(v) (SET_INT(top, v), top++)
 
 #define GET_LOCAL(i)    ({ ASSERT((i) < nlocals); (locals + (i)); })
 #define SET_LOCAL(i, v) (ASSERT((i) < nlocals), SET(locals + (i), v))
 #define SET_INT_LOCAL(i, v) do { \
     Value *loc = GET_LOCAL(i); \
-    loc->tag = VAL_TAG_INT; \
-    loc->ival = (v); \
+    SET_INT(loc, v); \
+} while (0)
+
+/*
+ * Every handler is both a `case` of the switch and a label in the threaded
+ * dispatch table, so the same body works for both dispatch methods.
+ */
+#if USE_COMPUTED_GOTOS
+#define TARGET(op) TARGET_##op: case op
+#define DISPATCH() do {             \
+    NEXT_OP();                      \
+    goto *opcode_targets[opcode];   \
 } while (0)
+#else
+#define TARGET(op) case op
+#define DISPATCH() goto dispatch
+#endif
 
-#define DISPATCH() goto dispatch;
+/* The guard of quickened insn failed, rewrite it back to the generic one. */
+#define DEOPT(generic, len) do { \
+    next_inst -= (len);          \
+    *next_inst = (generic);      \
+    DISPATCH();                  \
+} while (0)
+
+#define INT_BINARY_OP(generic, op) do {                 \
+    int A = NEXT_REG();                                 \
+    int B = NEXT_REG();                                 \
+    int C = NEXT_REG();                                 \
+    Value *rb = GET_LOCAL(B);                           \
+    Value *rc = GET_LOCAL(C);                           \
+    if (!IS_INT(rb) || !IS_INT(rc)) DEOPT(generic, 4);  \
+    int64_t r = to_int(rb) op to_int(rc);               \
+    SET_INT_LOCAL(A, r);                                \
+} while (0)
+
+/* zero and -1 divisors are handled by the generic one */
+#define INT_DIV_OP(generic, op) do {                    \
+    int A = NEXT_REG();                                 \
+    int B = NEXT_REG();                                 \
+    int C = NEXT_REG();                                 \
+    Value *rb = GET_LOCAL(B);                           \
+    Value *rc = GET_LOCAL(C);                           \
+    if (!IS_INT(rb) || !IS_INT(rc) ||                   \
+        to_int(rc) == 0 || to_int(rc) == -1)            \
+        DEOPT(generic, 4);                              \
+    int64_t r = to_int(rb) op to_int(rc);               \
+    SET_INT_LOCAL(A, r);                                \
+} while (0)
+
+#define FLOAT_BINARY_OP(generic, op) do {                   \
+    int A = NEXT_REG();                                     \
+    int B = NEXT_REG();                                     \
+    int C = NEXT_REG();                                     \
+    Value *rb = GET_LOCAL(B);                               \
+    Value *rc = GET_LOCAL(C);                               \
+    if (!IS_FLOAT(rb) || !IS_FLOAT(rc)) DEOPT(generic, 4);  \
+    double r = to_float(rb) op to_float(rc);                \
+    Value *ra = GET_LOCAL(A);                               \
+    *ra = float_value(r);                                   \
+} while (0)
 
 /* clang-format on */
 
+/* typed opcodes are in the same order as the generic ones */
+_Static_assert(OP_INT_USHR - OP_INT_ADD == OP_BINARY_USHR - OP_BINARY_ADD,
+               "OP_INT_xxx mismatch OP_BINARY_xxx");
+_Static_assert(OP_INT_CMP_GE - OP_INT_CMP_EQ == OP_BINARY_CMP_GE - OP_BINARY_CMP_EQ,
+               "OP_INT_CMP_xxx mismatch OP_BINARY_CMP_xxx");
+_Static_assert(OP_FLOAT_MOD - OP_FLOAT_ADD == OP_BINARY_MOD - OP_BINARY_ADD,
+               "OP_FLOAT_xxx mismatch OP_BINARY_xxx");
+
+/* indexed by `opcode - OP_BINARY_ADD` */
+static const char *_binary_op_strs[] = {
+    "+",  "-",  "*",   "/",  "%",  NULL, "&",  "|",  "^", NULL,
+    "<<", ">>", ">>>", "==", "!=", "<",  ">",  "<=", ">=",
+};
+
+/* indexed by `opcode - OP_BINARY_ADD` */
+static const char *_binary_meth_names[] = {
+    "__add__", "__sub__", "__mul__", "__div__", "__mod__", NULL,      "__and__",
+    "__or__",  "__xor__", NULL,      "__shl__", "__shr__", "__ushr__", "__cmp__",
+    "__cmp__", "__cmp__", "__cmp__", "__cmp__", "__cmp__",
+};
+
 static Object *_get_symbol(CallFrame *cf, int rel, int sym)
 {
     ModuleObject *m = (ModuleObject *)cf->module;
@@ -173,6 +477,269 @@ static void _call_function(Object *obj, Value *args, int nargs, Object *names,
     _fini_gc_stack(cf->ks);
 }
 
+static int _int_binary(KoalaState *ks, int op, int64_t x, int64_t y, Value *ra)
+{
+    int64_t r;
+
+    switch (op) {
+        case OP_BINARY_ADD: r = x + y; break;
+        case OP_BINARY_SUB: r = x - y; break;
+        case OP_BINARY_MUL: r = x * y; break;
+        case OP_BINARY_DIV: /* fall-through */
+        case OP_BINARY_MOD: {
+            if (!y) {
+                _raise_exc_str(ks, "division by zero");
+                return -1;
+            }
+            /* INT64_MIN / -1 traps */
+            if (y == -1) {
+                r = (op == OP_BINARY_DIV) ? (int64_t)(0 - (uint64_t)x) : 0;
+            } else {
+                r = (op == OP_BINARY_DIV) ? x / y : x % y;
+            }
+            break;
+        }
+        case OP_BINARY_AND: r = x & y; break;
+        case OP_BINARY_OR: r = x | y; break;
+        case OP_BINARY_XOR: r = x ^ y; break;
+        case OP_BINARY_SHL: r = x << (y & 63); break;
+        case OP_BINARY_SHR: r = x >> (y & 63); break;
+        case OP_BINARY_USHR: r = (int64_t)((uint64_t)x >> (y & 63)); break;
+        case OP_BINARY_CMP_EQ: r = x == y; break;
+        case OP_BINARY_CMP_NE: r = x != y; break;
+        case OP_BINARY_CMP_LT: r = x < y; break;
+        case OP_BINARY_CMP_GT: r = x > y; break;
+        case OP_BINARY_CMP_LE: r = x <= y; break;
+        case OP_BINARY_CMP_GE: r = x >= y; break;
+        default: UNREACHABLE(); break;
+    }
+
+    *ra = int_value(r);
+    return 0;
+}
+
+/* return -1, if the operation is not supported by float */
+static int _float_binary(int op, double x, double y, Value *ra)
+{
+    switch (op) {
+        case OP_BINARY_ADD: *ra = float_value(x + y); break;
+        case OP_BINARY_SUB: *ra = float_value(x - y); break;
+        case OP_BINARY_MUL: *ra = float_value(x * y); break;
+        case OP_BINARY_DIV: *ra = float_value(x / y); break;
+        case OP_BINARY_MOD: *ra = float_value(fmod(x, y)); break;
+        case OP_BINARY_CMP_EQ: *ra = int_value(x == y); break;
+        case OP_BINARY_CMP_NE: *ra = int_value(x != y); break;
+        case OP_BINARY_CMP_LT: *ra = int_value(x < y); break;
+        case OP_BINARY_CMP_GT: *ra = int_value(x > y); break;
+        case OP_BINARY_CMP_LE: *ra = int_value(x <= y); break;
+        case OP_BINARY_CMP_GE: *ra = int_value(x >= y); break;
+        default: return -1;
+    }
+    return 0;
+}
+
+static int _binary_call_method(int op, Object *meth, Value *ra, Value *rb, Value *rc)
+{
+    Value args[2] = { *rb, *rc };
+    Value callable = obj_value(meth);
+    Value r = object_call(&callable, args, 2, NULL);
+    if (IS_ERROR(&r)) return -1;
+
+    if (op >= OP_BINARY_CMP_EQ) {
+        /* __cmp__ returns -1, 0 or 1 */
+        ASSERT(IS_INT(&r));
+        return _int_binary(NULL, op, to_int(&r), 0, ra);
+    }
+
+    *ra = r;
+    return 0;
+}
+
+/*
+ * Execute the generic binary insn at `inst`, and quicken it in place by the
+ * types of its operands:
+ *   int   op int   -> OP_INT_xxx
+ *   float op float -> OP_FLOAT_xxx(arithmetic only)
+ *   obj   op any   -> OP_BINARY_METHOD with the method cached
+ */
+static int _binary_generic(CallFrame *cf, int op, uint8_t *inst, Value *ra, Value *rb,
+                           Value *rc)
+{
+    KoalaState *ks = cf->ks;
+    ASSERT(op >= OP_BINARY_ADD && op <= OP_BINARY_CMP_GE);
+
+    if (IS_INT(rb) && IS_INT(rc)) {
+        if (_int_binary(ks, op, to_int(rb), to_int(rc), ra)) return -1;
+        if (op >= OP_BINARY_CMP_EQ) {
+            *inst = OP_INT_CMP_EQ + (op - OP_BINARY_CMP_EQ);
+        } else {
+            *inst = OP_INT_ADD + (op - OP_BINARY_ADD);
+        }
+        return 0;
+    }
+
+    if ((IS_INT(rb) || IS_FLOAT(rb)) && (IS_INT(rc) || IS_FLOAT(rc))) {
+        /* ra may be the same register as rb or rc */
+        int both = IS_FLOAT(rb) && IS_FLOAT(rc);
+        double x = IS_FLOAT(rb) ? to_float(rb) : (double)to_int(rb);
+        double y = IS_FLOAT(rc) ? to_float(rc) : (double)to_int(rc);
+        if (!_float_binary(op, x, y, ra)) {
+            if (both && op <= OP_BINARY_MOD) {
+                *inst = OP_FLOAT_ADD + (op - OP_BINARY_ADD);
+            }
+            return 0;
+        }
+    } else if (IS_OBJ(rb)) {
+        const char *fname = _binary_meth_names[op - OP_BINARY_ADD];
+        Object *meth = fname ? kl_lookup_method(rb, fname) : NULL;
+        if (meth) {
+            CodeObject *code = cf->code;
+            int offset = inst - (uint8_t *)code->cs.insns;
+            InlineCache *ic = code_inline_cache(code, offset);
+            ic->opcode = op;
+            ic->ms.fname = fname;
+            ic->ms.num = 1;
+            ic->ms.entries[0].type = object_typeof(rb);
+            ic->ms.entries[0].method = meth;
+            *inst = OP_BINARY_METHOD;
+            return _binary_call_method(op, meth, ra, rb, rc);
+        }
+    }
+
+    _raise_exc_fmt(ks, "unsupported operand type(s) for '%s': '%s' and '%s'",
+                   _binary_op_strs[op - OP_BINARY_ADD], object_typeof(rb)->name,
+                   object_typeof(rc)->name);
+    return -1;
+}
+
+#if USE_JIT
+/* the insn may be quickened since compiled, the generic op is from native code */
+int jit_binary_generic(CallFrame *cf, int offset, int op)
+{
+    uint8_t *inst = (uint8_t *)cf->code->cs.insns + offset;
+    Value *locals = cf->local_stack;
+    cf->next_inst = inst + 4;
+    return _binary_generic(cf, op, inst, locals + inst[1], locals + inst[2], locals + inst[3]);
+}
+
+/* OP_CALL of a code, others are left to the interpreter */
+JitFrame jit_call(CallFrame *cf, int offset)
+{
+    KoalaState *ks = cf->ks;
+    uint8_t *inst = (uint8_t *)cf->code->cs.insns + offset;
+    int rel = inst[1];
+    int sym = inst[2];
+    int nargs = inst[3];
+    int A = inst[4];
+
+    Object *callable = _get_symbol(cf, rel, sym);
+    ASSERT(callable);
+    if (!IS_CODE(callable)) return (JitFrame){ NULL };
+
+    /* the interpreter raises the error */
+    CodeObject *code = (CodeObject *)callable;
+    Value *ra = cf->local_stack + A;
+    /* the boxed result may wait for a gc */
+    cf->next_inst = inst + 5;
+    if (OPT_CALL(code, nargs, ra)) {
+        /* continue in this frame */
+        cf->top -= nargs;
+        JitCode *jc = cf->code->jit;
+        int next = offset + 5;
+        if (next >= cf->code->cs.insns_size) return (JitFrame){ cf, NULL };
+        return (JitFrame){ cf, jc->entries[next] };
+    }
+
+    if (_frame_overflow(ks, code)) return (JitFrame){ NULL };
+
+    cf->top -= nargs;
+    CallFrame *new_cf = _new_frame(ks, code);
+    _copy_arguments(new_cf, cf->stack, nargs);
+    new_cf->ret = ra;
+    _enter_frame(ks, new_cf);
+    gc_safepoint();
+
+    jit_count(code);
+    JitCode *jc = code->jit;
+    return (JitFrame){ new_cf, jc ? jc->entries[0] : NULL };
+}
+
+/* OP_RETURN to a frame in the same loop */
+JitFrame jit_return(CallFrame *cf, int offset)
+{
+    if (!cf->ret) return (JitFrame){ NULL };
+
+    KoalaState *ks = cf->ks;
+    uint8_t *inst = (uint8_t *)cf->code->cs.insns + offset;
+    Value *ra = cf->local_stack + inst[1];
+    SET(cf->ret, ra);
+
+    CallFrame *back = cf->back;
+    _leave_frame(ks, cf);
+    _pop_frame(ks, cf);
+
+    JitCode *jc = back->code->jit;
+    if (!jc) return (JitFrame){ back, NULL };
+    int next = back->next_inst - (uint8_t *)back->code->cs.insns;
+    return (JitFrame){ back, jc->entries[next] };
+}
+#endif
+
+/*
+ * Load the attribute `CONST(k)` of `rb`, and cache it by the receiver type.
+ * The cached plain field is loaded by its offset in _eval_frame directly.
+ */
+static int _attr_load(CallFrame *cf, int op, InlineCache *ic, int k, Value *rb, Value *ra)
+{
+    KoalaState *ks = cf->ks;
+    AttrSite *as = &ic->as;
+
+    if (!as->name) {
+        ModuleObject *m = (ModuleObject *)cf->module;
+        Value *name = vector_get(&m->consts, k);
+        ASSERT(name);
+        ic->opcode = op;
+        as->name = code_site_name(name);
+    }
+
+    Object *attr;
+    if (IS_OBJ(rb) && OB_TYPE(to_obj(rb)) == as->type) {
+        attr = as->attr;
+    } else {
+        attr = kl_lookup_attr(rb, as->name);
+        if (!attr) {
+            _raise_exc_fmt(ks, "'%s' object has no attribute '%s'", object_typeof(rb)->name,
+                           as->name);
+            return -1;
+        }
+        if (op == OP_FIELD_LOAD && !IS_FIELD(attr)) {
+            _raise_exc_fmt(ks, "'%s' is not a field of '%s'", as->name,
+                           object_typeof(rb)->name);
+            return -1;
+        }
+        if (IS_OBJ(rb)) {
+            as->type = OB_TYPE(to_obj(rb));
+            as->attr = attr;
+            as->offset = IS_FIELD(attr) ? kl_field_offset(attr, &as->mtype) : -1;
+        }
+    }
+
+    if (!IS_FIELD(attr)) {
+        /* method */
+        *ra = obj_value(attr);
+        return 0;
+    }
+
+    if (!IS_OBJ(rb)) {
+        _raise_exc_fmt(ks, "'%s' object has no attribute '%s'", object_typeof(rb)->name,
+                       as->name);
+        return -1;
+    }
+
+    *ra = kl_field_get(attr, to_obj(rb));
+    return 0;
+}
+
 static void _eval_frame(KoalaState *ks, CallFrame *cf, Value *result)
 {
     CodeObject *code = (CodeObject *)cf->code;
@@ -184,26 +751,32 @@ static void _eval_frame(KoalaState *ks, CallFrame *cf, Value *result)
     Value *locals = cf->local_stack;
     int nlocals = cf->local_size;
     int opcode;
+#ifdef OPCODE_PROFILE
+    int prev2 = -1, prev1 = -1;
+#endif
 
     /* push frame */
-    cf->back = ks->cf;
-    cf->ks = ks;
-    ks->cf = cf;
-    ++ks->depth;
+    _enter_frame(ks, cf);
+
+#if USE_COMPUTED_GOTOS
+#include "opcode_targets.h"
+#endif
 
-    ASSERT(ks->depth <= MAX_CALL_DEPTH);
+    SAFEPOINT();
+    JIT_COUNT();
+    JIT_ENTER();
 
-main_loop:
     for (;;) {
+#if !USE_COMPUTED_GOTOS
     dispatch:
+#endif
         NEXT_OP();
-    dispatch_opcode:
         switch (opcode) {
-            case OP_CONST_INT_0: {
+            TARGET(OP_CONST_INT_0): {
                 DISPATCH();
             }
 
-            case OP_CONST_INT_IMM8: {
+            TARGET(OP_CONST_INT_IMM8): {
                 int A = NEXT_REG();
                 int imm = NEXT_INT8();
                 Value *ra = GET_LOCAL(A);
@@ -211,70 +784,246 @@ main_loop:
                 DISPATCH();
             }
 
-            case OP_JMP_INT_CMP_LT_IMM8: {
+            TARGET(OP_JMP_INT_CMP_LT_IMM8): {
                 int A = NEXT_REG();
                 int imm = NEXT_INT8();
                 int off = NEXT_INT16();
                 Value *ra = GET_LOCAL(A);
                 ASSERT(IS_INT(ra));
-                if (ra->ival < imm) {
-                    // absolute offset
-                    next_inst = first_inst + off;
-                }
+                if (to_int(ra) < imm) JUMP_TO(off, 5);
                 DISPATCH();
             }
 
-            case OP_JMP_INT_CMP_GE_IMM8: {
+            TARGET(OP_JMP_INT_CMP_GE_IMM8): {
                 int A = NEXT_REG();
                 int imm = NEXT_INT8();
                 int off = NEXT_INT16();
                 Value *ra = GET_LOCAL(A);
                 ASSERT(IS_INT(ra));
-                if (ra->ival >= imm) {
-                    // absolute offset
-                    next_inst = first_inst + off;
-                }
+                if (to_int(ra) >= imm) JUMP_TO(off, 5);
+                DISPATCH();
+            }
+
+            /*
+             * The typed opcodes are emitted by compiler or quickened from the
+             * generic ones, the guards deopt the latter if the types changed.
+             */
+            TARGET(OP_INT_ADD): {
+                INT_BINARY_OP(OP_BINARY_ADD, +);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_SUB): {
+                INT_BINARY_OP(OP_BINARY_SUB, -);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_MUL): {
+                INT_BINARY_OP(OP_BINARY_MUL, *);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_DIV): {
+                INT_DIV_OP(OP_BINARY_DIV, /);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_MOD): {
+                INT_DIV_OP(OP_BINARY_MOD, %);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_AND): {
+                INT_BINARY_OP(OP_BINARY_AND, &);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_OR): {
+                INT_BINARY_OP(OP_BINARY_OR, |);
                 DISPATCH();
             }
 
-            case OP_INT_ADD: {
+            TARGET(OP_INT_XOR): {
+                INT_BINARY_OP(OP_BINARY_XOR, ^);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_SHL): {
                 int A = NEXT_REG();
                 int B = NEXT_REG();
                 int C = NEXT_REG();
+                Value *rb = GET_LOCAL(B);
+                Value *rc = GET_LOCAL(C);
+                if (!IS_INT(rb) || !IS_INT(rc)) DEOPT(OP_BINARY_SHL, 4);
+                int64_t r = to_int(rb) << (to_int(rc) & 63);
+                SET_INT_LOCAL(A, r);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_SHR): {
+                int A = NEXT_REG();
+                int B = NEXT_REG();
+                int C = NEXT_REG();
+                Value *rb = GET_LOCAL(B);
+                Value *rc = GET_LOCAL(C);
+                if (!IS_INT(rb) || !IS_INT(rc)) DEOPT(OP_BINARY_SHR, 4);
+                int64_t r = to_int(rb) >> (to_int(rc) & 63);
+                SET_INT_LOCAL(A, r);
+                DISPATCH();
+            }
 
+            TARGET(OP_INT_USHR): {
+                int A = NEXT_REG();
+                int B = NEXT_REG();
+                int C = NEXT_REG();
                 Value *rb = GET_LOCAL(B);
                 Value *rc = GET_LOCAL(C);
-                ASSERT(IS_INT(rb) && IS_INT(rc));
-                int64_t r = rb->ival + rc->ival;
+                if (!IS_INT(rb) || !IS_INT(rc)) DEOPT(OP_BINARY_USHR, 4);
+                int64_t r = (int64_t)((uint64_t)to_int(rb) >> (to_int(rc) & 63));
                 SET_INT_LOCAL(A, r);
                 DISPATCH();
             }
 
-            case OP_INT_SUB_IMM8: {
+            TARGET(OP_INT_CMP_EQ): {
+                INT_BINARY_OP(OP_BINARY_CMP_EQ, ==);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_CMP_NE): {
+                INT_BINARY_OP(OP_BINARY_CMP_NE, !=);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_CMP_LT): {
+                INT_BINARY_OP(OP_BINARY_CMP_LT, <);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_CMP_GT): {
+                INT_BINARY_OP(OP_BINARY_CMP_GT, >);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_CMP_LE): {
+                INT_BINARY_OP(OP_BINARY_CMP_LE, <=);
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_CMP_GE): {
+                INT_BINARY_OP(OP_BINARY_CMP_GE, >=);
+                DISPATCH();
+            }
+
+            TARGET(OP_FLOAT_ADD): {
+                FLOAT_BINARY_OP(OP_BINARY_ADD, +);
+                DISPATCH();
+            }
+
+            TARGET(OP_FLOAT_SUB): {
+                FLOAT_BINARY_OP(OP_BINARY_SUB, -);
+                DISPATCH();
+            }
+
+            TARGET(OP_FLOAT_MUL): {
+                FLOAT_BINARY_OP(OP_BINARY_MUL, *);
+                DISPATCH();
+            }
+
+            TARGET(OP_FLOAT_DIV): {
+                FLOAT_BINARY_OP(OP_BINARY_DIV, /);
+                DISPATCH();
+            }
+
+            TARGET(OP_FLOAT_MOD): {
+                int A = NEXT_REG();
+                int B = NEXT_REG();
+                int C = NEXT_REG();
+                Value *rb = GET_LOCAL(B);
+                Value *rc = GET_LOCAL(C);
+                if (!IS_FLOAT(rb) || !IS_FLOAT(rc)) DEOPT(OP_BINARY_MOD, 4);
+                Value *ra = GET_LOCAL(A);
+                *ra = float_value(fmod(to_float(rb), to_float(rc)));
+                DISPATCH();
+            }
+
+            TARGET(OP_BINARY_METHOD): {
+                int A = NEXT_REG();
+                int B = NEXT_REG();
+                int C = NEXT_REG();
+                Value *rb = GET_LOCAL(B);
+                InlineCache *ic = code_inline_cache(code, next_inst - 4 - first_inst);
+                if (!IS_OBJ(rb)) DEOPT(ic->opcode, 4);
+                Object *meth = methodsite_lookup(&ic->ms, rb);
+                if (!meth) DEOPT(ic->opcode, 4);
+                Value *ra = GET_LOCAL(A);
+                Value *rc = GET_LOCAL(C);
+                SAVE_FRAME();
+                if (_binary_call_method(ic->opcode, meth, ra, rb, rc)) {
+                    ASSERT(_exc_occurred(ks));
+                    *result = error_value;
+                    goto error;
+                }
+                DISPATCH();
+            }
+
+            /* quickened at the first run */
+            TARGET(OP_BINARY_ADD):
+            TARGET(OP_BINARY_SUB):
+            TARGET(OP_BINARY_MUL):
+            TARGET(OP_BINARY_DIV):
+            TARGET(OP_BINARY_MOD):
+            TARGET(OP_BINARY_AND):
+            TARGET(OP_BINARY_OR):
+            TARGET(OP_BINARY_XOR):
+            TARGET(OP_BINARY_SHL):
+            TARGET(OP_BINARY_SHR):
+            TARGET(OP_BINARY_USHR):
+            TARGET(OP_BINARY_CMP_EQ):
+            TARGET(OP_BINARY_CMP_NE):
+            TARGET(OP_BINARY_CMP_LT):
+            TARGET(OP_BINARY_CMP_GT):
+            TARGET(OP_BINARY_CMP_LE):
+            TARGET(OP_BINARY_CMP_GE): {
+                int A = NEXT_REG();
+                int B = NEXT_REG();
+                int C = NEXT_REG();
+                Value *ra = GET_LOCAL(A);
+                Value *rb = GET_LOCAL(B);
+                Value *rc = GET_LOCAL(C);
+                SAVE_FRAME();
+                if (_binary_generic(cf, opcode, next_inst - 4, ra, rb, rc)) {
+                    ASSERT(_exc_occurred(ks));
+                    *result = error_value;
+                    goto error;
+                }
+                DISPATCH();
+            }
+
+            TARGET(OP_INT_SUB_IMM8): {
                 int A = NEXT_REG();
                 int B = NEXT_REG();
                 int imm = NEXT_INT8();
                 Value *rb = GET_LOCAL(B);
                 ASSERT(IS_INT(rb));
-                int64_t r = rb->ival - imm;
+                int64_t r = to_int(rb) - imm;
                 SET_INT_LOCAL(A, r);
                 DISPATCH();
             }
 
-            case OP_PUSH: {
+            TARGET(OP_PUSH): {
                 int A = NEXT_REG();
                 Value *ra = GET_LOCAL(A);
                 PUSH(ra);
                 DISPATCH();
             }
 
-            case OP_PUSH_IMM8: {
+            TARGET(OP_PUSH_IMM8): {
                 int imm = NEXT_INT8();
                 PUSH_INT(imm);
                 DISPATCH();
             }
 
-            case OP_CONST_LOAD: {
+            TARGET(OP_CONST_LOAD): {
                 int A = NEXT_REG();
                 int offset = NEXT_INT16();
                 Value *val = vector_get(consts, offset);
@@ -284,7 +1033,7 @@ main_loop:
                 DISPATCH();
             }
 
-            case OP_CALL: {
+            TARGET(OP_CALL): {
                 int rel = NEXT_INT8();
                 int sym = NEXT_INT8();
                 int nargs = NEXT_INT8();
@@ -292,6 +1041,11 @@ main_loop:
                 Object *callable = _get_symbol(cf, rel, sym);
                 ASSERT(callable);
                 Value *ra = GET_LOCAL(A);
+                SAVE_FRAME();
+                if (IS_CODE(callable)) {
+                    CALL_CODE((CodeObject *)callable, nargs, ra);
+                    DISPATCH();
+                }
                 _call_function(callable, cf->stack, nargs, NULL, cf, ra);
                 if (IS_ERROR(ra)) {
                     ASSERT(_exc_occurred(ks));
@@ -302,7 +1056,43 @@ main_loop:
                 DISPATCH();
             }
 
-            case OP_CALL_KW: {
+            TARGET(OP_CALL_METHOD): {
+                int offset = NEXT_INT16();
+                int nargs = NEXT_INT8();
+                int A = NEXT_REG();
+                /* receiver is the first argument */
+                Value *self = cf->stack;
+                SAVE_FRAME();
+                InlineCache *ic = code_inline_cache(code, next_inst - 5 - first_inst);
+                if (!ic->ms.fname) {
+                    Value *name = vector_get(consts, offset);
+                    ASSERT(name);
+                    ic->opcode = OP_CALL_METHOD;
+                    ic->ms.fname = code_site_name(name);
+                }
+                Object *meth = methodsite_lookup(&ic->ms, self);
+                if (!meth) {
+                    _raise_exc_fmt(ks, "'%s' object has no method '%s'",
+                                   object_typeof(self)->name, ic->ms.fname);
+                    *result = error_value;
+                    goto error;
+                }
+                Value *ra = GET_LOCAL(A);
+                if (IS_CODE(meth)) {
+                    CALL_CODE((CodeObject *)meth, nargs, ra);
+                    DISPATCH();
+                }
+                _call_function(meth, cf->stack, nargs, NULL, cf, ra);
+                if (IS_ERROR(ra)) {
+                    ASSERT(_exc_occurred(ks));
+                    *result = *ra;
+                    goto error;
+                }
+                SHRINK(nargs);
+                DISPATCH();
+            }
+
+            TARGET(OP_CALL_KW): {
                 int rel = NEXT_INT8();
                 int sym = NEXT_INT8();
                 int nargs = NEXT_INT8();
@@ -315,6 +1105,7 @@ main_loop:
                 Value *ra = GET_LOCAL(A);
                 ASSERT(nargs >= TUPLE_LEN(names));
                 nargs -= TUPLE_LEN(names);
+                SAVE_FRAME();
                 _call_function(callable, cf->stack, nargs, names, cf, ra);
                 if (IS_ERROR(ra)) {
                     ASSERT(_exc_occurred(ks));
@@ -325,15 +1116,30 @@ main_loop:
                 DISPATCH();
             }
 
-            case OP_ATTR_LOAD: {
+            /* the receiver type guards the cached field offset */
+            TARGET(OP_ATTR_LOAD):
+            TARGET(OP_FIELD_LOAD): {
                 int A = NEXT_REG();
                 int B = NEXT_REG();
-                int offset = NEXT_INT16();
-                NYI();
+                int k = NEXT_INT16();
+                Value *ra = GET_LOCAL(A);
+                Value *rb = GET_LOCAL(B);
+                InlineCache *ic = code_inline_cache(code, next_inst - 5 - first_inst);
+                AttrSite *as = &ic->as;
+                if (IS_OBJ(rb) && OB_TYPE(to_obj(rb)) == as->type && as->offset >= 0) {
+                    *ra = kl_member_load((char *)to_obj(rb) + as->offset, as->mtype);
+                    DISPATCH();
+                }
+                SAVE_FRAME();
+                if (_attr_load(cf, opcode, ic, k, rb, ra)) {
+                    ASSERT(_exc_occurred(ks));
+                    *result = error_value;
+                    goto error;
+                }
                 DISPATCH();
             }
 
-            case OP_REL_LOAD: {
+            TARGET(OP_REL_LOAD): {
                 int A = NEXT_REG();
                 int rel = NEXT_INT8();
                 int sym = NEXT_INT8();
@@ -344,18 +1150,33 @@ main_loop:
                 DISPATCH();
             }
 
-            case OP_RETURN: {
+            TARGET(OP_RETURN): {
                 int A = NEXT_REG();
                 Value *ra = GET_LOCAL(A);
+                if (cf->ret) {
+                    SET(cf->ret, ra);
+                    RETURN_TO_CALLER();
+                    DISPATCH();
+                }
                 SET(result, ra);
                 goto done;
             }
 
-            case OP_RETURN_NONE: {
+            TARGET(OP_RETURN_NONE): {
+                if (cf->ret) {
+                    *cf->ret = none_value;
+                    RETURN_TO_CALLER();
+                    DISPATCH();
+                }
                 *result = none_value;
                 goto done;
             }
 
+#include "super_targets.h"
+
+#if USE_COMPUTED_GOTOS
+            _unknown_opcode:
+#endif
             default: {
                 UNREACHABLE();
                 break;
@@ -364,18 +1185,24 @@ main_loop:
 
         /* This should never be reached here! */
         UNREACHABLE();
-    } /* main_loop */
+    } /* for */
 
 error:
 
-    /* log traceback info */
+    /* log traceback info, and unwind the frames called in this loop */
     kl_trace_here(cf);
+    while (cf->ret) {
+        CallFrame *back = cf->back;
+        _leave_frame(ks, cf);
+        _pop_frame(ks, cf);
+        cf = back;
+        kl_trace_here(cf);
+    }
 
     /* finish the loop as we have an error. */
 done:
     /* pop frame */
-    ks->cf = cf->back;
-    --ks->depth;
+    _leave_frame(ks, cf);
 }
 
 Value kl_eval_code(Value *self, Value *args, int nargs, Object *names)
@@ -384,6 +1211,16 @@ Value kl_eval_code(Value *self, Value *args, int nargs, Object *names)
 
     Object *code = as_obj(self);
 
+    /* optimized code runs without a frame */
+    OptCode *oc = ((CodeObject *)code)->opt;
+    Value result;
+    if (oc && !opt_run(oc, args, nargs, OPT_BUDGET(ks), &result)) return result;
+
+    if (ks->native_depth >= MAX_NATIVE_DEPTH || _frame_overflow(ks, (CodeObject *)code)) {
+        _raise_exc_str(ks, "maximum call depth exceeded");
+        return error_value;
+    }
+
     /* build a call frame */
     CallFrame *cf = _new_frame(ks, (CodeObject *)code);
 
@@ -391,8 +1228,10 @@ Value kl_eval_code(Value *self, Value *args, int nargs, Object *names)
     _copy_arguments(cf, args, nargs);
 
     /* eval the call frame */
-    Value result = { 0 };
+    result = none_value;
+    ++ks->native_depth;
     _eval_frame(ks, cf, &result);
+    --ks->native_depth;
 
     /* pop frame to free list */
     _pop_frame(ks, cf);
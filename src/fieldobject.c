@@ -4,6 +4,7 @@
  */
 
 #include "fieldobject.h"
+#include "stringobject.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,12 +54,64 @@ Object *kl_field_from_value(ValueInfo *val)
     int sz = sizeof(FieldObject) + sizeof(ValueInfo);
     FieldObject *field = gc_alloc_p(sz);
     INIT_OBJECT_HEAD(field, &field_type);
-    field->kind = FIELD_KIND_VAR;
+    field->kind = FIELD_KIND_VALUE;
     ValueInfo *p = (ValueInfo *)(field + 1);
     *p = *val;
     return (Object *)field;
 }
 
+int kl_field_offset(Object *_field, int *type)
+{
+    FieldObject *field = (FieldObject *)_field;
+    switch (field->kind) {
+        case FIELD_KIND_MEMBER: {
+            MemberDef *member = *(MemberDef **)(field + 1);
+            /* string is copied into a new object, not a plain load */
+            if (member->type == MBR_T_STRING) return -1;
+            *type = member->type;
+            return member->offset;
+        }
+        case FIELD_KIND_VAR: {
+            VarInfo *var = (VarInfo *)(field + 1);
+            *type = MBR_T_VALUE;
+            return VAR_OFFSET(var->index);
+        }
+        default:
+            return -1;
+    }
+}
+
+Value kl_field_get(Object *_field, Object *obj)
+{
+    FieldObject *field = (FieldObject *)_field;
+    switch (field->kind) {
+        case FIELD_KIND_MEMBER: {
+            MemberDef *member = *(MemberDef **)(field + 1);
+            char *ptr = (char *)obj + member->offset;
+            if (member->type == MBR_T_STRING) {
+                char *s = *(char **)ptr;
+                return s ? obj_value(kl_new_str(s)) : none_value;
+            }
+            return kl_member_load(ptr, member->type);
+        }
+        case FIELD_KIND_GETSET: {
+            GetSetDef *getset = *(GetSetDef **)(field + 1);
+            return getset->get();
+        }
+        case FIELD_KIND_VAR: {
+            VarInfo *var = (VarInfo *)(field + 1);
+            return *(Value *)((char *)obj + VAR_OFFSET(var->index));
+        }
+        case FIELD_KIND_VALUE: {
+            ValueInfo *val = (ValueInfo *)(field + 1);
+            return val->value;
+        }
+        default:
+            UNREACHABLE();
+            return none_value;
+    }
+}
+
 #ifdef __cplusplus
 }
 #endif
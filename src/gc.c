@@ -4,13 +4,16 @@
  */
 
 #include "gc.h"
+#include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
-#include <signal.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include "log.h"
 #include "run.h"
+#include "vector.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,12 +24,12 @@ extern "C" {
 /* CMS algorithm */
 
 static const char *_gc_state_strs[] = {
-    "GC_DONE", "GC_MARK_ROOTS", "GC_CO_MARK", "GC_REMARK", "GC_CO_SWEEP", "GC_FULL",
+    "GC_DONE",     "GC_MARK_ROOTS", "GC_CO_MARK", "GC_REMARK",
+    "GC_CO_SWEEP", "GC_FULL",       "GC_YOUNG",
 };
 
-/* We use like JVM solution to stop the mutators. */
-static int _pagesize;
-volatile char *_gc_check_ptr;
+/* the mutators poll it at the calls and backward jumps, see gc_safepoint */
+volatile int gc_safepoint_requested;
 
 /* gc state */
 static volatile GcState _gc_state;
@@ -35,30 +38,273 @@ static int _full_gc;
 /* alloc failed reason */
 static volatile int _failed_minor;
 static volatile int _failed_major;
+/* the nursery is full */
+static volatile int _failed_young;
 
 /* waiting for continuing to run after GC_STW */
 static pthread_mutex_t _mutator_wait_mutex;
 static pthread_cond_t _mutator_wait_cond;
 static volatile int _mutator_wait_flag;
 
+/*
+ * Finalization. The objects allocated by gc_alloc_f are registered. A dead
+ * one found by a major gc is marked again with the objects it refers to, and
+ * queued for the finalizer thread. It is freed by a cycle after its fini.
+ */
+static Vector _gc_finalizable;
+static Vector _gc_fini_queue;
+/* taken from the queue, run without the lock */
+static Vector _gc_fini_batch;
+static int _gc_fini_running;
+static int _gc_fini_done;
+static pthread_mutex_t _gc_fini_mutex;
+static pthread_cond_t _gc_fini_cond;
+static pthread_t _gc_fini_pid;
+
+/* the weak slots and the ephemeron slots found by the marking */
+static Vector _gc_weak_slots;
+static Vector _gc_ephemeron_slots;
+static pthread_spinlock_t _gc_weak_lock;
+
 /* memory allocator */
 static size_t _gc_max_size;
+static size_t _gc_init_size;
+/* a full gc is run when it is full, resized by pace_heap */
+static size_t _gc_heap_size;
+/* a concurrent cycle is started when it is reached */
 static size_t _gc_minor_size;
 static volatile size_t _gc_used_size;
 
-/* protect _gc_state and _gc_used_size */
+/*
+ * Pacing. After a cycle the heap is twice its live objects, within the initial
+ * and the max sizes, and the next concurrent cycle is started early enough to
+ * finish before the heap is full, by the allocation rate and the time of the
+ * last cycles. The nursery is shrunk if a minor gc is longer than the target
+ * pause, and grown back if it is much shorter.
+ */
+#define GC_INIT_HEAP_SIZE (64 * 1024 * 1024)
+#define GC_HEAP_GROWTH    2
+/* the first concurrent cycle, and the latest one */
+#define GC_TRIGGER_RATIO  0.8
+#define GC_TRIGGER_MAX    0.95
+#define GC_PAUSE_MS       10
+
+static int _gc_pause_ms;
+/* old bytes reserved, and at the start of the concurrent cycle */
+static size_t _gc_allocated;
+static size_t _gc_cycle_allocated;
+/* the concurrent cycle is started, 0: not running */
+static uint64_t _gc_cycle_start;
+/* moving averages of the concurrent cycles, bytes per ms and ms */
+static double _gc_alloc_rate;
+static double _gc_cycle_ms;
+
+/*
+ * Telemetry, see gc_get_stats. The counters are changed with _gc_spin_lock or
+ * the world stopped, the phases and the types by the collector.
+ */
+static GcStats _gc_stats;
+/* young bytes allocated at the end of the last minor gc, and kept by it */
+static size_t _gc_young_base;
+static size_t _gc_young_live;
+/* young bytes pinned by this minor gc */
+static size_t _gc_pinned;
+/* the statistics are dumped to it by the collector when it is idle */
+static FILE *_gc_stats_fp;
+static uint64_t _gc_stats_interval;
+static uint64_t _gc_stats_last;
+#define GC_STATS_MS 1000
+
+/* protect _gc_state, _gc_used_size, the pages and the buffers */
 static pthread_spinlock_t _gc_spin_lock;
 
-/* Objects are allocated in GC_DONE */
-static LLDeque _gc_lists[3];
-static LLDeque *_gc_list;
-static LLDeque *_gc_list_2;
-static LLDeque *_gc_old_list;
+/* cell sizes of the size classes */
+static int _gc_class_sizes[GC_NR_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128,  160,  192,  224,  256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+/* (size - 1) / 16 -> size class */
+static uint8_t _gc_size_classes[GC_MAX_SMALL_SIZE / 16];
+
+/* bitmap words of a page, enough for the 16 bytes cells */
+#define GC_PAGE_WORDS (GC_PAGE_SIZE / 16 / 64)
+
+/* a dirty card may have old to young references */
+#define GC_CARD_SIZE  512
+#define GC_PAGE_CARDS (GC_PAGE_SIZE / GC_CARD_SIZE)
+
+/*
+ * A page of cells of one size class, aligned to its size. Its header is the
+ * metadata: the mark bits and the allocated bits are side bitmaps, the sweep
+ * touches no object. The free cells are the clear bits of the alloc bitmap.
+ */
+typedef struct _GcPage {
+    /* all pages (or permanent pages) */
+    struct _GcPage *link;
+    /* pages with free cells of the size class */
+    struct _GcPage *next;
+    int size;
+    int ncells;
+    /* cells not allocated, nor reserved by a buffer */
+    int nfree;
+    char *cells;
+    /* allocated, reserved or past the last cell */
+    uint64_t alloc[GC_PAGE_WORDS];
+    uint64_t mark[GC_PAGE_WORDS];
+    /* card table, and any card is dirty */
+    uint8_t cards[GC_PAGE_CARDS];
+    int dirty;
+} GcPage;
+
+#define GC_PAGE_HEAD ALIGN(sizeof(GcPage), 16)
+
+static GcPage *_gc_pages;
+/* pages with free cells, rebuilt by sweep */
+static GcPage *_gc_avail_pages[GC_NR_CLASSES];
+/*
+ * Immortal arenas of the permanent objects, bump allocated in pages that are
+ * never marked nor swept. The objects of the read-only one are not written
+ * once the runtime is initialized, its pages may be protected.
+ */
+typedef struct _GcArena {
+    GcPage *pages;
+    /* the pages from it on are protected */
+    GcPage *sealed;
+    char *top;
+    char *end;
+} GcArena;
+
+static GcArena _gc_arenas[2];
+static int _gc_protect_perm;
+
+/* header of an object bigger than the size classes, allocated alone */
+typedef struct _GcBig {
+    struct _GcBig *next;
+    /* card table, after the object, NULL: no reference in it */
+    uint8_t *cards;
+    /* length of the mapping of a large object, 0: by calloc */
+    size_t mapped;
+    int perm;
+    int mark;
+    int dirty;
+} GcBig;
+
+static GcBig *_gc_bigs;
+
+/*
+ * Large object space. An object of GC_LARGE_SIZE or more is mapped alone,
+ * page aligned, and unmapped when it is freed, so the memory goes back to
+ * the OS. A few freed mappings are kept for reuse, their pages are dropped.
+ */
+#define GC_LARGE_SIZE  (64 * 1024)
+#define GC_LARGE_CACHE 8
+
+static GcBig *_gc_larges;
+static GcBig *_gc_large_free;
+static int _gc_large_nfree;
+static size_t _gc_os_page_size;
+
+/*
+ * Young objects are bumped in the nursery pages. A minor gc copies the live
+ * ones to the survivor pages, or promotes them to the old pages when they are
+ * old enough. The objects of the shadow stacks are pinned, their pages are
+ * kept. The nursery is not collected during a concurrent cycle.
+ */
+#define GC_NURSERY_SIZE (4 * 1024 * 1024)
+/* promoted by the minor gc of this age */
+#define GC_PROMOTE_AGE 3
+
+static GcPage *_gc_nursery;
+static int _gc_young_pages;
+static int _gc_young_max;
+/* the nursery is never grown above it */
+static int _gc_young_limit;
+#define GC_MIN_YOUNG_PAGES 4
+/* emptied nursery pages, reused */
+static GcPage *_gc_young_free;
+static int _gc_young_nfree;
+
+/* copying of a minor gc */
+static int _gc_promote_age;
+static GcPage *_gc_survivors;
+static char *_gc_survivor_top;
+static char *_gc_survivor_end;
+static size_t _gc_survived;
+/* old cells of the promoted objects */
+static GcTlab _gc_promote_tlab;
 
-/* Objects are allocated in GC_CO_MARK and GC_CO_SWEEP */
-static LLDeque _gc_remark_list;
-/* Objects are permanent, never reclaimed. */
-static LLDeque _gc_perm_list;
+/*
+ * Compaction. A sweep measures the free cells of the old pages. If they are
+ * fragmented, the next major cycle is a full gc, which evacuates its sparse
+ * pages into the other pages of their size classes after the sweep. A stub
+ * left in the old cell forwards to the copy and looks young, so the references
+ * are updated by the scan of a minor gc. The pinned cells are not moved.
+ */
+/* free bytes of the old pages, of all their bytes, and at least */
+#define GC_COMPACT_RATIO    0.5
+#define GC_COMPACT_MIN      (4 * 1024 * 1024)
+/* a page of fewer live cells is evacuated */
+#define GC_SPARSE_RATIO     0.5
+/* major cycles after a compaction, the pinned cells may keep it fragmented */
+#define GC_COMPACT_INTERVAL 4
+
+static int _gc_compact;
+static int _gc_compact_pending;
+/* the first major cycle a compaction may be requested by */
+static size_t _gc_compact_cycle;
+/* by gc_pin, roots */
+static Vector _gc_pins;
+
+/* detached by remark, swept concurrently */
+static GcPage *_gc_sweep_pages;
+static GcBig *_gc_sweep_bigs;
+static GcBig *_gc_sweep_larges;
+
+volatile int gc_marking;
+/* filled snapshot buffers, and the emptied ones */
+static GcSatbBuf *_gc_satb_full;
+static GcSatbBuf *_gc_satb_free;
+
+/* allocation buffers of all threads */
+static GcTlab *_gc_tlabs;
+
+/* gray objects a thief can take, owner at bottom, thieves at top */
+#define GC_DEQUE_SIZE 1024
+
+typedef struct _GcDeque {
+    volatile long top;
+    volatile long bottom;
+    GcObject *objs[GC_DEQUE_SIZE];
+} GcDeque;
+
+/* a parallel marker, the first one is the collector thread */
+typedef struct _GcMarker {
+    pthread_t pid;
+    int id;
+    /* private gray objects, the mark functions push into it */
+    GcMarkStack stk;
+    /* shared part of the gray objects */
+    GcDeque dq;
+    /* the objects marked by it, hashed by their types */
+    GcTypeStats types[GC_MAX_TYPE_STATS];
+} GcMarker;
+
+/* roots of the collector */
+static GcMarkStack _gc_root_stack;
+
+/* number of markers, KOALA_GC_MARKERS or a quarter of online cpus */
+static int _gc_nmarkers;
+static GcMarker *_gc_markers;
+/* markers without work, all are idle: marking is done */
+static volatile int _gc_idle_markers;
+static sem_t _gc_mark_start_sema;
+static sem_t _gc_mark_done_sema;
+
+/* full gcs done, waited by gc_collect */
+static volatile size_t _gc_cycles;
+/* the collections which move objects, see gc_moves */
+static size_t _gc_moves;
 
 /* gc worker thread */
 static sem_t _gc_worker_sema;
@@ -97,7 +343,7 @@ static inline void enable_stw(void)
 {
     pthread_mutex_lock(&_mutator_wait_mutex);
     _mutator_wait_flag = 1;
-    mprotect((void *)_gc_check_ptr, _pagesize, PROT_NONE);
+    gc_safepoint_requested = 1;
     pthread_mutex_unlock(&_mutator_wait_mutex);
     log_info("[Collector][%s]Enable STW", _gc_state_strs[_gc_state]);
 }
@@ -108,100 +354,494 @@ static inline void disable_stw_wakeup_threads(void)
 
     log_info("[Collector][%s]Disable STW and wakeup mutators", _gc_state_strs[_gc_state]);
     _mutator_wait_flag = 0;
-    mprotect((void *)_gc_check_ptr, _pagesize, PROT_READ);
+    gc_safepoint_requested = 0;
     pthread_cond_broadcast(&_mutator_wait_cond);
 
     pthread_mutex_unlock(&_mutator_wait_mutex);
 }
 
-#define gc_incr_age(obj) ++((GcObject *)(obj))->gc_age
+#define size_class(size) _gc_size_classes[((size)-1) >> 4]
+#define page_of(obj)     ((GcPage *)((uintptr_t)(obj) & ~(uintptr_t)(GC_PAGE_SIZE - 1)))
+#define big_of(obj)      ((GcBig *)(obj)-1)
+
+/* bits of the word past the last cell */
+static inline uint64_t tail_bits(int ncells, int w)
+{
+    int n = ncells - w * 64;
+    if (n <= 0) return ~(uint64_t)0;
+    if (n >= 64) return 0;
+    return ~(uint64_t)0 << n;
+}
+
+static GcPage *map_page(void)
+{
+    /* aligned to its size, an object finds its page by masking */
+    char *addr = mmap(NULL, GC_PAGE_SIZE * 2, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) panic("gc cannot map a page");
+    char *start = (char *)ALIGN((uintptr_t)addr, GC_PAGE_SIZE);
+    if (start > addr) munmap(addr, start - addr);
+    munmap(start + GC_PAGE_SIZE, addr + GC_PAGE_SIZE - start);
+    return (GcPage *)start;
+}
+
+static GcPage *new_page(int c)
+{
+    GcPage *page = map_page();
+    char *start = (char *)page;
+    page->size = _gc_class_sizes[c];
+    page->ncells = (GC_PAGE_SIZE - GC_PAGE_HEAD) / page->size;
+    page->nfree = page->ncells;
+    page->cells = start + GC_PAGE_HEAD;
+    for (int w = 0; w < GC_PAGE_WORDS; w++) {
+        page->alloc[w] = tail_bits(page->ncells, w);
+    }
+    return page;
+}
+
+/* give the cells not allocated back to the page, with _gc_spin_lock */
+static void release_page(GcTlab *tlab, int c)
+{
+    GcPage *page = tlab->pages[c];
+    if (!page) return;
+
+    int w = tlab->words[c];
+    uint64_t bits = tlab->bits[c];
+    int nfree = __builtin_popcountll(bits);
+    if (bits) page->alloc[w] &= ~bits;
+    for (int i = w + 1; i < GC_PAGE_WORDS; i++) {
+        nfree += __builtin_popcountll(~page->alloc[i]);
+    }
+
+    page->nfree = nfree;
+    _gc_used_size -= (size_t)nfree * page->size;
+    if (tlab != &_gc_promote_tlab) _gc_stats.old_allocated -= (size_t)nfree * page->size;
+    if (nfree) {
+        page->next = _gc_avail_pages[c];
+        _gc_avail_pages[c] = page;
+    }
+
+    tlab->pages[c] = NULL;
+    tlab->bits[c] = 0;
+}
+
+static void retire_tlab(GcTlab *tlab)
+{
+    for (int c = 0; c < GC_NR_CLASSES; c++) release_page(tlab, c);
+}
 
-static void *free_obj(GcObject *obj)
+/* the world is stopped */
+static void retire_all_tlabs(void)
 {
     pthread_spin_lock(&_gc_spin_lock);
-    _gc_used_size -= obj->gc_size;
+    for (GcTlab *tlab = _gc_tlabs; tlab; tlab = tlab->next) {
+        retire_tlab(tlab);
+    }
     pthread_spin_unlock(&_gc_spin_lock);
-    free(obj);
 }
 
-static GcObject *alloc_obj(int size, int minor, int perm)
+/* the bytes bumped in the nursery page of the thread */
+static inline size_t young_bumped(GcTlab *tlab)
 {
-    ThreadState *ts = __ts;
-    UNUSED(ts);
+    if (!tlab->young_end) return 0;
+    return tlab->young_top - page_of(tlab->young_end - 1)->cells;
+}
+
+/* a zero header ends the bumped objects of a nursery page, see fixup_nursery */
+static inline void end_young(char *top, char *end)
+{
+    if (top < end) memset(top, 0, sizeof(GcObject));
+}
+
+void gc_init_tlab(GcTlab *tlab)
+{
+    memset(tlab, 0, sizeof(*tlab));
+    pthread_spin_lock(&_gc_spin_lock);
+    tlab->next = _gc_tlabs;
+    _gc_tlabs = tlab;
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+void gc_fini_tlab(GcTlab *tlab)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    retire_tlab(tlab);
+    _gc_stats.young_allocated += young_bumped(tlab);
+    if (tlab->satb) {
+        tlab->satb->next = _gc_satb_full;
+        _gc_satb_full = tlab->satb;
+        tlab->satb = NULL;
+    }
+    GcTlab **pp = &_gc_tlabs;
+    while (*pp != tlab) pp = &(*pp)->next;
+    *pp = tlab->next;
+    pthread_spin_unlock(&_gc_spin_lock);
+}
 
+/*
+ * Own a page with free cells, all of them are reserved from the heap. The
+ * page given up is full, or it is put back by release_page.
+ */
+static int refill_tlab(GcTlab *tlab, int c)
+{
     pthread_spin_lock(&_gc_spin_lock);
 
-    size_t used = _gc_used_size + size;
+    release_page(tlab, c);
+
+    GcPage *page = _gc_avail_pages[c];
+    size_t size = _gc_class_sizes[c];
+    size_t nfree = page ? (size_t)page->nfree : (GC_PAGE_SIZE - GC_PAGE_HEAD) / size;
+    if (_gc_used_size + nfree * size > _gc_heap_size) {
+        ++_failed_major;
+        _failed_minor = 0;
+        pthread_spin_unlock(&_gc_spin_lock);
+        return -1;
+    }
+
+    if (page) {
+        _gc_avail_pages[c] = page->next;
+    } else {
+        page = new_page(c);
+        page->link = _gc_pages;
+        _gc_pages = page;
+    }
+    _gc_used_size += nfree * size;
+    _gc_allocated += nfree * size;
+    if (tlab != &_gc_promote_tlab) _gc_stats.old_allocated += nfree * size;
+    page->nfree = 0;
+
+    /* mark concurrently before the heap is full */
+    int wakeup = 0;
+    if (_gc_used_size > _gc_minor_size && _gc_state == GC_DONE && !_failed_minor) {
+        _failed_minor = 1;
+        wakeup = 1;
+    }
+
+    tlab->pages[c] = page;
+    tlab->words[c] = -1;
+    tlab->bits[c] = 0;
+
+    pthread_spin_unlock(&_gc_spin_lock);
+    if (wakeup) gc_worker_wakeup();
+    return 0;
+}
+
+/* no lock, the next free cell of the page, a bitmap word is taken at a time */
+static inline GcObject *tlab_alloc(GcTlab *tlab, int c)
+{
+    GcPage *page = tlab->pages[c];
+    uint64_t bits = tlab->bits[c];
+    while (!bits) {
+        if (!page || tlab->words[c] + 1 >= GC_PAGE_WORDS) return NULL;
+        int w = ++tlab->words[c];
+        bits = ~page->alloc[w];
+        page->alloc[w] = ~(uint64_t)0;
+    }
+
+    tlab->bits[c] = bits & (bits - 1);
+    int i = tlab->words[c] * 64 + __builtin_ctzll(bits);
+    GcObject *obj = (GcObject *)(page->cells + i * page->size);
+    /* a dead object may be in the cell */
+    memset(obj, 0, page->size);
+    obj->gc_size = page->size;
+    return obj;
+}
+
+/* bumped in a page of the arena, the objects are walked by their sizes */
+static GcObject *alloc_perm(int size, int perm)
+{
+    GcArena *arena = _gc_arenas + perm - 1;
+    /* the next object is pointer aligned */
+    size = ALIGN_PTR(size);
+
+    pthread_spin_lock(&_gc_spin_lock);
 
-    if (used >= _gc_max_size) {
-        log_info("[Mutator]Thread-%d failed, Major, used: %ld(%ld), obj-size: %d", ts->id,
-                 _gc_used_size, _gc_max_size, size);
+    if (_gc_used_size + size > _gc_heap_size) {
         ++_failed_major;
-        goto exit;
-        // } else if (minor && used >= _gc_minor_size) {
-        //     log_info("[Mutator]Thread-%d failed, Minor, used: %ld(%ld-%ld), obj-size:
-        //     %d",
-        //              ts->id, _gc_used_size, _gc_minor_size, _gc_max_size, size);
-        //     ++_failed_minor;
-        //     goto exit;
+        _failed_minor = 0;
+        pthread_spin_unlock(&_gc_spin_lock);
+        return NULL;
+    }
+    _gc_used_size += size;
+    _gc_allocated += size;
+    _gc_stats.old_allocated += size;
+
+    if (arena->top + size > arena->end) {
+        GcPage *page = map_page();
+        page->cells = (char *)page + GC_PAGE_HEAD;
+        page->link = arena->pages;
+        arena->pages = page;
+        arena->top = page->cells;
+        arena->end = (char *)page + GC_PAGE_SIZE;
+    }
+    GcObject *obj = (GcObject *)arena->top;
+    arena->top += size;
+    obj->gc_size = size;
+
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    obj->gc_age = -1;
+    return obj;
+}
+
+/* the arrays of ints and floats are not scanned, no card table */
+static inline int has_refs(char kind)
+{
+    return kind == GC_KIND_OBJECT || kind == GC_KIND_ARRAY_OBJECT ||
+           kind == GC_KIND_ARRAY_VALUE;
+}
+
+/* a freed mapping, not much longer, or a new one, its memory is zero */
+static GcBig *map_large(size_t len)
+{
+    GcBig *big = NULL;
+
+    pthread_spin_lock(&_gc_spin_lock);
+    for (GcBig **pp = &_gc_large_free; *pp; pp = &(*pp)->next) {
+        GcBig *b = *pp;
+        if (b->mapped >= len && b->mapped <= len * 2) {
+            *pp = b->next;
+            --_gc_large_nfree;
+            big = b;
+            break;
+        }
+    }
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    if (big) {
+        big->mark = 0;
+        big->dirty = 0;
+        return big;
+    }
+
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+    big = addr;
+    big->mapped = len;
+    return big;
+}
+
+/* the pages are dropped, the mapping is kept if the cache is not full */
+static void unmap_large(GcBig *big)
+{
+    madvise(big, big->mapped, MADV_DONTNEED);
+
+    pthread_spin_lock(&_gc_spin_lock);
+    if (_gc_large_nfree < GC_LARGE_CACHE) {
+        big->next = _gc_large_free;
+        _gc_large_free = big;
+        ++_gc_large_nfree;
+        big = NULL;
+    }
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    if (big) munmap(big, big->mapped);
+}
+
+static void free_big(GcBig *big)
+{
+    if (big->mapped) {
+        unmap_large(big);
+    } else {
+        free(big);
+    }
+}
+
+static GcObject *alloc_big(int size, int perm, char kind)
+{
+    int ncards = has_refs(kind) ? (size + GC_CARD_SIZE - 1) / GC_CARD_SIZE : 0;
+    size_t len = sizeof(GcBig) + size + ncards;
+    int large = size >= GC_LARGE_SIZE;
+    GcBig *big;
+    if (large) {
+        big = map_large(ALIGN(len, _gc_os_page_size));
     } else {
-        /* use memory normally */
-        _gc_used_size = used;
+        big = calloc(1, len);
+    }
+    if (!big) panic("gc cannot allocate a big object of %d bytes", size);
+    big->cards = ncards ? (uint8_t *)(big + 1) + size : NULL;
+    big->perm = perm;
+
+    pthread_spin_lock(&_gc_spin_lock);
+    if (_gc_used_size + size >= _gc_heap_size) {
+        ++_failed_major;
+        _failed_minor = 0;
         pthread_spin_unlock(&_gc_spin_lock);
+        free_big(big);
+        return NULL;
+    }
+    _gc_used_size += size;
+    _gc_allocated += size;
+    _gc_stats.old_allocated += size;
+    if (large) {
+        _gc_stats.large_size += big->mapped;
+        big->next = _gc_larges;
+        _gc_larges = big;
+    } else {
+        big->next = _gc_bigs;
+        _gc_bigs = big;
     }
+    pthread_spin_unlock(&_gc_spin_lock);
 
-    GcObject *obj = calloc(1, size);
-    ASSERT(obj);
-    lldq_node_init(&obj->gc_link);
+    GcObject *obj = (GcObject *)(big + 1);
     obj->gc_size = size;
-    // default kind
-    obj->gc_kind = GC_KIND_OBJECT;
-    if (perm) {
-        obj->gc_age = -1;
-        obj->gc_color = GC_COLOR_WHITE;
-        lldq_push_tail(&_gc_perm_list, &obj->gc_link);
-        log_info("[Mutator]Thread-%d, successful, permanent, size: %ld", ts->id, size);
+    obj->gc_age = perm ? -1 : 0;
+    return obj;
+}
+
+static inline GcObject *alloc_small(GcTlab *tlab, int c)
+{
+    GcObject *obj = tlab_alloc(tlab, c);
+    if (!obj && !refill_tlab(tlab, c)) obj = tlab_alloc(tlab, c);
+    return obj;
+}
+
+/* an emptied nursery page or a new one, with _gc_spin_lock or the world stopped */
+static GcPage *take_young_page(void)
+{
+    GcPage *page = _gc_young_free;
+    if (page) {
+        _gc_young_free = page->link;
+        --_gc_young_nfree;
+        /* the pins of the last minor gc */
+        memset(page->mark, 0, sizeof(page->mark));
     } else {
-        obj->gc_age = 0;
-        if (_gc_state == GC_DONE) {
-            obj->gc_color = GC_COLOR_WHITE;
-            lldq_push_tail(_gc_list, &obj->gc_link);
-            log_info("[Mutator]Thread-%d, successful, WHITE, size: %ld", ts->id, size);
-        } else {
-            ASSERT(_gc_state == GC_CO_MARK || _gc_state == GC_CO_SWEEP);
-            obj->gc_color = GC_COLOR_BLACK;
-            lldq_push_tail(&_gc_remark_list, &obj->gc_link);
-            log_info("[Mutator]Thread-%d, successful, BLACK, size: %ld", ts->id, size);
+        page = new_page(0);
+    }
+    return page;
+}
+
+/* a nursery page for the thread, -1: the nursery is full */
+static int refill_nursery(GcTlab *tlab)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+
+    if (_gc_young_pages >= _gc_young_max) {
+        /* not during a concurrent cycle */
+        int wakeup = 0;
+        if (_gc_state == GC_DONE && !_failed_young) {
+            _failed_young = 1;
+            wakeup = 1;
         }
+        pthread_spin_unlock(&_gc_spin_lock);
+        if (wakeup) gc_worker_wakeup();
+        return -1;
     }
 
+    GcPage *page = take_young_page();
+    page->link = _gc_nursery;
+    _gc_nursery = page;
+    ++_gc_young_pages;
+    _gc_stats.young_allocated += young_bumped(tlab);
+
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    end_young(tlab->young_top, tlab->young_end);
+    tlab->young_top = page->cells;
+    tlab->young_end = page->cells + page->ncells * page->size;
+    return 0;
+}
+
+/* no lock, bump the nursery page of the thread */
+static inline GcObject *nursery_alloc(GcTlab *tlab, int size)
+{
+    char *top = tlab->young_top;
+    if (tlab->young_end - top < size) return NULL;
+    tlab->young_top = top + size;
+
+    GcObject *obj = (GcObject *)top;
+    /* the page may be reused */
+    memset(obj, 0, size);
+    obj->gc_size = size;
+    obj->gc_age = 1;
     return obj;
+}
 
-exit:
-    // TODO: STW firstly
-    ++_failed_major;
-    _failed_minor = 0;
+/* NULL: no memory, or the nursery is full and a minor gc is requested */
+static GcObject *alloc_obj(GcTlab *tlab, int size, int perm, char kind)
+{
+    if (perm == GC_FINI) {
+        /* never moved, the finalizer thread runs with the minor gcs */
+        if (size > GC_MAX_SMALL_SIZE) return alloc_big(size, 0, kind);
+        return alloc_small(tlab, size_class(size));
+    }
+    if (size > GC_MAX_SMALL_SIZE) return alloc_big(size, perm, kind);
+    if (perm) return alloc_perm(size, perm);
+
+    int c = size_class(size);
+
+    GcObject *obj = nursery_alloc(tlab, size);
+    if (obj) return obj;
+    if (!refill_nursery(tlab)) return nursery_alloc(tlab, size);
+    if (_failed_young) return NULL;
+    /* old ones during a concurrent cycle */
+    return alloc_small(tlab, c);
+}
+
+/* the heap is full after a full gc, grow it, 0: it is at the max size */
+static int grow_heap(int size)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    int grown = _gc_heap_size < _gc_max_size;
+    if (grown) {
+        size_t heap = _gc_used_size + size + GC_PAGE_SIZE;
+        heap = MAX(heap, _gc_heap_size * GC_HEAP_GROWTH);
+        _gc_heap_size = MIN(heap, _gc_max_size);
+        /* the failure of this allocation */
+        _failed_major = 0;
+        log_info("[Mutator]heap is grown to %ld", _gc_heap_size);
+    }
     pthread_spin_unlock(&_gc_spin_lock);
-    return NULL;
+    return grown;
+}
+
+/* at a safepoint, until the cycle after `cycle` is done or marking is started */
+static void wait_gc(size_t cycle, int marking)
+{
+    ThreadState *ts = __ts;
+    ASSERT(ts->state == TS_RUNNING);
+
+    ts->state = TS_GC_STW;
+    gc_worker_wakeup();
+    pthread_mutex_lock(&_mutator_wait_mutex);
+    while ((_gc_cycles <= cycle && !(marking && gc_marking)) || _mutator_wait_flag) {
+        pthread_cond_wait(&_mutator_wait_cond, &_mutator_wait_mutex);
+    }
+    pthread_mutex_unlock(&_mutator_wait_mutex);
+    ts->state = TS_RUNNING;
 }
 
-void *_gc_alloc(int size, int perm)
+static size_t gc_cycles(void)
+{
+    pthread_mutex_lock(&_mutator_wait_mutex);
+    size_t cycles = _gc_cycles;
+    pthread_mutex_unlock(&_mutator_wait_mutex);
+    return cycles;
+}
+
+void *_gc_alloc(int size, int perm, char kind)
 {
     ThreadState *ts = __ts;
     ASSERT(ts->state == TS_RUNNING);
 
-    /* aligned pointer size */
+    /* aligned pointer size, room for a forward */
     int mm_size = ALIGN_PTR(size);
+    if (mm_size < (int)sizeof(GcForward)) mm_size = sizeof(GcForward);
+    GcTlab *tlab = &ts->tlab;
     GcObject *obj = NULL;
 
     /* simple fsm */
     while (1) {
+        /* before the state, a cycle ended after it is newer */
+        size_t cycle = __atomic_load_n(&_gc_cycles, __ATOMIC_ACQUIRE);
         switch (_gc_state) {
             case GC_DONE: {
                 /* normal case */
-                obj = alloc_obj(mm_size, 1, perm);
+                obj = alloc_obj(tlab, mm_size, perm, kind);
                 if (!obj) {
-                    if (_full_gc) {
+                    /* the nursery is full, not the heap */
+                    if (_full_gc && !_failed_young) {
+                        if (grow_heap(mm_size)) continue;
                         panic(
                             "gc memory(used: %ld/%ld, request: %d) is too small and "
                             "cannot allocate more objects.",
@@ -214,13 +854,16 @@ void *_gc_alloc(int size, int perm)
             case GC_CO_MARK: /* fall-through */
             case GC_CO_SWEEP: {
                 /* normal case */
-                obj = alloc_obj(mm_size, 0, perm);
-                if (!obj) goto suspend;
-                goto done;
+                obj = alloc_obj(tlab, mm_size, perm, kind);
+                if (obj) goto done;
+                /* not spin, the collector is running */
+                wait_gc(cycle, 0);
+                continue;
             }
             case GC_MARK_ROOTS: /* fall-through */
             case GC_REMARK: /* fall-through */
-            case GC_FULL: {
+            case GC_FULL: /* fall-through */
+            case GC_YOUNG: {
                 goto suspend;
             }
             default: {
@@ -239,105 +882,1516 @@ void *_gc_alloc(int size, int perm)
     }
 
 done:
+    /* the last full gc has freed enough */
+    if (_full_gc) _full_gc = 0;
 
+    obj->gc_kind = kind;
+    /* allocated black, not in the snapshot */
+    if (gc_marking && (!perm || perm == GC_FINI)) gc_set_mark(obj);
+    if (perm == GC_FINI) {
+        pthread_mutex_lock(&_gc_fini_mutex);
+        vector_push_back(&_gc_finalizable, &obj);
+        pthread_mutex_unlock(&_gc_fini_mutex);
+    }
     return obj;
 }
 
-void *gc_alloc_array(char kind, size_t len)
+int gc_set_mark(GcObject *obj)
 {
-    static size_t sizes[] = {
-        0,
-        sizeof(int8_t),
-        sizeof(int64_t),
-        sizeof(double),
-        sizeof(Object *),
-        sizeof(Value),
-    };
-    ASSERT(kind >= GC_KIND_ARRAY_INT8 && kind <= GC_KIND_ARRAY_VALUE);
-    int size = sizeof(GcArrayObject) + len * sizes[kind];
-    GcArrayObject *obj = gc_alloc(size);
-    obj->gc_kind = kind;
-    obj->gc_num_objs = len;
-    return obj;
+    /* atomic, if set by the parallel markers */
+    if (obj->gc_size > GC_MAX_SMALL_SIZE) {
+        GcBig *big = big_of(obj);
+        if (big->mark) return 0;
+        if (_gc_nmarkers == 1 && !gc_marking) return big->mark = 1;
+        return !__atomic_exchange_n(&big->mark, 1, __ATOMIC_RELAXED);
+    }
+
+    GcPage *page = page_of(obj);
+    int i = ((char *)obj - page->cells) / page->size;
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    uint64_t *word = page->mark + (i >> 6);
+    if (*word & bit) return 0;
+    if (_gc_nmarkers == 1 && !gc_marking) {
+        *word |= bit;
+        return 1;
+    }
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
 }
 
-static void gc_segment_fault_handler(int sig, siginfo_t *si, void *unused)
+void gc_collect(void)
 {
-    ThreadState *ts = __ts;
-    ASSERT(ts->state == TS_RUNNING);
+    size_t cycle = gc_cycles();
 
-    if (!_mutator_wait_flag) return;
+    pthread_spin_lock(&_gc_spin_lock);
+    ++_failed_major;
+    pthread_spin_unlock(&_gc_spin_lock);
 
-    log_warn("[Mutator][Signal]Thread-%d got SIGSEGV at address: %p", ts->id,
-             si->si_addr);
-    if (si->si_addr != _gc_check_ptr) {
-        log_fatal("Segmentation fault\n");
-        abort();
-    }
+    wait_gc(cycle, 0);
+}
 
-    /* waiting for resuming to run */
-    ts->state = TS_GC_STW;
-    log_info("[Mutator][Signal]Thread-%d is suspend", ts->id);
+size_t gc_start_marking(void)
+{
+    size_t cycle = gc_cycles();
 
-    gc_worker_wakeup();
-    mutator_wait();
+    pthread_spin_lock(&_gc_spin_lock);
+    ++_failed_minor;
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    wait_gc(cycle, 1);
+    return cycle;
+}
+
+void gc_wait_cycle(size_t cycle) { wait_gc(cycle, 0); }
+
+void gc_wait_done(void)
+{
+    ThreadState *ts = __ts;
+    ASSERT(ts->state == TS_RUNNING);
 
+    ts->state = TS_GC_STW;
+    gc_worker_wakeup();
+    pthread_mutex_lock(&_mutator_wait_mutex);
+    /*
+     * Not by the cycles, a minor gc finishes none. The failures are cleared
+     * after the state is switched, the mutators are waked up after it is done.
+     */
+    while (_failed_minor || _failed_major || _failed_young || _gc_state != GC_DONE ||
+           _mutator_wait_flag) {
+        pthread_cond_wait(&_mutator_wait_cond, &_mutator_wait_mutex);
+    }
+    pthread_mutex_unlock(&_mutator_wait_mutex);
     ts->state = TS_RUNNING;
-    log_info("[Mutator][Signal]Thread-%d is running", ts->id);
 }
 
-static void _gc_mark_array_obj(GcObject *obj, Queue *que)
+void _gc_card_mark(void *owner, void *slot)
 {
-    GcArrayObject *arr = (GcArrayObject *)obj;
-    if (arr->gc_kind == GC_KIND_ARRAY_OBJECT) {
-        GcObject *objs = (GcObject *)(arr + 1);
-        for (int i = 0; i < arr->gc_num_objs; i++) {
-            gc_mark_obj(objs + i, que);
-        }
-    } else if (arr->gc_kind == GC_KIND_ARRAY_VALUE) {
-        Value *values = (Value *)(arr + 1);
-        for (int i = 0; i < arr->gc_num_objs; i++) {
-            gc_mark_value(values + i, que);
-        }
+    GcObject *obj = owner;
+    /* not in the heap */
+    if (!obj->gc_size) return;
+
+    /* racy stores of the same value */
+    if (obj->gc_size > GC_MAX_SMALL_SIZE) {
+        GcBig *big = big_of(obj);
+        big->cards[((char *)slot - (char *)obj) / GC_CARD_SIZE] = 1;
+        big->dirty = 1;
+    } else {
+        GcPage *page = page_of(obj);
+        page->cards[((char *)slot - (char *)page) / GC_CARD_SIZE] = 1;
+        page->dirty = 1;
     }
 }
 
-static void *gc_pthread_func(void *arg)
+/* a snapshot buffer is full, swap it with an empty one */
+static GcSatbBuf *swap_satb(GcSatbBuf *buf)
 {
-    log_info("[Collector]running");
+    pthread_spin_lock(&_gc_spin_lock);
+    if (buf) {
+        buf->next = _gc_satb_full;
+        _gc_satb_full = buf;
+    }
+    buf = _gc_satb_free;
+    if (buf) _gc_satb_free = buf->next;
+    pthread_spin_unlock(&_gc_spin_lock);
 
-    QUEUE(que);
+    if (!buf) buf = mm_alloc_obj(buf);
+    buf->next = NULL;
+    buf->count = 0;
+    return buf;
+}
 
-/* simple fsm */
-main_loop:
-    if (_gc_thread_done) goto done;
-    gc_worker_wait();
-next:
-    if (_gc_thread_done) goto done;
+void _gc_satb_push(GcObject *obj)
+{
+    /* permanent, not marked */
+    if (obj->gc_age == -1) return;
+
+    GcTlab *tlab = &__ts->tlab;
+    GcSatbBuf *buf = tlab->satb;
+    if (!buf || buf->count == GC_SATB_SIZE) tlab->satb = buf = swap_satb(buf);
+    buf->objs[buf->count++] = obj;
+}
+
+/* mark the recorded objects, 0: nothing is recorded */
+static int drain_satb(GcMarkStack *stk)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    GcSatbBuf *buf = _gc_satb_full;
+    _gc_satb_full = NULL;
+    pthread_spin_unlock(&_gc_spin_lock);
+    if (!buf) return 0;
+
+    GcSatbBuf *last = buf;
+    for (GcSatbBuf *b = buf; b; b = b->next) {
+        for (int i = 0; i < b->count; i++) gc_mark_obj(b->objs[i], stk);
+        b->count = 0;
+        last = b;
+    }
+
+    pthread_spin_lock(&_gc_spin_lock);
+    last->next = _gc_satb_free;
+    _gc_satb_free = buf;
+    pthread_spin_unlock(&_gc_spin_lock);
+    return 1;
+}
+
+/* the buffers of the threads too, the world is stopped */
+static void drain_all_satb(GcMarkStack *stk)
+{
+    for (GcTlab *tlab = _gc_tlabs; tlab; tlab = tlab->next) {
+        GcSatbBuf *buf = tlab->satb;
+        if (!buf) continue;
+        tlab->satb = NULL;
+        buf->next = _gc_satb_full;
+        _gc_satb_full = buf;
+    }
+    drain_satb(stk);
+}
+
+void *gc_alloc_array(char kind, size_t len)
+{
+    static size_t sizes[] = {
+        0,
+        sizeof(int8_t),
+        sizeof(int64_t),
+        sizeof(double),
+        sizeof(Object *),
+        sizeof(Value),
+    };
+    ASSERT(kind >= GC_KIND_ARRAY_INT8 && kind <= GC_KIND_ARRAY_VALUE);
+    int size = sizeof(GcArrayObject) + len * sizes[kind];
+    GcArrayObject *obj = _gc_alloc(size, 0, kind);
+    obj->gc_num_objs = len;
+    return obj;
+}
+
+void _gc_safepoint(void)
+{
+    ThreadState *ts = __ts;
+    ASSERT(ts->state == TS_RUNNING);
+
+    /* waiting for resuming to run */
+    ts->state = TS_GC_STW;
+    log_info("[Mutator][Safepoint]Thread-%d is suspend", ts->id);
+
+    gc_worker_wakeup();
+    mutator_wait();
+
+    ts->state = TS_RUNNING;
+    log_info("[Mutator][Safepoint]Thread-%d is running", ts->id);
+}
+
+void gc_mark_stack_init(GcMarkStack *stk)
+{
+    stk->seg = mm_alloc_obj(stk->seg);
+    stk->spare = NULL;
+    stk->minor = 0;
+    stk->owner = NULL;
+}
+
+void gc_mark_stack_fini(GcMarkStack *stk)
+{
+    GcMarkSeg *seg = stk->seg;
+    while (seg) {
+        GcMarkSeg *prev = seg->prev;
+        mm_free(seg);
+        seg = prev;
+    }
+    seg = stk->spare;
+    while (seg) {
+        GcMarkSeg *prev = seg->prev;
+        mm_free(seg);
+        seg = prev;
+    }
+    stk->seg = NULL;
+    stk->spare = NULL;
+}
+
+/* the top segment is full */
+void _gc_mark_stack_push_seg(GcMarkStack *stk)
+{
+    GcMarkSeg *seg = stk->spare;
+    if (seg) {
+        stk->spare = seg->prev;
+    } else {
+        seg = mm_alloc_obj(seg);
+    }
+    seg->top = 0;
+    seg->prev = stk->seg;
+    stk->seg = seg;
+}
+
+/* the top segment is empty, 0: the stack is empty */
+int _gc_mark_stack_pop_seg(GcMarkStack *stk)
+{
+    GcMarkSeg *seg = stk->seg;
+    if (!seg->prev) return 0;
+    stk->seg = seg->prev;
+    seg->prev = stk->spare;
+    stk->spare = seg;
+    return 1;
+}
+
+static void _gc_mark_array_obj(GcObject *obj, GcMarkStack *stk)
+{
+    GcArrayObject *arr = (GcArrayObject *)obj;
+    if (arr->gc_kind == GC_KIND_ARRAY_OBJECT) {
+        GcObject **objs = (GcObject **)(arr + 1);
+        for (int i = 0; i < arr->gc_num_objs; i++) {
+            gc_mark_field(objs + i, stk);
+        }
+    } else if (arr->gc_kind == GC_KIND_ARRAY_VALUE) {
+        Value *values = (Value *)(arr + 1);
+        for (int i = 0; i < arr->gc_num_objs; i++) {
+            gc_mark_value(values + i, stk);
+        }
+    }
+}
+
+/* the marks of an unfinished cycle, the world is stopped */
+static void clear_marks(void)
+{
+    for (GcPage *page = _gc_pages; page; page = page->link) {
+        memset(page->mark, 0, sizeof(page->mark));
+    }
+    for (GcBig *big = _gc_bigs; big; big = big->next) big->mark = 0;
+    for (GcBig *big = _gc_larges; big; big = big->next) big->mark = 0;
+}
+
+/*
+ * The marked cells are the allocated ones, the others are the free cells, the
+ * marks are cleared for the next cycle. No object is touched. The page is not
+ * used by the mutators, return its live cells.
+ */
+static int sweep_page(GcPage *page)
+{
+    int live = 0;
+    for (int w = 0; w < GC_PAGE_WORDS; w++) {
+        uint64_t mark = page->mark[w];
+        live += __builtin_popcountll(mark);
+        page->alloc[w] = mark | tail_bits(page->ncells, w);
+        page->mark[w] = 0;
+    }
+    return live;
+}
+
+/* back to the heap, unmapped without live cells, with _gc_spin_lock */
+static void put_page(GcPage *page, int live)
+{
+    int nfree = page->ncells - live;
+    _gc_used_size -= (size_t)(nfree - page->nfree) * page->size;
+    _gc_stats.old_freed += (size_t)(nfree - page->nfree) * page->size;
+
+    if (!live) {
+        munmap(page, GC_PAGE_SIZE);
+        return;
+    }
+
+    page->nfree = nfree;
+    page->link = _gc_pages;
+    _gc_pages = page;
+    if (nfree) {
+        int c = size_class(page->size);
+        page->next = _gc_avail_pages[c];
+        _gc_avail_pages[c] = page;
+    }
+}
+
+/* the buffers are retired, the pages are detached for sweeping */
+static void detach_all(void)
+{
+    _gc_sweep_pages = _gc_pages;
+    _gc_pages = NULL;
+    memset(_gc_avail_pages, 0, sizeof(_gc_avail_pages));
+    _gc_sweep_bigs = _gc_bigs;
+    _gc_bigs = NULL;
+    _gc_sweep_larges = _gc_larges;
+    _gc_larges = NULL;
+}
+
+/* the world is stopped, or with the lock per page */
+static void sweep_pages(int locked)
+{
+    GcPage *page = _gc_sweep_pages;
+    _gc_sweep_pages = NULL;
+    while (page) {
+        GcPage *next = page->link;
+        int live = sweep_page(page);
+        if (locked) pthread_spin_lock(&_gc_spin_lock);
+        put_page(page, live);
+        if (locked) pthread_spin_unlock(&_gc_spin_lock);
+        page = next;
+    }
+}
+
+/* the live ones are put back to `list` */
+static void sweep_big_list(GcBig *big, GcBig **list, int locked)
+{
+    while (big) {
+        GcBig *next = big->next;
+        if (big->mark || big->perm) {
+            big->mark = 0;
+            if (locked) pthread_spin_lock(&_gc_spin_lock);
+            big->next = *list;
+            *list = big;
+            if (locked) pthread_spin_unlock(&_gc_spin_lock);
+        } else {
+            if (locked) pthread_spin_lock(&_gc_spin_lock);
+            _gc_used_size -= ((GcObject *)(big + 1))->gc_size;
+            _gc_stats.old_freed += ((GcObject *)(big + 1))->gc_size;
+            _gc_stats.large_size -= big->mapped;
+            if (locked) pthread_spin_unlock(&_gc_spin_lock);
+            free_big(big);
+        }
+        big = next;
+    }
+}
+
+static void sweep_bigs(int locked)
+{
+    GcBig *bigs = _gc_sweep_bigs;
+    GcBig *larges = _gc_sweep_larges;
+    _gc_sweep_bigs = NULL;
+    _gc_sweep_larges = NULL;
+    sweep_big_list(bigs, &_gc_bigs, locked);
+    sweep_big_list(larges, &_gc_larges, locked);
+}
+
+/* end of a cycle, wakeup gc_wait_cycle */
+static void finish_cycle(void)
+{
+    pthread_mutex_lock(&_mutator_wait_mutex);
+    ++_gc_cycles;
+    pthread_cond_broadcast(&_mutator_wait_cond);
+    pthread_mutex_unlock(&_mutator_wait_mutex);
+}
+
+/* Chase-Lev deque of a fixed size, 0: full */
+static int deque_push(GcDeque *dq, GcObject *obj)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    if (b - t >= GC_DEQUE_SIZE) return 0;
+    __atomic_store_n(&dq->objs[b % GC_DEQUE_SIZE], obj, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* by the owner */
+static GcObject *deque_pop(GcDeque *dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    GcObject *obj = NULL;
+    if (t <= b) {
+        obj = __atomic_load_n(&dq->objs[b % GC_DEQUE_SIZE], __ATOMIC_RELAXED);
+        if (t == b) {
+            /* the last one, race with the thieves */
+            if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED)) {
+                obj = NULL;
+            }
+            __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+/* by the thieves, NULL: empty or lost the race */
+static GcObject *deque_steal(GcDeque *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+
+    GcObject *obj = __atomic_load_n(&dq->objs[t % GC_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return obj;
+}
+
+static inline int deque_empty(GcDeque *dq)
+{
+    return __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+}
+
+static inline void scan_obj(GcObject *obj, GcMarkStack *stk)
+{
+    if (obj->gc_kind == GC_KIND_OBJECT) {
+        TypeObject *tp = OB_TYPE(obj);
+        if (tp->mark) tp->mark((Object *)obj, stk);
+    } else {
+        _gc_mark_array_obj(obj, stk);
+    }
+}
+
+/* share some private gray objects if the deque is drained */
+static inline void share_work(GcMarker *m)
+{
+    GcMarkSeg *seg = m->stk.seg;
+    if (seg->top < 2 || !deque_empty(&m->dq)) return;
+    int n = MIN(seg->top / 2, 32);
+    while (n-- > 0 && deque_push(&m->dq, seg->objs[seg->top - 1])) --seg->top;
+}
+
+static GcObject *steal_work(GcMarker *m)
+{
+    for (int i = 1; i < _gc_nmarkers; i++) {
+        GcMarker *victim = _gc_markers + (m->id + i) % _gc_nmarkers;
+        GcObject *obj = deque_steal(&victim->dq);
+        if (obj) return obj;
+    }
+    return NULL;
+}
+
+/*
+ * A marker is idle only with its stack and its deque empty, and only the owner
+ * fills a deque, so once all markers are idle, no gray object is left.
+ */
+static int offer_termination(void)
+{
+    __atomic_add_fetch(&_gc_idle_markers, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        if (__atomic_load_n(&_gc_idle_markers, __ATOMIC_SEQ_CST) == _gc_nmarkers) {
+            return 1;
+        }
+        for (int i = 0; i < _gc_nmarkers; i++) {
+            if (!deque_empty(&_gc_markers[i].dq)) {
+                __atomic_sub_fetch(&_gc_idle_markers, 1, __ATOMIC_SEQ_CST);
+                return 0;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/* add to the table hashed by the types, the type is dropped if it is full */
+static inline void add_type(GcTypeStats *types, void *type, size_t objs, size_t bytes)
+{
+    int i = ((uintptr_t)type >> 4) & (GC_MAX_TYPE_STATS - 1);
+    for (int n = 0; n < GC_MAX_TYPE_STATS; n++) {
+        GcTypeStats *ts = types + i;
+        if (ts->type == type || !ts->type) {
+            ts->type = type;
+            ts->objs += objs;
+            ts->bytes += bytes;
+            return;
+        }
+        i = (i + 1) & (GC_MAX_TYPE_STATS - 1);
+    }
+}
+
+static inline void count_type(GcMarker *m, GcObject *obj)
+{
+    void *type = (void *)(uintptr_t)obj->gc_kind;
+    if (obj->gc_kind == GC_KIND_OBJECT) type = OB_TYPE(obj);
+    add_type(m->types, type, 1, obj->gc_size);
+}
+
+static void mark_loop(GcMarker *m)
+{
+    GcMarkStack *stk = &m->stk;
+    GcObject *obj;
+
+    if (_gc_nmarkers == 1) {
+        while ((obj = gc_mark_stack_pop(stk))) {
+            count_type(m, obj);
+            scan_obj(obj, stk);
+        }
+        return;
+    }
+
+    do {
+        while ((obj = gc_mark_stack_pop(stk)) || (obj = deque_pop(&m->dq)) ||
+               (obj = steal_work(m))) {
+            count_type(m, obj);
+            scan_obj(obj, stk);
+            share_work(m);
+        }
+    } while (!offer_termination());
+}
+
+static void *gc_marker_func(void *arg)
+{
+    GcMarker *m = arg;
+    while (1) {
+        sem_wait(&_gc_mark_start_sema);
+        if (_gc_thread_done) break;
+        mark_loop(m);
+        sem_post(&_gc_mark_done_sema);
+    }
+    return NULL;
+}
+
+/* mark from the roots by all markers, the world is stopped */
+static void mark_all(GcMarkStack *roots)
+{
+    /* partition the roots */
+    GcObject *obj;
+    int i = 0;
+    while ((obj = gc_mark_stack_pop(roots))) {
+        gc_mark_stack_push(&_gc_markers[i++ % _gc_nmarkers].stk, obj);
+    }
+
+    _gc_idle_markers = 0;
+    for (i = 1; i < _gc_nmarkers; i++) sem_post(&_gc_mark_start_sema);
+    mark_loop(_gc_markers);
+    for (i = 1; i < _gc_nmarkers; i++) sem_wait(&_gc_mark_done_sema);
+}
+
+static int is_marked(GcObject *obj)
+{
+    if (obj->gc_size > GC_MAX_SMALL_SIZE) return big_of(obj)->mark;
+
+    GcPage *page = page_of(obj);
+    int i = ((char *)obj - page->cells) / page->size;
+    return (page->mark[i >> 6] >> (i & 63)) & 1;
+}
+
+/* the queued ones and the ones being run are roots */
+static void mark_finalizing(GcMarkStack *stk)
+{
+    pthread_mutex_lock(&_gc_fini_mutex);
+    Vector *lists[] = { &_gc_fini_queue, &_gc_fini_batch };
+    for (int k = 0; k < 2; k++) {
+        GcObject **slot;
+        vector_foreach(slot, lists[k]) gc_mark_obj(*slot, stk);
+    }
+    pthread_mutex_unlock(&_gc_fini_mutex);
+}
+
+/* the marking is done, the dead registered ones are queued, 0: none */
+static int queue_finalizers(GcMarkStack *stk)
+{
+    pthread_mutex_lock(&_gc_fini_mutex);
+    GcObject **objs = (GcObject **)_gc_finalizable.objs;
+    int n = 0;
+    for (int i = 0; i < vector_size(&_gc_finalizable); i++) {
+        GcObject *obj = objs[i];
+        if (is_marked(obj)) {
+            objs[n++] = obj;
+        } else {
+            vector_push_back(&_gc_fini_queue, &obj);
+            gc_mark_obj(obj, stk);
+        }
+    }
+    int queued = n < vector_size(&_gc_finalizable);
+    _gc_finalizable.size = n;
+    if (queued) pthread_cond_broadcast(&_gc_fini_cond);
+    pthread_mutex_unlock(&_gc_fini_mutex);
+
+    /* what they refer to */
+    if (queued) mark_all(stk);
+    return queued;
+}
+
+static void run_fini(GcObject *obj)
+{
+    TypeObject *tp = OB_TYPE(obj);
+    tp->fini((Object *)obj);
+}
+
+/* with _gc_fini_mutex, nothing is running, the number run */
+static int run_finalizers(void)
+{
+    Vector batch = _gc_fini_batch;
+    _gc_fini_batch = _gc_fini_queue;
+    _gc_fini_queue = batch;
+    _gc_fini_running = 1;
+    pthread_mutex_unlock(&_gc_fini_mutex);
+
+    GcObject **slot;
+    vector_foreach(slot, &_gc_fini_batch) run_fini(*slot);
+
+    pthread_mutex_lock(&_gc_fini_mutex);
+    int n = vector_size(&_gc_fini_batch);
+    vector_clear(&_gc_fini_batch);
+    _gc_fini_running = 0;
+    pthread_cond_broadcast(&_gc_fini_cond);
+    return n;
+}
+
+int gc_run_finalizers(void)
+{
+    int n = 0;
+    pthread_mutex_lock(&_gc_fini_mutex);
+    while (_gc_fini_running || !vector_empty(&_gc_fini_queue)) {
+        if (_gc_fini_running) {
+            pthread_cond_wait(&_gc_fini_cond, &_gc_fini_mutex);
+        } else {
+            n += run_finalizers();
+        }
+    }
+    pthread_mutex_unlock(&_gc_fini_mutex);
+    return n;
+}
+
+static void *gc_fini_func(void *arg)
+{
+#ifdef SCHED_IDLE
+    /* below the mutators */
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    pthread_mutex_lock(&_gc_fini_mutex);
+    while (1) {
+        if (!_gc_fini_running && !vector_empty(&_gc_fini_queue)) {
+            run_finalizers();
+        } else if (_gc_fini_done) {
+            break;
+        } else {
+            pthread_cond_wait(&_gc_fini_cond, &_gc_fini_mutex);
+        }
+    }
+    pthread_mutex_unlock(&_gc_fini_mutex);
+    return NULL;
+}
+
+/* by the parallel markers */
+void _gc_weak_slot(void *slot)
+{
+    pthread_spin_lock(&_gc_weak_lock);
+    vector_push_back(&_gc_weak_slots, &slot);
+    pthread_spin_unlock(&_gc_weak_lock);
+}
+
+void _gc_ephemeron_slot(void *slot)
+{
+    pthread_spin_lock(&_gc_weak_lock);
+    vector_push_back(&_gc_ephemeron_slots, &slot);
+    pthread_spin_unlock(&_gc_weak_lock);
+}
+
+/* the ones found by an unfinished marking */
+static void reset_weaks(void)
+{
+    vector_clear(&_gc_weak_slots);
+    vector_clear(&_gc_ephemeron_slots);
+}
+
+/* permanent, or not in the heap, or marked */
+static int is_live(GcObject *obj)
+{
+    if (obj->gc_age == -1 || !obj->gc_size) return 1;
+    return is_marked(obj);
+}
+
+static inline int is_live_value(Value *val)
+{
+    return !IS_OBJ(val) || is_live(to_obj(val));
+}
+
+/*
+ * The values of the live keys, until no more is marked. A table allocated
+ * during the marking is not scanned, it is read from its slot.
+ */
+static void mark_ephemerons(GcMarkStack *stk)
+{
+    int more;
+    do {
+        more = 0;
+        GcArrayObject ***slot;
+        vector_foreach(slot, &_gc_ephemeron_slots) {
+            GcArrayObject *table = **slot;
+            gc_set_mark((GcObject *)table);
+            Value *pairs = (Value *)(table + 1);
+            for (int j = 0; j < table->gc_num_objs; j += 2) {
+                Value *key = pairs + j;
+                if (IS_NONE(key) || IS_ERROR(key) || !is_live_value(key)) continue;
+                if (is_live_value(key + 1)) continue;
+                gc_mark_value(key + 1, stk);
+                more = 1;
+            }
+        }
+        if (more) mark_all(stk);
+    } while (more);
+}
+
+/* the world is stopped, no barrier */
+static void clear_weaks(void)
+{
+    GcObject ***slot;
+    vector_foreach(slot, &_gc_weak_slots) {
+        if (!is_live(**slot)) **slot = NULL;
+    }
+
+    GcArrayObject ***tslot;
+    vector_foreach(tslot, &_gc_ephemeron_slots) {
+        GcArrayObject *table = **tslot;
+        Value *pairs = (Value *)(table + 1);
+        for (int j = 0; j < table->gc_num_objs; j += 2) {
+            if (IS_NONE(pairs + j) || is_live_value(pairs + j)) continue;
+            pairs[j] = error_value;
+            pairs[j + 1] = none_value;
+        }
+    }
+    reset_weaks();
+}
+
+/*
+ * The marking is done. The weak references of the dead objects are cleared
+ * before their finis are queued, the ones found by marking the queued ones
+ * are cleared after.
+ */
+static void process_weaks(GcMarkStack *stk)
+{
+    mark_ephemerons(stk);
+    clear_weaks();
+    if (queue_finalizers(stk)) {
+        mark_ephemerons(stk);
+        clear_weaks();
+    }
+}
+
+void gc_pin(void *obj)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    vector_push_back(&_gc_pins, &obj);
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+void gc_unpin(void *obj)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    GcObject **objs = (GcObject **)_gc_pins.objs;
+    for (int i = vector_size(&_gc_pins) - 1; i >= 0; i--) {
+        if (objs[i] == obj) {
+            objs[i] = objs[--_gc_pins.size];
+            break;
+        }
+    }
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+/* the world is stopped, a minor gc does not move them */
+static void mark_pins(GcMarkStack *stk)
+{
+    GcObject **slot;
+    vector_foreach(slot, &_gc_pins) gc_mark_obj(*slot, stk);
+}
+
+/* pinned, or copied by this minor gc */
+static inline int is_kept(GcObject *obj)
+{
+    GcPage *page = page_of(obj);
+    int i = ((char *)obj - page->cells) / page->size;
+    return (page->mark[i >> 6] >> (i & 63)) & 1;
+}
+
+static void clear_young_marks(GcPage *page)
+{
+    for (; page; page = page->link) memset(page->mark, 0, sizeof(page->mark));
+}
+
+static inline int has_marks(GcPage *page)
+{
+    for (int w = 0; w < GC_PAGE_WORDS; w++) {
+        if (page->mark[w]) return 1;
+    }
+    return 0;
+}
+
+/* a young copy, NULL: the survivors are too many, promoted */
+static GcObject *survivor_alloc(int size)
+{
+    if (_gc_survived + size > (size_t)_gc_young_max * GC_PAGE_SIZE / 2) return NULL;
+
+    if (_gc_survivor_end - _gc_survivor_top < size) {
+        end_young(_gc_survivor_top, _gc_survivor_end);
+        GcPage *page = take_young_page();
+        page->link = _gc_survivors;
+        _gc_survivors = page;
+        _gc_survivor_top = page->cells;
+        _gc_survivor_end = page->cells + page->ncells * page->size;
+    }
+
+    GcObject *obj = (GcObject *)_gc_survivor_top;
+    _gc_survivor_top += size;
+    _gc_survived += size;
+    obj->gc_size = size;
+    return obj;
+}
+
+static GcObject *evacuate(GcObject *obj, GcMarkStack *stk)
+{
+    if (obj->gc_kind == GC_KIND_FORWARD) return ((GcForward *)obj)->to;
+    if (is_kept(obj)) return obj;
+
+    int age = obj->gc_age + 1;
+    GcObject *copy = NULL;
+    if (age < _gc_promote_age) copy = survivor_alloc(obj->gc_size);
+    if (!copy) {
+        int c = size_class(obj->gc_size);
+        copy = alloc_small(&_gc_promote_tlab, c);
+        if (copy) _gc_stats.promoted += obj->gc_size;
+        age = 0;
+    }
+    if (!copy) {
+        /* the heap is full, a full gc is requested */
+        _gc_pin(obj, stk);
+        return obj;
+    }
+
+    int size = copy->gc_size;
+    memcpy(copy, obj, obj->gc_size);
+    copy->gc_size = size;
+    copy->gc_age = age;
+    if (age) gc_set_mark(copy);
+
+    obj->gc_kind = GC_KIND_FORWARD;
+    ((GcForward *)obj)->to = copy;
+    gc_mark_stack_push(stk, copy);
+    return copy;
+}
+
+GcObject *_gc_forward(GcObject *obj, void *slot, GcMarkStack *stk)
+{
+    GcObject *copy = evacuate(obj, stk);
+    /* still an old to young reference, for the next minor gc */
+    GcObject *owner = stk->owner;
+    if (owner && gc_is_young(copy) && !gc_is_young(owner)) _gc_card_mark(owner, slot);
+    return copy;
+}
+
+void _gc_pin(GcObject *obj, GcMarkStack *stk)
+{
+    /* the shadow stacks are enumerated before the frames */
+    ASSERT(obj->gc_kind != GC_KIND_FORWARD);
+    if (gc_set_mark(obj)) {
+        _gc_pinned += obj->gc_size;
+        gc_mark_stack_push(stk, obj);
+    }
+}
+
+/* the slots of an old object in a dirty card */
+static void scan_range(GcObject *obj, char *start, char *end, GcMarkStack *stk)
+{
+    stk->owner = obj;
+    if (obj->gc_kind == GC_KIND_ARRAY_OBJECT || obj->gc_kind == GC_KIND_ARRAY_VALUE) {
+        GcArrayObject *arr = (GcArrayObject *)obj;
+        long elem =
+            obj->gc_kind == GC_KIND_ARRAY_OBJECT ? sizeof(GcObject *) : sizeof(Value);
+        char *base = (char *)(arr + 1);
+        long lo = start > base ? (start - base + elem - 1) / elem : 0;
+        long hi = MIN((end - base + elem - 1) / elem, arr->gc_num_objs);
+        for (long i = lo; i < hi; i++) {
+            if (elem == sizeof(Value)) {
+                gc_mark_value((Value *)base + i, stk);
+            } else {
+                gc_mark_field((GcObject **)base + i, stk);
+            }
+        }
+    } else if (obj->gc_kind == GC_KIND_OBJECT) {
+        scan_obj(obj, stk);
+    }
+}
+
+/* the allocated cells in a dirty card of a page */
+static void scan_card(GcPage *page, int card, GcMarkStack *stk)
+{
+    char *start = (char *)page + card * GC_CARD_SIZE;
+    char *end = start + GC_CARD_SIZE;
+    if (end <= page->cells) return;
+
+    int first = start > page->cells ? (start - page->cells) / page->size : 0;
+    int last = MIN((end - 1 - page->cells) / page->size, page->ncells - 1);
+    for (int i = first; i <= last; i++) {
+        if (!(page->alloc[i >> 6] & ((uint64_t)1 << (i & 63)))) continue;
+        scan_range((GcObject *)(page->cells + i * page->size), start, end, stk);
+    }
+}
+
+/* the objects of an arena page are contiguous, the free space is zero */
+static void scan_perm_card(GcPage *page, int card, GcMarkStack *stk)
+{
+    char *start = (char *)page + card * GC_CARD_SIZE;
+    char *end = start + GC_CARD_SIZE;
+    char *limit = (char *)page + GC_PAGE_SIZE;
+
+    char *p = page->cells;
+    while (p < end && p < limit) {
+        GcObject *obj = (GcObject *)p;
+        if (!obj->gc_size) break;
+        if (p + obj->gc_size > start) scan_range(obj, start, end, stk);
+        p += obj->gc_size;
+    }
+}
+
+/* the remembered set, the cards are dirty again if still needed */
+static void scan_cards(GcMarkStack *stk)
+{
+    GcPage *lists[] = { _gc_pages, _gc_arenas[0].pages, _gc_arenas[1].pages };
+    for (int k = 0; k < 3; k++) {
+        for (GcPage *page = lists[k]; page; page = page->link) {
+            /* a sealed page is never dirty, see gc_seal_perm */
+            if (!page->dirty) continue;
+            page->dirty = 0;
+            for (int c = 0; c < GC_PAGE_CARDS; c++) {
+                if (!page->cards[c]) continue;
+                page->cards[c] = 0;
+                if (k) {
+                    scan_perm_card(page, c, stk);
+                } else {
+                    scan_card(page, c, stk);
+                }
+            }
+        }
+    }
+
+    GcBig *bigs[] = { _gc_bigs, _gc_larges };
+    for (int k = 0; k < 2; k++) {
+        for (GcBig *big = bigs[k]; big; big = big->next) {
+            /* no card table, never dirty */
+            if (!big->dirty) continue;
+            big->dirty = 0;
+            GcObject *obj = (GcObject *)(big + 1);
+            int ncards = (obj->gc_size + GC_CARD_SIZE - 1) / GC_CARD_SIZE;
+            for (int c = 0; c < ncards; c++) {
+                if (!big->cards[c]) continue;
+                big->cards[c] = 0;
+                char *start = (char *)obj + c * GC_CARD_SIZE;
+                scan_range(obj, start, start + GC_CARD_SIZE, stk);
+            }
+        }
+    }
+    stk->owner = NULL;
+}
+
+/* the young bytes collected by a minor gc are promoted, kept or freed */
+static void young_stats(size_t promoted)
+{
+    GcStats *st = &_gc_stats;
+    size_t collected = st->young_allocated - _gc_young_base + _gc_young_live;
+    size_t live = _gc_survived + _gc_pinned;
+    if (collected > promoted + live) st->young_freed += collected - promoted - live;
+    st->promotion_rate = collected ? (double)promoted / collected : 0;
+    _gc_young_base = st->young_allocated;
+    _gc_young_live = live;
+}
+
+/*
+ * Copy the live young objects reachable from the roots and the dirty cards,
+ * the world is stopped. The emptied pages are reused, the pages of the
+ * pinned objects are kept.
+ */
+static void collect_young(int promote_all)
+{
+    GcMarkStack *stk = &_gc_root_stack;
+
+    for (GcTlab *tlab = _gc_tlabs; tlab; tlab = tlab->next) {
+        _gc_stats.young_allocated += young_bumped(tlab);
+        end_young(tlab->young_top, tlab->young_end);
+        tlab->young_top = NULL;
+        tlab->young_end = NULL;
+    }
+    /* the reserved cells are not scanned */
+    retire_all_tlabs();
+
+    GcPage *from = _gc_nursery;
+    _gc_nursery = NULL;
+    _gc_young_pages = 0;
+    clear_young_marks(from);
+    ++_gc_moves;
+
+    _gc_promote_age = promote_all ? 1 : GC_PROMOTE_AGE;
+    _gc_survived = 0;
+    _gc_pinned = 0;
+    size_t promoted = _gc_stats.promoted;
+    stk->minor = 1;
+    enum_all_roots(stk);
+    mark_pins(stk);
+    scan_cards(stk);
+    GcObject *obj;
+    while ((obj = gc_mark_stack_pop(stk))) {
+        stk->owner = obj;
+        scan_obj(obj, stk);
+    }
+    stk->owner = NULL;
+    stk->minor = 0;
+
+    while (_gc_survivors) {
+        GcPage *page = _gc_survivors;
+        _gc_survivors = page->link;
+        page->link = _gc_nursery;
+        _gc_nursery = page;
+        ++_gc_young_pages;
+    }
+    end_young(_gc_survivor_top, _gc_survivor_end);
+    _gc_survivor_top = NULL;
+    _gc_survivor_end = NULL;
+    young_stats(_gc_stats.promoted - promoted);
+
+    while (from) {
+        GcPage *page = from;
+        from = page->link;
+        if (has_marks(page)) {
+            page->link = _gc_nursery;
+            _gc_nursery = page;
+            ++_gc_young_pages;
+        } else if (_gc_young_nfree < _gc_young_max) {
+            page->link = _gc_young_free;
+            _gc_young_free = page;
+            ++_gc_young_nfree;
+        } else {
+            munmap(page, GC_PAGE_SIZE);
+        }
+    }
+
+    retire_all_tlabs();
+}
+
+/* not moved by the compaction, the old pages are swept, their marks are free */
+static inline void pin_cell(GcObject *obj)
+{
+    /* young, permanent, big or not in the heap */
+    if (obj->gc_age || !obj->gc_size || obj->gc_size > GC_MAX_SMALL_SIZE) return;
+    gc_set_mark(obj);
+}
+
+/* the objects in a page of an arena are contiguous */
+static void scan_arena(GcArena *arena, GcMarkStack *stk)
+{
+    for (GcPage *page = arena->pages; page; page = page->link) {
+        char *p = page->cells;
+        char *end = (char *)page + GC_PAGE_SIZE;
+        while (p < end) {
+            GcObject *obj = (GcObject *)p;
+            if (!obj->gc_size) break;
+            scan_range(obj, p, p + obj->gc_size, stk);
+            p += obj->gc_size;
+        }
+    }
+    stk->owner = NULL;
+}
+
+/* never marked, what the permanent objects refer to is marked as a root */
+static void mark_perm(GcMarkStack *stk)
+{
+    for (int i = 0; i < 2; i++) scan_arena(_gc_arenas + i, stk);
+    GcBig *bigs[] = { _gc_bigs, _gc_larges };
+    for (int k = 0; k < 2; k++) {
+        for (GcBig *big = bigs[k]; big; big = big->next) {
+            if (!big->perm) continue;
+            GcObject *obj = (GcObject *)(big + 1);
+            scan_range(obj, (char *)obj, (char *)obj + obj->gc_size, stk);
+        }
+    }
+    stk->owner = NULL;
+}
+
+static void pin_cells(GcMarkStack *stk)
+{
+    GcObject *obj;
+    enum_pinned_roots(stk);
+    while ((obj = gc_mark_stack_pop(stk))) pin_cell(obj);
+
+    GcObject **slot;
+    vector_foreach(slot, &_gc_pins) pin_cell(*slot);
+
+    /* some of them are run by the finalizer thread */
+    pthread_mutex_lock(&_gc_fini_mutex);
+    Vector *lists[] = { &_gc_finalizable, &_gc_fini_queue, &_gc_fini_batch };
+    for (int k = 0; k < 3; k++) {
+        vector_foreach(slot, lists[k]) pin_cell(*slot);
+    }
+    pthread_mutex_unlock(&_gc_fini_mutex);
+
+    /* the read-only arena is not updated, what it refers to is marked */
+    scan_arena(_gc_arenas + GC_PERM_RO - 1, stk);
+    while (gc_mark_stack_pop(stk));
+    for (GcBig *big = _gc_bigs; big; big = big->next) big->mark = 0;
+    for (GcBig *big = _gc_larges; big; big = big->next) big->mark = 0;
+    reset_weaks();
+}
+
+/* the live cells not pinned are copied, the bytes moved */
+static size_t evacuate_pages(GcPage *page)
+{
+    size_t moved = 0;
+    for (; page; page = page->link) {
+        int c = size_class(page->size);
+        for (int i = 0; i < page->ncells; i++) {
+            uint64_t bit = (uint64_t)1 << (i & 63);
+            if (!(page->alloc[i >> 6] & bit) || (page->mark[i >> 6] & bit)) continue;
+            /* the heap is full, the others are kept */
+            GcObject *copy = alloc_small(&_gc_promote_tlab, c);
+            if (!copy) return moved;
+
+            GcObject *obj = (GcObject *)(page->cells + i * page->size);
+            memcpy(copy, obj, page->size);
+            obj->gc_kind = GC_KIND_FORWARD;
+            obj->gc_age = 1;
+            ((GcForward *)obj)->to = copy;
+            moved += page->size;
+        }
+    }
+    return moved;
+}
+
+/* the slots of the live cells, the stubs are skipped */
+static void fixup_pages(GcPage *page, GcMarkStack *stk)
+{
+    for (; page; page = page->link) {
+        for (int i = 0; i < page->ncells; i++) {
+            if (!(page->alloc[i >> 6] & ((uint64_t)1 << (i & 63)))) continue;
+            GcObject *obj = (GcObject *)(page->cells + i * page->size);
+            if (obj->gc_kind == GC_KIND_FORWARD) continue;
+            scan_range(obj, (char *)obj, (char *)obj + obj->gc_size, stk);
+        }
+    }
+    stk->owner = NULL;
+}
+
+/*
+ * The young ones pinned by the full gc, marked by it. The objects are bumped
+ * at pointer alignment, not at the cells of the mark bits, so they are walked.
+ */
+static void fixup_nursery(GcMarkStack *stk)
+{
+    for (GcPage *page = _gc_nursery; page; page = page->link) {
+        char *p = page->cells;
+        char *end = page->cells + page->ncells * page->size;
+        while (p < end) {
+            GcObject *obj = (GcObject *)p;
+            if (!obj->gc_size) break;
+            if (is_kept(obj)) scan_range(obj, p, p + obj->gc_size, stk);
+            p += obj->gc_size;
+        }
+    }
+    stk->owner = NULL;
+}
+
+static void fixup_bigs(GcBig *big, GcMarkStack *stk)
+{
+    for (; big; big = big->next) {
+        GcObject *obj = (GcObject *)(big + 1);
+        scan_range(obj, (char *)obj, (char *)obj + obj->gc_size, stk);
+    }
+    stk->owner = NULL;
+}
+
+/* the stubs are freed, an emptied page is unmapped */
+static void release_pages(GcPage *page)
+{
+    while (page) {
+        GcPage *next = page->link;
+        int live = 0;
+        for (int i = 0; i < page->ncells; i++) {
+            uint64_t bit = (uint64_t)1 << (i & 63);
+            if (!(page->alloc[i >> 6] & bit)) continue;
+            GcObject *obj = (GcObject *)(page->cells + i * page->size);
+            if (obj->gc_kind == GC_KIND_FORWARD) {
+                page->alloc[i >> 6] &= ~bit;
+            } else {
+                ++live;
+            }
+        }
+        int nfree = page->ncells - live;
+        _gc_used_size -= (size_t)(nfree - page->nfree) * page->size;
+        page->nfree = nfree;
+        put_page(page, live);
+        page = next;
+    }
+}
+
+/* after the sweep of a full gc, the world is stopped */
+static void compact(GcMarkStack *stk)
+{
+    pin_cells(stk);
+
+    /* the sparse pages are taken out, the others are filled */
+    GcPage *sparse = NULL;
+    GcPage *page = _gc_pages;
+    _gc_pages = NULL;
+    memset(_gc_avail_pages, 0, sizeof(_gc_avail_pages));
+    while (page) {
+        GcPage *next = page->link;
+        if (page->ncells - page->nfree <= page->ncells * GC_SPARSE_RATIO) {
+            page->link = sparse;
+            sparse = page;
+        } else {
+            page->link = _gc_pages;
+            _gc_pages = page;
+            if (page->nfree) {
+                int c = size_class(page->size);
+                page->next = _gc_avail_pages[c];
+                _gc_avail_pages[c] = page;
+            }
+        }
+        page = next;
+    }
+
+    size_t moved = evacuate_pages(sparse);
+    ++_gc_moves;
+    /* the cells of its buffer are not scanned */
+    pthread_spin_lock(&_gc_spin_lock);
+    retire_tlab(&_gc_promote_tlab);
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    /* the references to the stubs */
+    stk->minor = 1;
+    enum_all_roots(stk);
+    fixup_pages(_gc_pages, stk);
+    fixup_pages(sparse, stk);
+    fixup_nursery(stk);
+    fixup_bigs(_gc_bigs, stk);
+    fixup_bigs(_gc_larges, stk);
+    scan_arena(_gc_arenas + GC_PERM_RW - 1, stk);
+    ASSERT(!gc_mark_stack_pop(stk));
+    stk->minor = 0;
+
+    release_pages(sparse);
+    for (page = _gc_pages; page; page = page->link) {
+        memset(page->mark, 0, sizeof(page->mark));
+    }
+
+    _gc_stats.compacted += moved;
+    _gc_compact_pending = 0;
+    _gc_compact_cycle = _gc_cycles + GC_COMPACT_INTERVAL;
+    /* by the copies, the heap is not full */
+    clear_failed();
+    log_info("compacted: %zu bytes, used: %ld(%ld)", moved, _gc_used_size, _gc_heap_size);
+}
+
+/* after a sweep, with _gc_spin_lock or the world stopped */
+static void measure_fragmentation(void)
+{
+    size_t total = 0;
+    size_t free = 0;
+    for (GcPage *page = _gc_pages; page; page = page->link) {
+        total += (size_t)page->ncells * page->size;
+        free += (size_t)page->nfree * page->size;
+    }
+
+    double ratio = total ? (double)free / total : 0;
+    _gc_stats.fragmentation = ratio;
+    if (_gc_compact && ratio >= GC_COMPACT_RATIO && free >= GC_COMPACT_MIN &&
+        _gc_cycles >= _gc_compact_cycle) {
+        _gc_compact_pending = 1;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The allocation rate and the time of the concurrent cycle, which is finished,
+ * or failed by a full heap, it would take longer.
+ */
+static void sample_cycle(int finished)
+{
+    if (!_gc_cycle_start) return;
+
+    double ms = (now_ns() - _gc_cycle_start) / 1e6;
+    if (ms > 0) {
+        double rate = (_gc_allocated - _gc_cycle_allocated) / ms;
+        if (!finished) ms *= 2;
+        _gc_alloc_rate = _gc_alloc_rate ? (_gc_alloc_rate + rate) / 2 : rate;
+        _gc_cycle_ms = _gc_cycle_ms ? (_gc_cycle_ms + ms) / 2 : ms;
+    }
+    _gc_cycle_start = 0;
+}
+
+/* resize the heap by the live objects, and set the trigger of the next cycle */
+static void pace_heap(void)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+
+    size_t live = _gc_used_size;
+    _gc_stats.live_size = live;
+    size_t heap = MAX(live * GC_HEAP_GROWTH, _gc_init_size);
+    heap = MIN(heap, _gc_max_size);
+    _gc_heap_size = heap;
+
+    size_t trigger = heap * GC_TRIGGER_RATIO;
+    if (_gc_cycle_ms && heap > live) {
+        /* the old objects allocated during a cycle, and a half more */
+        size_t headroom = _gc_alloc_rate * _gc_cycle_ms * 1.5;
+        trigger = heap > headroom ? heap - headroom : 0;
+        trigger = MAX(trigger, live + (heap - live) / 4);
+        trigger = MIN(trigger, (size_t)(heap * GC_TRIGGER_MAX));
+    }
+    _gc_minor_size = trigger;
+
+    pthread_spin_unlock(&_gc_spin_lock);
+
+    log_info("[Collector]live: %ld, heap: %ld, trigger: %ld, rate: %.0f B/ms, "
+             "cycle: %.2f ms",
+             live, heap, trigger, _gc_alloc_rate, _gc_cycle_ms);
+}
+
+/* size the nursery by the pause of a minor gc, the world is stopped */
+static void pace_young(uint64_t pause)
+{
+    uint64_t target = (uint64_t)_gc_pause_ms * 1000000;
+    if (pause > target) {
+        _gc_young_max = MAX(_gc_young_max * 3 / 4, GC_MIN_YOUNG_PAGES);
+    } else if (pause < target / 2) {
+        _gc_young_max = MIN(_gc_young_max + _gc_young_max / 4 + 1, _gc_young_limit);
+    }
+}
+
+/* the markers count the objects of a major cycle from scratch */
+static void reset_type_stats(void)
+{
+    for (int i = 0; i < _gc_nmarkers; i++) {
+        memset(_gc_markers[i].types, 0, sizeof(_gc_markers[i].types));
+    }
+}
+
+static int cmp_type_bytes(const void *a, const void *b)
+{
+    size_t x = ((GcTypeStats *)a)->bytes;
+    size_t y = ((GcTypeStats *)b)->bytes;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* the survivors of the major cycle, by all markers */
+static void type_stats(void)
+{
+    static GcTypeStats types[GC_MAX_TYPE_STATS];
+    memset(types, 0, sizeof(types));
+    for (int i = 0; i < _gc_nmarkers; i++) {
+        GcTypeStats *ts = _gc_markers[i].types;
+        for (int j = 0; j < GC_MAX_TYPE_STATS; j++) {
+            if (ts[j].type) add_type(types, ts[j].type, ts[j].objs, ts[j].bytes);
+        }
+    }
+
+    int n = 0;
+    for (int i = 0; i < GC_MAX_TYPE_STATS; i++) {
+        if (types[i].type) types[n++] = types[i];
+    }
+    qsort(types, n, sizeof(types[0]), cmp_type_bytes);
+
+    pthread_spin_lock(&_gc_spin_lock);
+    memcpy(_gc_stats.types, types, n * sizeof(types[0]));
+    _gc_stats.ntypes = n;
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+static void phase_stats(GcState phase, uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    pthread_spin_lock(&_gc_spin_lock);
+    GcPhaseStats *ps = _gc_stats.phases + phase;
+    ++ps->count;
+    ps->total_ns += ns;
+    if (ns > ps->max_ns) ps->max_ns = ns;
+    ++ps->hist[MIN(b, GC_HIST_BUCKETS - 1)];
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+/* at most once an interval */
+static void dump_stats_due(void)
+{
+    uint64_t now = now_ns();
+    if (now - _gc_stats_last < _gc_stats_interval) return;
+    _gc_stats_last = now;
+
+    static GcStats stats;
+    gc_get_stats(&stats);
+    gc_dump_stats(&stats, _gc_stats_fp);
+    fflush(_gc_stats_fp);
+}
+
+/* wakeup by the mutators, and by the interval of the statistics */
+static void gc_idle_wait(void)
+{
+    if (!_gc_stats_fp) {
+        gc_worker_wait();
+        return;
+    }
+
+    while (1) {
+        dump_stats_due();
+        uint64_t left = _gc_stats_last + _gc_stats_interval - now_ns();
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = ts.tv_nsec + MIN(left, _gc_stats_interval);
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        if (!sem_timedwait(&_gc_worker_sema, &ts)) return;
+    }
+}
+
+static void *gc_pthread_func(void *arg)
+{
+    log_info("[Collector]running");
+
+    GcMarkStack *stk = &_gc_root_stack;
+    uint64_t start;
+
+/* simple fsm */
+main_loop:
+    if (_gc_thread_done) goto done;
+    gc_idle_wait();
+next:
+    if (_gc_thread_done) goto done;
     switch (_gc_state) {
         case GC_DONE: {
             if (_failed_major) {
-                clear_failed();
                 _switch(GC_FULL);
+                clear_failed();
+                goto next;
+            } else if (_failed_young) {
+                _switch(GC_YOUNG);
                 goto next;
             } else if (_failed_minor) {
+                /* the fragmented pages are compacted by a full gc */
+                _switch(_gc_compact_pending ? GC_FULL : GC_MARK_ROOTS);
                 clear_failed();
-                _switch(GC_MARK_ROOTS);
                 goto next;
             } else {
                 goto main_loop;
             }
         }
         case GC_MARK_ROOTS: {
+            start = now_ns();
+            _gc_cycle_start = start;
+            _gc_cycle_allocated = _gc_allocated;
             enable_stw();
             clear_failed();
             while (!check_all_threads_stw());
-            enum_all_roots(&que);
+            /* the snapshot, the marks are cleared by the last sweep */
+            clear_young_marks(_gc_nursery);
+            reset_type_stats();
+            reset_weaks();
+            gc_marking = 1;
+            enum_all_roots(stk);
+            mark_pins(stk);
+            mark_perm(stk);
+            mark_finalizing(stk);
+            phase_stats(GC_MARK_ROOTS, start);
             _switch(GC_CO_MARK);
             goto next;
         }
         case GC_CO_MARK: {
+            start = now_ns();
             disable_stw_wakeup_threads();
+            /* mark with the mutators running, and the recorded objects */
+            do {
+                mark_all(stk);
+                if (_failed_major) break;
+            } while (drain_satb(stk));
+
+            phase_stats(GC_CO_MARK, start);
             /* ignore minor failed */
             if (_failed_major) {
                 _switch(GC_FULL);
@@ -348,108 +2402,100 @@ next:
             goto next;
         }
         case GC_REMARK: {
+            start = now_ns();
             enable_stw();
             clear_failed();
             while (!check_all_threads_stw());
+            /* only the snapshot buffers and the stacks */
+            drain_all_satb(stk);
+            enum_all_roots(stk);
+            mark_pins(stk);
+            mark_all(stk);
+            process_weaks(stk);
+            gc_marking = 0;
+            retire_all_tlabs();
+            detach_all();
+            phase_stats(GC_REMARK, start);
             _switch(GC_CO_SWEEP);
             goto next;
         }
         case GC_CO_SWEEP: {
+            start = now_ns();
             disable_stw_wakeup_threads();
-
-            /* ignore minor failed */
-            if (_failed_major) {
-                clear_failed();
-                _switch(GC_FULL);
-                goto next;
-            }
-
-            LLDqNode *node = lldq_pop_head(_gc_list);
-            while (node) {
-                GcObject *obj = (GcObject *)node;
-                if (obj->gc_color == GC_COLOR_WHITE) {
-                    free_obj(obj);
-                } else if (obj->gc_color == GC_COLOR_BLACK) {
-                    _gc_mark(obj, GC_COLOR_WHITE);
-                    gc_incr_age(obj);
-                } else {
-                    ASSERT(0);
-                }
-
-                if (_failed_major) {
-                    clear_failed();
-                    _switch(GC_FULL);
-                    goto next;
-                }
-
-                node = lldq_pop_head(_gc_list);
-            }
-
-            node = lldq_pop_head(&_gc_remark_list);
-            while (node) {
-                GcObject *obj = (GcObject *)node;
-                ASSERT(obj->gc_color == GC_COLOR_BLACK);
-                _gc_mark(obj, GC_COLOR_WHITE);
-                gc_incr_age(obj);
-                lldq_push_tail(_gc_list, node);
-
-                if (_failed_major) {
-                    clear_failed();
-                    _switch(GC_FULL);
-                    goto next;
-                }
-
-                node = lldq_pop_head(&_gc_remark_list);
-            }
-
+            /* the detached pages are not used by the mutators */
+            sweep_pages(1);
+            sweep_bigs(1);
+            pthread_spin_lock(&_gc_spin_lock);
+            measure_fragmentation();
+            pthread_spin_unlock(&_gc_spin_lock);
+            sample_cycle(1);
+            pace_heap();
+            type_stats();
+            phase_stats(GC_CO_SWEEP, start);
             _switch(GC_DONE);
+            finish_cycle();
             goto next;
         }
         case GC_FULL: {
+            start = now_ns();
+            sample_cycle(0);
             enable_stw();
             clear_failed();
             while (!check_all_threads_stw());
             log_info("all mutators are stoped");
-            enum_all_roots(&que);
-            while (!queue_empty(&que)) {
-                GcObject *obj = queue_pop(&que);
-                _gc_mark(obj, GC_COLOR_BLACK);
-                if (obj->gc_kind == GC_KIND_OBJECT) {
-                    TypeObject *tp = OB_TYPE(obj);
-                    ASSERT(tp->mark);
-                    tp->mark((Object *)obj, &que);
-                } else {
-                    _gc_mark_array_obj(obj, &que);
-                }
-            }
-
-            LLDqNode *node = lldq_pop_head(_gc_list);
-            while (node) {
-                GcObject *obj = (GcObject *)node;
-                if (obj->gc_color == GC_COLOR_WHITE) {
-                    free_obj(obj);
-                } else if (obj->gc_color == GC_COLOR_BLACK) {
-                    _gc_mark(obj, GC_COLOR_WHITE);
-                    gc_incr_age(obj);
-                    if (obj->gc_age < 10) {
-                        lldq_push_tail(_gc_list_2, obj);
-                    } else {
-                        lldq_push_tail(_gc_old_list, obj);
-                    }
-                } else {
-                    ASSERT(0);
-                }
-                node = lldq_pop_head(_gc_list);
+            /* an unfinished concurrent marking */
+            gc_marking = 0;
+            drain_all_satb(stk);
+            while (gc_mark_stack_pop(stk));
+            for (int i = 0; i < _gc_nmarkers; i++) {
+                while (gc_mark_stack_pop(&_gc_markers[i].stk));
             }
+            /* the cells of the buffers are swept */
+            retire_all_tlabs();
+            /* the young objects are promoted, except the pinned ones */
+            collect_young(1);
+            _failed_young = 0;
+            clear_young_marks(_gc_nursery);
+            clear_marks();
+            reset_type_stats();
+            reset_weaks();
+            enum_all_roots(stk);
+            mark_pins(stk);
+            mark_perm(stk);
+            mark_finalizing(stk);
+            mark_all(stk);
+            process_weaks(stk);
+            /* the promotion failures are handled by this gc */
+            clear_failed();
 
-            LLDeque *swap = _gc_list;
-            _gc_list = _gc_list_2;
-            _gc_list_2 = swap;
+            detach_all();
+            sweep_pages(0);
+            sweep_bigs(0);
+            if (_gc_compact_pending) compact(stk);
+            measure_fragmentation();
 
-            log_info("used: %ld(%ld)", _gc_used_size, _gc_max_size);
-            ASSERT(lldq_empty(&_gc_remark_list));
+            pace_heap();
+            type_stats();
             _full_gc = 1;
 
+            phase_stats(GC_FULL, start);
+            _switch(GC_DONE);
+            finish_cycle();
+            disable_stw_wakeup_threads();
+            goto next;
+        }
+        case GC_YOUNG: {
+            start = now_ns();
+            enable_stw();
+            _failed_young = 0;
+            while (!check_all_threads_stw());
+            collect_young(0);
+            /* the promoted ones, mark concurrently before the heap is full */
+            if (_gc_used_size > _gc_minor_size) _failed_minor = 1;
+            pace_young(now_ns() - start);
+            phase_stats(GC_YOUNG, start);
+            log_info("young: %d(%d) pages, used: %ld(%ld)", _gc_young_pages,
+                     _gc_young_max, _gc_used_size, _gc_heap_size);
             _switch(GC_DONE);
             disable_stw_wakeup_threads();
             goto next;
@@ -467,60 +2513,447 @@ done:
     return NULL;
 }
 
-void init_gc_system(size_t max_mem_size, double factor)
+/* bytes of a number with an optional k, m or g suffix, 0: bad */
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 10);
+    if (end == s) return 0;
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+        default: break;
+    }
+    return *end ? 0 : n;
+}
+
+/* set the option `name` to `val`, -1: unknown or bad */
+static int set_option(GcOptions *opts, const char *name, const char *val)
 {
-    _pagesize = sysconf(_SC_PAGE_SIZE);
-    char *addr = mmap(NULL, _pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (!addr) {
-        perror("mmap");
-        exit(-1);
+    if (!strcmp(name, "init-heap") || !strcmp(name, "max-heap")) {
+        size_t n = parse_size(val);
+        if (!n) return -1;
+        if (name[0] == 'i') {
+            opts->init_size = n;
+        } else {
+            opts->max_size = n;
+        }
+        return 0;
+    }
+
+    if (!strcmp(name, "pause") || !strcmp(name, "stats-interval")) {
+        char *end;
+        long ms = strtol(val, &end, 10);
+        if (end == val || *end || ms <= 0) return -1;
+        if (name[0] == 'p') {
+            opts->pause_ms = ms;
+        } else {
+            opts->stats_ms = ms;
+        }
+        return 0;
+    }
+
+    if (!strcmp(name, "stats")) {
+        if (!*val) return -1;
+        opts->stats_file = val;
+        return 0;
+    }
+
+    if (!strcmp(name, "protect-perm") || !strcmp(name, "compact")) {
+        if (strcmp(val, "0") && strcmp(val, "1")) return -1;
+        if (name[0] == 'p') {
+            opts->protect_perm = val[0] == '1';
+        } else {
+            opts->compact = val[0] == '1';
+        }
+        return 0;
     }
-    _gc_check_ptr = addr;
 
-    /* prepare segment fault handler */
-    struct sigaction sa = { 0 };
+    return -1;
+}
 
-    sa.sa_flags = SA_SIGINFO;
-    if (sigemptyset(&sa.sa_mask)) {
-        perror("sigemptyset");
-        exit(-1);
+void gc_init_options(GcOptions *opts, size_t max_size)
+{
+    /* the initial size is the smaller one of the default and the max */
+    opts->init_size = 0;
+    opts->max_size = max_size;
+    opts->pause_ms = GC_PAUSE_MS;
+    opts->stats_file = NULL;
+    opts->stats_ms = GC_STATS_MS;
+    opts->protect_perm = 0;
+    opts->compact = 1;
+
+    static const char *envs[][2] = {
+        { "KOALA_GC_INIT_HEAP", "init-heap" },
+        { "KOALA_GC_MAX_HEAP", "max-heap" },
+        { "KOALA_GC_PAUSE", "pause" },
+        { "KOALA_GC_STATS", "stats" },
+        { "KOALA_GC_STATS_INTERVAL", "stats-interval" },
+        { "KOALA_GC_PROTECT_PERM", "protect-perm" },
+        { "KOALA_GC_COMPACT", "compact" },
+    };
+    for (int i = 0; i < COUNT_OF(envs); i++) {
+        char *s = getenv(envs[i][0]);
+        if (s && set_option(opts, envs[i][1], s)) {
+            log_warn("invalid %s: '%s'", envs[i][0], s);
+        }
     }
+}
+
+int gc_parse_option(GcOptions *opts, const char *arg)
+{
+    if (strncmp(arg, "--gc-", 5)) return -1;
+    const char *val = strchr(arg, '=');
+    if (!val) return -1;
+
+    char name[16];
+    int len = val - (arg + 5);
+    if (len >= (int)sizeof(name)) return -1;
+    memcpy(name, arg + 5, len);
+    name[len] = '\0';
+    return set_option(opts, name, val + 1);
+}
+
+size_t gc_heap_size(void) { return _gc_heap_size; }
+size_t gc_moves(void) { return _gc_moves; }
 
-    sa.sa_sigaction = gc_segment_fault_handler;
+void gc_get_stats(GcStats *stats)
+{
+    pthread_spin_lock(&_gc_spin_lock);
+    *stats = _gc_stats;
+    stats->alloc_rate = _gc_alloc_rate;
+    stats->heap_size = _gc_heap_size;
+    stats->used_size = _gc_used_size;
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+const char *gc_phase_name(int phase)
+{
+    static const char *names[] = {
+        "done", "mark_roots", "co_mark", "remark", "co_sweep", "full", "young",
+    };
+    ASSERT(phase >= 0 && phase < COUNT_OF(names));
+    return names[phase];
+}
+
+const char *gc_type_name(GcTypeStats *ts)
+{
+    static const char *kinds[] = {
+        NULL,           "array[int8]",   "array[int64]",
+        "array[float]", "array[object]", "array[value]",
+    };
+    uintptr_t kind = (uintptr_t)ts->type;
+    if (kind < COUNT_OF(kinds)) return kinds[kind];
+    return ((TypeObject *)ts->type)->name;
+}
+
+void gc_dump_stats(GcStats *stats, FILE *fp)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(fp, "{\"time\": %ld, ", now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    fprintf(fp, "\"heap\": %zu, \"used\": %zu, \"live\": %zu, \"large\": %zu, ",
+            stats->heap_size, stats->used_size, stats->live_size, stats->large_size);
+    fprintf(fp, "\"young_allocated\": %zu, \"old_allocated\": %zu, ",
+            stats->young_allocated, stats->old_allocated);
+    fprintf(fp, "\"young_freed\": %zu, \"old_freed\": %zu, \"promoted\": %zu, ",
+            stats->young_freed, stats->old_freed, stats->promoted);
+    fprintf(fp, "\"promotion_rate\": %.4f, \"alloc_rate\": %.1f, ",
+            stats->promotion_rate, stats->alloc_rate);
+    fprintf(fp, "\"fragmentation\": %.4f, \"compacted\": %zu, ", stats->fragmentation,
+            stats->compacted);
+
+    fprintf(fp, "\"phases\": {");
+    for (int i = GC_MARK_ROOTS; i <= GC_YOUNG; i++) {
+        GcPhaseStats *ps = stats->phases + i;
+        fprintf(fp, "%s\"%s\": {\"count\": %zu, ", i > GC_MARK_ROOTS ? ", " : "",
+                gc_phase_name(i), ps->count);
+        fprintf(fp, "\"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", ", ps->total_ns,
+                ps->max_ns);
+        fprintf(fp, "\"hist\": [");
+        for (int b = 0; b < GC_HIST_BUCKETS; b++) {
+            fprintf(fp, b ? ", %zu" : "%zu", ps->hist[b]);
+        }
+        fprintf(fp, "]}");
+    }
 
-    if (sigaction(SIGSEGV, &sa, NULL)) {
-        perror("sigaction");
-        exit(-1);
+    fprintf(fp, "}, \"types\": [");
+    for (int i = 0; i < stats->ntypes; i++) {
+        GcTypeStats *ts = stats->types + i;
+        fprintf(fp, "%s{\"name\": \"%s\", \"objs\": %zu, \"bytes\": %zu}",
+                i ? ", " : "", gc_type_name(ts), ts->objs, ts->bytes);
     }
+    fprintf(fp, "]}\n");
+}
 
+void init_gc_system(GcOptions *opts)
+{
+    gc_safepoint_requested = 0;
     _gc_state = GC_DONE;
     _failed_minor = 0;
     _failed_major = 0;
+    _failed_young = 0;
 
     pthread_mutex_init(&_mutator_wait_mutex, NULL);
     pthread_cond_init(&_mutator_wait_cond, NULL);
     _mutator_wait_flag = 0;
 
-    _gc_max_size = max_mem_size;
-    _gc_minor_size = (size_t)(max_mem_size * factor);
+    vector_init_ptr(&_gc_finalizable);
+    vector_init_ptr(&_gc_fini_queue);
+    vector_init_ptr(&_gc_fini_batch);
+    _gc_fini_running = 0;
+    _gc_fini_done = 0;
+    pthread_mutex_init(&_gc_fini_mutex, NULL);
+    pthread_cond_init(&_gc_fini_cond, NULL);
+
+    vector_init_ptr(&_gc_pins);
+    vector_init_ptr(&_gc_weak_slots);
+    vector_init_ptr(&_gc_ephemeron_slots);
+    pthread_spin_init(&_gc_weak_lock, 0);
+
+    _gc_max_size = opts->max_size;
+    size_t init_size = opts->init_size ? opts->init_size : GC_INIT_HEAP_SIZE;
+    _gc_init_size = MIN(init_size, _gc_max_size);
+    _gc_heap_size = _gc_init_size;
+    _gc_minor_size = (size_t)(_gc_heap_size * GC_TRIGGER_RATIO);
     _gc_used_size = 0;
 
-    pthread_spin_init(&_gc_spin_lock, 0);
-
-    lldq_init(&_gc_lists[0]);
-    lldq_init(&_gc_lists[1]);
-    lldq_init(&_gc_lists[2]);
+    _gc_pause_ms = opts->pause_ms;
+    _gc_allocated = 0;
+    _gc_cycle_start = 0;
+    _gc_alloc_rate = 0;
+    _gc_cycle_ms = 0;
+
+    memset(&_gc_stats, 0, sizeof(_gc_stats));
+    _gc_young_base = 0;
+    _gc_young_live = 0;
+    _gc_stats_fp = NULL;
+    if (opts->stats_file) {
+        _gc_stats_fp = fopen(opts->stats_file, "a");
+        if (!_gc_stats_fp) log_warn("cannot open gc stats file '%s'", opts->stats_file);
+    }
+    _gc_stats_interval = (uint64_t)opts->stats_ms * 1000000;
+    _gc_stats_last = now_ns();
 
-    _gc_list = &_gc_lists[0];
-    _gc_list_2 = &_gc_lists[1];
-    _gc_old_list = &_gc_lists[2];
+    pthread_spin_init(&_gc_spin_lock, 0);
 
-    lldq_init(&_gc_remark_list);
-    lldq_init(&_gc_perm_list);
+    for (int i = 0, c = 0; i < GC_MAX_SMALL_SIZE / 16; i++) {
+        while (_gc_class_sizes[c] < (i + 1) * 16) c++;
+        _gc_size_classes[i] = c;
+    }
+    _gc_pages = NULL;
+    memset(_gc_avail_pages, 0, sizeof(_gc_avail_pages));
+    memset(_gc_arenas, 0, sizeof(_gc_arenas));
+    _gc_protect_perm = opts->protect_perm;
+    _gc_compact = opts->compact;
+    _gc_compact_pending = 0;
+    _gc_compact_cycle = 0;
+    _gc_bigs = NULL;
+    _gc_larges = NULL;
+    _gc_large_free = NULL;
+    _gc_large_nfree = 0;
+    _gc_os_page_size = sysconf(_SC_PAGESIZE);
+    _gc_nursery = NULL;
+    _gc_young_pages = 0;
+    _gc_young_limit = MIN(GC_NURSERY_SIZE, _gc_max_size / 8) / GC_PAGE_SIZE;
+    if (_gc_young_limit < GC_MIN_YOUNG_PAGES) _gc_young_limit = GC_MIN_YOUNG_PAGES;
+    _gc_young_max = _gc_young_limit;
+    _gc_young_free = NULL;
+    _gc_young_nfree = 0;
+    _gc_survivors = NULL;
+    _gc_sweep_pages = NULL;
+    _gc_sweep_bigs = NULL;
+    _gc_sweep_larges = NULL;
+    gc_marking = 0;
+    _gc_satb_full = NULL;
+    _gc_satb_free = NULL;
+    _gc_tlabs = NULL;
+    gc_init_tlab(&_gc_promote_tlab);
+    _gc_cycles = 0;
+    gc_mark_stack_init(&_gc_root_stack);
+
+    char *markers = getenv("KOALA_GC_MARKERS");
+    _gc_nmarkers = markers ? atoi(markers) : sysconf(_SC_NPROCESSORS_ONLN) / 4;
+    if (_gc_nmarkers < 1) _gc_nmarkers = 1;
+    _gc_markers = mm_alloc(sizeof(GcMarker) * _gc_nmarkers);
+    sem_init(&_gc_mark_start_sema, 0, 0);
+    sem_init(&_gc_mark_done_sema, 0, 0);
+    for (int i = 0; i < _gc_nmarkers; i++) {
+        GcMarker *m = _gc_markers + i;
+        m->id = i;
+        gc_mark_stack_init(&m->stk);
+        /* the collector is the first one */
+        if (i > 0) pthread_create(&m->pid, NULL, gc_marker_func, m);
+    }
 
     sem_init(&_gc_worker_sema, 0, 0);
 
     pthread_create(&_gc_pid, NULL, gc_pthread_func, NULL);
+    pthread_create(&_gc_fini_pid, NULL, gc_fini_func, NULL);
+}
+
+static void fini_obj(GcObject *gc_obj)
+{
+    switch (gc_obj->gc_kind) {
+        case GC_KIND_ARRAY_OBJECT: {
+            log_debug("gc object array is freed");
+            break;
+        }
+        case GC_KIND_ARRAY_VALUE: {
+            log_debug("gc value array is freed");
+            break;
+        }
+        case GC_KIND_OBJECT: {
+            Object *obj = (Object *)gc_obj;
+            TypeObject *tp = OB_TYPE(obj);
+            /* the others are finalized by their registration */
+            if (tp->fini && gc_obj->gc_age == -1) tp->fini(obj);
+            log_debug("object '%s' is freed", tp->name);
+            break;
+        }
+        case GC_KIND_ARRAY_INT8: {
+            log_debug("gc int8 array is freed");
+            break;
+        }
+        case GC_KIND_ARRAY_INT64: {
+            log_debug("gc int64 array is freed");
+            break;
+        }
+        case GC_KIND_ARRAY_FLT64: {
+            log_debug("gc float64 array is freed");
+            break;
+        }
+        default: {
+            UNREACHABLE();
+            break;
+        }
+    }
+    _gc_used_size -= gc_obj->gc_size;
+}
+
+/* the allocated cells of the pages, the buffers are retired */
+static void fini_pages(GcPage *pages)
+{
+    for (GcPage *page = pages; page; page = page->link) {
+        for (int w = 0; w < GC_PAGE_WORDS; w++) {
+            uint64_t bits = page->alloc[w] & ~tail_bits(page->ncells, w);
+            while (bits) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                fini_obj((GcObject *)(page->cells + i * page->size));
+            }
+        }
+    }
+}
+
+static void fini_perm_pages(GcPage *pages)
+{
+    for (GcPage *page = pages; page; page = page->link) {
+        char *p = page->cells;
+        while (p < (char *)page + GC_PAGE_SIZE) {
+            GcObject *obj = (GcObject *)p;
+            if (!obj->gc_size) break;
+            p += obj->gc_size;
+            fini_obj(obj);
+        }
+    }
+}
+
+static int has_dirty_pages(GcArena *arena)
+{
+    int dirty = 0;
+    pthread_spin_lock(&_gc_spin_lock);
+    for (GcPage *page = arena->pages; page != arena->sealed; page = page->link) {
+        if (page->dirty) dirty = 1;
+    }
+    pthread_spin_unlock(&_gc_spin_lock);
+    return dirty;
+}
+
+void gc_seal_perm(void)
+{
+    if (!_gc_protect_perm) return;
+
+    GcArena *arena = _gc_arenas;
+    /* the young objects of the dirty cards are promoted, their cards are clean */
+    if (has_dirty_pages(arena)) gc_collect();
+
+    pthread_spin_lock(&_gc_spin_lock);
+    /* still dirty by a pinned young one, the minor gcs write it, not sealed */
+    GcPage *dirty = NULL;
+    GcPage *sealed = arena->sealed;
+    GcPage *page = arena->pages;
+    while (page != arena->sealed) {
+        GcPage *next = page->link;
+        if (page->dirty) {
+            page->link = dirty;
+            dirty = page;
+        } else {
+            page->link = sealed;
+            sealed = page;
+        }
+        page = next;
+    }
+    /* the headers are in the pages, relinked before */
+    for (page = sealed; page != arena->sealed; page = page->link) {
+        if (mprotect(page, GC_PAGE_SIZE, PROT_READ)) panic("gc cannot protect a page");
+    }
+    arena->sealed = sealed;
+    /* the pages not sealed are before the sealed ones */
+    arena->pages = sealed;
+    while (dirty) {
+        GcPage *next = dirty->link;
+        dirty->link = arena->pages;
+        arena->pages = dirty;
+        dirty = next;
+    }
+    /* the next object is in a new page */
+    arena->top = arena->end = NULL;
+    pthread_spin_unlock(&_gc_spin_lock);
+}
+
+/* the fini of an object may clear it */
+static void unseal_perm(void)
+{
+    GcArena *arena = _gc_arenas;
+    for (GcPage *page = arena->sealed; page; page = page->link) {
+        mprotect(page, GC_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    }
+    arena->sealed = NULL;
+}
+
+static void unmap_pages(GcPage *page)
+{
+    while (page) {
+        GcPage *next = page->link;
+        munmap(page, GC_PAGE_SIZE);
+        page = next;
+    }
+}
+
+static void fini_big_list(GcBig **pp, int perm)
+{
+    while (*pp) {
+        GcBig *big = *pp;
+        if (big->perm != perm) {
+            pp = &big->next;
+            continue;
+        }
+        *pp = big->next;
+        fini_obj((GcObject *)(big + 1));
+        if (big->mapped) {
+            munmap(big, big->mapped);
+        } else {
+            free(big);
+        }
+    }
+}
+
+static void fini_bigs(int perm)
+{
+    fini_big_list(&_gc_bigs, perm);
+    fini_big_list(&_gc_larges, perm);
 }
 
 void fini_gc_system(void)
@@ -529,70 +2962,64 @@ void fini_gc_system(void)
     gc_worker_wakeup();
     pthread_join(_gc_pid, NULL);
 
-    munmap((void *)_gc_check_ptr, _pagesize);
-
-    GcObject *gc_obj = (GcObject *)lldq_pop_head(_gc_list);
-    while (gc_obj) {
-        switch (gc_obj->gc_kind) {
-            case GC_KIND_ARRAY_OBJECT:
-                /* code */
-                break;
-            case GC_KIND_ARRAY_VALUE:
-                /* code */
-                break;
-            case GC_KIND_OBJECT: {
-                Object *obj = (Object *)gc_obj;
-                TypeObject *tp = OB_TYPE(obj);
-                if (tp->fini) tp->fini(obj);
-                log_debug("object '%s' is freed", tp->name);
-                break;
-            }
-            default:
-                break;
-        }
-        _gc_used_size -= gc_obj->gc_size;
-        free(gc_obj);
-        gc_obj = (GcObject *)lldq_pop_head(_gc_list);
+    /* the last ones */
+    if (_gc_stats_fp) {
+        _gc_stats_last = 0;
+        dump_stats_due();
+        fclose(_gc_stats_fp);
+        _gc_stats_fp = NULL;
     }
 
-    ASSERT(lldq_empty(_gc_list_2));
-    ASSERT(lldq_empty(&_gc_remark_list));
-    ASSERT(lldq_empty(_gc_old_list));
-
-    gc_obj = (GcObject *)lldq_pop_head(&_gc_perm_list);
-    while (gc_obj) {
-        switch (gc_obj->gc_kind) {
-            case GC_KIND_ARRAY_OBJECT: {
-                log_debug("gc object array is freed");
-                break;
-            }
-            case GC_KIND_ARRAY_VALUE: {
-                log_debug("gc value array is freed");
-                break;
-            }
-            case GC_KIND_OBJECT: {
-                Object *obj = (Object *)gc_obj;
-                TypeObject *tp = OB_TYPE(obj);
-                if (tp->fini) tp->fini(obj);
-                log_debug("object '%s' is freed", tp->name);
-                break;
-            }
-            case GC_KIND_ARRAY_INT8: {
-                log_debug("gc int8 array is freed");
-                break;
-            }
-            case GC_KIND_ARRAY_INT64: {
-                log_debug("gc int64 array is freed");
-                break;
-            }
-            default: {
-                UNREACHABLE();
-                break;
-            }
+    gc_fini_tlab(&_gc_promote_tlab);
+    ASSERT(!_gc_tlabs);
+
+    /* the queued ones, then the live ones */
+    pthread_mutex_lock(&_gc_fini_mutex);
+    _gc_fini_done = 1;
+    pthread_cond_broadcast(&_gc_fini_cond);
+    pthread_mutex_unlock(&_gc_fini_mutex);
+    pthread_join(_gc_fini_pid, NULL);
+    gc_run_finalizers();
+    GcObject **slot;
+    vector_foreach(slot, &_gc_finalizable) run_fini(*slot);
+    vector_fini(&_gc_finalizable);
+    vector_fini(&_gc_fini_queue);
+    vector_fini(&_gc_fini_batch);
+    vector_fini(&_gc_pins);
+    vector_fini(&_gc_weak_slots);
+    vector_fini(&_gc_ephemeron_slots);
+
+    /* the objects first, the permanent ones may be used by their fini */
+    fini_pages(_gc_pages);
+    fini_bigs(0);
+    unseal_perm();
+    for (int i = 0; i < 2; i++) fini_perm_pages(_gc_arenas[i].pages);
+    fini_bigs(GC_PERM_RO);
+    fini_bigs(GC_PERM_RW);
+
+    /* no young object has a fini, the ones with fini are permanent */
+    unmap_pages(_gc_pages);
+    unmap_pages(_gc_arenas[0].pages);
+    unmap_pages(_gc_arenas[1].pages);
+    unmap_pages(_gc_nursery);
+    unmap_pages(_gc_young_free);
+    gc_mark_stack_fini(&_gc_root_stack);
+    for (int i = 1; i < _gc_nmarkers; i++) sem_post(&_gc_mark_start_sema);
+    for (int i = 0; i < _gc_nmarkers; i++) {
+        GcMarker *m = _gc_markers + i;
+        if (i > 0) pthread_join(m->pid, NULL);
+        gc_mark_stack_fini(&m->stk);
+    }
+    mm_free(_gc_markers);
+
+    GcSatbBuf *lists[] = { _gc_satb_full, _gc_satb_free };
+    for (int i = 0; i < 2; i++) {
+        GcSatbBuf *buf = lists[i];
+        while (buf) {
+            GcSatbBuf *next = buf->next;
+            mm_free(buf);
+            buf = next;
         }
-        _gc_used_size -= gc_obj->gc_size;
-        free(gc_obj);
-        gc_obj = (GcObject *)lldq_pop_head(&_gc_perm_list);
     }
 
     log_debug("_gc_max_size: %ld", _gc_max_size);
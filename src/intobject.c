@@ -12,7 +12,8 @@ extern "C" {
 
 static Value int_hash(Value *self)
 {
-    unsigned int v = mem_hash(&to_int(self), sizeof(int64_t));
+    int64_t ival = to_int(self);
+    unsigned int v = mem_hash(&ival, sizeof(int64_t));
     return int_value(v);
 }
 
@@ -131,6 +132,16 @@ TypeObject int_type = {
     .init = int_init,
 };
 
+#if USE_NAN_BOXING
+Value kl_new_boxed_int(int64_t v)
+{
+    BoxedInt *obj = gc_alloc_obj(obj);
+    INIT_OBJECT_HEAD(obj, &int_type);
+    obj->ival = v;
+    return obj_value(obj);
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
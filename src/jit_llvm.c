@@ -0,0 +1,963 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "jit.h"
+#include <pthread.h>
+#include "log.h"
+#include "mm.h"
+#include "moduleobject.h"
+#include "opcode.h"
+
+#if USE_LLVM_JIT
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if USE_LLVM_JIT
+
+/*
+ * Optimizing tier: the hottest codes are lowered to llvm ir and compiled at
+ * O2. The quickened bytecode is the type feedback, only the numeric kernels
+ * are lowered: codes of the typed int insns, int compare jumps and calls of
+ * other kernels. The locals are unboxed to i64 in allocas, promoted to ssa
+ * registers by llvm.
+ *
+ * A kernel only reads its int arguments and has no side effect, so it does
+ * not deopt in the middle. On a divisor of 0 or -1, or a call too deep, it
+ * bails out and the whole call is run again by the interpreter, which raises
+ * the error or does the generic op.
+ *
+ * A hot loop of any code is entered by on-stack replacement at its head: the
+ * int locals of the frame are moved into the optimized loop. The insns it
+ * cannot lower are exits, and a bail out is an exit at the insn (or at the
+ * pushes of the call), where the locals are written back and the interpreter
+ * resumes.
+ *
+ * The callees are lowered into the same llvm module, and may be inlined.
+ */
+
+uint32_t opt_threshold = OPT_THRESHOLD;
+
+static pthread_mutex_t _opt_lock = PTHREAD_MUTEX_INITIALIZER;
+static LLVMContextRef _opt_ctx;
+
+void opt_init(void)
+{
+    char *s = getenv("KOALA_OPT_THRESHOLD");
+    if (s) opt_threshold = (uint32_t)atoi(s);
+
+    LLVMLinkInMCJIT();
+    if (LLVMInitializeNativeTarget() || LLVMInitializeNativeAsmPrinter()) {
+        log_error("opt: llvm native target is not available");
+        opt_threshold = 0;
+        return;
+    }
+    _opt_ctx = LLVMContextCreate();
+}
+
+/* max codes lowered into one module */
+#define MAX_KERNELS 16
+
+typedef struct _LocalSet {
+    uint64_t bits[OPT_MAX_LOCALS / 64];
+} LocalSet;
+
+#define LOCAL_SET(s, i)  ((s)->bits[(i) >> 6] |= (uint64_t)1 << ((i)&63))
+#define LOCAL_TEST(s, i) ((s)->bits[(i) >> 6] & ((uint64_t)1 << ((i)&63)))
+
+typedef struct _Block {
+    /* insn offsets [start, end) */
+    int start;
+    int end;
+    /* reachable from the entry or the loop head */
+    int reached;
+    /* locals defined at entry on all paths */
+    LocalSet in;
+    /* locals defined at entry on any path */
+    LocalSet may;
+    LLVMBasicBlockRef bb;
+} Block;
+
+typedef struct _Kernel {
+    CodeObject *code;
+    LLVMTypeRef type;
+    LLVMValueRef func;
+} Kernel;
+
+typedef struct _Opt {
+    LLVMModuleRef mod;
+    LLVMBuilderRef builder;
+    LLVMTypeRef i64;
+    LLVMTypeRef i32;
+    int nr_kernels;
+    Kernel kernels[MAX_KERNELS];
+} Opt;
+
+/* lowering of a kernel or a loop */
+typedef struct _Lower {
+    CodeObject *code;
+    /* the loop head, -1: a kernel */
+    int head;
+    /* locals defined at the entry or the loop head */
+    LocalSet init;
+    /* offset -> opcode, -1: not an insn */
+    int *ops;
+    /* offset -> 1: exit to the interpreter, only in a loop */
+    char *exits;
+    char *leaders;
+    Vector blocks;
+    LLVMValueRef func;
+    /* allocas of the locals */
+    LLVMValueRef *locals;
+    /* alloca of the results of the calls */
+    LLVMValueRef result;
+    /* bail out of a kernel */
+    LLVMBasicBlockRef bail;
+} Lower;
+
+/* the lowered insns, int only */
+static int _opt_insn(int op)
+{
+    switch (op) {
+        case OP_CONST_INT_IMM8:
+        case OP_INT_ADD ... OP_INT_MOD:
+        case OP_INT_AND ... OP_INT_XOR:
+        case OP_INT_SHL ... OP_INT_CMP_GE:
+        case OP_INT_SUB_IMM8:
+        case OP_JMP_INT_CMP_LT_IMM8:
+        case OP_JMP_INT_CMP_GE_IMM8:
+        case OP_PUSH:
+        case OP_PUSH_IMM8:
+        case OP_CALL:
+        case OP_RETURN:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int _is_jump(int op)
+{
+    return op == OP_JMP_INT_CMP_LT_IMM8 || op == OP_JMP_INT_CMP_GE_IMM8;
+}
+
+/* the called code of OP_CALL, NULL: not a code or the arguments mismatch */
+static CodeObject *_opt_callee(CodeObject *code, uint8_t *inst)
+{
+    Object *callable;
+    if (!inst[1]) {
+        callable = module_get_symbol(code->module, inst[2]);
+    } else {
+        RelocInfo *reloc = module_get_rel(code->module, inst[1]);
+        SymbolInfo *symbol = reloc ? vector_get(&reloc->syms, inst[2]) : NULL;
+        callable = symbol ? symbol->obj : NULL;
+    }
+    if (!callable || !IS_CODE(callable)) return NULL;
+    CodeObject *callee = (CodeObject *)callable;
+    return callee->cs.nargs == inst[3] ? callee : NULL;
+}
+
+/* the kernel of the code, declared if not yet, NULL: too many */
+static Kernel *_opt_kernel(Opt *o, CodeObject *code)
+{
+    for (int i = 0; i < o->nr_kernels; i++) {
+        if (o->kernels[i].code == code) return &o->kernels[i];
+    }
+
+    int nargs = code->cs.nargs;
+    if (o->nr_kernels >= MAX_KERNELS || nargs > OPT_MAX_ARGS) return NULL;
+    if (code->cs.nlocals > OPT_MAX_LOCALS || nargs > code->cs.nlocals) return NULL;
+
+    /* i32 kernel(i64 args..., i64 *ret, i32 budget) */
+    LLVMTypeRef params[OPT_MAX_ARGS + 2];
+    for (int i = 0; i < nargs; i++) params[i] = o->i64;
+    params[nargs] = LLVMPointerType(o->i64, 0);
+    params[nargs + 1] = o->i32;
+
+    char name[32];
+    snprintf(name, sizeof(name), "kernel%d", o->nr_kernels);
+    Kernel *k = &o->kernels[o->nr_kernels++];
+    k->code = code;
+    k->type = LLVMFunctionType(o->i32, params, nargs + 2, 0);
+    k->func = LLVMAddFunction(o->mod, name, k->type);
+    LLVMSetLinkage(k->func, LLVMPrivateLinkage);
+    return k;
+}
+
+static void _opt_uses(int op, uint8_t *inst, int *uses, int *def)
+{
+    uses[0] = uses[1] = *def = -1;
+    switch (op) {
+        case OP_CONST_INT_IMM8:
+        case OP_CALL:
+            *def = op == OP_CALL ? inst[4] : inst[1];
+            break;
+        case OP_INT_ADD ... OP_INT_MOD:
+        case OP_INT_AND ... OP_INT_XOR:
+        case OP_INT_SHL ... OP_INT_CMP_GE:
+            *def = inst[1];
+            uses[0] = inst[2];
+            uses[1] = inst[3];
+            break;
+        case OP_INT_SUB_IMM8:
+            *def = inst[1];
+            uses[0] = inst[2];
+            break;
+        case OP_JMP_INT_CMP_LT_IMM8:
+        case OP_JMP_INT_CMP_GE_IMM8:
+        case OP_PUSH:
+        case OP_RETURN:
+            uses[0] = inst[1];
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Decode the insns and mark the leaders. In a loop, the insns not lowered,
+ * the returns and the calls of codes not optimized are exits.
+ */
+static int _opt_decode(Lower *l)
+{
+    CodeObject *code = l->code;
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    int size = code->cs.insns_size;
+    int nlocals = code->cs.nlocals;
+    int osr = l->head >= 0;
+
+    /* offsets of the pushes right before the insn */
+    int pushes[OPT_MAX_ARGS];
+    int npush = 0;
+
+    int offset = 0;
+    l->leaders[0] = 1;
+    while (offset < size) {
+        int op = code_unfuse_opcode(insns[offset]);
+        int len = code_insn_length(op);
+        if (len < 0 || offset + len > size || (!osr && !_opt_insn(op))) {
+            log_debug("opt: opcode %d at %d of '%s' is not lowered", op, offset,
+                      code->cs.name);
+            return -1;
+        }
+        l->ops[offset] = op;
+        uint8_t *inst = insns + offset;
+
+        if (!_opt_insn(op)) {
+            l->exits[offset] = 1;
+        } else {
+            int uses[2], def;
+            _opt_uses(op, inst, uses, &def);
+            if (def >= nlocals || uses[0] >= nlocals || uses[1] >= nlocals) return -1;
+            if (_is_jump(op)) {
+                int off = inst[3] | (inst[4] << 8);
+                if (off >= size) return -1;
+                l->leaders[off] = 1;
+            }
+            if (osr && op == OP_RETURN) l->exits[offset] = 1;
+            if (osr && op == OP_CALL) {
+                /* resumed at the pushes, nothing is run twice */
+                int nargs = inst[3];
+                if (nargs > npush) return -1;
+                CodeObject *callee = _opt_callee(code, inst);
+                if (!callee || !callee->opt) {
+                    l->exits[nargs ? pushes[npush - nargs] : offset] = 1;
+                }
+            }
+        }
+
+        if (op == OP_PUSH || op == OP_PUSH_IMM8) {
+            if (npush == OPT_MAX_ARGS) {
+                memmove(pushes, pushes + 1, sizeof(int) * (OPT_MAX_ARGS - 1));
+                --npush;
+            }
+            pushes[npush++] = offset;
+        } else {
+            npush = 0;
+        }
+
+        if (_is_jump(op) || op == OP_RETURN) l->leaders[offset + len] = 1;
+        offset += len;
+    }
+
+    /* jump targets are insns */
+    for (int i = 0; i < size; i++) {
+        if (l->leaders[i] && l->ops[i] < 0) return -1;
+    }
+    return 0;
+}
+
+static Block *_opt_block(Lower *l, int offset)
+{
+    Block *b;
+    vector_foreach(b, &l->blocks) {
+        if (b->start == offset) return b;
+    }
+    return NULL;
+}
+
+/* the insns of a block up to the first exit */
+#define block_foreach(off, b, l)                                    \
+    for (int off = (b)->start; off < (b)->end && !(l)->exits[off]; \
+         off += code_insn_length((l)->ops[off]))
+
+/* the exit ending the block, or -1 */
+static int _opt_block_exit(Lower *l, Block *b)
+{
+    int off = b->start;
+    while (off < b->end && !l->exits[off]) off += code_insn_length(l->ops[off]);
+    return off < b->end ? off : -1;
+}
+
+static void _opt_meet(Block *succ, LocalSet *must, LocalSet *may, int *changed)
+{
+    if (!succ->reached) {
+        succ->reached = 1;
+        succ->in = *must;
+        succ->may = *may;
+        *changed = 1;
+        return;
+    }
+
+    for (int w = 0; w < COUNT_OF(must->bits); w++) {
+        uint64_t in = succ->in.bits[w] & must->bits[w];
+        uint64_t maybe = succ->may.bits[w] | may->bits[w];
+        if (in != succ->in.bits[w] || maybe != succ->may.bits[w]) {
+            succ->in.bits[w] = in;
+            succ->may.bits[w] = maybe;
+            *changed = 1;
+        }
+    }
+}
+
+/*
+ * Split the code into blocks, and check every local is defined before used
+ * on all paths. The defined locals are ints, the arguments or the locals at
+ * the loop head are guarded at entry. A loop writes back the locals defined
+ * on all paths at its exits, a local defined only on some paths is rejected.
+ */
+static int _opt_flow(Lower *l)
+{
+    CodeObject *code = l->code;
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    int size = code->cs.insns_size;
+
+    for (int i = 0; i < size; i++) {
+        if (!l->leaders[i]) continue;
+        Block blk = { .start = i };
+        int end = i + code_insn_length(l->ops[i]);
+        while (end < size && !l->leaders[end]) end += code_insn_length(l->ops[end]);
+        blk.end = end;
+        vector_push_back(&l->blocks, &blk);
+    }
+
+    Block *entry = _opt_block(l, l->head >= 0 ? l->head : 0);
+    if (!entry) return -1;
+    entry->reached = 1;
+    entry->in = l->init;
+    entry->may = l->init;
+
+    int changed = 1;
+    Block *b;
+    while (changed) {
+        changed = 0;
+        vector_foreach(b, &l->blocks) {
+            if (!b->reached || _opt_block_exit(l, b) >= 0) continue;
+            LocalSet must = b->in;
+            LocalSet may = b->may;
+            int last = -1;
+            block_foreach(off, b, l) {
+                int uses[2], def;
+                _opt_uses(l->ops[off], insns + off, uses, &def);
+                if (def >= 0) {
+                    LOCAL_SET(&must, def);
+                    LOCAL_SET(&may, def);
+                }
+                last = off;
+            }
+
+            int succs[2] = { -1, -1 };
+            if (_is_jump(l->ops[last])) {
+                succs[0] = insns[last + 3] | (insns[last + 4] << 8);
+                succs[1] = b->end;
+            } else if (l->ops[last] != OP_RETURN) {
+                succs[0] = b->end;
+            }
+
+            for (int s = 0; s < 2; s++) {
+                if (succs[s] < 0) continue;
+                /* falls off the end */
+                if (succs[s] >= size) return -1;
+                _opt_meet(_opt_block(l, succs[s]), &must, &may, &changed);
+            }
+        }
+    }
+
+    vector_foreach(b, &l->blocks) {
+        if (!b->reached) continue;
+        LocalSet must = b->in;
+        int bail = 0;
+        block_foreach(off, b, l) {
+            int op = l->ops[off];
+            int uses[2], def;
+            _opt_uses(op, insns + off, uses, &def);
+            for (int u = 0; u < 2; u++) {
+                if (uses[u] >= 0 && !LOCAL_TEST(&must, uses[u])) {
+                    log_debug("opt: local %d at %d of '%s' may be not an int", uses[u],
+                              off, code->cs.name);
+                    return -1;
+                }
+            }
+            bail |= op == OP_INT_DIV || op == OP_INT_MOD || op == OP_CALL;
+            if (def >= 0) LOCAL_SET(&must, def);
+        }
+
+        if (l->head < 0 || (!bail && _opt_block_exit(l, b) < 0)) continue;
+        /* the defs are added to both, the same anywhere in the block */
+        if (memcmp(&b->in, &b->may, sizeof(LocalSet))) {
+            log_debug("opt: locals of the loop at %d of '%s' are not written back",
+                      l->head, code->cs.name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static LLVMValueRef _opt_const(Opt *o, int64_t v)
+{
+    return LLVMConstInt(o->i64, (uint64_t)v, 1);
+}
+
+static LLVMValueRef _opt_elem(Opt *o, LLVMValueRef ptr, int i)
+{
+    LLVMValueRef idx = _opt_const(o, i);
+    return LLVMBuildGEP2(o->builder, o->i64, ptr, &idx, 1, "");
+}
+
+static LLVMValueRef _opt_int_binary(Opt *o, int op, LLVMValueRef b, LLVMValueRef c)
+{
+    LLVMBuilderRef builder = o->builder;
+    static LLVMIntPredicate preds[] = {
+        LLVMIntEQ, LLVMIntNE, LLVMIntSLT, LLVMIntSGT, LLVMIntSLE, LLVMIntSGE,
+    };
+
+    switch (op) {
+        case OP_INT_ADD:
+            return LLVMBuildAdd(builder, b, c, "");
+        case OP_INT_SUB:
+            return LLVMBuildSub(builder, b, c, "");
+        case OP_INT_MUL:
+            return LLVMBuildMul(builder, b, c, "");
+        case OP_INT_DIV:
+            return LLVMBuildSDiv(builder, b, c, "");
+        case OP_INT_MOD:
+            return LLVMBuildSRem(builder, b, c, "");
+        case OP_INT_AND:
+            return LLVMBuildAnd(builder, b, c, "");
+        case OP_INT_OR:
+            return LLVMBuildOr(builder, b, c, "");
+        case OP_INT_XOR:
+            return LLVMBuildXor(builder, b, c, "");
+        case OP_INT_SHL:
+        case OP_INT_SHR:
+        case OP_INT_USHR: {
+            c = LLVMBuildAnd(builder, c, _opt_const(o, 63), "");
+            if (op == OP_INT_SHL) return LLVMBuildShl(builder, b, c, "");
+            if (op == OP_INT_SHR) return LLVMBuildAShr(builder, b, c, "");
+            return LLVMBuildLShr(builder, b, c, "");
+        }
+        case OP_INT_CMP_EQ ... OP_INT_CMP_GE: {
+            LLVMValueRef r = LLVMBuildICmp(builder, preds[op - OP_INT_CMP_EQ], b, c, "");
+            return LLVMBuildZExt(builder, r, o->i64, "");
+        }
+        default:
+            UNREACHABLE();
+    }
+}
+
+/*
+ * The block resuming the interpreter at `offset`: a loop writes back the
+ * defined locals, a kernel just bails out.
+ */
+static LLVMBasicBlockRef _opt_exit(Opt *o, Lower *l, int offset, LocalSet *defined)
+{
+    if (l->head < 0) return l->bail;
+
+    LLVMBuilderRef builder = o->builder;
+    LLVMBasicBlockRef cur = LLVMGetInsertBlock(builder);
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(_opt_ctx, l->func, "");
+    LLVMPositionBuilderAtEnd(builder, bb);
+
+    LLVMValueRef locals = LLVMGetParam(l->func, 0);
+    LLVMValueRef mask = LLVMGetParam(l->func, 1);
+    for (int i = 0; i < l->code->cs.nlocals; i++) {
+        if (!LOCAL_TEST(defined, i)) continue;
+        LLVMValueRef v = LLVMBuildLoad2(builder, o->i64, l->locals[i], "");
+        LLVMBuildStore(builder, v, _opt_elem(o, locals, i));
+    }
+    for (int w = 0; w < COUNT_OF(defined->bits); w++) {
+        LLVMValueRef bits = LLVMConstInt(o->i64, defined->bits[w], 0);
+        LLVMBuildStore(builder, bits, _opt_elem(o, mask, w));
+    }
+    LLVMBuildRet(builder, LLVMConstInt(o->i32, offset, 0));
+
+    LLVMPositionBuilderAtEnd(builder, cur);
+    return bb;
+}
+
+/* go to `exit` if `cond`, or continue in a new block */
+static void _opt_exit_if(Opt *o, Lower *l, LLVMValueRef cond, LLVMBasicBlockRef exit)
+{
+    LLVMBasicBlockRef cont = LLVMAppendBasicBlockInContext(_opt_ctx, l->func, "");
+    LLVMBuildCondBr(o->builder, cond, exit, cont);
+    LLVMPositionBuilderAtEnd(o->builder, cont);
+}
+
+/* go to `exit` if a gc is requested, the interpreter stops at its safepoint */
+static void _opt_poll(Opt *o, Lower *l, LLVMBasicBlockRef exit)
+{
+    LLVMBuilderRef builder = o->builder;
+    LLVMValueRef addr = LLVMConstInt(o->i64, (uintptr_t)&gc_safepoint_requested, 0);
+    LLVMValueRef ptr = LLVMConstIntToPtr(addr, LLVMPointerType(o->i32, 0));
+    LLVMValueRef flag = LLVMBuildLoad2(builder, o->i32, ptr, "");
+    LLVMSetVolatile(flag, 1);
+    LLVMValueRef zero = LLVMConstInt(o->i32, 0, 0);
+    _opt_exit_if(o, l, LLVMBuildICmp(builder, LLVMIntNE, flag, zero, ""), exit);
+}
+
+/* the allocas, and the arguments or the locals at the loop head, returns budget */
+static LLVMValueRef _opt_prologue(Opt *o, Lower *l, LLVMBasicBlockRef entry)
+{
+    LLVMBuilderRef builder = o->builder;
+    LLVMValueRef func = l->func;
+    int nlocals = l->code->cs.nlocals;
+    int nargs = l->code->cs.nargs;
+
+    LLVMPositionBuilderAtEnd(builder, entry);
+    for (int i = 0; i < nlocals; i++) {
+        l->locals[i] = LLVMBuildAlloca(builder, o->i64, "");
+    }
+    l->result = LLVMBuildAlloca(builder, o->i64, "");
+
+    if (l->head >= 0) {
+        /* i32 osr(i64 *locals, i64 *mask, i32 budget) */
+        LLVMValueRef locals = LLVMGetParam(func, 0);
+        for (int i = 0; i < nlocals; i++) {
+            if (!LOCAL_TEST(&l->init, i)) continue;
+            LLVMValueRef v = LLVMBuildLoad2(builder, o->i64, _opt_elem(o, locals, i), "");
+            LLVMBuildStore(builder, v, l->locals[i]);
+        }
+        LLVMBuildBr(builder, _opt_block(l, l->head)->bb);
+        return LLVMGetParam(func, 2);
+    }
+
+    /* i32 kernel(i64 args..., i64 *ret, i32 budget) */
+    for (int i = 0; i < nargs; i++) {
+        LLVMBuildStore(builder, LLVMGetParam(func, i), l->locals[i]);
+    }
+    l->bail = LLVMAppendBasicBlockInContext(_opt_ctx, func, "bail");
+    LLVMValueRef budget = LLVMGetParam(func, nargs + 1);
+    LLVMValueRef zero = LLVMConstInt(o->i32, 0, 0);
+    LLVMValueRef exhausted = LLVMBuildICmp(builder, LLVMIntSLE, budget, zero, "");
+    budget = LLVMBuildSub(builder, budget, LLVMConstInt(o->i32, 1, 0), "");
+    LLVMBuildCondBr(builder, exhausted, l->bail, _opt_block(l, 0)->bb);
+
+    LLVMPositionBuilderAtEnd(builder, l->bail);
+    LLVMBuildRet(builder, LLVMConstInt(o->i32, OPT_BAIL, 0));
+    return budget;
+}
+
+/* lower the reachable blocks */
+static int _opt_codegen(Opt *o, Lower *l)
+{
+    CodeObject *code = l->code;
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    LLVMBuilderRef builder = o->builder;
+
+    /* the allocas are in the entry block */
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(_opt_ctx, l->func, "");
+    Block *b;
+    vector_foreach(b, &l->blocks) {
+        if (b->reached) b->bb = LLVMAppendBasicBlockInContext(_opt_ctx, l->func, "");
+    }
+    LLVMValueRef budget = _opt_prologue(o, l, entry);
+
+#define LOAD(i)     LLVMBuildLoad2(builder, o->i64, l->locals[i], "")
+#define STORE(i, v) LLVMBuildStore(builder, (v), l->locals[i])
+
+    LLVMValueRef stack[OPT_MAX_ARGS];
+    vector_foreach(b, &l->blocks) {
+        if (!b->reached) continue;
+        LLVMPositionBuilderAtEnd(builder, b->bb);
+        LocalSet defined = b->in;
+        int depth = 0;
+        int push = -1;
+        int last = -1;
+        block_foreach(off, b, l) {
+            uint8_t *inst = insns + off;
+            int op = l->ops[off];
+            last = off;
+            switch (op) {
+                case OP_CONST_INT_IMM8:
+                    STORE(inst[1], _opt_const(o, (int8_t)inst[2]));
+                    break;
+                case OP_INT_DIV:
+                case OP_INT_MOD: {
+                    /* 0 and -1 divisors are left to the interpreter */
+                    LLVMValueRef c = LOAD(inst[3]);
+                    LLVMValueRef t = LLVMBuildAdd(builder, c, _opt_const(o, 1), "");
+                    LLVMValueRef bad =
+                        LLVMBuildICmp(builder, LLVMIntULE, t, _opt_const(o, 1), "");
+                    _opt_exit_if(o, l, bad, _opt_exit(o, l, off, &defined));
+                    STORE(inst[1], _opt_int_binary(o, op, LOAD(inst[2]), c));
+                    break;
+                }
+                case OP_INT_ADD ... OP_INT_MUL:
+                case OP_INT_AND ... OP_INT_XOR:
+                case OP_INT_SHL ... OP_INT_CMP_GE:
+                    STORE(inst[1], _opt_int_binary(o, op, LOAD(inst[2]), LOAD(inst[3])));
+                    break;
+                case OP_INT_SUB_IMM8: {
+                    LLVMValueRef imm = _opt_const(o, (int8_t)inst[3]);
+                    STORE(inst[1], LLVMBuildSub(builder, LOAD(inst[2]), imm, ""));
+                    break;
+                }
+                case OP_JMP_INT_CMP_LT_IMM8:
+                case OP_JMP_INT_CMP_GE_IMM8: {
+                    LLVMIntPredicate pred =
+                        op == OP_JMP_INT_CMP_LT_IMM8 ? LLVMIntSLT : LLVMIntSGE;
+                    LLVMValueRef imm = _opt_const(o, (int8_t)inst[2]);
+                    LLVMValueRef cond = LLVMBuildICmp(builder, pred, LOAD(inst[1]), imm, "");
+                    int target = inst[3] | (inst[4] << 8);
+                    /* a backward jump polls the gc, a kernel bails out */
+                    if (target <= off) _opt_poll(o, l, _opt_exit(o, l, off, &defined));
+                    LLVMBuildCondBr(builder, cond, _opt_block(l, target)->bb,
+                                    _opt_block(l, b->end)->bb);
+                    break;
+                }
+                case OP_PUSH:
+                case OP_PUSH_IMM8: {
+                    if (depth >= OPT_MAX_ARGS) return -1;
+                    if (!depth) push = off;
+                    /* the value when pushed */
+                    stack[depth++] =
+                        op == OP_PUSH ? LOAD(inst[1]) : _opt_const(o, (int8_t)inst[1]);
+                    break;
+                }
+                case OP_CALL: {
+                    int nargs = inst[3];
+                    CodeObject *callee = _opt_callee(code, inst);
+                    if (!callee || nargs != depth) return -1;
+                    Kernel *ck = _opt_kernel(o, callee);
+                    if (!ck) return -1;
+                    LLVMValueRef args[OPT_MAX_ARGS + 2];
+                    for (int i = 0; i < nargs; i++) args[i] = stack[i];
+                    args[nargs] = l->result;
+                    args[nargs + 1] = budget;
+                    LLVMValueRef status =
+                        LLVMBuildCall2(builder, ck->type, ck->func, args, nargs + 2, "");
+                    LLVMValueRef zero = LLVMConstInt(o->i32, 0, 0);
+                    LLVMValueRef failed =
+                        LLVMBuildICmp(builder, LLVMIntNE, status, zero, "");
+                    LLVMBasicBlockRef exit = _opt_exit(o, l, nargs ? push : off, &defined);
+                    _opt_exit_if(o, l, failed, exit);
+                    STORE(inst[4], LLVMBuildLoad2(builder, o->i64, l->result, ""));
+                    depth = 0;
+                    break;
+                }
+                case OP_RETURN: {
+                    LLVMValueRef ret = LLVMGetParam(l->func, code->cs.nargs);
+                    LLVMBuildStore(builder, LOAD(inst[1]), ret);
+                    LLVMBuildRet(builder, LLVMConstInt(o->i32, 0, 0));
+                    break;
+                }
+                default:
+                    UNREACHABLE();
+            }
+
+            int uses[2], def;
+            _opt_uses(op, inst, uses, &def);
+            if (def >= 0) LOCAL_SET(&defined, def);
+        }
+
+        /* the value stack is empty across blocks and at exits */
+        if (depth) return -1;
+
+        int exit = _opt_block_exit(l, b);
+        if (exit >= 0) {
+            LLVMBuildBr(builder, _opt_exit(o, l, exit, &defined));
+        } else if (!_is_jump(l->ops[last]) && l->ops[last] != OP_RETURN) {
+            LLVMBuildBr(builder, _opt_block(l, b->end)->bb);
+        }
+    }
+
+#undef LOAD
+#undef STORE
+
+    return 0;
+}
+
+/* lower the code into `func`, a kernel or a loop entered at `head` */
+static int _opt_lower(Opt *o, CodeObject *code, LLVMValueRef func, int head,
+                      LocalSet *init)
+{
+    int size = code->cs.insns_size;
+    Lower l = { .code = code, .head = head, .init = *init, .func = func };
+    l.ops = mm_alloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++) l.ops[i] = -1;
+    l.exits = mm_alloc(size);
+    l.leaders = mm_alloc(size + 1);
+    l.locals = mm_alloc(sizeof(LLVMValueRef) * code->cs.nlocals);
+    vector_init(&l.blocks, sizeof(Block));
+
+    int ret = -1;
+    if (!_opt_decode(&l) && !_opt_flow(&l)) ret = _opt_codegen(o, &l);
+
+    vector_fini(&l.blocks);
+    mm_free(l.locals);
+    mm_free(l.leaders);
+    mm_free(l.exits);
+    mm_free(l.ops);
+    return ret;
+}
+
+/* lower the kernels, the callees are declared while lowering */
+static int _opt_lower_kernels(Opt *o)
+{
+    for (int i = 0; i < o->nr_kernels; i++) {
+        Kernel *k = &o->kernels[i];
+        LocalSet args = { 0 };
+        for (int j = 0; j < k->code->cs.nargs; j++) LOCAL_SET(&args, j);
+        if (_opt_lower(o, k->code, k->func, -1, &args)) return -1;
+    }
+    return 0;
+}
+
+/* i32 entry(i64 *args, i64 *ret, i32 budget), calls the kernel of the code */
+static LLVMValueRef _opt_entry(Opt *o, Kernel *k)
+{
+    LLVMBuilderRef builder = o->builder;
+    LLVMTypeRef i64p = LLVMPointerType(o->i64, 0);
+    LLVMTypeRef params[] = { i64p, i64p, o->i32 };
+    LLVMTypeRef type = LLVMFunctionType(o->i32, params, 3, 0);
+    LLVMValueRef func = LLVMAddFunction(o->mod, "entry", type);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(_opt_ctx, func, ""));
+
+    int nargs = k->code->cs.nargs;
+    LLVMValueRef argv = LLVMGetParam(func, 0);
+    LLVMValueRef args[OPT_MAX_ARGS + 2];
+    for (int i = 0; i < nargs; i++) {
+        args[i] = LLVMBuildLoad2(builder, o->i64, _opt_elem(o, argv, i), "");
+    }
+    args[nargs] = LLVMGetParam(func, 1);
+    args[nargs + 1] = LLVMGetParam(func, 2);
+    LLVMBuildRet(builder, LLVMBuildCall2(builder, k->type, k->func, args, nargs + 2, ""));
+    return func;
+}
+
+static void _opt_optimize(LLVMModuleRef mod)
+{
+    LLVMPassManagerBuilderRef pmb = LLVMPassManagerBuilderCreate();
+    LLVMPassManagerBuilderSetOptLevel(pmb, 2);
+
+    LLVMPassManagerRef fpm = LLVMCreateFunctionPassManagerForModule(mod);
+    LLVMPassManagerBuilderPopulateFunctionPassManager(pmb, fpm);
+    LLVMInitializeFunctionPassManager(fpm);
+    for (LLVMValueRef f = LLVMGetFirstFunction(mod); f; f = LLVMGetNextFunction(f)) {
+        LLVMRunFunctionPassManager(fpm, f);
+    }
+    LLVMFinalizeFunctionPassManager(fpm);
+
+    LLVMPassManagerRef mpm = LLVMCreatePassManager();
+    LLVMPassManagerBuilderPopulateModulePassManager(pmb, mpm);
+    LLVMRunPassManager(mpm, mod);
+
+    LLVMDisposePassManager(mpm);
+    LLVMDisposePassManager(fpm);
+    LLVMPassManagerBuilderDispose(pmb);
+}
+
+/* verify, optimize and compile the module, returns the address of `name` */
+static void *_opt_emit(Opt *o, CodeObject *code, char *name, void **engine)
+{
+    char *err = NULL;
+    if (LLVMVerifyModule(o->mod, LLVMReturnStatusAction, &err)) {
+        log_error("opt: bad llvm ir of '%s': %s", code->cs.name, err);
+        LLVMDisposeMessage(err);
+        return NULL;
+    }
+    LLVMDisposeMessage(err);
+
+    _opt_optimize(o->mod);
+
+    struct LLVMMCJITCompilerOptions options;
+    LLVMInitializeMCJITCompilerOptions(&options, sizeof(options));
+    options.OptLevel = 2;
+    LLVMExecutionEngineRef ee;
+    if (LLVMCreateMCJITCompilerForModule(&ee, o->mod, &options, sizeof(options), &err)) {
+        log_error("opt: cannot create llvm engine: %s", err);
+        LLVMDisposeMessage(err);
+        return NULL;
+    }
+    /* owned by the engine */
+    o->mod = NULL;
+
+    *engine = ee;
+    return (void *)(uintptr_t)LLVMGetFunctionAddress(ee, name);
+}
+
+static void _opt_begin(Opt *o, CodeObject *code)
+{
+    o->mod = LLVMModuleCreateWithNameInContext(code->cs.name, _opt_ctx);
+    o->builder = LLVMCreateBuilderInContext(_opt_ctx);
+    o->i64 = LLVMInt64TypeInContext(_opt_ctx);
+    o->i32 = LLVMInt32TypeInContext(_opt_ctx);
+}
+
+static void _opt_end(Opt *o)
+{
+    LLVMDisposeBuilder(o->builder);
+    if (o->mod) LLVMDisposeModule(o->mod);
+}
+
+static OptCode *_opt_compile(Opt *o, CodeObject *code)
+{
+    Kernel *k = _opt_kernel(o, code);
+    if (!k || _opt_lower_kernels(o)) return NULL;
+    _opt_entry(o, k);
+
+    void *engine;
+    void *entry = _opt_emit(o, code, "entry", &engine);
+    if (!entry) return NULL;
+
+    OptCode *oc = mm_alloc_obj(oc);
+    oc->engine = engine;
+    oc->entry = (OptFunc)entry;
+    oc->nargs = code->cs.nargs;
+    return oc;
+}
+
+int opt_compile(CodeObject *code)
+{
+    if (!opt_threshold) return -1;
+
+    pthread_mutex_lock(&_opt_lock);
+
+    if (code->opt) {
+        pthread_mutex_unlock(&_opt_lock);
+        return 0;
+    }
+
+    Opt o = { 0 };
+    _opt_begin(&o, code);
+    OptCode *oc = _opt_compile(&o, code);
+    if (oc) {
+        log_debug("opt: '%s', %d kernels", code->cs.name, o.nr_kernels);
+        __atomic_store_n(&code->opt, oc, __ATOMIC_RELEASE);
+    }
+    _opt_end(&o);
+
+    pthread_mutex_unlock(&_opt_lock);
+    return oc ? 0 : -1;
+}
+
+static OptOsr *_opt_compile_osr(Opt *o, CallFrame *cf, int head)
+{
+    CodeObject *code = cf->code;
+    int nlocals = code->cs.nlocals;
+    if (nlocals > OPT_MAX_LOCALS) return NULL;
+
+    /* specialized on the int locals now */
+    LocalSet init = { 0 };
+    for (int i = 0; i < nlocals; i++) {
+        if (IS_INT(cf->local_stack + i)) LOCAL_SET(&init, i);
+    }
+
+    LLVMTypeRef i64p = LLVMPointerType(o->i64, 0);
+    LLVMTypeRef params[] = { i64p, i64p, o->i32 };
+    LLVMTypeRef type = LLVMFunctionType(o->i32, params, 3, 0);
+    LLVMValueRef func = LLVMAddFunction(o->mod, "osr", type);
+    if (_opt_lower(o, code, func, head, &init) || _opt_lower_kernels(o)) return NULL;
+
+    void *engine;
+    void *entry = _opt_emit(o, code, "osr", &engine);
+    if (!entry) return NULL;
+
+    OptOsr *osr = mm_alloc_obj(osr);
+    osr->engine = engine;
+    osr->entry = (OsrFunc)entry;
+    memcpy(osr->mask, init.bits, sizeof(osr->mask));
+    return osr;
+}
+
+int opt_compile_osr(CallFrame *cf, int offset)
+{
+    if (!opt_threshold) return -1;
+
+    CodeObject *code = cf->code;
+    uint8_t *inst = (uint8_t *)code->cs.insns + offset;
+    int head = inst[3] | (inst[4] << 8);
+    LoopSite *ls = code_loop_site(code, offset);
+
+    pthread_mutex_lock(&_opt_lock);
+
+    if (ls->osr) {
+        pthread_mutex_unlock(&_opt_lock);
+        return 0;
+    }
+
+    Opt o = { 0 };
+    _opt_begin(&o, code);
+    OptOsr *osr = _opt_compile_osr(&o, cf, head);
+    if (osr) {
+        log_debug("opt: loop at %d of '%s', %d kernels", head, code->cs.name,
+                  o.nr_kernels);
+        __atomic_store_n(&ls->osr, osr, __ATOMIC_RELEASE);
+    }
+    _opt_end(&o);
+
+    pthread_mutex_unlock(&_opt_lock);
+    return osr ? 0 : -1;
+}
+
+int opt_osr_run(OptOsr *osr, CallFrame *cf, int budget)
+{
+    Value *locals = cf->local_stack;
+    int nlocals = cf->local_size;
+    int64_t ilocals[OPT_MAX_LOCALS];
+
+    for (int i = 0; i < nlocals; i++) {
+        if (!(osr->mask[i >> 6] & ((uint64_t)1 << (i & 63)))) continue;
+        if (!IS_INT(locals + i)) return -1;
+        ilocals[i] = to_int(locals + i);
+    }
+
+    uint64_t mask[OPT_MAX_LOCALS / 64];
+    int offset = osr->entry(ilocals, mask, budget);
+    /* the boxing may wait for a gc, it scans the registers live in the exit insn */
+    if (offset >= 0) {
+        uint8_t *inst = (uint8_t *)cf->code->cs.insns + offset;
+        cf->next_inst = inst + code_insn_length(code_unfuse_opcode(*inst));
+    }
+
+    /* deopt, the ints are boxed back into the frame */
+    for (int i = 0; i < nlocals; i++) {
+        if (mask[i >> 6] & ((uint64_t)1 << (i & 63))) locals[i] = int_value(ilocals[i]);
+    }
+    return offset;
+}
+
+#endif /* USE_LLVM_JIT */
+
+#ifdef __cplusplus
+}
+#endif
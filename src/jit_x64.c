@@ -0,0 +1,875 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "jit.h"
+#include <pthread.h>
+#include <stddef.h>
+#include "log.h"
+#include "mm.h"
+#include "opcode.h"
+
+#if USE_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if USE_JIT
+
+/*
+ * Baseline jit: every insn is compiled to a fixed machine code template, the
+ * locals stay in the CallFrame. The typed int insns guard the tags of their
+ * operands, if failed, the native code exits and the interpreter runs (and
+ * deopts) the insn. The insns without a template also exit to the
+ * interpreter, which enters the native code again at the next call, return
+ * or backward jump.
+ *
+ * A call to a compiled code is a native call after the frame is pushed by
+ * the helper, and its return pops the frame and returns natively. Exits
+ * unwind the native stack, the frames are resumed by the interpreter.
+ *
+ * registers:
+ *   rbx: locals
+ *   r12: value stack top
+ *   rbp: CallFrame
+ *   r13: depth of native calls
+ *   r14: native stack pointer at entry
+ */
+
+/* nested native calls on the c stack, a deeper callee is resumed by the interpreter */
+#define JIT_MAX_CALLS 10000
+
+uint32_t jit_threshold = JIT_THRESHOLD;
+
+static pthread_mutex_t _jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void jit_init(void)
+{
+    char *s = getenv("KOALA_JIT_THRESHOLD");
+    if (s) jit_threshold = (uint32_t)atoi(s);
+}
+
+/* clang-format off */
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* condition codes of jcc and setcc */
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+};
+
+/* opcode of `op r/m64, r64` */
+enum {
+    ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+    ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85,
+};
+
+/* reg field of group 2 shifts */
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+/* clang-format on */
+
+#define FIXUP_JUMP  1 /* to the native code of an insn */
+#define FIXUP_EXIT  2 /* to the exit stub of an insn */
+#define FIXUP_ERROR 3 /* to the error stub */
+#define FIXUP_RESUME 4 /* to the resume stub */
+
+typedef struct _Fixup {
+    int kind;
+    /* position of the rel32 */
+    int pos;
+    /* insn offset */
+    int offset;
+} Fixup;
+
+typedef struct _Jit {
+    CodeObject *code;
+    uint8_t *buf;
+    int len;
+    int cap;
+    /* insn offset -> native offset, -1: not an insn */
+    int *native;
+    /* insn offset -> 1: compiled, 0: left to the interpreter */
+    char *compiled;
+    /* offset of current insn */
+    int offset;
+    Vector fixups;
+} Jit;
+
+static void emit1(Jit *j, int b)
+{
+    if (j->len >= j->cap) {
+        int cap = j->cap * 2;
+        uint8_t *buf = mm_alloc(cap);
+        memcpy(buf, j->buf, j->len);
+        mm_free(j->buf);
+        j->buf = buf;
+        j->cap = cap;
+    }
+    j->buf[j->len++] = (uint8_t)b;
+}
+
+static void emit4(Jit *j, int32_t v)
+{
+    for (int i = 0; i < 4; i++) emit1(j, (v >> (i * 8)) & 0xff);
+}
+
+static void emit8(Jit *j, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) emit1(j, (v >> (i * 8)) & 0xff);
+}
+
+static void patch4(Jit *j, int pos, int32_t v)
+{
+    for (int i = 0; i < 4; i++) j->buf[pos + i] = (v >> (i * 8)) & 0xff;
+}
+
+static void emit_rex(Jit *j, int w, int reg, int rm)
+{
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) emit1(j, rex);
+}
+
+static void emit_modrm(Jit *j, int mod, int reg, int rm)
+{
+    emit1(j, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* modrm of [base + disp] */
+static void emit_mem(Jit *j, int reg, int base, int disp)
+{
+    int mod;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    emit_modrm(j, mod, reg, base);
+    if ((base & 7) == RSP) emit1(j, 0x24);
+    if (mod == 1) {
+        emit1(j, disp & 0xff);
+    } else if (mod == 2) {
+        emit4(j, disp);
+    }
+}
+
+/* mov reg, [base + disp] */
+static void emit_load(Jit *j, int reg, int base, int disp)
+{
+    emit_rex(j, 1, reg, base);
+    emit1(j, 0x8B);
+    emit_mem(j, reg, base, disp);
+}
+
+/* mov [base + disp], reg */
+static void emit_store(Jit *j, int base, int disp, int reg)
+{
+    emit_rex(j, 1, reg, base);
+    emit1(j, 0x89);
+    emit_mem(j, reg, base, disp);
+}
+
+#if !USE_NAN_BOXING
+/* mov dword [base + disp], imm32, the tag of a Value */
+static void emit_store_imm32(Jit *j, int base, int disp, int32_t imm)
+{
+    emit_rex(j, 0, 0, base);
+    emit1(j, 0xC7);
+    emit_mem(j, 0, base, disp);
+    emit4(j, imm);
+}
+#endif
+
+/* mov dst, src */
+static void emit_mov(Jit *j, int dst, int src)
+{
+    emit_rex(j, 1, src, dst);
+    emit1(j, 0x89);
+    emit_modrm(j, 3, src, dst);
+}
+
+/* movabs reg, imm64 */
+static void emit_mov_imm64(Jit *j, int reg, uint64_t imm)
+{
+    emit_rex(j, 1, 0, reg);
+    emit1(j, 0xB8 + (reg & 7));
+    emit8(j, imm);
+}
+
+/* op dst, src */
+static void emit_alu(Jit *j, int op, int dst, int src)
+{
+    emit_rex(j, 1, src, dst);
+    emit1(j, op);
+    emit_modrm(j, 3, src, dst);
+}
+
+/* op reg, imm8, op is the reg field of 0x83 */
+static void emit_alu_imm8(Jit *j, int op, int reg, int imm)
+{
+    emit_rex(j, 1, 0, reg);
+    emit1(j, 0x83);
+    emit_modrm(j, 3, op, reg);
+    emit1(j, imm & 0xff);
+}
+
+#define ALU_IMM_ADD 0
+#define ALU_IMM_SUB 5
+#define ALU_IMM_CMP 7
+
+/* imul dst, src */
+static void emit_imul(Jit *j, int dst, int src)
+{
+    emit_rex(j, 1, dst, src);
+    emit1(j, 0x0F);
+    emit1(j, 0xAF);
+    emit_modrm(j, 3, dst, src);
+}
+
+/* shift reg by cl */
+static void emit_shift_cl(Jit *j, int op, int reg)
+{
+    emit_rex(j, 1, 0, reg);
+    emit1(j, 0xD3);
+    emit_modrm(j, 3, op, reg);
+}
+
+#if USE_NAN_BOXING
+/* shift reg by imm8, boxes and unboxes the ints */
+static void emit_shift_imm(Jit *j, int op, int reg, int imm)
+{
+    emit_rex(j, 1, 0, reg);
+    emit1(j, 0xC1);
+    emit_modrm(j, 3, op, reg);
+    emit1(j, imm);
+}
+#endif
+
+/* setcc al; movzx eax, al */
+static void emit_setcc(Jit *j, int cc)
+{
+    emit1(j, 0x0F);
+    emit1(j, 0x90 | cc);
+    emit1(j, 0xC0);
+    emit1(j, 0x0F);
+    emit1(j, 0xB6);
+    emit1(j, 0xC0);
+}
+
+static void add_fixup(Jit *j, int kind, int offset)
+{
+    Fixup f = { kind, j->len, offset };
+    vector_push_back(&j->fixups, &f);
+    emit4(j, 0);
+}
+
+/* jcc to the insn at `offset` */
+static void emit_jcc(Jit *j, int cc, int kind, int offset)
+{
+    emit1(j, 0x0F);
+    emit1(j, 0x80 | cc);
+    add_fixup(j, kind, offset);
+}
+
+static void emit_jmp(Jit *j, int kind, int offset)
+{
+    emit1(j, 0xE9);
+    add_fixup(j, kind, offset);
+}
+
+/* the guard failed, leave current insn to the interpreter */
+static void emit_guard(Jit *j, int cc)
+{
+    emit_jcc(j, cc, FIXUP_EXIT, j->offset);
+}
+
+#define LOCAL(i) ((int)sizeof(Value) * (i))
+
+/* reg = R(i), which must be an int */
+static void emit_load_int(Jit *j, int reg, int i)
+{
+#if !USE_NAN_BOXING
+    /* cmp dword [rbx + tag], VAL_TAG_INT */
+    emit_rex(j, 0, 0, RBX);
+    emit1(j, 0x83);
+    emit_mem(j, 7, RBX, LOCAL(i) + offsetof(Value, tag));
+    emit1(j, VAL_TAG_INT);
+    emit_guard(j, CC_NE);
+    emit_load(j, reg, RBX, LOCAL(i) + offsetof(Value, ival));
+#else
+    /* high 16 bits are 0xFFFF, boxed ints are left to the interpreter */
+    emit_load(j, reg, RBX, LOCAL(i));
+    emit_mov(j, RDX, reg);
+    emit_shift_imm(j, SHIFT_SHR, RDX, 48);
+    emit1(j, 0x81);
+    emit_modrm(j, 3, 7, RDX);
+    emit4(j, 0xFFFF);
+    emit_guard(j, CC_NE);
+    emit_shift_imm(j, SHIFT_SHL, reg, 16);
+    emit_shift_imm(j, SHIFT_SAR, reg, 16);
+#endif
+}
+
+/* R(i) = rax, `small`: rax fits in any int Value */
+static void emit_store_int(Jit *j, int i, int small)
+{
+#if !USE_NAN_BOXING
+    emit_store(j, RBX, LOCAL(i) + offsetof(Value, ival), RAX);
+    emit_store_imm32(j, RBX, LOCAL(i) + offsetof(Value, tag), VAL_TAG_INT);
+#else
+    if (!small) {
+        /* out of 48 bits, the interpreter boxes it */
+        emit_mov(j, RDX, RAX);
+        emit_shift_imm(j, SHIFT_SHL, RDX, 16);
+        emit_shift_imm(j, SHIFT_SAR, RDX, 16);
+        emit_alu(j, ALU_CMP, RDX, RAX);
+        emit_guard(j, CC_NE);
+    }
+    emit_shift_imm(j, SHIFT_SHL, RAX, 16);
+    emit_shift_imm(j, SHIFT_SHR, RAX, 16);
+    emit_mov_imm64(j, RDX, NAN_BOX_INT_TAG);
+    emit_alu(j, ALU_OR, RAX, RDX);
+    emit_store(j, RBX, LOCAL(i), RAX);
+#endif
+}
+
+/* [base + disp] = int constant */
+static void emit_store_int_imm(Jit *j, int base, int disp, int64_t v)
+{
+    Value val = int_value(v);
+#if !USE_NAN_BOXING
+    emit_mov_imm64(j, RAX, (uint64_t)val.ival);
+    emit_store(j, base, disp + offsetof(Value, ival), RAX);
+    emit_store_imm32(j, base, disp + offsetof(Value, tag), VAL_TAG_INT);
+#else
+    emit_mov_imm64(j, RAX, val.bits);
+    emit_store(j, base, disp, RAX);
+#endif
+}
+
+/* leave the insn at `offset` to the interpreter */
+static void emit_exit(Jit *j, int offset)
+{
+    /* mov eax, offset */
+    emit1(j, 0xB8);
+    emit4(j, offset);
+    emit_jmp(j, FIXUP_EXIT, -1);
+}
+
+/* load rbx and r12 from the frame in rbp */
+static void emit_load_frame(Jit *j)
+{
+    /* lea rbx, [rbp + local_stack] */
+    emit_rex(j, 1, RBX, RBP);
+    emit1(j, 0x8D);
+    emit_mem(j, RBX, RBP, offsetof(CallFrame, local_stack));
+    emit_load(j, R12, RBP, offsetof(CallFrame, top));
+}
+
+static void emit_prologue(Jit *j)
+{
+    /* push rbx, r12, rbp, r13, r14, rsp is 16-byte aligned for calls */
+    emit1(j, 0x53);
+    emit1(j, 0x41);
+    emit1(j, 0x54);
+    emit1(j, 0x55);
+    emit1(j, 0x41);
+    emit1(j, 0x55);
+    emit1(j, 0x41);
+    emit1(j, 0x56);
+    emit_mov(j, R14, RSP);
+    emit_alu(j, ALU_XOR, R13, R13);
+    emit_mov(j, RBP, RDI);
+    emit_load_frame(j);
+    /* jmp rsi */
+    emit1(j, 0xFF);
+    emit_modrm(j, 3, 4, RSI);
+}
+
+static void emit_epilogue(Jit *j)
+{
+    /* unwind the native calls */
+    emit_mov(j, RSP, R14);
+    emit_store(j, RBP, offsetof(CallFrame, top), R12);
+    emit1(j, 0x41);
+    emit1(j, 0x5E);
+    emit1(j, 0x41);
+    emit1(j, 0x5D);
+    emit1(j, 0x5D);
+    emit1(j, 0x41);
+    emit1(j, 0x5C);
+    emit1(j, 0x5B);
+    emit1(j, 0xC3);
+}
+
+static int int_cmp_cc(int op)
+{
+    static int ccs[] = { CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE };
+    return ccs[op - OP_INT_CMP_EQ];
+}
+
+/* R(A) = R(B) op R(C) */
+static void emit_int_binary(Jit *j, int op, uint8_t *inst)
+{
+    int A = inst[1], B = inst[2], C = inst[3];
+    emit_load_int(j, RAX, B);
+    emit_load_int(j, RCX, C);
+
+    switch (op) {
+        case OP_INT_ADD:
+            emit_alu(j, ALU_ADD, RAX, RCX);
+            break;
+        case OP_INT_SUB:
+            emit_alu(j, ALU_SUB, RAX, RCX);
+            break;
+        case OP_INT_MUL:
+            emit_imul(j, RAX, RCX);
+            break;
+        case OP_INT_DIV:
+        case OP_INT_MOD:
+            /* zero and -1 divisors are left to the interpreter */
+            emit_rex(j, 1, RDX, RCX);
+            emit1(j, 0x8D);
+            emit_mem(j, RDX, RCX, 1);
+            emit_alu_imm8(j, ALU_IMM_CMP, RDX, 1);
+            emit_guard(j, CC_BE);
+            /* cqo; idiv rcx */
+            emit1(j, 0x48);
+            emit1(j, 0x99);
+            emit_rex(j, 1, 0, RCX);
+            emit1(j, 0xF7);
+            emit_modrm(j, 3, 7, RCX);
+            if (op == OP_INT_MOD) emit_mov(j, RAX, RDX);
+            break;
+        case OP_INT_AND:
+            emit_alu(j, ALU_AND, RAX, RCX);
+            break;
+        case OP_INT_OR:
+            emit_alu(j, ALU_OR, RAX, RCX);
+            break;
+        case OP_INT_XOR:
+            emit_alu(j, ALU_XOR, RAX, RCX);
+            break;
+        case OP_INT_SHL:
+            /* the count is masked by 63 as the interpreter does */
+            emit_shift_cl(j, SHIFT_SHL, RAX);
+            break;
+        case OP_INT_SHR:
+            emit_shift_cl(j, SHIFT_SAR, RAX);
+            break;
+        case OP_INT_USHR:
+            emit_shift_cl(j, SHIFT_SHR, RAX);
+            break;
+        default:
+            /* OP_INT_CMP_XXX */
+            emit_alu(j, ALU_CMP, RAX, RCX);
+            emit_setcc(j, int_cmp_cc(op));
+            emit_store_int(j, A, 1);
+            return;
+    }
+
+    emit_store_int(j, A, 0);
+}
+
+/* helper(cf, offset, edx), the helper sees the value stack */
+static void emit_call_helper(Jit *j, void *fn)
+{
+    emit_store(j, RBP, offsetof(CallFrame, top), R12);
+    emit_mov(j, RDI, RBP);
+    /* mov esi, offset */
+    emit1(j, 0xBE);
+    emit4(j, j->offset);
+    emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)fn);
+    /* call rax */
+    emit1(j, 0xFF);
+    emit_modrm(j, 3, 2, RAX);
+}
+
+/* generic binary op, by the C helper */
+static void emit_binary_generic(Jit *j, int op)
+{
+    /* mov edx, op */
+    emit1(j, 0xBA);
+    emit4(j, op);
+    emit_call_helper(j, jit_binary_generic);
+    /* test eax, eax */
+    emit1(j, 0x85);
+    emit1(j, 0xC0);
+    emit_jcc(j, CC_NE, FIXUP_ERROR, -1);
+}
+
+/* switch to the JitFrame in rax:rdx, returned by a call or return helper */
+static void emit_switch_frame(Jit *j, int call)
+{
+    emit_alu(j, ALU_TEST, RAX, RAX);
+    emit_guard(j, CC_E);
+
+    if (call) {
+        /* the optimized callee is done by the helper, cmp rax, rbp; jne callee */
+        emit_alu(j, ALU_CMP, RAX, RBP);
+        emit1(j, 0x75);
+        int callee = j->len;
+        emit1(j, 0);
+        emit_load_frame(j);
+        emit_alu(j, ALU_TEST, RDX, RDX);
+        emit_jcc(j, CC_E, FIXUP_RESUME, -1);
+        /* jmp rdx */
+        emit1(j, 0xFF);
+        emit_modrm(j, 3, 4, RDX);
+        ASSERT(j->len - (callee + 1) < 128);
+        j->buf[callee] = j->len - (callee + 1);
+    }
+
+    emit_mov(j, RBP, RAX);
+    emit_load_frame(j);
+    emit_alu(j, ALU_TEST, RDX, RDX);
+    emit_jcc(j, CC_E, FIXUP_RESUME, -1);
+
+    if (!call) {
+        /* jmp rdx */
+        emit1(j, 0xFF);
+        emit_modrm(j, 3, 4, RDX);
+        return;
+    }
+
+    /* cmp r13, JIT_MAX_CALLS; jae resume */
+    emit_rex(j, 1, 0, R13);
+    emit1(j, 0x81);
+    emit_modrm(j, 3, ALU_IMM_CMP, R13);
+    emit4(j, JIT_MAX_CALLS);
+    emit_jcc(j, CC_AE, FIXUP_RESUME, -1);
+
+    /* inc r13; sub rsp, 8; call rdx; add rsp, 8, keep rsp aligned */
+    emit_rex(j, 1, 0, R13);
+    emit1(j, 0xFF);
+    emit_modrm(j, 3, 0, R13);
+    emit_alu_imm8(j, ALU_IMM_SUB, RSP, 8);
+    emit1(j, 0xFF);
+    emit_modrm(j, 3, 2, RDX);
+    emit_alu_imm8(j, ALU_IMM_ADD, RSP, 8);
+}
+
+/* return R(A) to the native caller, or by the helper */
+static void emit_return(Jit *j, int A)
+{
+    CodeObject *code = j->code;
+
+    /* test r13, r13; jz slow */
+    emit_alu(j, ALU_TEST, R13, R13);
+    emit1(j, 0x74);
+    int slow = j->len;
+    emit1(j, 0);
+
+    /* *cf->ret = R(A) */
+    emit_load(j, RAX, RBP, offsetof(CallFrame, ret));
+    for (int i = 0; i < (int)sizeof(Value); i += 8) {
+        emit_load(j, RCX, RBX, LOCAL(A) + i);
+        emit_store(j, RAX, i, RCX);
+    }
+
+    /* ks->cf = cf->back; --ks->depth */
+    emit_load(j, RDX, RBP, offsetof(CallFrame, ks));
+    emit_load(j, RCX, RBP, offsetof(CallFrame, back));
+    emit_store(j, RDX, offsetof(KoalaState, cf), RCX);
+    emit1(j, 0xFF);
+    emit_mem(j, 1, RDX, offsetof(KoalaState, depth));
+
+    /* sub qword [rdx + stack_top_ptr], frame size */
+    int size = sizeof(CallFrame) + sizeof(Value) * (code->cs.nlocals + code->cs.stack_size);
+    emit_rex(j, 1, 0, RDX);
+    emit1(j, 0x81);
+    emit_mem(j, 5, RDX, offsetof(KoalaState, stack_top_ptr));
+    emit4(j, size);
+
+    emit_mov(j, RBP, RCX);
+    emit_load_frame(j);
+    /* dec r13; ret */
+    emit_rex(j, 1, 0, R13);
+    emit1(j, 0xFF);
+    emit_modrm(j, 3, 1, R13);
+    emit1(j, 0xC3);
+
+    ASSERT(j->len - (slow + 1) < 128);
+    j->buf[slow] = j->len - (slow + 1);
+    emit_call_helper(j, jit_return);
+    emit_switch_frame(j, 0);
+}
+
+/*
+ * A taken backward jump polls the gc and counts its loop site. The jump is left
+ * to the interpreter if the world is stopping, which suspends the thread there,
+ * at the count before opt_threshold, which compiles the loop, or if the loop is
+ * optimized, which enters it by on-stack replacement.
+ */
+static void emit_back_edge(Jit *j, int cc, int off)
+{
+    /* not taken, jncc skip */
+    emit1(j, 0x70 | (cc ^ 1));
+    int skip = j->len;
+    emit1(j, 0);
+
+    /* cmp dword [gc_safepoint_requested], 0; jne exit */
+    emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)&gc_safepoint_requested);
+    emit1(j, 0x83);
+    emit_mem(j, 7, RAX, 0);
+    emit1(j, 0);
+    emit_guard(j, CC_NE);
+
+    if (opt_threshold) {
+        LoopSite *ls = code_loop_site(j->code, j->offset);
+        /* cmp dword [rax + count], opt_threshold - 1; je exit */
+        emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)ls);
+        emit1(j, 0x81);
+        emit_mem(j, 7, RAX, offsetof(LoopSite, count));
+        emit4(j, opt_threshold - 1);
+        emit_guard(j, CC_E);
+        /* inc dword [rax + count] */
+        emit1(j, 0xFF);
+        emit_mem(j, 0, RAX, offsetof(LoopSite, count));
+        /* cmp qword [rax + osr], 0; jne exit */
+        emit_rex(j, 1, 0, RAX);
+        emit1(j, 0x83);
+        emit_mem(j, 7, RAX, offsetof(LoopSite, osr));
+        emit1(j, 0);
+        emit_guard(j, CC_NE);
+    }
+    emit_jmp(j, FIXUP_JUMP, off);
+
+    ASSERT(j->len - (skip + 1) < 128);
+    j->buf[skip] = j->len - (skip + 1);
+}
+
+/* compile the insn at j->offset, 0: it is left to the interpreter */
+static int emit_insn(Jit *j, int op, uint8_t *inst)
+{
+    switch (op) {
+        case OP_CONST_INT_IMM8: {
+            emit_store_int_imm(j, RBX, LOCAL(inst[1]), (int8_t)inst[2]);
+            return 1;
+        }
+        case OP_JMP_INT_CMP_LT_IMM8:
+        case OP_JMP_INT_CMP_GE_IMM8: {
+            int off = inst[3] | (inst[4] << 8);
+            int cc = op == OP_JMP_INT_CMP_LT_IMM8 ? CC_L : CC_GE;
+            emit_load_int(j, RAX, inst[1]);
+            emit_alu_imm8(j, ALU_IMM_CMP, RAX, (int8_t)inst[2]);
+            if (off < j->offset) {
+                emit_back_edge(j, cc, off);
+            } else {
+                emit_jcc(j, cc, FIXUP_JUMP, off);
+            }
+            return 1;
+        }
+        case OP_INT_ADD ... OP_INT_MOD:
+        case OP_INT_AND ... OP_INT_XOR:
+        case OP_INT_SHL ... OP_INT_CMP_GE: {
+            emit_int_binary(j, op, inst);
+            return 1;
+        }
+        case OP_INT_SUB_IMM8: {
+            emit_load_int(j, RAX, inst[2]);
+            emit_alu_imm8(j, ALU_IMM_SUB, RAX, (int8_t)inst[3]);
+            emit_store_int(j, inst[1], 0);
+            return 1;
+        }
+        case OP_BINARY_ADD ... OP_BINARY_MOD:
+        case OP_BINARY_AND ... OP_BINARY_XOR:
+        case OP_BINARY_SHL ... OP_BINARY_CMP_GE: {
+            emit_binary_generic(j, op);
+            return 1;
+        }
+        case OP_PUSH: {
+            for (int i = 0; i < (int)sizeof(Value); i += 8) {
+                emit_load(j, RAX, RBX, LOCAL(inst[1]) + i);
+                emit_store(j, R12, i, RAX);
+            }
+            emit_alu_imm8(j, ALU_IMM_ADD, R12, sizeof(Value));
+            return 1;
+        }
+        case OP_CALL: {
+            emit_call_helper(j, jit_call);
+            emit_switch_frame(j, 1);
+            return 1;
+        }
+        case OP_RETURN: {
+            emit_return(j, inst[1]);
+            return 1;
+        }
+        case OP_PUSH_IMM8: {
+            emit_store_int_imm(j, R12, 0, (int8_t)inst[1]);
+            emit_alu_imm8(j, ALU_IMM_ADD, R12, sizeof(Value));
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static uint8_t *alloc_exec(Jit *j, int *size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int n = (j->len + page - 1) / page * page;
+    uint8_t *mem = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    memcpy(mem, j->buf, j->len);
+    if (mprotect(mem, n, PROT_READ | PROT_EXEC)) {
+        munmap(mem, n);
+        return NULL;
+    }
+    *size = n;
+    return mem;
+}
+
+static JitCode *_jit_compile(Jit *j)
+{
+    CodeObject *code = j->code;
+    uint8_t *insns = (uint8_t *)code->cs.insns;
+    int size = code->cs.insns_size;
+    int nr_native = 0;
+
+    emit_prologue(j);
+
+    int offset = 0;
+    while (offset < size) {
+        int op = code_unfuse_opcode(insns[offset]);
+        int len = code_insn_length(op);
+        if (len < 0) {
+            log_debug("jit: unknown opcode %d at %d of '%s'", op, offset, code->cs.name);
+            return NULL;
+        }
+        j->offset = offset;
+        j->native[offset] = j->len;
+        if (emit_insn(j, op, insns + offset)) {
+            j->compiled[offset] = 1;
+            ++nr_native;
+        } else {
+            emit_exit(j, offset);
+        }
+        offset += len;
+    }
+
+    if (!nr_native) return NULL;
+
+    /* the last insn falls through */
+    emit_exit(j, size);
+
+    int epilogue = j->len;
+    emit_epilogue(j);
+
+    int error = j->len;
+    emit1(j, 0xB8);
+    emit4(j, JIT_ERROR);
+    emit1(j, 0xE9);
+    emit4(j, epilogue - (j->len + 4));
+
+    int resume = j->len;
+    emit1(j, 0xB8);
+    emit4(j, JIT_RESUME);
+    emit1(j, 0xE9);
+    emit4(j, epilogue - (j->len + 4));
+
+    /* exit stubs of the guards, mov eax, offset; jmp epilogue */
+    int *stubs = mm_alloc(sizeof(int) * (size + 1));
+    Fixup *f;
+    vector_foreach(f, &j->fixups) {
+        if (f->kind != FIXUP_EXIT || f->offset < 0 || stubs[f->offset]) continue;
+        stubs[f->offset] = j->len;
+        emit1(j, 0xB8);
+        emit4(j, f->offset);
+        emit1(j, 0xE9);
+        emit4(j, epilogue - (j->len + 4));
+    }
+
+    int ok = 1;
+    vector_foreach(f, &j->fixups) {
+        int target;
+        if (f->kind == FIXUP_JUMP) {
+            target = f->offset < size ? j->native[f->offset] : -1;
+            if (target < 0) {
+                log_debug("jit: bad jump target %d of '%s'", f->offset, code->cs.name);
+                ok = 0;
+                break;
+            }
+        } else if (f->kind == FIXUP_ERROR) {
+            target = error;
+        } else if (f->kind == FIXUP_RESUME) {
+            target = resume;
+        } else if (f->offset < 0) {
+            target = epilogue;
+        } else {
+            target = stubs[f->offset];
+        }
+        patch4(j, f->pos, target - (f->pos + 4));
+    }
+    mm_free(stubs);
+
+    if (!ok) return NULL;
+
+    int mem_size;
+    uint8_t *mem = alloc_exec(j, &mem_size);
+    if (!mem) {
+        log_error("jit: cannot allocate executable memory");
+        return NULL;
+    }
+
+    JitCode *jc = mm_alloc_obj(jc);
+    jc->mem = mem;
+    jc->size = mem_size;
+    jc->nr_native = nr_native;
+    jc->entries = mm_alloc(sizeof(uint8_t *) * size);
+    for (int i = 0; i < size; i++) {
+        if (j->compiled[i]) jc->entries[i] = mem + j->native[i];
+    }
+    return jc;
+}
+
+int jit_compile(CodeObject *code)
+{
+    if (!jit_threshold) return -1;
+
+    pthread_mutex_lock(&_jit_lock);
+
+    if (code->jit) {
+        pthread_mutex_unlock(&_jit_lock);
+        return 0;
+    }
+
+    int size = code->cs.insns_size;
+    Jit j = { .code = code };
+    j.cap = size * 32 + 64;
+    j.buf = mm_alloc(j.cap);
+    j.native = mm_alloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++) j.native[i] = -1;
+    j.compiled = mm_alloc(size);
+    vector_init(&j.fixups, sizeof(Fixup));
+
+    JitCode *jc = _jit_compile(&j);
+    if (jc) {
+        log_debug("jit: '%s', %d bytes, %d insns native", code->cs.name, j.len,
+                  jc->nr_native);
+        __atomic_store_n(&code->jit, jc, __ATOMIC_RELEASE);
+    }
+
+    vector_fini(&j.fixups);
+    mm_free(j.compiled);
+    mm_free(j.native);
+    mm_free(j.buf);
+
+    pthread_mutex_unlock(&_jit_lock);
+    return jc ? 0 : -1;
+}
+
+#endif /* USE_JIT */
+
+#ifdef __cplusplus
+}
+#endif
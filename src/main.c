@@ -10,7 +10,10 @@ int main(int argc, char *argv[])
 {
     init_log(LOG_INFO, NULL, 0);
     kl_init(argc, argv);
-    kl_run_file(argv[1]);
+    /* the options are parsed by kl_init */
+    int i = 1;
+    while (i < argc && !strncmp(argv[i], "--", 2)) i++;
+    kl_run_file(argv[i]);
     kl_fini();
     return 0;
 }
@@ -28,7 +28,8 @@ TypeObject module_type = {
 
 Object *kl_new_module(const char *name)
 {
-    ModuleObject *m = gc_alloc_obj_p(m);
+    /* its symbols and constants are added later */
+    ModuleObject *m = gc_alloc_obj_pw(m);
     INIT_OBJECT_HEAD(m, &module_type);
 
     vector_init_ptr(&m->symbols);
@@ -4,12 +4,14 @@
  */
 
 #include "buffer.h"
+#include "dictobject.h"
 #include "exception.h"
 #include "moduleobject.h"
 #include "object.h"
 #include "shadowstack.h"
 #include "stringobject.h"
 #include "tupleobject.h"
+#include "weakrefobject.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,6 +26,9 @@ static void init_types(Object *m)
     type_ready(&int_type, m);
     type_ready(&str_type, m);
     type_ready(&tuple_type, m);
+    type_ready(&dict_type, m);
+    type_ready(&weakdict_type, m);
+    type_ready(&weakref_type, m);
 }
 
 static void builtin_print_impl(Value *args, int nargs, Value *_sep, Value *_end,
@@ -61,9 +66,9 @@ static void builtin_print_impl(Value *args, int nargs, Value *_sep, Value *_end,
         if (IS_NONE(arg)) {
             buf_write_str(&buf, "none");
         } else if (IS_INT(arg)) {
-            buf_write_int64(&buf, arg->ival);
+            buf_write_int64(&buf, to_int(arg));
         } else if (IS_FLOAT(arg)) {
-            buf_write_double(&buf, arg->fval);
+            buf_write_double(&buf, to_float(arg));
         } else if (IS_OBJ(arg)) {
             Object *obj = to_obj(arg);
             const char *s;
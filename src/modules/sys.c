@@ -0,0 +1,122 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "dictobject.h"
+#include "moduleobject.h"
+#include "shadowstack.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the dict is pinned by the caller */
+static void set_int(Object *dict, const char *key, int64_t v)
+{
+    Value val = int_value(v);
+    kl_dict_set_str(dict, key, &val);
+}
+
+static void set_float(Object *dict, const char *key, double v)
+{
+    Value val = float_value(v);
+    kl_dict_set_str(dict, key, &val);
+}
+
+static void set_obj(Object *dict, const char *key, Object *obj)
+{
+    Value val = obj_value(obj);
+    kl_dict_set_str(dict, key, &val);
+}
+
+static Object *phase_dict(GcPhaseStats *ps)
+{
+    Object *dict = kl_new_dict();
+    init_gc_stack_push(1, dict);
+    set_int(dict, "count", ps->count);
+    set_int(dict, "total_ns", ps->total_ns);
+    set_int(dict, "max_ns", ps->max_ns);
+
+    Object *hist = kl_new_tuple(GC_HIST_BUCKETS);
+    for (int i = 0; i < GC_HIST_BUCKETS; i++) {
+        TUPLE_SET_ITEM(hist, i, int_value(ps->hist[i]));
+    }
+    set_obj(dict, "hist", hist);
+    fini_gc_stack();
+    return dict;
+}
+
+static Object *types_dict(GcStats *st)
+{
+    Object *dict = kl_new_dict();
+    init_gc_stack_push(1, dict);
+    for (int i = 0; i < st->ntypes; i++) {
+        GcTypeStats *ts = st->types + i;
+        Object *pair = kl_new_tuple(2);
+        TUPLE_SET_ITEM(pair, 0, int_value(ts->objs));
+        TUPLE_SET_ITEM(pair, 1, int_value(ts->bytes));
+        set_obj(dict, gc_type_name(ts), pair);
+    }
+    fini_gc_stack();
+    return dict;
+}
+
+/*
+public func gc_stats() dict
+*/
+static Value sys_gc_stats(Value *module)
+{
+    GcStats *st = mm_alloc(sizeof(GcStats));
+    gc_get_stats(st);
+
+    Object *stats = kl_new_dict();
+    init_gc_stack(2);
+    gc_stack_push(stats);
+
+    set_int(stats, "heap", st->heap_size);
+    set_int(stats, "used", st->used_size);
+    set_int(stats, "live", st->live_size);
+    set_int(stats, "large", st->large_size);
+    set_int(stats, "young_allocated", st->young_allocated);
+    set_int(stats, "old_allocated", st->old_allocated);
+    set_int(stats, "young_freed", st->young_freed);
+    set_int(stats, "old_freed", st->old_freed);
+    set_int(stats, "promoted", st->promoted);
+    set_float(stats, "promotion_rate", st->promotion_rate);
+    set_float(stats, "alloc_rate", st->alloc_rate);
+    set_float(stats, "fragmentation", st->fragmentation);
+    set_int(stats, "compacted", st->compacted);
+
+    Object *phases = kl_new_dict();
+    gc_stack_push(phases);
+    for (int i = GC_MARK_ROOTS; i <= GC_YOUNG; i++) {
+        set_obj(phases, gc_phase_name(i), phase_dict(st->phases + i));
+    }
+    set_obj(stats, "phases", phases);
+    set_obj(stats, "types", types_dict(st));
+
+    fini_gc_stack();
+    mm_free(st);
+    return obj_value(stats);
+}
+
+static MethodDef sys_methods[] = {
+    { "gc_stats", sys_gc_stats, METH_NO_ARGS, "", "Ldict;" },
+    { NULL },
+};
+
+static ModuleDef sys_module = {
+    .name = "sys",
+    .size = 0,
+    .methods = sys_methods,
+    .init = NULL,
+    .fini = NULL,
+};
+
+void init_sys_module(void) { kl_module_def_init(&sys_module); }
+
+#ifdef __cplusplus
+}
+#endif
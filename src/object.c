@@ -4,6 +4,7 @@
  */
 
 #include "exception.h"
+#include "fieldobject.h"
 #include "stringobject.h"
 #include "tupleobject.h"
 
@@ -17,7 +18,7 @@ static TypeObject *mapping[] = {
 
 TypeObject *object_typeof(Value *val)
 {
-    TypeObject *tp = mapping[val->tag];
+    TypeObject *tp = mapping[VAL_TAG(val)];
     if (tp) return tp;
     return OB_TYPE(to_obj(val));
 }
@@ -36,24 +37,69 @@ Value object_call(Value *self, Value *args, int nargs, Object *names)
     return call(self, args, nargs, names);
 }
 
-Object *kl_lookup_method(Value *obj, const char *fname)
+/* lookup a field or a method of the object */
+Object *kl_lookup_attr(Value *obj, const char *name)
 {
     TypeObject *tp = object_typeof(obj);
-    Object *fn = hashmap_get(&tp->map, NULL);
+    int len = strlen(name);
+
+    /* search self firstly, and then its base classes */
+    while (tp) {
+        if (tp->map.entries) {
+            Object *attr = table_find(&tp->map, name, len);
+            if (attr) return attr;
+        }
+        if (tp->base == tp) break;
+        tp = tp->base;
+    }
+
+    return NULL;
+}
+
+Object *kl_lookup_method(Value *obj, const char *fname)
+{
+    Object *fn = kl_lookup_attr(obj, fname);
+    if (fn && IS_FIELD(fn)) return NULL;
     return fn;
 }
 
-Value methodsite_call(MethodSite *ms, Value *args, int nargs, Object *names)
+/* Find the method of `obj` in the call site cache, or do a full lookup and cache it. */
+Object *methodsite_lookup(MethodSite *ms, Value *obj)
 {
-    TypeObject *tp = object_typeof(args);
+    TypeObject *tp = object_typeof(obj);
     ASSERT(tp);
-    if (tp != ms->type) {
-        Object *meth = kl_lookup_method(args, ms->fname);
-        ASSERT(meth);
-        ms->type = tp;
-        ms->method = meth;
+
+    for (int i = 0; i < ms->num; i++) {
+        if (ms->entries[i].type == tp) {
+            ++ms->hits;
+            return ms->entries[i].method;
+        }
+    }
+
+    ++ms->misses;
+    Object *meth = kl_lookup_method(obj, ms->fname);
+    if (!meth) return NULL;
+
+    if (ms->num >= METHOD_SITE_SIZE) {
+        /* too many types, give up caching */
+        ms->num = -1;
+    } else if (ms->num >= 0) {
+        ms->entries[ms->num].type = tp;
+        ms->entries[ms->num].method = meth;
+        ++ms->num;
+    }
+    return meth;
+}
+
+Value methodsite_call(MethodSite *ms, Value *args, int nargs, Object *names)
+{
+    Object *meth = methodsite_lookup(ms, args);
+    if (!meth) {
+        raise_exc_fmt("'%s' object has no method '%s'", object_typeof(args)->name,
+                      ms->fname);
+        return error_value;
     }
-    Value v = obj_value(ms->method);
+    Value v = obj_value(meth);
     return object_call(&v, args, nargs, names);
 }
 
@@ -0,0 +1,108 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "eval.h"
+#include <pthread.h>
+#include "log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef OPCODE_PROFILE
+
+/*
+ * Opcode frequencies of all interpreter loops, dumped at exit and used by
+ * tools/gen_superinsns.py to generate superinstructions.
+ */
+
+#define MAX_OPCODES 256
+
+/* triples are sparse, save them in an open addressing table */
+#define TRIPLE_TABLE_SIZE 8192
+
+typedef struct _TripleEntry {
+    /* (a << 16 | b << 8 | c) + 1, 0 is empty */
+    uint32_t key;
+    uint64_t count;
+} TripleEntry;
+
+static uint64_t _singles[MAX_OPCODES];
+static uint64_t _pairs[MAX_OPCODES][MAX_OPCODES];
+static TripleEntry _triples[TRIPLE_TABLE_SIZE];
+static pthread_mutex_t _triple_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_triple(int a, int b, int c)
+{
+    uint32_t key = ((uint32_t)a << 16 | (uint32_t)b << 8 | (uint32_t)c) + 1;
+    uint32_t i = (key * 2654435761u) & (TRIPLE_TABLE_SIZE - 1);
+
+    pthread_mutex_lock(&_triple_lock);
+    for (int n = 0; n < TRIPLE_TABLE_SIZE; n++) {
+        TripleEntry *e = _triples + i;
+        if (e->key == key || !e->key) {
+            e->key = key;
+            ++e->count;
+            break;
+        }
+        i = (i + 1) & (TRIPLE_TABLE_SIZE - 1);
+    }
+    pthread_mutex_unlock(&_triple_lock);
+}
+
+void opcode_profile_record(int prev2, int prev1, int opcode)
+{
+    __atomic_fetch_add(&_singles[opcode], 1, __ATOMIC_RELAXED);
+    if (prev1 < 0) return;
+    __atomic_fetch_add(&_pairs[prev1][opcode], 1, __ATOMIC_RELAXED);
+    if (prev2 < 0) return;
+    record_triple(prev2, prev1, opcode);
+}
+
+/*
+ * One record per line:
+ *   single <count> <op>
+ *   pair   <count> <op1> <op2>
+ *   triple <count> <op1> <op2> <op3>
+ */
+void opcode_profile_dump(void)
+{
+    const char *path = getenv("KOALA_OPCODE_PROFILE");
+    if (!path) path = "opcode_profile.txt";
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_error("cannot open opcode profile '%s'", path);
+        return;
+    }
+
+    fprintf(fp, "# koala opcode profile\n");
+
+    for (int i = 0; i < MAX_OPCODES; i++) {
+        if (_singles[i]) fprintf(fp, "single %lu %d\n", _singles[i], i);
+    }
+
+    for (int i = 0; i < MAX_OPCODES; i++) {
+        for (int j = 0; j < MAX_OPCODES; j++) {
+            if (_pairs[i][j]) fprintf(fp, "pair %lu %d %d\n", _pairs[i][j], i, j);
+        }
+    }
+
+    for (int i = 0; i < TRIPLE_TABLE_SIZE; i++) {
+        TripleEntry *e = _triples + i;
+        if (!e->key) continue;
+        uint32_t k = e->key - 1;
+        fprintf(fp, "triple %lu %d %d %d\n", e->count, (k >> 16) & 0xff, (k >> 8) & 0xff,
+                k & 0xff);
+    }
+
+    fclose(fp);
+}
+
+#endif /* OPCODE_PROFILE */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,155 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+/*
+ * Threaded dispatch table of _eval_frame, included inside the function body.
+ * One entry per OpCode and in the same order as opcode.h, opcodes without a
+ * handler jump to `_unknown_opcode`. Superinstructions are generated.
+ */
+
+/* clang-format off */
+static void *opcode_targets[] = {
+    &&_unknown_opcode,               /* OP_NOP */
+    &&_unknown_opcode,               /* OP_MOVE */
+    &&TARGET_OP_PUSH,                /* OP_PUSH */
+    &&_unknown_opcode,               /* OP_POP */
+    &&_unknown_opcode,               /* OP_PUSH_NONE */
+    &&TARGET_OP_PUSH_IMM8,           /* OP_PUSH_IMM8 */
+    &&TARGET_OP_CONST_LOAD,          /* OP_CONST_LOAD */
+    &&_unknown_opcode,               /* OP_CONST_NONE */
+    &&_unknown_opcode,               /* OP_CONST_INT_M1 */
+    &&TARGET_OP_CONST_INT_0,         /* OP_CONST_INT_0 */
+    &&_unknown_opcode,               /* OP_CONST_INT_1 */
+    &&_unknown_opcode,               /* OP_CONST_INT_2 */
+    &&_unknown_opcode,               /* OP_CONST_INT_3 */
+    &&_unknown_opcode,               /* OP_CONST_INT_4 */
+    &&_unknown_opcode,               /* OP_CONST_INT_5 */
+    &&TARGET_OP_CONST_INT_IMM8,      /* OP_CONST_INT_IMM8 */
+    &&_unknown_opcode,               /* OP_CONST_FLOAT_0 */
+    &&_unknown_opcode,               /* OP_CONST_FLOAT_1 */
+    &&_unknown_opcode,               /* OP_CONST_FLOAT_2 */
+    &&_unknown_opcode,               /* OP_CONST_FLOAT_3 */
+    &&TARGET_OP_INT_ADD,             /* OP_INT_ADD */
+    &&TARGET_OP_INT_SUB,             /* OP_INT_SUB */
+    &&TARGET_OP_INT_MUL,             /* OP_INT_MUL */
+    &&TARGET_OP_INT_DIV,             /* OP_INT_DIV */
+    &&TARGET_OP_INT_MOD,             /* OP_INT_MOD */
+    &&_unknown_opcode,               /* OP_INT_NEG */
+    &&TARGET_OP_INT_AND,             /* OP_INT_AND */
+    &&TARGET_OP_INT_OR,              /* OP_INT_OR */
+    &&TARGET_OP_INT_XOR,             /* OP_INT_XOR */
+    &&_unknown_opcode,               /* OP_INT_NOT */
+    &&TARGET_OP_INT_SHL,             /* OP_INT_SHL */
+    &&TARGET_OP_INT_SHR,             /* OP_INT_SHR */
+    &&TARGET_OP_INT_USHR,            /* OP_INT_USHR */
+    &&TARGET_OP_INT_CMP_EQ,          /* OP_INT_CMP_EQ */
+    &&TARGET_OP_INT_CMP_NE,          /* OP_INT_CMP_NE */
+    &&TARGET_OP_INT_CMP_LT,          /* OP_INT_CMP_LT */
+    &&TARGET_OP_INT_CMP_GT,          /* OP_INT_CMP_GT */
+    &&TARGET_OP_INT_CMP_LE,          /* OP_INT_CMP_LE */
+    &&TARGET_OP_INT_CMP_GE,          /* OP_INT_CMP_GE */
+    &&_unknown_opcode,               /* OP_INT_ADD_IMM8 */
+    &&TARGET_OP_INT_SUB_IMM8,        /* OP_INT_SUB_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_MUL_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_DIV_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_MOD_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_AND_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_OR_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_XOR_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_SHL_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_SHR_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_USHR_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_EQ_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_NE_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_LT_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_GT_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_LE_IMM8 */
+    &&_unknown_opcode,               /* OP_INT_CMP_GE_IMM8 */
+    &&TARGET_OP_FLOAT_ADD,           /* OP_FLOAT_ADD */
+    &&TARGET_OP_FLOAT_SUB,           /* OP_FLOAT_SUB */
+    &&TARGET_OP_FLOAT_MUL,           /* OP_FLOAT_MUL */
+    &&TARGET_OP_FLOAT_DIV,           /* OP_FLOAT_DIV */
+    &&TARGET_OP_FLOAT_MOD,           /* OP_FLOAT_MOD */
+    &&_unknown_opcode,               /* OP_FLOAT_NEG */
+    &&_unknown_opcode,               /* OP_FLOAT_CMPL */
+    &&_unknown_opcode,               /* OP_FLOAT_CMPG */
+    &&_unknown_opcode,               /* OP_AS */
+    &&_unknown_opcode,               /* OP_IS */
+    &&_unknown_opcode,               /* OP_LAND */
+    &&_unknown_opcode,               /* OP_LOR */
+    &&_unknown_opcode,               /* OP_LNOT */
+    &&_unknown_opcode,               /* OP_JMP */
+    &&_unknown_opcode,               /* OP_JMP_TRUE */
+    &&_unknown_opcode,               /* OP_JMP_FALSE */
+    &&_unknown_opcode,               /* OP_JMP_NONE */
+    &&_unknown_opcode,               /* OP_JMP_NOT_NONE */
+    &&_unknown_opcode,               /* OP_JMP_CMP_EQ */
+    &&_unknown_opcode,               /* OP_JMP_CMP_NE */
+    &&_unknown_opcode,               /* OP_JMP_CMP_LT */
+    &&_unknown_opcode,               /* OP_JMP_CMP_GT */
+    &&_unknown_opcode,               /* OP_JMP_CMP_LE */
+    &&_unknown_opcode,               /* OP_JMP_CMP_GE */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_EQ */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_NE */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_LT */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_GT */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_LE */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_GE */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_EQ_IMM8 */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_NE_IMM8 */
+    &&TARGET_OP_JMP_INT_CMP_LT_IMM8, /* OP_JMP_INT_CMP_LT_IMM8 */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_GT_IMM8 */
+    &&_unknown_opcode,               /* OP_JMP_INT_CMP_LE_IMM8 */
+    &&TARGET_OP_JMP_INT_CMP_GE_IMM8, /* OP_JMP_INT_CMP_GE_IMM8 */
+    &&TARGET_OP_CALL,                /* OP_CALL */
+    &&TARGET_OP_CALL_METHOD,         /* OP_CALL_METHOD */
+    &&_unknown_opcode,               /* OP_CALL_DYNAMIC */
+    &&TARGET_OP_CALL_KW,             /* OP_CALL_KW */
+    &&_unknown_opcode,               /* OP_CALL_METHOD_KW */
+    &&_unknown_opcode,               /* OP_CALL_DYNAMIC_KW */
+    &&TARGET_OP_RETURN,              /* OP_RETURN */
+    &&TARGET_OP_RETURN_NONE,         /* OP_RETURN_NONE */
+    &&_unknown_opcode,               /* OP_GLOBAL_LOAD */
+    &&_unknown_opcode,               /* OP_GLOBAL_STORE */
+    &&TARGET_OP_FIELD_LOAD,          /* OP_FIELD_LOAD */
+    &&_unknown_opcode,               /* OP_FIELD_STORE */
+    &&TARGET_OP_BINARY_ADD,          /* OP_BINARY_ADD */
+    &&TARGET_OP_BINARY_SUB,          /* OP_BINARY_SUB */
+    &&TARGET_OP_BINARY_MUL,          /* OP_BINARY_MUL */
+    &&TARGET_OP_BINARY_DIV,          /* OP_BINARY_DIV */
+    &&TARGET_OP_BINARY_MOD,          /* OP_BINARY_MOD */
+    &&_unknown_opcode,               /* OP_UNARY_NEG */
+    &&TARGET_OP_BINARY_AND,          /* OP_BINARY_AND */
+    &&TARGET_OP_BINARY_OR,           /* OP_BINARY_OR */
+    &&TARGET_OP_BINARY_XOR,          /* OP_BINARY_XOR */
+    &&_unknown_opcode,               /* OP_UNARY_NOT */
+    &&TARGET_OP_BINARY_SHL,          /* OP_BINARY_SHL */
+    &&TARGET_OP_BINARY_SHR,          /* OP_BINARY_SHR */
+    &&TARGET_OP_BINARY_USHR,         /* OP_BINARY_USHR */
+    &&TARGET_OP_BINARY_CMP_EQ,       /* OP_BINARY_CMP_EQ */
+    &&TARGET_OP_BINARY_CMP_NE,       /* OP_BINARY_CMP_NE */
+    &&TARGET_OP_BINARY_CMP_LT,       /* OP_BINARY_CMP_LT */
+    &&TARGET_OP_BINARY_CMP_GT,       /* OP_BINARY_CMP_GT */
+    &&TARGET_OP_BINARY_CMP_LE,       /* OP_BINARY_CMP_LE */
+    &&TARGET_OP_BINARY_CMP_GE,       /* OP_BINARY_CMP_GE */
+    &&_unknown_opcode,               /* OP_SUBSCR_LOAD */
+    &&_unknown_opcode,               /* OP_SUBSCR_STORE */
+    &&TARGET_OP_ATTR_LOAD,           /* OP_ATTR_LOAD */
+    &&_unknown_opcode,               /* OP_ATTR_STORE */
+    &&TARGET_OP_REL_LOAD,            /* OP_REL_LOAD */
+    &&_unknown_opcode,               /* OP_GET_ITER */
+    &&_unknown_opcode,               /* OP_ITER_NEXT */
+    &&_unknown_opcode,               /* OP_RAISE */
+    &&TARGET_OP_BINARY_METHOD,       /* OP_BINARY_METHOD */
+    &&_unknown_opcode,               /* OP_IR_LOAD */
+    &&_unknown_opcode,               /* OP_IR_STORE */
+    &&_unknown_opcode,               /* OP_IR_PHI */
+    &&_unknown_opcode,               /* OP_IR_JMP_COND */
+    SUPER_TARGETS
+};
+/* clang-format on */
+
+_Static_assert(COUNT_OF(opcode_targets) == OP_IR_JMP_COND + 1 + NUM_SUPER_INSNS,
+               "opcode_targets is out of sync with opcode.h");
@@ -6,8 +6,10 @@
 #include "run.h"
 #include <unistd.h>
 #include "eval.h"
+#include "jit.h"
 #include "log.h"
 #include "mm.h"
+#include "moduleobject.h"
 #include "shadowstack.h"
 
 #ifdef __cplusplus
@@ -119,6 +121,7 @@ static void init_threads(int nthreads)
     /* initialize main thread as koala thread */
     ThreadState *ts = _threads;
     lldq_init(&ts->run_list);
+    gc_init_tlab(&ts->tlab);
     ts->current = ks_new();
     ts->id = 1;
     ts->steal_count = 0;
@@ -129,6 +132,7 @@ static void init_threads(int nthreads)
     for (int i = 1; i < nthreads; i++) {
         ts = _threads + i;
         lldq_init(&ts->run_list);
+        gc_init_tlab(&ts->tlab);
         ts->current = NULL;
         ts->id = i + 1;
         ts->steal_count = 0;
@@ -138,13 +142,21 @@ static void init_threads(int nthreads)
     }
 }
 
+void init_type_table(void);
 void init_builtin_module(void);
 void init_sys_module(void);
 
 void kl_init(int argc, char *argv[])
 {
-    /* init garbage collection */
-    init_gc_system(MAX_GC_MEM_SIZE, 0.8f);
+    init_type_table();
+
+    /* init garbage collection, the options of the vm are before the file */
+    GcOptions opts;
+    gc_init_options(&opts, MAX_GC_MEM_SIZE);
+    for (int i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (gc_parse_option(&opts, argv[i])) log_warn("unknown option: '%s'", argv[i]);
+    }
+    init_gc_system(&opts);
 
     /* init global mutex&cond */
     pthread_mutex_init(&_gs_mutex, NULL);
@@ -163,7 +175,12 @@ void kl_init(int argc, char *argv[])
 
     /* init builtin & sys module */
     init_builtin_module();
-    // init_sys_module(ks);
+    init_sys_module();
+
+    jit_init();
+    opt_init();
+
+    gc_seal_perm();
 }
 
 static int done(void)
@@ -226,6 +243,9 @@ void kl_run_file(const char *filename)
 
 void kl_fini(void)
 {
+    /* the collector stops the mutators no more */
+    gc_wait_done();
+
     // signal to all suspended pthread
     pthread_mutex_lock(&_gs_mutex);
     for (int i = 1; i < __nthreads; i++) {
@@ -247,8 +267,15 @@ void kl_fini(void)
     ASSERT(lldq_empty(&_gs_done_list));
 
     ks_free(__ts->current);
+    for (int i = 0; i < __nthreads; i++) {
+        gc_fini_tlab(&_threads[i].tlab);
+    }
     mm_free(_threads);
 
+#ifdef OPCODE_PROFILE
+    opcode_profile_dump();
+#endif
+
     fini_gc_system();
 }
 
@@ -258,7 +285,8 @@ int check_all_threads_stw(void)
 {
     int yes = 1;
 
-    for (int i = 1; i < __nthreads; i++) {
+    /* the main thread is a mutator too */
+    for (int i = 0; i < __nthreads; i++) {
         ThreadState *ts = _threads + i;
         if (ts->state != TS_GC_STW) {
             yes = 0;
@@ -269,51 +297,91 @@ int check_all_threads_stw(void)
     return yes;
 }
 
-static void enum_koala_state(Queue *que, KoalaState *ks)
+/* the objects of the C functions, pinned by a minor gc */
+static void enum_shadow_stacks(GcMarkStack *stk, KoalaState *ks)
 {
-    if (!ks) return;
-
-    CallFrame *cf = ks->cf;
-    while (cf) {
-        int size = cf->local_size + cf->stack_size;
-        Value *v;
-        for (int i = 0; i < size; i++) {
-            v = cf->local_stack + i;
-            gc_mark_value(v, que);
-        }
-        cf = cf->back;
-    }
-
-    /* enumerate trace shadow stack */
     ShadowStack *trace = ks->shadow_stacks;
     while (trace) {
         void *obj;
         for (int i = 0; i < trace->avail; i++) {
             obj = trace->objs[i];
-            gc_mark_obj(obj, que);
+            gc_mark_obj(obj, stk);
         }
         trace = trace->back;
     }
 }
 
-int enum_all_roots(Queue *que)
+/* the slots of the frames are updated by a minor gc */
+static void enum_frames(GcMarkStack *stk, KoalaState *ks)
+{
+    CallFrame *cf = ks->cf;
+    while (cf) {
+        /* a frame is stopped at a safepoint, the dead registers are skipped */
+        int offset = cf->next_inst - (uint8_t *)cf->code->cs.insns;
+        uint64_t *live = code_live_regs(cf->code, offset);
+        for (int i = 0; i < cf->local_size; i++) {
+            if (live && !(live[i >> 6] & ((uint64_t)1 << (i & 63)))) continue;
+            gc_mark_value(cf->local_stack + i, stk);
+        }
+
+        /* the value stack up to its top */
+        Value *top = live ? cf->top : cf->stack + cf->stack_size;
+        for (Value *v = cf->stack; v < top; v++) gc_mark_value(v, stk);
+        cf = cf->back;
+    }
+
+    gc_mark_field(&ks->exc, stk);
+}
+
+static void enum_koala_states(GcMarkStack *stk,
+                              void (*enum_func)(GcMarkStack *, KoalaState *))
 {
     /* enum global running list */
     KoalaState *ks;
     lldq_foreach(ks, link, &_gs_run_list) {
-        enum_koala_state(que, ks);
+        enum_func(stk, ks);
     }
 
     /* enum local running lists */
     for (int i = 0; i < __nthreads; i++) {
         ThreadState *ts = _threads + i;
-        enum_koala_state(que, ts->current);
+        if (ts->current) enum_func(stk, ts->current);
         lldq_foreach(ks, link, &ts->run_list) {
-            enum_koala_state(que, ks);
+            enum_func(stk, ks);
+        }
+    }
+}
+
+/* the constants of the modules, the modules are permanent */
+static void enum_module_consts(GcMarkStack *stk)
+{
+    HashMapIter it = { 0 };
+    while (hashmap_next(&_gs_modules, &it)) {
+        ModuleObject *m = (ModuleObject *)((SymbolEntry *)it.entry)->obj;
+        for (int i = 0; i < vector_size(&m->consts); i++) {
+            gc_mark_value(vector_get(&m->consts, i), stk);
         }
     }
+}
+
+/* pushed, not marked */
+static void push_shadow_stacks(GcMarkStack *stk, KoalaState *ks)
+{
+    for (ShadowStack *trace = ks->shadow_stacks; trace; trace = trace->back) {
+        for (int i = 0; i < trace->avail; i++) gc_mark_stack_push(stk, trace->objs[i]);
+    }
+}
+
+void enum_pinned_roots(GcMarkStack *stk) { enum_koala_states(stk, push_shadow_stacks); }
+
+int enum_all_roots(GcMarkStack *stk)
+{
+    /* pinned before the frames move them */
+    enum_koala_states(stk, enum_shadow_stacks);
+    enum_koala_states(stk, enum_frames);
 
     /* enum global variables */
+    enum_module_consts(stk);
 
     return 0;
 }
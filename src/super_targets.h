@@ -0,0 +1,75 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+/* Generated by tools/gen_superinsns.py, DO NOT EDIT! */
+
+/* Superinstruction handlers, included inside the switch of _eval_frame. */
+
+TARGET(OP_SUPER_INT_SUB_IMM8_PUSH_CALL): {
+    /* OP_INT_SUB_IMM8 */
+    {
+        int A = NEXT_REG();
+        int B = NEXT_REG();
+        int imm = NEXT_INT8();
+        Value *rb = GET_LOCAL(B);
+        ASSERT(IS_INT(rb));
+        int64_t r = to_int(rb) - imm;
+        SET_INT_LOCAL(A, r);
+    }
+    /* skip the kept opcode of OP_PUSH */
+    next_inst++;
+    /* OP_PUSH */
+    {
+        int A = NEXT_REG();
+        Value *ra = GET_LOCAL(A);
+        PUSH(ra);
+    }
+    /* skip the kept opcode of OP_CALL */
+    next_inst++;
+    /* OP_CALL */
+    {
+        int rel = NEXT_INT8();
+        int sym = NEXT_INT8();
+        int nargs = NEXT_INT8();
+        int A = NEXT_REG();
+        Object *callable = _get_symbol(cf, rel, sym);
+        ASSERT(callable);
+        Value *ra = GET_LOCAL(A);
+        SAVE_FRAME();
+        if (IS_CODE(callable)) {
+            CALL_CODE((CodeObject *)callable, nargs, ra);
+            DISPATCH();
+        }
+        _call_function(callable, cf->stack, nargs, NULL, cf, ra);
+        if (IS_ERROR(ra)) {
+            ASSERT(_exc_occurred(ks));
+            *result = *ra;
+            goto error;
+        }
+        SHRINK(nargs);
+        DISPATCH();
+    }
+}
+
+TARGET(OP_SUPER_INT_ADD_RETURN): {
+    /* OP_INT_ADD */
+    {
+        INT_BINARY_OP(OP_BINARY_ADD, +);
+    }
+    /* skip the kept opcode of OP_RETURN */
+    next_inst++;
+    /* OP_RETURN */
+    {
+        int A = NEXT_REG();
+        Value *ra = GET_LOCAL(A);
+        if (cf->ret) {
+            SET(cf->ret, ra);
+            RETURN_TO_CALLER();
+            DISPATCH();
+        }
+        SET(result, ra);
+        goto done;
+    }
+}
@@ -17,11 +17,17 @@ static Value tuple_str(Value *self)
     return r;
 }
 
+static void tuple_gc_mark(TupleObject *obj, GcMarkStack *stk)
+{
+    gc_mark_field(&obj->array, stk);
+}
+
 TypeObject tuple_type = {
     OBJECT_HEAD_INIT(&type_type),
     .name = "tuple",
     .flags = TP_FLAGS_CLASS | TP_FLAGS_FINAL | TP_FLAGS_PUBLIC,
     .str = tuple_str,
+    .mark = (GcMarkFunc)tuple_gc_mark,
 };
 
 Object *kl_new_tuple(int size)
@@ -34,7 +40,7 @@ Object *kl_new_tuple(int size)
     init_gc_stack_push(1, x);
     GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_VALUE, size);
     fini_gc_stack();
-    x->array = arr;
+    gc_store_obj(x, &x->array, arr);
 
     Value *values = (Value *)(arr + 1);
     for (int i = 0; i < size; i++) {
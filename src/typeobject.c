@@ -3,6 +3,7 @@
  * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
  */
 
+#include <pthread.h>
 #include "exception.h"
 #include "moduleobject.h"
 #include "object.h"
@@ -67,12 +68,34 @@ static Value type_call(Value *self, Value *args, int nargs, Object *names)
 
 TypeObject type_type = {
     OBJECT_HEAD_INIT(&type_type),
+    .index = TYPE_INDEX_TYPE,
     .name = "type",
     .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC | TP_FLAGS_FINAL | TP_FLAGS_META,
     .str = type_str,
     .call = type_call,
 };
 
+/* not initialized, or it is in the data section */
+TypeObject *kl_type_table[TYPE_TABLE_SIZE];
+static int _type_count = TYPE_INDEX_TYPE + 1;
+static pthread_mutex_t _type_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_type_table(void) { kl_type_table[TYPE_INDEX_TYPE] = &type_type; }
+
+int kl_register_type(TypeObject *tp)
+{
+    pthread_mutex_lock(&_type_lock);
+    int index = tp->index;
+    if (!index) {
+        if (_type_count >= TYPE_TABLE_SIZE) panic("too many types");
+        index = _type_count++;
+        kl_type_table[index] = tp;
+        __atomic_store_n(&tp->index, index, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_type_lock);
+    return index;
+}
+
 #ifdef __cplusplus
 }
 #endif
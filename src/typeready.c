@@ -4,6 +4,7 @@
  */
 
 #include "cfuncobject.h"
+#include "fieldobject.h"
 #include "hashmap.h"
 #include "moduleobject.h"
 #include "stringobject.h"
@@ -28,6 +29,23 @@ static int _type_ready(TypeObject *tp, Object *m)
         ++def;
     }
 
+    // add members and getsets to type
+    MemberDef *member = tp->members;
+    while (member && member->name) {
+        Object *field = kl_field_from_member(member);
+        vector_push_back(tp->fields, &field);
+        table_add_object(&tp->map, member->name, field);
+        ++member;
+    }
+
+    GetSetDef *getset = tp->getsets;
+    while (getset && getset->name) {
+        Object *field = kl_field_from_getset(getset);
+        vector_push_back(tp->fields, &field);
+        table_add_object(&tp->map, getset->name, field);
+        ++getset;
+    }
+
     TypeObject *base;
 
     if (!tp->base) {
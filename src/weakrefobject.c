@@ -0,0 +1,46 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "weakrefobject.h"
+#include "shadowstack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void weakref_gc_mark(WeakRefObject *ref, GcMarkStack *stk)
+{
+    gc_mark_weak(&ref->obj, stk);
+}
+
+TypeObject weakref_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "weakref",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC | TP_FLAGS_FINAL,
+    .mark = (GcMarkFunc)weakref_gc_mark,
+};
+
+Object *kl_new_weakref(Object *obj)
+{
+    init_gc_stack_push(1, obj);
+    WeakRefObject *ref = gc_alloc_obj(ref);
+    INIT_OBJECT_HEAD(ref, &weakref_type);
+    gc_store_obj(ref, &ref->obj, obj);
+    fini_gc_stack();
+    return (Object *)ref;
+}
+
+Object *kl_weakref_get(Object *self)
+{
+    ASSERT(IS_WEAKREF(self));
+    WeakRefObject *ref = (WeakRefObject *)self;
+    Object *obj = __atomic_load_n(&ref->obj, __ATOMIC_ACQUIRE);
+    gc_keep_alive(obj);
+    return obj;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include <time.h>
+#include "codeobject.h"
+#include "jit.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined(USE_COMPUTED_GOTOS) || USE_COMPUTED_GOTOS
+#define DISPATCH_NAME "computed-goto"
+#else
+#define DISPATCH_NAME "switch"
+#endif
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* usage: bench_dispatch [n] [rounds], KOALA_JIT_THRESHOLD=0 disables jit,
+ * KOALA_OPT_THRESHOLD=0 disables llvm */
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 32;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+    Object *m = kl_new_module("fib");
+
+    /* same bytecode as test_fib.c */
+    /* clang-format off */
+    char fib_insns[] = {
+        OP_JMP_INT_CMP_GE_IMM8, 0, 2, 7, 0,
+        OP_RETURN, 0,
+        OP_INT_SUB_IMM8, 1, 0, 1,
+        OP_PUSH, 1,
+        OP_CALL, 0, 0, 1, 1,
+        OP_INT_SUB_IMM8, 2, 0, 2,
+        OP_PUSH, 2,
+        OP_CALL, 0, 0, 1, 2,
+        OP_INT_ADD, 0, 1, 2,
+        OP_RETURN, 0,
+    };
+    /* clang-format on */
+
+    CodeObject *code = (CodeObject *)kl_new_code("fib", m, NULL);
+    code->cs.insns = fib_insns;
+    code->cs.insns_size = sizeof(fib_insns);
+    code->cs.nargs = 1;
+    code->cs.nlocals = 4;
+    code->cs.stack_size = 1;
+    module_add_object(m, "fib", (Object *)code);
+
+    Value self = obj_value(code);
+    Value args[] = { int_value(n) };
+    Value result;
+    double best = 0;
+
+    for (int i = 0; i < rounds; i++) {
+        double start = now_ms();
+        result = object_call(&self, args, 1, NULL);
+        double cost = now_ms() - start;
+        if (i == 0 || cost < best) best = cost;
+    }
+
+    const char *tier = opt_threshold ? "+llvm" : jit_threshold ? "+jit" : "";
+
+    printf("%-14s%-5s fib(%d) = %ld, best of %d: %.2f ms\n", DISPATCH_NAME, tier, n,
+           to_int(&result), rounds, best);
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include <time.h>
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* usage: bench_gc_pause [n] [rounds], full gc pauses with n live tuples */
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+    Object *all = kl_new_tuple(n);
+    init_gc_stack_push(1, all);
+
+    /* every tuple refers to the previous one too */
+    for (int i = 0; i < n; i++) {
+        Object *x = kl_new_tuple(2);
+        TUPLE_SET_ITEM(x, 0, int_value(i));
+        if (i > 0) TUPLE_SET_ITEM(x, 1, TUPLE_ITEMS(all)[i - 1]);
+        TUPLE_SET_ITEM(all, i, obj_value(x));
+    }
+
+    double best = 0;
+    double total = 0;
+    for (int i = 0; i < rounds; i++) {
+        double start = now_ms();
+        gc_collect();
+        double cost = now_ms() - start;
+        if (i == 0 || cost < best) best = cost;
+        total += cost;
+    }
+
+    printf("full gc with %d tuples, best of %d: %.2f ms, average: %.2f ms\n", n, rounds,
+           best, total / rounds);
+
+    fini_gc_stack();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
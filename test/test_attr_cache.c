@@ -0,0 +1,141 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include <stddef.h>
+#include "codeobject.h"
+#include "exception.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _Point {
+    OBJECT_HEAD
+    int64_t x;
+    int32_t y;
+} Point;
+
+/* same fields, different layout */
+typedef struct _Point2 {
+    OBJECT_HEAD
+    int32_t y;
+    int64_t x;
+} Point2;
+
+static MemberDef point_members[] = {
+    { "x", "i", MER_T_LONG, offsetof(Point, x) },
+    { "y", "i", MBR_T_INT, offsetof(Point, y) },
+    { NULL },
+};
+
+static MemberDef point2_members[] = {
+    { "x", "i", MER_T_LONG, offsetof(Point2, x) },
+    { "y", "i", MBR_T_INT, offsetof(Point2, y) },
+    { NULL },
+};
+
+static TypeObject point_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "Point",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC,
+    .members = point_members,
+};
+
+static TypeObject point2_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "Point2",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC,
+    .members = point2_members,
+};
+
+static CodeObject *new_code(Object *m, char *insns, int size)
+{
+    CodeObject *code = (CodeObject *)kl_new_code("attr", m, NULL);
+    code->cs.insns = insns;
+    code->cs.insns_size = size;
+    code->cs.nargs = 1;
+    code->cs.nlocals = 3;
+    code->cs.stack_size = 0;
+    return code;
+}
+
+static Value call1(CodeObject *code, Object *obj)
+{
+    Value self = obj_value(code);
+    Value args[] = { obj_value(obj) };
+    return object_call(&self, args, 1, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+    Object *m = kl_new_module("test_attr_cache");
+    module_add_str_const(m, "x");
+    module_add_str_const(m, "y");
+    module_add_str_const(m, "z");
+    type_ready(&point_type, m);
+
+    Point *p = gc_alloc_obj(p);
+    INIT_OBJECT_HEAD(p, &point_type);
+    p->x = 100;
+    p->y = 20;
+
+    /* return p.z */
+    char _insns2[] = {
+        OP_FIELD_LOAD, 1, 0, 2, 0, OP_RETURN, 1,
+    };
+    CodeObject *code2 = new_code(m, _insns2, sizeof(_insns2));
+    Value r = call1(code2, (Object *)p);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+
+    type_ready(&point2_type, m);
+    Point2 *p2 = gc_alloc_obj(p2);
+    INIT_OBJECT_HEAD(p2, &point2_type);
+    p2->x = 1;
+    p2->y = 2;
+
+    /* return p.x + p.y */
+    /* clang-format off */
+    char _insns[] = {
+        OP_ATTR_LOAD, 1, 0, 0, 0,
+        OP_FIELD_LOAD, 2, 0, 1, 0,
+        OP_INT_ADD, 1, 1, 2,
+        OP_RETURN, 1,
+    };
+    /* clang-format on */
+    CodeObject *code = new_code(m, _insns, sizeof(_insns));
+    AttrSite *as = &code_inline_cache(code, 0)->as;
+    AttrSite *as2 = &code_inline_cache(code, 5)->as;
+
+    for (int i = 0; i < 3; i++) {
+        r = call1(code, (Object *)p);
+        ASSERT(IS_INT(&r) && to_int(&r) == 120);
+    }
+    ASSERT(as->type == &point_type && as->offset == offsetof(Point, x));
+    ASSERT(as2->type == &point_type && as2->offset == offsetof(Point, y));
+
+    /* guard failed, cached by new type */
+    r = call1(code, (Object *)p2);
+    ASSERT(IS_INT(&r) && to_int(&r) == 3);
+    ASSERT(as->type == &point2_type && as->offset == offsetof(Point2, x));
+    ASSERT(as2->type == &point2_type && as2->offset == offsetof(Point2, y));
+
+    r = call1(code, (Object *)p);
+    ASSERT(IS_INT(&r) && to_int(&r) == 120);
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "dictobject.h"
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the table grows, the young keys and values are moved by the minor gcs */
+void test_dict(void)
+{
+    Object *dict = kl_new_dict();
+    init_gc_stack_push(1, dict);
+
+    for (int i = 0; i < 10000; i++) {
+        Value key = int_value(i);
+        Value val = obj_value(kl_new_fmt_str("%d", i));
+        kl_dict_set(dict, &key, &val);
+        char buf[16];
+        snprintf(buf, sizeof(buf), "k%d", i);
+        key = int_value(i * 2);
+        kl_dict_set_str(dict, buf, &key);
+    }
+    ASSERT(DICT_LEN(dict) == 20000);
+
+    /* replaced */
+    Value key = int_value(7);
+    Value val = int_value(-7);
+    kl_dict_set(dict, &key, &val);
+    ASSERT(DICT_LEN(dict) == 20000);
+
+    for (int i = 0; i < 10000; i++) {
+        Value key = int_value(i);
+        Value v = kl_dict_get(dict, &key);
+        if (i == 7) {
+            ASSERT(to_int(&v) == -7);
+        } else {
+            ASSERT(atoi(STR_BUF(to_obj(&v))) == i);
+        }
+        char buf[16];
+        snprintf(buf, sizeof(buf), "k%d", i);
+        v = kl_dict_get_str(dict, buf);
+        ASSERT(to_int(&v) == i * 2);
+    }
+
+    key = int_value(10000);
+    val = kl_dict_get(dict, &key);
+    ASSERT(IS_ERROR(&val));
+    val = kl_dict_get_str(dict, "none");
+    ASSERT(IS_ERROR(&val));
+
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_dict();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
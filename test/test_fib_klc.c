@@ -91,7 +91,7 @@ int main(int argc, char *argv[])
     Value self = obj_value(code);
     Value args[] = { int_value(40) };
     Value result = object_call(&self, args, 1, NULL);
-    printf("%ld\n", result.ival);
+    printf("%ld\n", to_int(&result));
 
     kl_fini();
     return 0;
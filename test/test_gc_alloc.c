@@ -0,0 +1,126 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static char buf[64];
+
+/* one word, the type is an index */
+void test_header(void)
+{
+    ASSERT(sizeof(GcObject) == 8);
+    ASSERT(sizeof(Object) == 8);
+
+    Object *s = kl_new_str("hello");
+    ASSERT(OB_TYPE(s) == &str_type);
+    ASSERT(IS_TYPE(s, &str_type));
+    ASSERT(OB_TYPE(&str_type) == &type_type);
+    ASSERT(OB_TYPE(&type_type) == &type_type);
+    ASSERT(gc_is_young(s) && ((GcObject *)s)->gc_kind == GC_KIND_OBJECT);
+}
+
+/* young objects are bumped in address order */
+void test_tlab(void)
+{
+    /* 12 + 30 bytes, aligned to 48 */
+    GcObject *prev = gc_alloc_array(GC_KIND_ARRAY_INT8, 30);
+    ASSERT(prev->gc_size == 48);
+    ASSERT(gc_is_young(prev));
+
+    int adjacent = 0;
+    for (int i = 0; i < 100; i++) {
+        GcObject *obj = gc_alloc_array(GC_KIND_ARRAY_INT8, 30);
+        if ((char *)obj == (char *)prev + 48) ++adjacent;
+        prev = obj;
+    }
+    /* a refill may start a new page */
+    ASSERT(adjacent >= 98);
+
+    /* not a size class, old */
+    GcObject *big = gc_alloc_array(GC_KIND_ARRAY_INT8, 3000);
+    ASSERT(big->gc_size == (int)ALIGN_PTR(sizeof(GcArrayObject) + 3000));
+    ASSERT(!gc_is_young(big));
+}
+
+/* strings of many size classes, the kept one is marked by every gc */
+void test_gc_alloc(void)
+{
+    Object *kept = kl_new_str("kept");
+    init_gc_stack_push(1, kept);
+
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < 100000; i++) {
+        int len = (i * 7) % 64;
+        Object *s = kl_new_nstr(buf, len);
+        ASSERT(STR_LEN(s) == len);
+        ASSERT(!strncmp(STR_BUF(s), buf, len));
+    }
+
+    ASSERT(!strcmp(STR_BUF(kept), "kept"));
+    fini_gc_stack();
+}
+
+/* the dead old cells are free after a full gc, the kept ones are not */
+void test_gc_collect(void)
+{
+    Object *holder = kl_new_tuple(200);
+    init_gc_stack_push(1, holder);
+    for (int i = 0; i < 200; i++) {
+        TUPLE_SET_ITEM(holder, i, obj_value(kl_new_str(i % 2 ? "dead" : "kept")));
+    }
+    /* promoted by a full gc */
+    gc_collect();
+
+    Object *dead[100];
+    for (int i = 0; i < 100; i++) {
+        dead[i] = to_obj(TUPLE_ITEMS(holder) + 2 * i + 1);
+        ASSERT(!gc_is_young(dead[i]));
+        TUPLE_SET_ITEM(holder, 2 * i + 1, none_value);
+    }
+    gc_collect();
+
+    /* the promoted strings take the free cells between the kept ones */
+    for (int i = 0; i < 100; i++) {
+        TUPLE_SET_ITEM(holder, 2 * i + 1, obj_value(kl_new_str("new")));
+    }
+    gc_collect();
+
+    int reused = 0;
+    for (int i = 0; i < 100; i++) {
+        Object *s = to_obj(TUPLE_ITEMS(holder) + 2 * i + 1);
+        ASSERT(!strcmp(STR_BUF(s), "new"));
+        for (int j = 0; j < 100; j++) {
+            if (s == dead[j]) ++reused;
+        }
+        ASSERT(!strcmp(STR_BUF(to_obj(TUPLE_ITEMS(holder) + 2 * i)), "kept"));
+    }
+    ASSERT(reused);
+
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_header();
+    test_tlab();
+    test_gc_alloc();
+    test_gc_collect();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define N 200000
+
+void test_options(void)
+{
+    GcOptions opts;
+    gc_init_options(&opts, 1 << 30);
+    ASSERT(opts.compact);
+    ASSERT(!gc_parse_option(&opts, "--gc-compact=0"));
+    ASSERT(!opts.compact);
+    ASSERT(gc_parse_option(&opts, "--gc-compact=2"));
+}
+
+/* the survivors of the sparse pages are moved, except the pinned ones */
+void test_compact(void)
+{
+    /* large, not moved */
+    Object *all = kl_new_tuple(N);
+    init_gc_stack(2);
+    gc_stack_push(all);
+    for (int i = 0; i < N; i++) {
+        Object *t = kl_new_tuple(1);
+        TUPLE_SET_ITEM(t, 0, int_value(i));
+        TUPLE_SET_ITEM(all, i, obj_value(t));
+    }
+    /* promoted */
+    gc_collect();
+
+    Object *pinned = to_obj(TUPLE_ITEMS(all) + 8);
+    gc_pin(pinned);
+    Object *stacked = to_obj(TUPLE_ITEMS(all) + 16);
+    gc_stack_push(stacked);
+    for (int i = 0; i < N; i++) {
+        if (i % 8) TUPLE_SET_ITEM(all, i, none_value);
+    }
+    gc_collect();
+
+    GcStats st;
+    gc_get_stats(&st);
+    ASSERT(st.fragmentation >= 0.5);
+    size_t used = st.used_size;
+    size_t compacted = st.compacted;
+    Object **addrs = mm_alloc(sizeof(Object *) * N / 8);
+    for (int i = 0; i < N; i += 8) addrs[i / 8] = to_obj(TUPLE_ITEMS(all) + i);
+
+    gc_collect();
+    gc_get_stats(&st);
+    /* the same cells in fewer pages */
+    ASSERT(st.compacted > compacted && st.used_size <= used);
+    ASSERT(st.fragmentation < 0.5);
+
+    int moved = 0;
+    for (int i = 0; i < N; i += 8) {
+        Object *t = to_obj(TUPLE_ITEMS(all) + i);
+        if (t != addrs[i / 8]) ++moved;
+        ASSERT(TUPLE_LEN(t) == 1 && to_int(TUPLE_ITEMS(t)) == i);
+    }
+    ASSERT(moved > N / 16);
+    ASSERT(to_obj(TUPLE_ITEMS(all) + 8) == pinned);
+    ASSERT(to_obj(TUPLE_ITEMS(all) + 16) == stacked);
+
+    gc_unpin(pinned);
+    mm_free(addrs);
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_options();
+    test_compact();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
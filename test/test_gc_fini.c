@@ -0,0 +1,98 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include <unistd.h>
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _FileObject {
+    OBJECT_HEAD
+    int id;
+    /* the native resource */
+    int *fd;
+} FileObject;
+
+static int _closed;
+static int _live_closed;
+
+static void file_fini(FileObject *self)
+{
+    if (self->id < 0) __atomic_add_fetch(&_live_closed, 1, __ATOMIC_RELAXED);
+    mm_free(self->fd);
+    self->fd = NULL;
+    __atomic_add_fetch(&_closed, 1, __ATOMIC_RELAXED);
+}
+
+static TypeObject file_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "file",
+    .fini = (FiniFunc)file_fini,
+};
+
+static FileObject *new_file(int id)
+{
+    FileObject *f = gc_alloc_obj_f(f);
+    INIT_OBJECT_HEAD(f, &file_type);
+    f->id = id;
+    f->fd = mm_alloc(sizeof(int));
+    return f;
+}
+
+static int closed(void) { return __atomic_load_n(&_closed, __ATOMIC_RELAXED); }
+
+/* the dead ones are closed by the finalizer thread */
+void test_thread(void)
+{
+    for (int i = 0; i < 100; i++) new_file(i);
+    gc_collect();
+
+    for (int i = 0; i < 1000 && closed() < 100; i++) usleep(10000);
+    ASSERT(closed() == 100);
+    ASSERT(!gc_run_finalizers());
+}
+
+/* the live ones are kept, the dead ones are drained by the caller */
+void test_drain(void)
+{
+    FileObject *live = new_file(-1);
+    init_gc_stack_push(1, live);
+
+    int start = closed();
+    for (int i = 0; i < 1000; i++) {
+        new_file(i);
+        if (i % 10 == 0) kl_new_str("junk");
+    }
+    gc_collect();
+    gc_run_finalizers();
+    ASSERT(closed() == start + 1000);
+
+    /* freed by the next cycle */
+    gc_collect();
+    gc_collect();
+    ASSERT(closed() == start + 1000);
+    ASSERT(live->fd && !_live_closed);
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_thread();
+    test_drain();
+    kl_fini();
+    ASSERT(_live_closed == 1);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
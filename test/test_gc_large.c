@@ -0,0 +1,81 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the dead large arrays are unmapped, or kept for reuse */
+void test_unmap(void)
+{
+    GcStats st;
+    gc_get_stats(&st);
+    size_t base = st.large_size;
+
+    for (int i = 0; i < 64; i++) {
+        GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_INT8, 1024 * 1024);
+        uint8_t *bytes = (uint8_t *)(arr + 1);
+        for (int j = 0; j < 1024 * 1024; j += 4096) ASSERT(!bytes[j]);
+        memset(bytes, 0xff, 1024 * 1024);
+    }
+
+    GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_INT8, 1024 * 1024);
+    init_gc_stack_push(1, arr);
+    gc_collect();
+    gc_get_stats(&st);
+    ASSERT(st.large_size >= base + 1024 * 1024);
+    ASSERT(st.large_size < base + 2 * 1024 * 1024);
+    fini_gc_stack();
+
+    gc_collect();
+    gc_get_stats(&st);
+    ASSERT(st.large_size == base);
+}
+
+/* the young objects stored in a large tuple are found by its cards */
+void test_cards(void)
+{
+    int n = 20000;
+    Object *holder = kl_new_tuple(n);
+    init_gc_stack_push(1, holder);
+    gc_collect();
+
+    char buf[32];
+    for (int k = 0; k < 4; k++) {
+        for (int i = k; i < n; i += 4) {
+            snprintf(buf, sizeof(buf), "s-%d", i);
+            Object *s = kl_new_str(buf);
+            TUPLE_SET_ITEM(holder, i, obj_value(s));
+        }
+        for (int i = 0; i < 100000; i++) kl_new_str("junk");
+    }
+
+    for (int i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "s-%d", i);
+        Object *s = to_obj(TUPLE_ITEMS(holder) + i);
+        ASSERT(STR_LEN(s) == strlen(buf) && !memcmp(STR_BUF(s), buf, STR_LEN(s)));
+    }
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_unmap();
+    test_cards();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a binary tree of tuples, the leaves are strings */
+static Object *new_tree(int depth)
+{
+    if (!depth) return kl_new_str("leaf");
+
+    Object *x = kl_new_tuple(2);
+    init_gc_stack_push(1, x);
+    TUPLE_SET_ITEM(x, 0, obj_value(new_tree(depth - 1)));
+    TUPLE_SET_ITEM(x, 1, obj_value(new_tree(depth - 1)));
+    fini_gc_stack();
+    return x;
+}
+
+static int check_tree(Object *x, int depth)
+{
+    if (!depth) {
+        ASSERT(IS_STR(x));
+        ASSERT(!strcmp(STR_BUF(x), "leaf"));
+        return 1;
+    }
+
+    ASSERT(IS_TUPLE(x));
+    Value *items = TUPLE_ITEMS(x);
+    return check_tree(to_obj(items + 0), depth - 1) +
+           check_tree(to_obj(items + 1), depth - 1);
+}
+
+/* the markers steal the subtrees from each other */
+void test_parallel_mark(void)
+{
+    Object *tree = new_tree(16);
+    init_gc_stack_push(1, tree);
+
+    for (int i = 0; i < 5; i++) {
+        /* garbage, the freed cells are reused by the next trees */
+        new_tree(10);
+        gc_collect();
+        ASSERT(check_tree(tree, 16) == 1 << 16);
+    }
+
+    fini_gc_stack();
+}
+
+/* promoted strings, they reuse the freed cells of tuples */
+static void new_garbage(void)
+{
+    Object *junk = kl_new_tuple(10000);
+    init_gc_stack_push(1, junk);
+    for (int i = 0; i < 10000; i++) {
+        TUPLE_SET_ITEM(junk, i, obj_value(kl_new_str("junk")));
+    }
+    gc_collect();
+    fini_gc_stack();
+}
+
+/* a tree is moved while marked concurrently, the old slot is in the snapshot */
+void test_concurrent_mark(void)
+{
+    Object *from = kl_new_tuple(1);
+    init_gc_stack_push(3, from);
+    Object *to = kl_new_tuple(1);
+    gc_stack_push(to);
+
+    TUPLE_SET_ITEM(from, 0, obj_value(new_tree(12)));
+    /* promoted, a concurrent cycle sweeps the old objects only */
+    gc_collect();
+
+    /* the marking may be done before this thread runs again */
+    size_t cycle = gc_start_marking();
+    TUPLE_SET_ITEM(to, 0, *TUPLE_ITEMS(from));
+    TUPLE_SET_ITEM(from, 0, none_value);
+    /* allocated black */
+    Object *fresh = new_tree(4);
+    gc_stack_push(fresh);
+    gc_wait_cycle(cycle);
+    ASSERT(!gc_marking);
+
+    new_garbage();
+    ASSERT(check_tree(to_obj(TUPLE_ITEMS(to)), 12) == 1 << 12);
+    ASSERT(check_tree(fresh, 4) == 1 << 4);
+
+    /* marked by the next cycle from the new slot */
+    cycle = gc_start_marking();
+    gc_wait_cycle(cycle);
+    new_garbage();
+    ASSERT(check_tree(to_obj(TUPLE_ITEMS(to)), 12) == 1 << 12);
+
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    setenv("KOALA_GC_MARKERS", "4", 1);
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_parallel_mark();
+    test_concurrent_mark();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
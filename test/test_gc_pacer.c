@@ -0,0 +1,73 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void test_options(void)
+{
+    GcOptions opts;
+    gc_init_options(&opts, 1 << 30);
+    ASSERT(!gc_parse_option(&opts, "--gc-init-heap=512k"));
+    ASSERT(opts.init_size == 512 * 1024);
+    ASSERT(!gc_parse_option(&opts, "--gc-max-heap=2G"));
+    ASSERT(opts.max_size == 2UL * 1024 * 1024 * 1024);
+    ASSERT(!gc_parse_option(&opts, "--gc-pause=5"));
+    ASSERT(opts.pause_ms == 5);
+
+    ASSERT(gc_parse_option(&opts, "--gc-max-heap=10x"));
+    ASSERT(gc_parse_option(&opts, "--gc-pause=0"));
+    ASSERT(gc_parse_option(&opts, "--gc-young=1m"));
+    ASSERT(gc_parse_option(&opts, "--jit"));
+    ASSERT(opts.max_size == 2UL * 1024 * 1024 * 1024);
+}
+
+/* the heap grows by the live objects, and shrinks after they are dead */
+void test_resize(void)
+{
+    ASSERT(gc_heap_size() == 1024 * 1024);
+
+    char buf[200];
+    memset(buf, 'x', sizeof(buf));
+    Object *holder = kl_new_tuple(40000);
+    init_gc_stack_push(1, holder);
+    for (int i = 0; i < 40000; i++) {
+        TUPLE_SET_ITEM(holder, i, obj_value(kl_new_nstr(buf, sizeof(buf))));
+    }
+    gc_collect();
+
+    size_t heap = gc_heap_size();
+    ASSERT(heap > 8 * 1024 * 1024 && heap <= 64 * 1024 * 1024);
+    for (int i = 0; i < 40000; i++) {
+        ASSERT(STR_LEN(to_obj(TUPLE_ITEMS(holder) + i)) == sizeof(buf));
+    }
+
+    fini_gc_stack();
+    gc_collect();
+    ASSERT(gc_heap_size() < heap / 2);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    setenv("KOALA_GC_INIT_HEAP", "1m", 1);
+    setenv("KOALA_GC_MAX_HEAP", "64m", 1);
+    kl_init(argc, argv);
+    test_options();
+    test_resize();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
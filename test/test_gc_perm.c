@@ -0,0 +1,137 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cfuncobject.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "run.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bumped one after another */
+void test_bump(void)
+{
+    GcObject *prev = (GcObject *)kl_new_cfunc(NULL, NULL, NULL);
+    ASSERT(prev->gc_age == -1 && prev->gc_size == sizeof(CFuncObject));
+    for (int i = 0; i < 100; i++) {
+        GcObject *obj = (GcObject *)kl_new_cfunc(NULL, NULL, NULL);
+        ASSERT((char *)obj == (char *)prev + prev->gc_size);
+        prev = obj;
+    }
+}
+
+/* a young object stored in a permanent one is found by its card */
+void test_cards(void)
+{
+    TupleObject *t = gc_alloc_pw(sizeof(TupleObject));
+    INIT_OBJECT_HEAD(t, &tuple_type);
+    t->stop = 100;
+    GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_VALUE, 100);
+    gc_store_obj(t, &t->array, arr);
+
+    char buf[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "s-%d", i);
+        TUPLE_SET_ITEM(t, i, obj_value(kl_new_str(buf)));
+    }
+
+    GcStats st;
+    gc_get_stats(&st);
+    size_t young = st.phases[GC_YOUNG].count;
+    while (st.phases[GC_YOUNG].count < young + 3) {
+        for (int i = 0; i < 10000; i++) kl_new_str("junk");
+        gc_get_stats(&st);
+    }
+
+    ASSERT(t->array != arr);
+    /* a full gc keeps what it refers to */
+    gc_collect();
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "s-%d", i);
+        Object *s = to_obj(TUPLE_ITEMS(t) + i);
+        ASSERT(STR_LEN(s) == strlen(buf) && !memcmp(STR_BUF(s), buf, STR_LEN(s)));
+    }
+}
+
+/* the objects made by the initialization are read-only */
+void test_sealed(void)
+{
+    Object *m = kl_lookup_module("sys", 3);
+    ASSERT(m);
+    CFuncObject *cfunc = (CFuncObject *)module_lookup_object(m, "gc_stats", 8);
+    ASSERT(cfunc && cfunc->module == m);
+
+    /* a new one is writable */
+    CFuncObject *obj = (CFuncObject *)kl_new_cfunc(cfunc->def, m, NULL);
+    obj->def = NULL;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid) {
+        cfunc->def = NULL;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+}
+
+/* a read-only one with a young object is sealed after the object is promoted */
+void test_seal_dirty(void)
+{
+    TupleObject *t = gc_alloc_p(sizeof(TupleObject));
+    INIT_OBJECT_HEAD(t, &tuple_type);
+    t->stop = 1;
+    GcArrayObject *arr = gc_alloc_array(GC_KIND_ARRAY_VALUE, 1);
+    gc_store_obj(t, &t->array, arr);
+    TUPLE_SET_ITEM(t, 0, obj_value(kl_new_str("young")));
+    gc_seal_perm();
+
+    /* the cards are not written by the minor gcs */
+    GcStats st;
+    gc_get_stats(&st);
+    size_t young = st.phases[GC_YOUNG].count;
+    while (st.phases[GC_YOUNG].count < young + 3) {
+        for (int i = 0; i < 10000; i++) kl_new_str("junk");
+        gc_get_stats(&st);
+    }
+    Object *s = to_obj(TUPLE_ITEMS(t));
+    ASSERT(STR_LEN(s) == 5 && !memcmp(STR_BUF(s), "young", 5));
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid) {
+        t->stop = 0;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    setenv("KOALA_GC_INIT_HEAP", "256m", 1);
+    setenv("KOALA_GC_PROTECT_PERM", "1", 1);
+    kl_init(argc, argv);
+    test_bump();
+    test_cards();
+    test_sealed();
+    test_seal_dirty();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
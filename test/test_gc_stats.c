@@ -0,0 +1,134 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "dictobject.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATS_FILE "test_gc_stats.json"
+
+/* minor gcs, the kept strings are promoted and marked by a full gc */
+void test_counters(void)
+{
+    Object *holder = kl_new_tuple(1000);
+    init_gc_stack_push(1, holder);
+    for (int i = 0; i < 100000; i++) {
+        Object *s = kl_new_str("junk");
+        if (i % 100 == 0) TUPLE_SET_ITEM(holder, i / 100, obj_value(s));
+    }
+    gc_collect();
+
+    GcStats st;
+    gc_get_stats(&st);
+    ASSERT(st.phases[GC_YOUNG].count > 0);
+    ASSERT(st.phases[GC_FULL].count == 1);
+    ASSERT(st.phases[GC_FULL].max_ns > 0);
+    for (int i = GC_MARK_ROOTS; i <= GC_YOUNG; i++) {
+        size_t n = 0;
+        for (int b = 0; b < GC_HIST_BUCKETS; b++) n += st.phases[i].hist[b];
+        ASSERT(n == st.phases[i].count);
+    }
+
+    ASSERT(st.young_allocated > 100000 * 32);
+    ASSERT(st.young_freed > 0 && st.young_freed < st.young_allocated);
+    ASSERT(st.promoted > 0);
+    ASSERT(st.live_size > 0 && st.live_size <= st.used_size);
+
+    int found = 0;
+    for (int i = 0; i < st.ntypes; i++) {
+        if (!strcmp(gc_type_name(st.types + i), "str")) {
+            ASSERT(st.types[i].objs >= 1000);
+            found = 1;
+        }
+        if (i) ASSERT(st.types[i].bytes <= st.types[i - 1].bytes);
+    }
+    ASSERT(found);
+
+    fini_gc_stack();
+}
+
+/* sys.gc_stats() */
+void test_sys(void)
+{
+    Object *sys = kl_lookup_module("sys", 3);
+    ASSERT(sys);
+    Value fn = obj_value(module_lookup_object(sys, "gc_stats", 8));
+    Value r = object_call(&fn, NULL, 0, NULL);
+    Object *stats = as_obj(&r);
+    ASSERT(IS_DICT(stats));
+    init_gc_stack_push(1, stats);
+
+    Value v = kl_dict_get_str(stats, "young_allocated");
+    ASSERT(IS_INT(&v) && to_int(&v) > 0);
+    v = kl_dict_get_str(stats, "promotion_rate");
+    ASSERT(IS_FLOAT(&v));
+
+    v = kl_dict_get_str(stats, "phases");
+    Object *full = to_obj(&v);
+    v = kl_dict_get_str(full, "full");
+    full = to_obj(&v);
+    v = kl_dict_get_str(full, "count");
+    ASSERT(to_int(&v) == 1);
+    v = kl_dict_get_str(full, "hist");
+    ASSERT(TUPLE_LEN(to_obj(&v)) == GC_HIST_BUCKETS);
+
+    v = kl_dict_get_str(stats, "types");
+    v = kl_dict_get_str(to_obj(&v), "str");
+    ASSERT(IS_TUPLE(to_obj(&v)));
+    Value objs = TUPLE_ITEMS(to_obj(&v))[0];
+    ASSERT(to_int(&objs) > 0);
+
+    fini_gc_stack();
+}
+
+/* a json line by the api, and by the collector */
+void test_dump(void)
+{
+    char line[16384];
+    GcStats st;
+    gc_get_stats(&st);
+    FILE *fp = tmpfile();
+    gc_dump_stats(&st, fp);
+    rewind(fp);
+    ASSERT(fgets(line, sizeof(line), fp));
+    fclose(fp);
+    ASSERT(!strncmp(line, "{\"time\": ", 9));
+    ASSERT(strstr(line, "\"young\": {\"count\": "));
+    ASSERT(strstr(line, "{\"name\": \"str\", \"objs\": "));
+    ASSERT(!strcmp(line + strlen(line) - 3, "]}\n"));
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    unlink(STATS_FILE);
+    setenv("KOALA_GC_STATS", STATS_FILE, 1);
+    kl_init(argc, argv);
+    test_counters();
+    test_sys();
+    test_dump();
+    kl_fini();
+
+    /* the last one at least */
+    FILE *fp = fopen(STATS_FILE, "r");
+    ASSERT(fp);
+    char line[16384];
+    ASSERT(fgets(line, sizeof(line), fp) && line[0] == '{');
+    fclose(fp);
+    unlink(STATS_FILE);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
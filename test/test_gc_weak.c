@@ -0,0 +1,154 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "dictobject.h"
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+#include "weakrefobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int str_is(Object *s, const char *buf)
+{
+    return STR_LEN(s) == strlen(buf) && !memcmp(STR_BUF(s), buf, STR_LEN(s));
+}
+
+/* a concurrent cycle, or a full gc */
+static void collect(int full)
+{
+    if (full) {
+        gc_collect();
+    } else {
+        gc_wait_cycle(gc_start_marking());
+    }
+}
+
+/* kept by the minor gcs, cleared by a major gc after it is dead */
+void test_weakref(int full)
+{
+    Object *t = kl_new_tuple(2);
+    init_gc_stack(2);
+    gc_stack_push(t);
+    TUPLE_SET_ITEM(t, 0, obj_value(kl_new_str("alive")));
+    TUPLE_SET_ITEM(t, 1, obj_value(kl_new_weakref(to_obj(TUPLE_ITEMS(t)))));
+    Object *ref = kl_new_weakref(kl_new_str("dead"));
+    gc_stack_push(ref);
+
+    /* moved by the minor gcs */
+    GcStats st;
+    gc_get_stats(&st);
+    size_t young = st.phases[GC_YOUNG].count;
+    while (st.phases[GC_YOUNG].count < young + 2) {
+        for (int i = 0; i < 10000; i++) kl_new_str("junk");
+        gc_get_stats(&st);
+    }
+    Object *weak = to_obj(TUPLE_ITEMS(t) + 1);
+    ASSERT(kl_weakref_get(weak) == to_obj(TUPLE_ITEMS(t)));
+
+    collect(full);
+    ASSERT(kl_weakref_get(weak) == to_obj(TUPLE_ITEMS(t)));
+    ASSERT(str_is(kl_weakref_get(weak), "alive"));
+    ASSERT(!kl_weakref_get(ref));
+    fini_gc_stack();
+}
+
+/* the minor gcs move the young keys */
+static void move_keys(void)
+{
+    size_t moves = gc_moves();
+    while (gc_moves() < moves + 3) kl_new_str("garbage");
+}
+
+/* the values refer to their keys, the keys of the dead entries are dropped */
+void test_ephemeron(int full)
+{
+    Object *dict = kl_new_weakdict();
+    init_gc_stack(4);
+    gc_stack_push(dict);
+    Object *keys = kl_new_tuple(100);
+    gc_stack_push(keys);
+
+    char buf[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "k%d", i);
+        Value key = obj_value(kl_new_str(buf));
+        init_gc_stack_push(1, to_obj(&key));
+        Object *val = kl_new_tuple(1);
+        TUPLE_SET_ITEM(val, 0, key);
+        Value v = obj_value(val);
+        kl_weakdict_set(dict, &key, &v);
+        if (i % 10 == 0) TUPLE_SET_ITEM(keys, i / 10, key);
+        fini_gc_stack();
+    }
+    ASSERT(kl_weakdict_len(dict) == 1000);
+
+    /* a value is the key of another entry */
+    Value a = obj_value(kl_new_str("a"));
+    Value b = obj_value(kl_new_str("b"));
+    Value c = obj_value(kl_new_str("c"));
+    gc_stack_push(to_obj(&a));
+    kl_weakdict_set(dict, &b, &c);
+    kl_weakdict_set(dict, &a, &b);
+
+    move_keys();
+    collect(full);
+    ASSERT(kl_weakdict_len(dict) == 102);
+    for (int i = 0; i < 100; i++) {
+        Value *key = TUPLE_ITEMS(keys) + i;
+        Value v = kl_weakdict_get(dict, key);
+        Object *k = to_obj(TUPLE_ITEMS(to_obj(&v)));
+        ASSERT(k == to_obj(key));
+    }
+    Value v = kl_weakdict_get(dict, &a);
+    v = kl_weakdict_get(dict, &v);
+    ASSERT(str_is(to_obj(&v), "c"));
+
+    /* compared by identity, not by value */
+    Value key = obj_value(kl_new_str("k0"));
+    v = kl_weakdict_get(dict, &key);
+    ASSERT(IS_ERROR(&v));
+    key = int_value(0);
+    v = kl_weakdict_get(dict, &key);
+    ASSERT(IS_ERROR(&v));
+
+    /* the cleared entries are reused */
+    Object *keys2 = kl_new_tuple(1000);
+    gc_stack_push(keys2);
+    for (int i = 0; i < 1000; i++) {
+        Value key = obj_value(kl_new_tuple(0));
+        TUPLE_SET_ITEM(keys2, i, key);
+        Value v = int_value(i);
+        kl_weakdict_set(dict, &key, &v);
+    }
+    move_keys();
+    collect(full);
+    ASSERT(kl_weakdict_len(dict) == 1102);
+    for (int i = 0; i < 1000; i++) {
+        v = kl_weakdict_get(dict, TUPLE_ITEMS(keys2) + i);
+        ASSERT(to_int(&v) == i);
+    }
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_weakref(0);
+    test_weakref(1);
+    test_ephemeron(0);
+    test_ephemeron(1);
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
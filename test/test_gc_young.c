@@ -0,0 +1,105 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "log.h"
+#include "run.h"
+#include "shadowstack.h"
+#include "stringobject.h"
+#include "tupleobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* more than the nursery, a minor gc at least */
+static void new_garbage(void)
+{
+    for (int i = 0; i < 100000; i++) kl_new_str("junk");
+}
+
+/* a survivor is copied by every minor gc, until it is promoted */
+void test_promote(void)
+{
+    Object *holder = kl_new_tuple(1);
+    init_gc_stack_push(1, holder);
+    Object *s = kl_new_str("survivor");
+    TUPLE_SET_ITEM(holder, 0, obj_value(s));
+    ASSERT(gc_is_young(s));
+
+    new_garbage();
+    Object *moved = to_obj(TUPLE_ITEMS(holder));
+    ASSERT(moved != s);
+    ASSERT(!strcmp(STR_BUF(moved), "survivor"));
+
+    for (int i = 0; i < 5; i++) new_garbage();
+    s = to_obj(TUPLE_ITEMS(holder));
+    ASSERT(!gc_is_young(s));
+    ASSERT(!gc_is_young(((StrObject *)s)->array));
+    ASSERT(!strcmp(STR_BUF(s), "survivor"));
+
+    fini_gc_stack();
+}
+
+/* young objects referred only by old ones are found by the dirty cards */
+void test_card(void)
+{
+    Object *old = kl_new_tuple(2);
+    init_gc_stack_push(2, old);
+    /* bigger than the size classes, its cards are after it */
+    Object *big = kl_new_tuple(10000);
+    gc_stack_push(big);
+    /* the arrays are promoted, the pinned tuples are not */
+    gc_collect();
+    ASSERT(!gc_is_young(((TupleObject *)old)->array));
+    ASSERT(!gc_is_young(((TupleObject *)big)->array));
+
+    TUPLE_SET_ITEM(old, 1, obj_value(kl_new_str("card")));
+    for (int i = 0; i < 10000; i += 100) {
+        TUPLE_SET_ITEM(big, i, obj_value(kl_new_fmt_str("%d", i)));
+    }
+
+    for (int k = 0; k < 5; k++) {
+        new_garbage();
+        ASSERT(!strcmp(STR_BUF(to_obj(TUPLE_ITEMS(old) + 1)), "card"));
+        for (int i = 0; i < 10000; i += 100) {
+            Object *s = to_obj(TUPLE_ITEMS(big) + i);
+            ASSERT(atoi(STR_BUF(s)) == i);
+        }
+    }
+
+    fini_gc_stack();
+}
+
+/* an object of a shadow stack is not moved, the ones it refers to are */
+void test_pin(void)
+{
+    Object *pinned = kl_new_tuple(1);
+    init_gc_stack_push(1, pinned);
+    TUPLE_SET_ITEM(pinned, 0, obj_value(kl_new_str("pinned")));
+
+    for (int i = 0; i < 5; i++) {
+        new_garbage();
+        ASSERT(gc_is_young(pinned));
+        ASSERT(IS_TUPLE(pinned));
+        ASSERT(!strcmp(STR_BUF(to_obj(TUPLE_ITEMS(pinned))), "pinned"));
+    }
+
+    fini_gc_stack();
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_promote();
+    test_card();
+    test_pin();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,154 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "exception.h"
+#include "jit.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+static char fib_insns[] = {
+    OP_JMP_INT_CMP_GE_IMM8, 0, 2, 7, 0,
+    OP_RETURN, 0,
+    OP_INT_SUB_IMM8, 1, 0, 1,
+    OP_PUSH, 1,
+    OP_CALL, 0, 0, 1, 1,
+    OP_INT_SUB_IMM8, 2, 0, 2,
+    OP_PUSH, 2,
+    OP_CALL, 0, 0, 1, 2,
+    OP_INT_ADD, 0, 1, 2,
+    OP_RETURN, 0,
+};
+
+/* s = 0; for (i = 0; i < 100; i++) s += i; return s */
+static char loop_insns[] = {
+    OP_CONST_INT_IMM8, 1, 0,
+    OP_CONST_INT_IMM8, 2, 0,
+    OP_CONST_INT_IMM8, 3, 1,
+    OP_INT_ADD, 2, 2, 1,
+    OP_INT_ADD, 1, 1, 3,
+    OP_JMP_INT_CMP_LT_IMM8, 1, 100, 9, 0,
+    OP_RETURN, 2,
+};
+
+static char add_insns[] = {
+    OP_INT_ADD, 0, 0, 1,
+    OP_RETURN, 0,
+};
+
+static char div_insns[] = {
+    OP_INT_DIV, 0, 0, 1,
+    OP_RETURN, 0,
+};
+
+static char sub_insns[] = {
+    OP_BINARY_SUB, 0, 0, 1,
+    OP_RETURN, 0,
+};
+/* clang-format on */
+
+static CodeObject *new_code(Object *m, char *name, char *insns, int size, int nargs,
+                            int nlocals, int stack_size)
+{
+    CodeObject *code = (CodeObject *)kl_new_code(name, m, NULL);
+    code->cs.insns = insns;
+    code->cs.insns_size = size;
+    code->cs.nargs = nargs;
+    code->cs.nlocals = nlocals;
+    code->cs.stack_size = stack_size;
+    return code;
+}
+
+static Value call(CodeObject *code, Value *args, int nargs)
+{
+    Value self = obj_value(code);
+    return object_call(&self, args, nargs, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+#if USE_JIT
+    jit_threshold = JIT_THRESHOLD;
+
+    Object *m = kl_new_module("test_jit");
+    Value r;
+
+    /* divisor 0 is left to the interpreter, which raises */
+    CodeObject *div = new_code(m, "div", div_insns, sizeof(div_insns), 2, 2, 0);
+    ASSERT(!jit_compile(div));
+    Value args[] = { int_value(7), int_value(2) };
+    r = call(div, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == 3);
+    args[1] = int_value(0);
+    r = call(div, args, 2);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+
+    /* compiled by the calls */
+    CodeObject *fib = new_code(m, "fib", fib_insns, sizeof(fib_insns), 1, 4, 1);
+    module_add_object(m, "fib", (Object *)fib);
+    args[0] = int_value(20);
+    r = call(fib, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 6765);
+    ASSERT(fib->jit && fib->jit->nr_native == 10);
+    ASSERT(fib->jit->entries[13] && !fib->jit->entries[14]);
+    r = call(fib, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 6765);
+
+    /* compiled by the backward jumps, entered at the loop head */
+    CodeObject *loop = new_code(m, "loop", loop_insns, sizeof(loop_insns), 0, 4, 0);
+    for (int i = 0; i < 20; i++) {
+        r = call(loop, NULL, 0);
+        ASSERT(IS_INT(&r) && to_int(&r) == 4950);
+    }
+    ASSERT(loop->jit && loop->jit->nr_native == 7);
+
+    /* the guards fail, deopt by the interpreter */
+    CodeObject *add = new_code(m, "add", add_insns, sizeof(add_insns), 2, 2, 0);
+    ASSERT(!jit_compile(add));
+    args[0] = int_value(1);
+    args[1] = int_value(2);
+    r = call(add, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == 3);
+    args[0] = float_value(1.25);
+    args[1] = float_value(2.25);
+    r = call(add, args, 2);
+    ASSERT(IS_FLOAT(&r) && to_float(&r) == 3.5);
+    ASSERT((uint8_t)add_insns[0] == OP_FLOAT_ADD);
+    /* out of 48 bits with NaN-boxing */
+    args[0] = int_value(((int64_t)1 << 47) - 1);
+    args[1] = int_value(1);
+    r = call(add, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == (int64_t)1 << 47);
+
+    /* generic op by the C helper, which quickens the insn */
+    CodeObject *sub = new_code(m, "sub", sub_insns, sizeof(sub_insns), 2, 2, 0);
+    ASSERT(!jit_compile(sub));
+    args[0] = int_value(5);
+    args[1] = int_value(7);
+    r = call(sub, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == -2);
+    ASSERT((uint8_t)sub_insns[0] == OP_INT_SUB);
+    r = call(sub, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == -2);
+#endif
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
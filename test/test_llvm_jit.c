@@ -0,0 +1,255 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "exception.h"
+#include "jit.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+static char fib_insns[] = {
+    OP_JMP_INT_CMP_GE_IMM8, 0, 2, 7, 0,
+    OP_RETURN, 0,
+    OP_INT_SUB_IMM8, 1, 0, 1,
+    OP_PUSH, 1,
+    OP_CALL, 0, 0, 1, 1,
+    OP_INT_SUB_IMM8, 2, 0, 2,
+    OP_PUSH, 2,
+    OP_CALL, 0, 0, 1, 2,
+    OP_INT_ADD, 0, 1, 2,
+    OP_RETURN, 0,
+};
+
+/* return fib(x), symbol 0 is fib */
+static char call_fib_insns[] = {
+    OP_PUSH, 0,
+    OP_CALL, 0, 0, 1, 1,
+    OP_RETURN, 1,
+};
+
+/* s = 0; for (i = 0; i < 100; i++) s += i; return s */
+static char loop_insns[] = {
+    OP_CONST_INT_IMM8, 1, 0,
+    OP_CONST_INT_IMM8, 2, 0,
+    OP_CONST_INT_IMM8, 3, 1,
+    OP_INT_ADD, 2, 2, 1,
+    OP_INT_ADD, 1, 1, 3,
+    OP_JMP_INT_CMP_LT_IMM8, 1, 100, 9, 0,
+    OP_RETURN, 2,
+};
+
+static char div_insns[] = {
+    OP_INT_DIV, 0, 0, 1,
+    OP_RETURN, 0,
+};
+
+/* if x < 1 return x; return down(x - 1), symbol 1 is down */
+static char down_insns[] = {
+    OP_JMP_INT_CMP_LT_IMM8, 0, 1, 16, 0,
+    OP_INT_SUB_IMM8, 1, 0, 1,
+    OP_PUSH, 1,
+    OP_CALL, 0, 1, 1, 0,
+    OP_RETURN, 0,
+};
+
+static char sub_insns[] = {
+    OP_BINARY_SUB, 0, 0, 1,
+    OP_RETURN, 0,
+};
+
+/* s = 0; for (i = 0; i < 60; i++) s += 7 / (i - 60); return s + x */
+static char osr_insns[] = {
+    OP_CONST_INT_IMM8, 1, 0,
+    OP_CONST_INT_IMM8, 2, 0,
+    OP_CONST_INT_IMM8, 3, 1,
+    OP_CONST_INT_IMM8, 6, 7,
+    OP_INT_SUB_IMM8, 4, 1, 60,
+    OP_INT_DIV, 5, 6, 4,
+    OP_INT_ADD, 2, 2, 5,
+    OP_INT_ADD, 1, 1, 3,
+    OP_JMP_INT_CMP_LT_IMM8, 1, 60, 12, 0,
+    OP_BINARY_ADD, 2, 2, 0,
+    OP_RETURN, 2,
+};
+
+/* for (i = 0; i < 100; i++) { a = x + i; b = x + x; } return a + b */
+static char big_insns[] = {
+    OP_CONST_INT_IMM8, 1, 0,
+    OP_CONST_INT_IMM8, 3, 1,
+    OP_INT_ADD, 2, 0, 1,
+    OP_INT_ADD, 4, 0, 0,
+    OP_INT_ADD, 1, 1, 3,
+    OP_JMP_INT_CMP_LT_IMM8, 1, 100, 6, 0,
+    OP_INT_ADD, 5, 2, 4,
+    OP_RETURN, 5,
+};
+
+/* R(1) is none */
+static char none_insns[] = {
+    OP_RETURN, 1,
+};
+/* clang-format on */
+
+static CodeObject *new_code(Object *m, char *name, char *insns, int size, int nargs,
+                            int nlocals, int stack_size)
+{
+    CodeObject *code = (CodeObject *)kl_new_code(name, m, NULL);
+    code->cs.insns = insns;
+    code->cs.insns_size = size;
+    code->cs.nargs = nargs;
+    code->cs.nlocals = nlocals;
+    code->cs.stack_size = stack_size;
+    return code;
+}
+
+static Value call(CodeObject *code, Value *args, int nargs)
+{
+    Value self = obj_value(code);
+    return object_call(&self, args, nargs, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+#if USE_LLVM_JIT
+    Object *m = kl_new_module("test_llvm_jit");
+    Value r;
+    Value args[2];
+
+    /* a divisor of 0 bails out, the interpreter raises */
+    CodeObject *div = new_code(m, "div", div_insns, sizeof(div_insns), 2, 2, 0);
+    ASSERT(!opt_compile(div));
+    args[0] = int_value(7);
+    args[1] = int_value(0);
+    r = call(div, args, 2);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+    args[1] = int_value(-2);
+    r = call(div, args, 2);
+    ASSERT(IS_INT(&r) && to_int(&r) == -3);
+
+    /* not int arguments, run by the interpreter */
+    args[0] = float_value(7.5);
+    args[1] = float_value(2.5);
+    r = call(div, args, 2);
+    ASSERT(IS_FLOAT(&r) && to_float(&r) == 3.0);
+
+    /* recursive kernel */
+    CodeObject *fib = new_code(m, "fib", fib_insns, sizeof(fib_insns), 1, 4, 1);
+    module_add_object(m, "fib", (Object *)fib);
+    ASSERT(!opt_compile(fib));
+    ASSERT(fib->opt && fib->opt->nargs == 1);
+    args[0] = int_value(25);
+    r = call(fib, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 75025);
+
+    /* a kernel called by the interpreter and the baseline jit */
+    CodeObject *call_fib =
+        new_code(m, "call_fib", call_fib_insns, sizeof(call_fib_insns), 1, 2, 1);
+    jit_compile(call_fib);
+    args[0] = int_value(20);
+    r = call(call_fib, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 6765);
+
+    CodeObject *loop = new_code(m, "loop", loop_insns, sizeof(loop_insns), 0, 4, 0);
+    ASSERT(!opt_compile(loop));
+    r = call(loop, NULL, 0);
+    ASSERT(IS_INT(&r) && to_int(&r) == 4950);
+
+    /* too deep for the c stack, bails out and the interpreter runs it */
+    CodeObject *down = new_code(m, "down", down_insns, sizeof(down_insns), 1, 2, 1);
+    module_add_object(m, "down", (Object *)down);
+    ASSERT(!opt_compile(down));
+    args[0] = int_value(100);
+    r = call(down, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 0);
+    args[0] = int_value(20000);
+    r = call(down, args, 1);
+    ASSERT(IS_INT(&r) && to_int(&r) == 0);
+    /* the value stack overflows, the interpreter raises */
+    args[0] = int_value(2000000);
+    r = call(down, args, 1);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+
+    /*
+     * The loop is entered by on-stack replacement, x is not an int. The
+     * divisor -1 deopts, the interpreter divides and enters the loop again.
+     */
+    opt_threshold = 10;
+    CodeObject *osr = new_code(m, "osr", osr_insns, sizeof(osr_insns), 1, 7, 0);
+    for (int i = 0; i < 2; i++) {
+        args[0] = float_value(0.5);
+        r = call(osr, args, 1);
+        ASSERT(IS_FLOAT(&r) && to_float(&r) == -15.5);
+    }
+    LoopSite *ls = code_loop_site(osr, 28);
+    ASSERT(ls->osr && ls->count > 10 && !osr->opt);
+
+    /* the native back-edge of the baseline jit */
+    static char osr_jit_insns[sizeof(osr_insns)];
+    memcpy(osr_jit_insns, osr_insns, sizeof(osr_insns));
+    osr_jit_insns[33] = OP_BINARY_ADD;
+    osr = new_code(m, "osr_jit", osr_jit_insns, sizeof(osr_jit_insns), 1, 7, 0);
+    jit_compile(osr);
+    for (int i = 0; i < 2; i++) {
+        args[0] = float_value(0.5);
+        r = call(osr, args, 1);
+        ASSERT(IS_FLOAT(&r) && to_float(&r) == -15.5);
+    }
+    ASSERT(code_loop_site(osr, 28)->osr);
+
+    /* a requested gc exits the loop at the backward jump, a kernel bails out */
+    CodeObject *poll = new_code(m, "poll", loop_insns, sizeof(loop_insns), 0, 4, 0);
+    r = call(poll, NULL, 0);
+    ls = code_loop_site(poll, 17);
+    ASSERT(ls->osr);
+    int count = ls->count;
+    gc_safepoint_requested = 1;
+    r = call(poll, NULL, 0);
+    ASSERT(IS_INT(&r) && to_int(&r) == 4950);
+    ASSERT(ls->count - count >= 99);
+    r = call(loop, NULL, 0);
+    ASSERT(IS_INT(&r) && to_int(&r) == 4950);
+    gc_safepoint_requested = 0;
+
+#if USE_NAN_BOXING
+    /* the locals out of 48 bits are boxed at the exit, while young gcs run */
+    CodeObject *big = new_code(m, "big", big_insns, sizeof(big_insns), 1, 6, 0);
+    int64_t x = (int64_t)1 << 50;
+    size_t moves = gc_moves();
+    for (int i = 0; gc_moves() < moves + 8; i++) {
+        ASSERT(i < 10000000);
+        args[0] = int_value(x);
+        r = call(big, args, 1);
+        ASSERT(IS_INT(&r) && to_int(&r) == 3 * x + 99);
+    }
+    ASSERT(code_loop_site(big, 18)->osr);
+#endif
+    opt_threshold = OPT_THRESHOLD;
+
+    /* not numeric kernels */
+    CodeObject *sub = new_code(m, "sub", sub_insns, sizeof(sub_insns), 2, 2, 0);
+    ASSERT(opt_compile(sub) && !sub->opt);
+    CodeObject *none = new_code(m, "none", none_insns, sizeof(none_insns), 1, 2, 0);
+    ASSERT(opt_compile(none) && !none->opt);
+#endif
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
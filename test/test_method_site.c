@@ -0,0 +1,161 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "exception.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+#include "stringobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+#define FOO_TYPE(n)                                                 \
+static Value foo##n##_name(Value *self) { return int_value(n); }    \
+static MethodDef foo##n##_methods[] = {                             \
+    { "name", foo##n##_name, METH_NO_ARGS, "", "i" },               \
+    { NULL },                                                       \
+};                                                                  \
+static TypeObject foo##n##_type = {                                 \
+    OBJECT_HEAD_INIT(&type_type),                                   \
+    .name = "Foo" #n,                                               \
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC,                      \
+    .methods = foo##n##_methods,                                    \
+};
+
+FOO_TYPE(0)
+FOO_TYPE(1)
+FOO_TYPE(2)
+FOO_TYPE(3)
+FOO_TYPE(4)
+
+static TypeObject *foo_types[] = {
+    &foo0_type, &foo1_type, &foo2_type, &foo3_type, &foo4_type,
+};
+
+static TypeObject bar_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "Bar",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC,
+};
+
+/* return x.name() */
+static char _insns[] = {
+    OP_PUSH, 0,
+    OP_CALL_METHOD, 0, 0, 1, 1,
+    OP_RETURN, 1,
+};
+/* clang-format on */
+
+static Object *new_obj(TypeObject *tp)
+{
+    Object *obj = gc_alloc_obj(obj);
+    INIT_OBJECT_HEAD(obj, tp);
+    return obj;
+}
+
+static Value call_name(CodeObject *code, Object *obj)
+{
+    Value self = obj_value(code);
+    Value args[] = { obj_value(obj) };
+    return object_call(&self, args, 1, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+
+    Object *m = kl_new_module("test_method_site");
+    module_add_str_const(m, "name");
+    /* not readied, has no methods */
+    Object *bar = new_obj(&bar_type);
+
+    CodeObject *code = (CodeObject *)kl_new_code("call_name", m, NULL);
+    code->cs.insns = _insns;
+    code->cs.insns_size = sizeof(_insns);
+    code->cs.nargs = 1;
+    code->cs.nlocals = 2;
+    code->cs.stack_size = 1;
+
+    Value r;
+    MethodSite *ms = &code_inline_cache(code, 2)->ms;
+
+    /* no such method */
+    r = call_name(code, bar);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+    ASSERT(ms->num == 0 && ms->misses == 1);
+    ms->misses = 0;
+
+    Object *foos[COUNT_OF(foo_types)];
+    for (int i = 0; i < COUNT_OF(foo_types); i++) {
+        type_ready(foo_types[i], m);
+        foos[i] = new_obj(foo_types[i]);
+    }
+
+    /* monomorphic */
+    for (int i = 0; i < 3; i++) {
+        r = call_name(code, foos[0]);
+        ASSERT(IS_INT(&r) && to_int(&r) == 0);
+    }
+    ASSERT(ms->num == 1 && ms->hits == 2 && ms->misses == 1);
+
+    /* polymorphic */
+    for (int i = 0; i < METHOD_SITE_SIZE; i++) {
+        r = call_name(code, foos[i]);
+        ASSERT(IS_INT(&r) && to_int(&r) == i);
+    }
+    ASSERT(ms->num == METHOD_SITE_SIZE);
+    ASSERT(ms->hits == 3 && ms->misses == METHOD_SITE_SIZE);
+
+    /* megamorphic, all calls miss but still work */
+    r = call_name(code, foos[4]);
+    ASSERT(IS_INT(&r) && to_int(&r) == 4);
+    ASSERT(ms->num == -1);
+    r = call_name(code, foos[0]);
+    ASSERT(IS_INT(&r) && to_int(&r) == 0);
+    ASSERT(ms->hits == 3 && ms->misses == METHOD_SITE_SIZE + 2);
+
+    code_show_method_sites(code);
+    MethodSiteStats mss;
+    int offset = code_next_method_site(code, -1, &mss);
+    ASSERT(offset >= 0 && !strcmp(mss.name, "name"));
+    ASSERT(!strcmp(mss.state, "megamorphic"));
+    ASSERT(mss.hits == 3 && mss.misses == METHOD_SITE_SIZE + 2);
+    ASSERT(code_next_method_site(code, offset, &mss) < 0);
+
+    /* the cached name is not in the constant str, which is moved by a minor gc */
+    Object *m2 = kl_new_module("test_method_site_gc");
+    module_add_str_const(m2, "name");
+    CodeObject *code2 = (CodeObject *)kl_new_code("call_name", m2, NULL);
+    code2->cs = code->cs;
+    r = call_name(code2, foos[0]);
+    ASSERT(IS_INT(&r) && to_int(&r) == 0);
+
+    GcStats st;
+    gc_get_stats(&st);
+    size_t young = st.phases[GC_YOUNG].count;
+    while (st.phases[GC_YOUNG].count < young + 3) {
+        for (int i = 0; i < 10000; i++) kl_new_str("garbage");
+        gc_get_stats(&st);
+    }
+
+    /* the receivers are moved too */
+    r = call_name(code2, new_obj(foo_types[1]));
+    ASSERT(IS_INT(&r) && to_int(&r) == 1);
+    ASSERT(!strcmp(code_inline_cache(code2, 2)->ms.fname, "name"));
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
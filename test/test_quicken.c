@@ -0,0 +1,140 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "exception.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static Value foo_add(Value *self, Value *rhs) { return int_value(42); }
+
+static MethodDef foo_methods[] = {
+    { "__add__", foo_add, METH_ONE_ARG, "O", "i" },
+    { NULL },
+};
+
+static TypeObject foo_type = {
+    OBJECT_HEAD_INIT(&type_type),
+    .name = "Foo",
+    .flags = TP_FLAGS_CLASS | TP_FLAGS_PUBLIC,
+    .methods = foo_methods,
+};
+
+static Value call2(CodeObject *code, Value a, Value b)
+{
+    Value self = obj_value(code);
+    Value args[] = { a, b };
+    return object_call(&self, args, 2, NULL);
+}
+
+static CodeObject *new_binary_code(Object *m, char *insns, int size)
+{
+    CodeObject *code = (CodeObject *)kl_new_code("binary", m, NULL);
+    code->cs.insns = insns;
+    code->cs.insns_size = size;
+    code->cs.nargs = 2;
+    code->cs.nlocals = 2;
+    code->cs.stack_size = 0;
+    return code;
+}
+
+void test_quicken_add(void)
+{
+    Object *m = kl_new_module("test_quicken");
+
+    /* return a + b */
+    char _insns[] = {
+        OP_BINARY_ADD, 0, 0, 1, OP_RETURN, 0,
+    };
+    CodeObject *code = new_binary_code(m, _insns, sizeof(_insns));
+
+    Value r = call2(code, int_value(3), int_value(4));
+    ASSERT(IS_INT(&r) && to_int(&r) == 7);
+    ASSERT((uint8_t)_insns[0] == OP_INT_ADD);
+
+    r = call2(code, int_value(30), int_value(12));
+    ASSERT(IS_INT(&r) && to_int(&r) == 42);
+    ASSERT((uint8_t)_insns[0] == OP_INT_ADD);
+
+    /* guard failed, requicken into float */
+    r = call2(code, float_value(1.5), float_value(2.0));
+    ASSERT(IS_FLOAT(&r) && to_float(&r) == 3.5);
+    ASSERT((uint8_t)_insns[0] == OP_FLOAT_ADD);
+
+    /* mixed int and float stays generic */
+    r = call2(code, int_value(1), float_value(2.5));
+    ASSERT(IS_FLOAT(&r) && to_float(&r) == 3.5);
+    ASSERT((uint8_t)_insns[0] == OP_BINARY_ADD);
+
+    /* cached method */
+    type_ready(&foo_type, m);
+    Object *foo = gc_alloc_obj(foo);
+    INIT_OBJECT_HEAD(foo, &foo_type);
+    r = call2(code, obj_value(foo), int_value(1));
+    ASSERT(IS_INT(&r) && to_int(&r) == 42);
+    ASSERT((uint8_t)_insns[0] == OP_BINARY_METHOD);
+
+    r = call2(code, obj_value(foo), none_value);
+    ASSERT(IS_INT(&r) && to_int(&r) == 42);
+    ASSERT((uint8_t)_insns[0] == OP_BINARY_METHOD);
+
+    r = call2(code, int_value(1), int_value(2));
+    ASSERT(IS_INT(&r) && to_int(&r) == 3);
+    ASSERT((uint8_t)_insns[0] == OP_INT_ADD);
+}
+
+void test_quicken_cmp_div(void)
+{
+    Object *m = kl_new_module("test_quicken");
+
+    /* return a < b */
+    char _insns[] = {
+        OP_BINARY_CMP_LT, 0, 0, 1, OP_RETURN, 0,
+    };
+    CodeObject *code = new_binary_code(m, _insns, sizeof(_insns));
+
+    Value r = call2(code, int_value(3), int_value(4));
+    ASSERT(IS_INT(&r) && to_int(&r) == 1);
+    ASSERT((uint8_t)_insns[0] == OP_INT_CMP_LT);
+
+    r = call2(code, float_value(4.5), float_value(4.0));
+    ASSERT(IS_INT(&r) && to_int(&r) == 0);
+    ASSERT((uint8_t)_insns[0] == OP_BINARY_CMP_LT);
+
+    /* return a / b */
+    char _insns2[] = {
+        OP_BINARY_DIV, 0, 0, 1, OP_RETURN, 0,
+    };
+    code = new_binary_code(m, _insns2, sizeof(_insns2));
+
+    r = call2(code, int_value(9), int_value(2));
+    ASSERT(IS_INT(&r) && to_int(&r) == 4);
+    ASSERT((uint8_t)_insns2[0] == OP_INT_DIV);
+
+    r = call2(code, int_value(9), int_value(0));
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+    ASSERT((uint8_t)_insns2[0] == OP_BINARY_DIV);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    test_quicken_add();
+    test_quicken_cmp_div();
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "cfuncobject.h"
+#include "codeobject.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+#include "stringobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static Value _new_str(Value *self) { return obj_value(kl_new_str("kept")); }
+
+/* more than the nursery, a minor gc at least */
+static Value _garbage(Value *self)
+{
+    for (int i = 0; i < 100000; i++) kl_new_str("junk");
+    return none_value;
+}
+
+static MethodDef new_str_method = { "new_str", _new_str, METH_NO_ARGS };
+static MethodDef garbage_method = { "garbage", _garbage, METH_NO_ARGS };
+
+/* s = new_str(); i = 3; do { garbage(); i = i - 1; } while (i >= 1); return s */
+/* clang-format off */
+static char loop_insns[] = {
+    OP_CALL, 0, 0, 0, 0,
+    OP_CONST_INT_IMM8, 1, 3,
+    OP_CALL, 0, 1, 0, 2,
+    OP_INT_SUB_IMM8, 1, 1, 1,
+    OP_JMP_INT_CMP_GE_IMM8, 1, 1, 8, 0,
+    OP_RETURN, 0,
+};
+/* clang-format on */
+
+#define IS_LIVE(live, i) ((live)[0] & ((uint64_t)1 << (i)))
+
+static CodeObject *new_loop_code(void)
+{
+    Object *m = kl_new_module("safepoint");
+    module_add_cfunc(m, &new_str_method);
+    module_add_cfunc(m, &garbage_method);
+
+    CodeObject *code = (CodeObject *)kl_new_code("loop", m, NULL);
+    code->cs.insns = loop_insns;
+    code->cs.insns_size = sizeof(loop_insns);
+    code->cs.nargs = 0;
+    code->cs.nlocals = 3;
+    code->cs.stack_size = 1;
+    module_add_object(m, "loop", (Object *)code);
+    return code;
+}
+
+/* a safepoint is at the end of an insn, its live registers are read later */
+void test_stack_map(CodeObject *code)
+{
+    /* nothing at the entry */
+    uint64_t *live = code_live_regs(code, 0);
+    ASSERT(!live[0]);
+
+    /* the result of a call is not live in it */
+    live = code_live_regs(code, 5);
+    ASSERT(!live[0]);
+    live = code_live_regs(code, 13);
+    ASSERT(IS_LIVE(live, 0) && IS_LIVE(live, 1) && !IS_LIVE(live, 2));
+
+    /* the backward jump */
+    live = code_live_regs(code, 22);
+    ASSERT(IS_LIVE(live, 0) && IS_LIVE(live, 1) && !IS_LIVE(live, 2));
+
+    live = code_live_regs(code, 24);
+    ASSERT(IS_LIVE(live, 0) && !IS_LIVE(live, 1));
+}
+
+/* the live string in the frame is moved by the minor gcs in the calls */
+void test_live_reg(CodeObject *code)
+{
+    Value self = obj_value(code);
+    Value r = object_call(&self, NULL, 0, NULL);
+    ASSERT(IS_OBJ(&r) && IS_STR(to_obj(&r)));
+    ASSERT(!strcmp(STR_BUF(to_obj(&r)), "kept"));
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    kl_init(argc, argv);
+    CodeObject *code = new_loop_code();
+    test_stack_map(code);
+    test_live_reg(code);
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
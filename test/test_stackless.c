@@ -0,0 +1,80 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "exception.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* sum(n) = n < 1 ? n : n + sum(n - 1) */
+/* clang-format off */
+static char sum_insns[] = {
+    OP_JMP_INT_CMP_GE_IMM8, 0, 1, 7, 0,
+    OP_RETURN, 0,
+    OP_INT_SUB_IMM8, 1, 0, 1,
+    OP_PUSH, 1,
+    OP_CALL, 0, 0, 1, 1,
+    OP_INT_ADD, 0, 0, 1,
+    OP_RETURN, 0,
+};
+/* clang-format on */
+
+static Value call_sum(CodeObject *code, int n)
+{
+    Value self = obj_value(code);
+    Value args[] = { int_value(n) };
+    return object_call(&self, args, 1, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_WARN, NULL, 0);
+    setenv("KOALA_STACK_SIZE", "32", 1);
+    kl_init(argc, argv);
+
+    Object *m = kl_new_module("sum");
+    CodeObject *code = (CodeObject *)kl_new_code("sum", m, NULL);
+    code->cs.insns = sum_insns;
+    code->cs.insns_size = sizeof(sum_insns);
+    code->cs.nargs = 1;
+    code->cs.nlocals = 2;
+    code->cs.stack_size = 1;
+    module_add_object(m, "sum", (Object *)code);
+
+    KoalaState *ks = __ks();
+
+    /* the calls are in one loop, not limited by the C stack */
+    Value r = call_sum(code, 5000);
+    ASSERT(IS_INT(&r) && to_int(&r) == 12502500);
+    ASSERT(!ks->cf && !ks->depth);
+    ASSERT(ks->stack_top_ptr == ks->base_stack_ptr);
+
+    /* the depth is limited by the value stack only */
+    ASSERT(ks->stack_size == 32 << 20);
+    r = call_sum(code, 100000);
+    ASSERT(IS_INT(&r) && to_int(&r) == 5000050000);
+    ASSERT(!ks->cf && !ks->depth);
+    ASSERT(ks->stack_top_ptr == ks->base_stack_ptr);
+
+    /* overflow is an error, and all frames are unwound */
+    r = call_sum(code, 1000000);
+    ASSERT(IS_ERROR(&r));
+    ASSERT(exc_occurred());
+    ASSERT(!ks->cf && !ks->depth);
+    ASSERT(ks->stack_top_ptr == ks->base_stack_ptr);
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
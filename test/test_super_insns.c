@@ -0,0 +1,86 @@
+/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+#include "codeobject.h"
+#include "log.h"
+#include "moduleobject.h"
+#include "opcode.h"
+#include "run.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+static char fib_insns[] = {
+    OP_JMP_INT_CMP_GE_IMM8, 0, 2, 7, 0,
+    OP_RETURN, 0,
+    OP_INT_SUB_IMM8, 1, 0, 1,
+    OP_PUSH, 1,
+    OP_CALL, 0, 0, 1, 1,
+    OP_INT_SUB_IMM8, 2, 0, 2,
+    OP_PUSH, 2,
+    OP_CALL, 0, 0, 1, 2,
+    OP_INT_ADD, 0, 1, 2,
+    OP_RETURN, 0,
+};
+/* clang-format on */
+
+static Value call_fib(char *name, char *insns, int size, int fused, int n)
+{
+    Object *m = kl_new_module(name);
+    CodeObject *code = (CodeObject *)kl_new_code("fib", m, NULL);
+    code->cs.insns = insns;
+    code->cs.insns_size = size;
+    code->cs.nargs = 1;
+    code->cs.nlocals = 4;
+    code->cs.stack_size = 1;
+    /* 1: run the insns as they are */
+    code->fused = fused;
+    module_add_object(m, "fib", (Object *)code);
+
+    Value self = obj_value(code);
+    Value args[] = { int_value(n) };
+    return object_call(&self, args, 1, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log(LOG_INFO, NULL, 0);
+    kl_init(argc, argv);
+
+    char super_insns[sizeof(fib_insns)];
+    memcpy(super_insns, fib_insns, sizeof(fib_insns));
+
+    Value r1 = call_fib("fib", fib_insns, sizeof(fib_insns), 1, 20);
+    ASSERT(!memcmp(super_insns, fib_insns, sizeof(fib_insns)));
+
+    /* fused by the first call, the jump target(7) is a head */
+    Value r2 = call_fib("fib_super", super_insns, sizeof(super_insns), 0, 20);
+    ASSERT((uint8_t)super_insns[7] == OP_SUPER_INT_SUB_IMM8_PUSH_CALL);
+    ASSERT((uint8_t)super_insns[18] == OP_SUPER_INT_SUB_IMM8_PUSH_CALL);
+    ASSERT((uint8_t)super_insns[29] == OP_SUPER_INT_ADD_RETURN);
+    ASSERT((uint8_t)super_insns[11] == OP_PUSH && (uint8_t)super_insns[13] == OP_CALL);
+    ASSERT((uint8_t)super_insns[0] == OP_JMP_INT_CMP_GE_IMM8);
+
+    ASSERT(IS_INT(&r1) && IS_INT(&r2));
+    ASSERT(to_int(&r1) == 6765);
+    ASSERT(to_int(&r2) == to_int(&r1));
+
+    /* fused again, nothing changes */
+    Object *m = kl_new_module("fib_refuse");
+    CodeObject *code = (CodeObject *)kl_new_code("fib", m, NULL);
+    code->cs.insns = super_insns;
+    code->cs.insns_size = sizeof(super_insns);
+    ASSERT(code_fuse_insns(code) == 3);
+    ASSERT((uint8_t)super_insns[29] == OP_SUPER_INT_ADD_RETURN);
+
+    kl_fini();
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
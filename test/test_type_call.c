@@ -40,15 +40,29 @@ void test_type_call(void)
     if (IS_ERROR(&result)) {
         print_exc();
     } else {
-        printf("%ld\n", result.ival);
+        printf("%ld\n", to_int(&result));
     }
 }
 
+/* more types than the old 4096 entries of the table */
+void test_many_types(void)
+{
+    int num = 5000;
+    TypeObject *types = mm_alloc(sizeof(TypeObject) * num);
+    for (int i = 0; i < num; i++) {
+        types[i].name = "many";
+        int index = kl_type_index(types + i);
+        ASSERT(index && kl_type_table[index] == types + i);
+    }
+    ASSERT(types[num - 1].index > 4096);
+}
+
 int main(int argc, char *argv[])
 {
     init_log(LOG_INFO, NULL, 0);
     kl_init(argc, argv);
     test_type_call();
+    test_many_types();
     kl_fini();
     return 0;
 }
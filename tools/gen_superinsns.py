@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+#
+# This file is part of the koala project with MIT License.
+# Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+#
+
+"""
+Generate superinstructions from an opcode profile.
+
+usage: gen_superinsns.py [--max N] <opcode_profile.txt>
+
+The profile is dumped by the runtime built with -DOPCODE_PROFILE=ON. The
+hottest fusable opcode pairs/triples are turned into:
+
+  include/common/super_insns.h  opcodes, targets and patterns of code_fuse_insns
+  src/super_targets.h           handlers, included by _eval_frame
+
+A superinstruction only replaces the opcode of its first insn, the opcodes
+of the others are kept in the bytecode and skipped by the fused handler. So
+jumps into the middle of it and deopts of the quickened insns still work.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+OPCODE_H = os.path.join(ROOT, "include/common/opcode.h")
+EVAL_C = os.path.join(ROOT, "src/eval.c")
+SUPER_INSNS_H = os.path.join(ROOT, "include/common/super_insns.h")
+SUPER_TARGETS_H = os.path.join(ROOT, "src/super_targets.h")
+
+MAX_SUPER_LEN = 3
+
+HEADER = """/*
+ * This file is part of the koala project with MIT License.
+ * Copyright (c) 2024 zhuguangxiang <zhuguangxiang@gmail.com>.
+ */
+
+/* Generated by tools/gen_superinsns.py, DO NOT EDIT! */
+"""
+
+
+def parse_opcodes():
+    """opcodes in enum order, superinstructions are excluded"""
+    text = open(OPCODE_H).read()
+    body = text[text.index("typedef enum _OpCode") : text.index("SUPER_OPCODES\n")]
+    return re.findall(r"^\s+(OP_[A-Z0-9_]+),", body, re.M)
+
+
+def parse_handlers():
+    """map opcode to its handler body, shared handlers are not fusable"""
+    text = open(EVAL_C).read()
+    handlers = {}
+    pos = 0
+    pattern = re.compile(r"((?:\s*TARGET\(OP_[A-Z0-9_]+\):)+)\s*\{")
+    while True:
+        m = pattern.search(text, pos)
+        if not m:
+            break
+        ops = re.findall(r"TARGET\((OP_[A-Z0-9_]+)\)", m.group(1))
+        start = m.end()
+        depth = 1
+        i = start
+        while depth:
+            if text[i] == "{":
+                depth += 1
+            elif text[i] == "}":
+                depth -= 1
+            i += 1
+        body = text[start : i - 1]
+        pos = i
+        if len(ops) == 1:
+            handlers[ops[0]] = body
+    return handlers
+
+
+def dedent(body):
+    lines = [line for line in body.split("\n") if line.strip()]
+    indent = min(len(line) - len(line.lstrip()) for line in lines)
+    return [line[indent:] for line in lines]
+
+
+def can_fall_through(body):
+    """the body ends with DISPATCH() and never changes control flow"""
+    lines = dedent(body)
+    if lines[-1] != "DISPATCH();":
+        return False
+    if re.search(r"next_inst\s*=[^=]", body):
+        return False
+    return True
+
+
+def read_profile(path, opcodes):
+    seqs = {}
+    for line in open(path):
+        if line.startswith("#"):
+            continue
+        fields = line.split()
+        if fields[0] not in ("pair", "triple"):
+            continue
+        count = int(fields[1])
+        ops = [int(x) for x in fields[2:]]
+        if any(op >= len(opcodes) for op in ops):
+            continue
+        seqs[tuple(opcodes[op] for op in ops)] = count
+    return seqs
+
+
+def select(seqs, handlers, max_num):
+    candidates = []
+    for ops, count in seqs.items():
+        if len(ops) > MAX_SUPER_LEN:
+            continue
+        if any(op not in handlers for op in ops):
+            continue
+        if not all(can_fall_through(handlers[op]) for op in ops[:-1]):
+            continue
+        # saved dispatches
+        candidates.append((count * (len(ops) - 1), ops))
+    candidates.sort(key=lambda x: (-x[0], x[1]))
+
+    # the longer one consumes the most of its sub-sequences
+    def covered(ops, by):
+        n = len(ops)
+        return any(by[i : i + n] == ops for i in range(len(by) - n + 1))
+
+    supers = []
+    for _, ops in candidates:
+        if len(supers) >= max_num:
+            break
+        if any(covered(ops, s) for s in supers):
+            continue
+        supers.append(ops)
+    return supers
+
+
+def super_name(ops):
+    return "OP_SUPER_" + "_".join(op[3:] for op in ops)
+
+
+def gen_super_insns_h(supers):
+    out = [HEADER]
+    out.append("#ifndef _KOALA_SUPER_INSNS_H_")
+    out.append("#define _KOALA_SUPER_INSNS_H_")
+    out.append("")
+    out.append("/* clang-format off */")
+    out.append("")
+    out.append("#define NUM_SUPER_INSNS %d" % len(supers))
+    out.append("")
+    out.append("/* max number of insns in a superinstruction */")
+    out.append("#define MAX_SUPER_INSN_LEN %d" % MAX_SUPER_LEN)
+    out.append("")
+    out.append("/* opcodes, appended to OpCode */")
+    out.append("#define SUPER_OPCODES \\")
+    for ops in supers:
+        out.append("    %s, \\" % super_name(ops))
+    out.append("")
+    out.append("")
+    out.append("/* threaded dispatch targets, appended to opcode_targets */")
+    out.append("#define SUPER_TARGETS \\")
+    for ops in supers:
+        out.append("    &&TARGET_%s, \\" % super_name(ops))
+    out.append("")
+    out.append("")
+    out.append("/* { super opcode, number of insns, { opcodes } }, longest first */")
+    out.append("#define SUPER_INSN_PATTERNS \\")
+    for ops in sorted(supers, key=lambda x: -len(x)):
+        out.append(
+            "    { %s, %d, { %s } }, \\" % (super_name(ops), len(ops), ", ".join(ops))
+        )
+    out.append("")
+    out.append("")
+    out.append("/* clang-format on */")
+    out.append("")
+    out.append("#endif /* _KOALA_SUPER_INSNS_H_ */")
+    return "\n".join(out) + "\n"
+
+
+def gen_super_targets_h(supers, handlers):
+    out = [HEADER]
+    out.append("/* Superinstruction handlers, included inside the switch of _eval_frame. */")
+    for ops in supers:
+        out.append("")
+        out.append("TARGET(%s): {" % super_name(ops))
+        for i, op in enumerate(ops):
+            lines = dedent(handlers[op])
+            if i != len(ops) - 1:
+                lines = lines[:-1]
+            out.append("    /* %s */" % op)
+            out.append("    {")
+            out.extend("        " + line for line in lines)
+            out.append("    }")
+            if i != len(ops) - 1:
+                out.append("    /* skip the kept opcode of %s */" % ops[i + 1])
+                out.append("    next_inst++;")
+        out.append("}")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="generate superinstructions")
+    parser.add_argument("profile", help="opcode profile dumped by runtime")
+    parser.add_argument("--max", type=int, default=8, help="max superinstructions")
+    args = parser.parse_args()
+
+    opcodes = parse_opcodes()
+    handlers = parse_handlers()
+    seqs = read_profile(args.profile, opcodes)
+    supers = select(seqs, handlers, args.max)
+
+    with open(SUPER_INSNS_H, "w") as fp:
+        fp.write(gen_super_insns_h(supers))
+    with open(SUPER_TARGETS_H, "w") as fp:
+        fp.write(gen_super_targets_h(supers, handlers))
+
+    for ops in supers:
+        print("%s: %s" % (super_name(ops), " ".join(ops)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())